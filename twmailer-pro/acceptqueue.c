@@ -0,0 +1,119 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <semaphore.h>
+#include "acceptqueue.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // a slot at position p is free for the producer while its sequence is p and
+   // holds an item for a consumer once the sequence is p + 1, the consumer
+   // hands it back for the next round with p + size
+   // the semaphores make sure a thread only looks for a slot when there is one,
+   // so the compare and swap loops never wait for long
+
+static void* take(struct acceptQueue* queue);
+static void put(struct acceptQueue* queue, void* item);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int acceptQueueInit(struct acceptQueue* queue, int size)
+{
+   unsigned long capacity = 1;
+   while (capacity < (unsigned long)size)
+   {
+      capacity *= 2;
+   }
+   queue->slots = malloc(capacity * sizeof(struct acceptSlot));
+   if (queue->slots == NULL)
+   {
+      return -1;
+   }
+   for (unsigned long i = 0; i < capacity; ++i)
+   {
+      queue->slots[i].sequence = i;
+      queue->slots[i].item = NULL;
+   }
+   queue->mask = capacity - 1;
+   queue->head = 0;
+   queue->tail = 0;
+   sem_init(&queue->items, 0, 0);
+   sem_init(&queue->spaces, 0, capacity);
+   return 0;
+}
+
+void acceptQueueDestroy(struct acceptQueue* queue)
+{
+   sem_destroy(&queue->items);
+   sem_destroy(&queue->spaces);
+   free(queue->slots);
+   queue->slots = NULL;
+}
+
+int acceptQueuePush(struct acceptQueue* queue, void* item)
+{
+   if (sem_wait(&queue->spaces) == -1)
+   {
+      return -1;
+   }
+   put(queue, item);
+   sem_post(&queue->items);
+   return 0;
+}
+
+void* acceptQueuePop(struct acceptQueue* queue)
+{
+   while (sem_wait(&queue->items) == -1 && errno == EINTR)
+   {
+   }
+   void* item = take(queue);
+   sem_post(&queue->spaces);
+   return item;
+}
+
+static void put(struct acceptQueue* queue, void* item)
+{
+   unsigned long position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+   while (1)
+   {
+      struct acceptSlot* slot = &queue->slots[position & queue->mask];
+      long difference = (long)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+      if (difference == 0)
+      {
+         if (__atomic_compare_exchange_n(&queue->tail, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+         {
+            slot->item = item;
+            __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+            return;
+         }
+      }
+      else
+      {
+         // the slot is still being emptied or another producer took it
+         position = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+      }
+   }
+}
+
+static void* take(struct acceptQueue* queue)
+{
+   unsigned long position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+   while (1)
+   {
+      struct acceptSlot* slot = &queue->slots[position & queue->mask];
+      long difference = (long)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (position + 1));
+      if (difference == 0)
+      {
+         if (__atomic_compare_exchange_n(&queue->head, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+         {
+            void* item = slot->item;
+            __atomic_store_n(&slot->sequence, position + queue->mask + 1, __ATOMIC_RELEASE);
+            return item;
+         }
+      }
+      else
+      {
+         // the item is still being written or another consumer took it
+         position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+      }
+   }
+}
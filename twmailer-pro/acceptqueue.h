@@ -0,0 +1,56 @@
+#ifndef ACCEPTQUEUE_H
+#define ACCEPTQUEUE_H
+
+#include <semaphore.h>
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro accept queue                                                 //
+   //                                                                           //
+   // hands accepted connections from the thread that accepts them to the      //
+   // threads of the pool, a bounded ring in which every slot carries a        //
+   // sequence number, so producers and consumers only ever compare and swap   //
+   // their position and never take a lock                                     //
+   // two semaphores count the items and the free slots, they only put a      //
+   // thread to sleep when there is nothing to take or no room left, which is  //
+   // also the backpressure: a full queue stops accepting and the connections  //
+   // wait in the backlog of the kernel                                        //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define ACCEPT_QUEUE_SIZE 256
+
+struct acceptSlot{
+   unsigned long sequence;
+   void* item;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // head and tail are on cache lines of their own, consumers move head and
+   // the producer moves tail without disturbing each other
+struct acceptQueue{
+   struct acceptSlot* slots;
+   unsigned long mask;
+   sem_t items;
+   sem_t spaces;
+   unsigned long head __attribute__((aligned(64)));
+   unsigned long tail __attribute__((aligned(64)));
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // size is rounded up to a power of two, returns -1 if memory is out
+int acceptQueueInit(struct acceptQueue* queue, int size);
+void acceptQueueDestroy(struct acceptQueue* queue);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // waits for a free slot and queues item, returns -1 with errno EINTR if a
+   // signal came in while waiting (item is not queued then)
+int acceptQueuePush(struct acceptQueue* queue, void* item);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // waits for the oldest item and returns it
+void* acceptQueuePop(struct acceptQueue* queue);
+
+#endif
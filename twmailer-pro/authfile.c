@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "authfile.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // open hashing, the table has at least twice as many buckets as users, so
+   // the chains stay short
+
+struct authUser{
+   char* uid;
+   char* password;
+   struct authUser* next;
+};
+
+static struct authUser** buckets = NULL;
+static unsigned int bucketCount = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static unsigned int uidHash(const char* uid);
+static struct authUser* findUser(const char* uid);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int authFileLoad(const char* path)
+{
+   FILE* file = fopen(path, "r");
+   char line[512];
+   int users = 0;
+
+   if (file == NULL)
+   {
+      perror("open auth file");
+      return -1;
+   }
+   while (fgets(line, sizeof(line), file) != NULL)
+   {
+      char* uid = strtok(line, " \t\r\n");
+      if (uid != NULL && uid[0] != '#')
+      {
+         ++users;
+      }
+   }
+
+   bucketCount = 2 * users + 1;
+   buckets = calloc(bucketCount, sizeof(struct authUser*));
+   if (buckets == NULL)
+   {
+      perror("calloc auth file");
+      fclose(file);
+      return -1;
+   }
+   rewind(file);
+   users = 0;
+   while (fgets(line, sizeof(line), file) != NULL)
+   {
+      char* uid = strtok(line, " \t\r\n");
+      char* password = strtok(NULL, "\r\n");
+      if (uid == NULL || uid[0] == '#')
+      {
+         continue;
+      }
+      while (password != NULL && (*password == ' ' || *password == '\t'))
+      {
+         ++password;
+      }
+      struct authUser* user = malloc(sizeof(struct authUser));
+      if (user == NULL || (user->uid = strdup(uid)) == NULL ||
+          (user->password = strdup(password != NULL ? password : "")) == NULL)
+      {
+         perror("malloc auth user");
+         fclose(file);
+         return -1;
+      }
+      unsigned int bucket = uidHash(uid) % bucketCount;
+      user->next = buckets[bucket];
+      buckets[bucket] = user;
+      ++users;
+   }
+   fclose(file);
+   return users;
+}
+
+int authFileLoaded()
+{
+   return buckets != NULL;
+}
+
+int authFileExists(const char* uid)
+{
+   return findUser(uid) != NULL;
+}
+
+int authFileVerify(const char* uid, const char* password)
+{
+   struct authUser* user = findUser(uid);
+   return user != NULL && strcmp(user->password, password) == 0;
+}
+
+static struct authUser* findUser(const char* uid)
+{
+   if (buckets == NULL)
+   {
+      return NULL;
+   }
+   for (struct authUser* user = buckets[uidHash(uid) % bucketCount]; user != NULL; user = user->next)
+   {
+      if (strcasecmp(user->uid, uid) == 0)
+      {
+         return user;
+      }
+   }
+   return NULL;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // FNV-1a of the lower case uid
+static unsigned int uidHash(const char* uid)
+{
+   unsigned int hash = 2166136261u;
+   for (; *uid != '\0'; ++uid)
+   {
+      hash ^= (unsigned char)tolower((unsigned char)*uid);
+      hash *= 16777619u;
+   }
+   return hash;
+}
@@ -0,0 +1,36 @@
+#ifndef AUTHFILE_H
+#define AUTHFILE_H
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro auth file                                                    //
+   //                                                                           //
+   // a local stand-in for the directory, for benchmarks and tests that can't  //
+   // (or shouldn't) reach LDAP: the users are read from a file once at start  //
+   // and kept in a hash table that is only read afterwards, so threads and    //
+   // forked children use it without any locking                               //
+   // the file has one user per line:                                          //
+   //    <uid> <password>                                                      //
+   // empty lines and lines starting with # are skipped                        //
+   // the passwords are stored as they are, it is not meant for real users     //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns the number of users read or -1 if the file can't be read
+int authFileLoad(const char* path);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 if a file was loaded, login and receiver lookups use it then
+int authFileLoaded();
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // uids are compared ignoring case like the directory does
+   // authFileExists returns 1 if the user is listed, authFileVerify returns 1
+   // if the password matches as well
+int authFileExists(const char* uid);
+int authFileVerify(const char* uid, const char* password);
+
+#endif
@@ -0,0 +1,422 @@
+#include <sys/types.h>
+#include <sys/random.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "authprovider.h"
+#include "authfile.h"
+#include "ldappool.h"
+#include "uidcache.h"
+#include "metrics.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // there is only one directory, one auth file and one uid cache per server,
+   // so every provider is a static instance around that module
+
+static int ldapVerify(struct authProvider* provider, const char* uid, const char* password);
+static int ldapExist(struct authProvider* provider, const char** uids, int count, int* exists);
+static int fileVerify(struct authProvider* provider, const char* uid, const char* password);
+static int fileExist(struct authProvider* provider, const char** uids, int count, int* exists);
+static int cacheVerify(struct authProvider* provider, const char* uid, const char* password);
+static int cacheExist(struct authProvider* provider, const char** uids, int count, int* exists);
+static int ldapSubmit(struct authProvider* provider, struct authRequest* request);
+static void ldapAnswered(struct ldapRequest* directory);
+static int fileSubmit(struct authProvider* provider, struct authRequest* request);
+static int cacheSubmit(struct authProvider* provider, struct authRequest* request);
+static void cacheCompleted(struct authProvider* provider, struct authRequest* request);
+static int authForward(struct authProvider* provider, struct authRequest* request);
+static int authAllAnswered(const struct authRequest* request);
+static unsigned long long credentialHash(const char* uid, const char* password);
+
+static struct authProvider ldapProvider = {"ldap", ldapVerify, ldapExist, ldapSubmit, NULL, NULL};
+static struct authProvider fileProvider = {"file", fileVerify, fileExist, fileSubmit, NULL, NULL};
+static struct authProvider cacheProvider = {"cache", cacheVerify, cacheExist, cacheSubmit, cacheCompleted, NULL};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // random per process, a hash in the cache says nothing about the password
+   // without it
+static unsigned long long credentialSalt = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct authProvider* authLdapProvider()
+{
+   return &ldapProvider;
+}
+
+struct authProvider* authFileProvider(const char* path, struct authProvider* fallback)
+{
+   if (authFileLoad(path) == -1)
+   {
+      return NULL;
+   }
+   fileProvider.next = fallback;
+   return &fileProvider;
+}
+
+struct authProvider* authCacheProvider(struct authProvider* provider)
+{
+   if (getrandom(&credentialSalt, sizeof(credentialSalt), 0) != sizeof(credentialSalt))
+   {
+      credentialSalt = ((unsigned long long)time(NULL) << 32) ^ getpid() ^ (unsigned long long)(size_t)&provider;
+   }
+   cacheProvider.next = provider;
+   return &cacheProvider;
+}
+
+int authVerify(struct authProvider* provider, const char* uid, const char* password)
+{
+   return provider->verify(provider, uid, password);
+}
+
+int authUsersExist(struct authProvider* provider, const char** uids, int count, int* exists)
+{
+   return provider->usersExist(provider, uids, count, exists);
+}
+
+int authSubmit(struct authProvider* provider, struct authRequest* request)
+{
+   request->result = 0;
+   request->depth = 0;
+   for (int i = 0; i < request->count; ++i)
+   {
+      request->answeredBy[i] = -1;
+   }
+   return provider->submit(provider, request);
+}
+
+void authDescribe(struct authProvider* provider, char* description, int size)
+{
+   int length = 0;
+
+   description[0] = '\0';
+   for (; provider != NULL && length < size; provider = provider->next)
+   {
+      length += snprintf(description + length, size - length, "%s%s", length > 0 ? " -> " : "", provider->name);
+   }
+}
+
+static int ldapVerify(struct authProvider* provider, const char* uid, const char* password)
+{
+   uint64_t started = metricsNow();
+   int valid = ldapVerifyUser(uid, password);
+   metricsObserve(metricDirectoryBind, metricsNow() - started);
+   return valid;
+}
+
+static int ldapExist(struct authProvider* provider, const char** uids, int count, int* exists)
+{
+   uint64_t started = metricsNow();
+   int result = ldapUsersExist(uids, count, exists);
+   metricsObserve(metricDirectorySearch, metricsNow() - started);
+   return result;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // only the uids nobody answered yet go to the directory
+static int ldapSubmit(struct authProvider* provider, struct authRequest* request)
+{
+   struct ldapRequest* directory = &request->directory;
+
+   memset(directory, 0, sizeof(struct ldapRequest));
+   directory->uid = request->uid;
+   directory->password = request->password;
+   directory->uids = request->directoryUids;
+   directory->exists = request->directoryExists;
+   directory->done = ldapAnswered;
+   directory->data = request;
+   if (request->password == NULL)
+   {
+      for (int i = 0; i < request->count; ++i)
+      {
+         if (request->answeredBy[i] == -1)
+         {
+            request->directoryUids[directory->count] = request->uids[i];
+            request->directoryIndex[directory->count++] = i;
+         }
+      }
+      if (directory->count == 0)
+      {
+         return 1;
+      }
+   }
+   request->directoryStarted = metricsNow();
+   if (ldapAsyncRunning())
+   {
+      ldapAsyncSubmit(directory);
+      return 0;
+   }
+
+   if (request->password != NULL)
+   {
+      directory->result = ldapVerifyUser(request->uid, request->password);
+   }
+   else
+   {
+      directory->result = ldapUsersExist(directory->uids, directory->count, directory->exists);
+   }
+   directory->done = NULL;
+   ldapAnswered(directory);
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // copies the answer of the directory into the request, then the providers
+   // that handed it on see the answer in reverse order and the caller gets it
+   // the directory thread calls this for asynchronous requests, ldapSubmit
+   // for those it answered right away (done is NULL then)
+static void ldapAnswered(struct ldapRequest* directory)
+{
+   struct authRequest* request = (struct authRequest *)directory->data;
+
+   metricsObserve(request->password != NULL ? metricDirectoryBind : metricDirectorySearch,
+                  metricsNow() - request->directoryStarted);
+   request->result = directory->result;
+   if (request->password == NULL && directory->result != -1)
+   {
+      for (int j = 0; j < directory->count; ++j)
+      {
+         request->exists[request->directoryIndex[j]] = directory->exists[j];
+         request->answeredBy[request->directoryIndex[j]] = request->depth;
+      }
+   }
+   if (directory->done == NULL)
+   {
+      return;
+   }
+   while (request->depth > 0)
+   {
+      struct authProvider* provider = request->passed[--request->depth];
+      if (provider->completed != NULL)
+      {
+         provider->completed(provider, request);
+      }
+   }
+   request->done(request);
+}
+
+static int fileVerify(struct authProvider* provider, const char* uid, const char* password)
+{
+   if (authFileExists(uid) || provider->next == NULL)
+   {
+      return authFileVerify(uid, password);
+   }
+   return authVerify(provider->next, uid, password);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the uids the file doesn't list are passed on together, with a single
+   // search if the next provider is the directory
+static int fileExist(struct authProvider* provider, const char** uids, int count, int* exists)
+{
+   const char* missing[count];
+   int asked[count];
+   int missingExists[count];
+   int missingCount = 0;
+
+   for (int i = 0; i < count; ++i)
+   {
+      exists[i] = authFileExists(uids[i]);
+      if (!exists[i] && provider->next != NULL)
+      {
+         missing[missingCount] = uids[i];
+         asked[missingCount++] = i;
+      }
+   }
+   if (missingCount == 0)
+   {
+      return 0;
+   }
+   if (authUsersExist(provider->next, missing, missingCount, missingExists) == -1)
+   {
+      return -1;
+   }
+   for (int j = 0; j < missingCount; ++j)
+   {
+      exists[asked[j]] = missingExists[j];
+   }
+   return 0;
+}
+
+static int fileSubmit(struct authProvider* provider, struct authRequest* request)
+{
+   if (request->password != NULL)
+   {
+      if (authFileExists(request->uid) || provider->next == NULL)
+      {
+         request->result = authFileVerify(request->uid, request->password);
+         return 1;
+      }
+      return authForward(provider, request);
+   }
+   for (int i = 0; i < request->count; ++i)
+   {
+      int listed = authFileExists(request->uids[i]);
+      if (request->answeredBy[i] == -1 && (listed || provider->next == NULL))
+      {
+         request->exists[i] = listed;
+         request->answeredBy[i] = request->depth;
+      }
+   }
+   return authAllAnswered(request) ? 1 : authForward(provider, request);
+}
+
+static int cacheVerify(struct authProvider* provider, const char* uid, const char* password)
+{
+   unsigned long long credential = credentialHash(uid, password);
+
+   if (uidCacheCheckLogin(uid, credential))
+   {
+      return 1;
+   }
+   int valid = authVerify(provider->next, uid, password);
+   if (valid == 1)
+   {
+      uidCacheStoreLogin(uid, credential); // whoever can log in exists, no need to look them up later
+   }
+   return valid;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // bulk senders mail the same few receivers over and over again, so only
+   // the uids the cache doesn't know are passed on
+   // errors are not cached, the next SEND asks again
+static int cacheExist(struct authProvider* provider, const char** uids, int count, int* exists)
+{
+   const char* unknown[count];
+   int asked[count];
+   int unknownExists[count];
+   int unknownCount = 0;
+
+   for (int i = 0; i < count; ++i)
+   {
+      if (!uidCacheLookup(uids[i], &exists[i]))
+      {
+         unknown[unknownCount] = uids[i];
+         asked[unknownCount++] = i;
+      }
+   }
+   if (unknownCount == 0)
+   {
+      return 0;
+   }
+   if (authUsersExist(provider->next, unknown, unknownCount, unknownExists) == -1)
+   {
+      return -1;
+   }
+   for (int j = 0; j < unknownCount; ++j)
+   {
+      exists[asked[j]] = unknownExists[j];
+      uidCacheStore(unknown[j], unknownExists[j]);
+   }
+   return 0;
+}
+
+static int cacheSubmit(struct authProvider* provider, struct authRequest* request)
+{
+   if (request->password != NULL)
+   {
+      if (uidCacheCheckLogin(request->uid, credentialHash(request->uid, request->password)))
+      {
+         request->result = 1;
+         return 1;
+      }
+      return authForward(provider, request);
+   }
+   for (int i = 0; i < request->count; ++i)
+   {
+      if (request->answeredBy[i] == -1 && uidCacheLookup(request->uids[i], &request->exists[i]))
+      {
+         request->answeredBy[i] = request->depth;
+      }
+   }
+   return authAllAnswered(request) ? 1 : authForward(provider, request);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // remembers what the providers behind the cache answered
+static void cacheCompleted(struct authProvider* provider, struct authRequest* request)
+{
+   if (request->password != NULL)
+   {
+      if (request->result == 1)
+      {
+         uidCacheStoreLogin(request->uid, credentialHash(request->uid, request->password));
+      }
+      return;
+   }
+   if (request->result == -1)
+   {
+      return;
+   }
+   for (int i = 0; i < request->count; ++i)
+   {
+      if (request->answeredBy[i] > request->depth)
+      {
+         uidCacheStore(request->uids[i], request->exists[i]);
+      }
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // hands the request to the next provider and remembers that it passed
+   // provider, if the answer is there at once provider sees it right away
+static int authForward(struct authProvider* provider, struct authRequest* request)
+{
+   if (request->depth == AUTH_CHAIN_MAX)
+   {
+      request->result = request->password != NULL ? 0 : -1;
+      return 1;
+   }
+   request->passed[request->depth++] = provider;
+   if (!provider->next->submit(provider->next, request))
+   {
+      return 0;
+   }
+   --request->depth;
+   if (provider->completed != NULL)
+   {
+      provider->completed(provider, request);
+   }
+   return 1;
+}
+
+static int authAllAnswered(const struct authRequest* request)
+{
+   for (int i = 0; i < request->count; ++i)
+   {
+      if (request->answeredBy[i] == -1)
+      {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // FNV-1a over the salt, the uid and the password, never 0 because 0 marks
+   // an entry without a login
+   // not meant to withstand an attacker who can read the memory of the server,
+   // it only keeps plain passwords out of the cache
+static unsigned long long credentialHash(const char* uid, const char* password)
+{
+   unsigned long long hash = 14695981039346656037ull ^ credentialSalt;
+
+   for (; *uid != '\0'; ++uid)
+   {
+      hash ^= (unsigned char)tolower((unsigned char)*uid);
+      hash *= 1099511628211ull;
+   }
+   hash ^= 0xff;
+   hash *= 1099511628211ull;
+   for (; *password != '\0'; ++password)
+   {
+      hash ^= (unsigned char)*password;
+      hash *= 1099511628211ull;
+   }
+   return hash != 0 ? hash : 1;
+}
@@ -0,0 +1,111 @@
+#ifndef AUTHPROVIDER_H
+#define AUTHPROVIDER_H
+
+#include <stdint.h>
+#include "ldapasync.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro auth providers                                               //
+   //                                                                           //
+   // the server checks logins and receivers through a provider and doesn't    //
+   // know what is behind it:                                                  //
+   //    ldap   the directory, through the connection pool (ldappool.h)       //
+   //    file   users of an auth file kept in memory (authfile.h), users the  //
+   //           file doesn't list can be handed on to another provider        //
+   //    cache  remembers the answers of another provider for a while         //
+   //           (uidcache.h), only misses are passed on                        //
+   // the server puts them together at start, e.g. file -> cache -> ldap for  //
+   // an edge server that knows its own users and asks the directory for the  //
+   // rest, every provider is set up once and used by all threads             //
+   // verify and usersExist answer right away and may block, authSubmit is    //
+   // for the event loop: whatever the file and the cache know is answered    //
+   // at once, the directory is asked asynchronously (ldapasync.h) and the    //
+   // caller is called back once it answered                                  //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // verify returns 1 if the password of uid is right, 0 if not (or if the
+   // backend can't be asked, a login fails then)
+   // usersExist sets exists[i] to 1 or 0 for every uid and returns 0, or -1
+   // if the backend can't be asked
+   // submit answers what it can of an authRequest and returns 1, or hands it
+   // on and returns 0, completed is called on the way back with the answer
+   // next is the provider a file passes misses to or a cache wraps, NULL if none
+struct authRequest;
+struct authProvider{
+   const char* name;
+   int (*verify)(struct authProvider* provider, const char* uid, const char* password);
+   int (*usersExist)(struct authProvider* provider, const char** uids, int count, int* exists);
+   int (*submit)(struct authProvider* provider, struct authRequest* request);
+   void (*completed)(struct authProvider* provider, struct authRequest* request);
+   struct authProvider* next;
+};
+
+#define AUTH_CHAIN_MAX 4
+#define AUTH_MAX_UIDS 256
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a login if password is set, a lookup of count uids (at most
+   // AUTH_MAX_UIDS) otherwise, result and exists as for verify and usersExist
+   // the strings and arrays belong to the caller and must stay valid until
+   // the answer is there
+   // done is only called if authSubmit returned 0, in the thread that got the
+   // answer (the directory thread), data is left to the caller
+   // the fields after data are used by the providers on the way: the ones
+   // that handed the request on, which provider answered which uid, and the
+   // request to the directory
+struct authRequest{
+   const char* uid;
+   const char* password;
+   const char** uids;
+   int count;
+   int* exists;
+   int result;
+   void (*done)(struct authRequest* request);
+   void* data;
+   struct authProvider* passed[AUTH_CHAIN_MAX];
+   int depth;
+   signed char answeredBy[AUTH_MAX_UIDS];
+   const char* directoryUids[AUTH_MAX_UIDS];
+   int directoryIndex[AUTH_MAX_UIDS];
+   int directoryExists[AUTH_MAX_UIDS];
+   struct ldapRequest directory;
+   uint64_t directoryStarted;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the directory, configured with ldapPoolSetDirectory and ldapPoolSetSize
+struct authProvider* authLdapProvider();
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // loads the auth file, returns NULL if it can't be read
+   // fallback (may be NULL) is asked for users the file doesn't list,
+   // without one they don't exist
+struct authProvider* authFileProvider(const char* path, struct authProvider* fallback);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // caches what provider answers in the uid cache, configured with
+   // uidCacheConfigure: receivers found or not found, and successful logins
+   // as a salted hash of the password, so a password that was changed in the
+   // directory keeps working until the entry expires, failed logins and
+   // errors are never cached
+struct authProvider* authCacheProvider(struct authProvider* provider);
+
+int authVerify(struct authProvider* provider, const char* uid, const char* password);
+int authUsersExist(struct authProvider* provider, const char** uids, int count, int* exists);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 if the request is answered already, 0 if done will be called
+   // without the directory thread (ldapAsyncStart) the directory is asked
+   // right away, authSubmit blocks then like verify and usersExist do
+int authSubmit(struct authProvider* provider, struct authRequest* request);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // names of the chain, e.g. "file -> cache -> ldap"
+void authDescribe(struct authProvider* provider, char* description, int size);
+
+#endif
@@ -0,0 +1,160 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "framing.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // this file is compiled as C for the server and as C++ for the client,
+   // hence the casts of malloc and realloc
+
+static int receiveAll(int socket, char* data, size_t length);
+
+///////////////////////////////////////////////////////////////////////////////
+
+void frameEncodeHeader(unsigned char* header, uint32_t length, int more)
+{
+   uint32_t value = length & FRAME_MAX_FRAGMENT;
+   if (more)
+   {
+      value |= FRAME_MORE;
+   }
+   header[0] = value >> 24;
+   header[1] = value >> 16;
+   header[2] = value >> 8;
+   header[3] = value;
+}
+
+uint32_t frameDecodeHeader(const unsigned char* header, int* more)
+{
+   uint32_t value = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                    ((uint32_t)header[2] << 8) | (uint32_t)header[3];
+   *more = (value & FRAME_MORE) != 0;
+   return value & FRAME_MAX_FRAGMENT;
+}
+
+int frameSendFragment(int socket, const char* data, size_t length, int more)
+{
+   unsigned char header[FRAME_HEADER];
+   size_t sent = 0;
+
+   frameEncodeHeader(header, length, more);
+
+   ////////////////////////////////////////////////////////////////////////////
+   // header and data go out with one system call, send might take only a part
+   // of it though, so keep going until both are out
+   while (sent < FRAME_HEADER + length)
+   {
+      struct iovec parts[2];
+      struct msghdr message;
+      int count = 0;
+      if (sent < FRAME_HEADER)
+      {
+         parts[count].iov_base = header + sent;
+         parts[count].iov_len = FRAME_HEADER - sent;
+         ++count;
+         parts[count].iov_base = (void*)data;
+         parts[count].iov_len = length;
+         ++count;
+      }
+      else
+      {
+         parts[count].iov_base = (void*)(data + sent - FRAME_HEADER);
+         parts[count].iov_len = length - (sent - FRAME_HEADER);
+         ++count;
+      }
+      memset(&message, 0, sizeof(message));
+      message.msg_iov = parts;
+      message.msg_iovlen = count;
+
+      ssize_t bytesSent = sendmsg(socket, &message, MSG_NOSIGNAL);
+      if (bytesSent == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return -1;
+      }
+      sent += bytesSent;
+   }
+   return 0;
+}
+
+int frameSend(int socket, const char* data, size_t length)
+{
+   ////////////////////////////////////////////////////////////////////////////
+   // a fragment can't be longer than FRAME_MAX_FRAGMENT, longer messages are split
+   while (length > FRAME_MAX_FRAGMENT)
+   {
+      if (frameSendFragment(socket, data, FRAME_MAX_FRAGMENT, 1) == -1)
+      {
+         return -1;
+      }
+      data += FRAME_MAX_FRAGMENT;
+      length -= FRAME_MAX_FRAGMENT;
+   }
+   return frameSendFragment(socket, data, length, 0);
+}
+
+char* frameReceive(int socket, size_t* length)
+{
+   unsigned char header[FRAME_HEADER];
+   char* message = NULL;
+   size_t messageLength = 0;
+   int more = 1;
+
+   while (more)
+   {
+      if (receiveAll(socket, (char*)header, FRAME_HEADER) == -1)
+      {
+         free(message);
+         return NULL;
+      }
+      uint32_t fragmentLength = frameDecodeHeader(header, &more);
+
+      char* grown = (char*)realloc(message, messageLength + fragmentLength + 1);
+      if (grown == NULL)
+      {
+         perror("realloc message");
+         free(message);
+         return NULL;
+      }
+      message = grown;
+      if (receiveAll(socket, message + messageLength, fragmentLength) == -1)
+      {
+         free(message);
+         return NULL;
+      }
+      messageLength += fragmentLength;
+   }
+   message[messageLength] = '\0';
+   *length = messageLength;
+   return message;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // recv returns whatever has arrived so far, this waits for all of it
+   // returns 0 on success and -1 if the connection was closed or broke
+static int receiveAll(int socket, char* data, size_t length)
+{
+   size_t received = 0;
+   while (received < length)
+   {
+      ssize_t size = recv(socket, data + received, length - received, 0);
+      if (size == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      if (size <= 0)
+      {
+         return -1;
+      }
+      received += size;
+   }
+   return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro framing                                                      //
+   //                                                                           //
+   // shared by client and server                                               //
+   // instead of records of BUF - 1 bytes every message is sent as one or more  //
+   // fragments, each with a 4 byte header (network byte order):                //
+   //    bit 31     : more fragments of the same message follow                 //
+   //    bit 0 - 30 : length of the fragment                                    //
+   // followed by exactly that many bytes, so "OK\n" costs 7 bytes instead of   //
+   // 1023 and a message can be as long as it needs to be                       //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // negotiation: the server lists FRAME_CAPABILITY in its welcome message,
+   // a client that understands it answers with FRAME_MAGIC before anything
+   // else and from then on both sides only send frames
+   // the magic starts with 0xff which can't be the first byte of a uid, so the
+   // server can tell it apart from the records of an old client
+   // old clients ignore the capability and keep sending records
+#define FRAME_CAPABILITY "FRAMES/1"
+#define FRAME_MAGIC "\xffTWF"
+#define FRAME_MAGIC_LENGTH 4
+
+#define FRAME_HEADER 4
+#define FRAME_MORE 0x80000000u
+#define FRAME_MAX_FRAGMENT 0x7fffffffu
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void frameEncodeHeader(unsigned char* header, uint32_t length, int more);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns the length of the fragment and sets more
+uint32_t frameDecodeHeader(const unsigned char* header, int* more);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // blocking helpers for the client
+   // frameSendFragment sends one fragment, frameSend a whole message
+   // both return 0 on success and -1 on error
+int frameSendFragment(int socket, const char* data, size_t length, int more);
+int frameSend(int socket, const char* data, size_t length);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // receives all fragments of the next message into a buffer allocated with
+   // malloc, which the caller has to free, the message is terminated with '\0'
+   // returns NULL if the connection was closed or broke
+char* frameReceive(int socket, size_t* length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
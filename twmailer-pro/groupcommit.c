@@ -0,0 +1,402 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "groupcommit.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // submitted requests wait in queue until the committer takes all of them at
+   // once, syncs every file they name (each file only once) and completes them
+   // forked children don't inherit the thread, the first request of a child
+   // starts one for it (the lock is taken around fork so the child never
+   // inherits it locked)
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t completed = PTHREAD_COND_INITIALIZER;
+static pthread_once_t atforkOnce = PTHREAD_ONCE_INIT;
+static pthread_t committer;
+static int running = 0;
+static int stopping = 0;
+static int window = COMMIT_WINDOW;
+
+static struct commitRequest* queueHead = NULL;
+static struct commitRequest* queueTail = NULL;
+static int queueLength = 0;
+
+static unsigned long groupCount = 0;
+static unsigned long requestCount = 0;
+static unsigned long syncCount = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void *commitLoop(void *data);
+static void commitGroup(struct commitRequest* group);
+static int comparePaths(const void* first, const void* second);
+static int startLocked();
+static void registerAtfork();
+static void beforeFork();
+static void afterForkParent();
+static void afterForkChild();
+
+///////////////////////////////////////////////////////////////////////////////
+
+void groupCommitConfigure(int windowMicros)
+{
+   if (windowMicros >= 0)
+   {
+      window = windowMicros;
+   }
+}
+
+int groupCommitWindow()
+{
+   return window;
+}
+
+int groupCommitStart()
+{
+   pthread_once(&atforkOnce, registerAtfork);
+   pthread_mutex_lock(&lock);
+   int result = startLocked();
+   pthread_mutex_unlock(&lock);
+   return result;
+}
+
+void groupCommitStop()
+{
+   pthread_mutex_lock(&lock);
+   if (!running)
+   {
+      pthread_mutex_unlock(&lock);
+      return;
+   }
+   stopping = 1;
+   pthread_cond_signal(&queued);
+   pthread_mutex_unlock(&lock);
+   pthread_join(committer, NULL);
+   pthread_mutex_lock(&lock);
+   running = 0;
+   stopping = 0;
+   pthread_mutex_unlock(&lock);
+}
+
+void groupCommitAdd(struct commitRequest* request, const char* path)
+{
+   if (request == NULL)
+   {
+      return;
+   }
+   for (int i = 0; i < request->pathCount; ++i)
+   {
+      if (strcmp(request->paths[i], path) == 0)
+      {
+         return;
+      }
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // no memory, sync it right now instead of with the group
+   if (request->pathCount == request->pathSize)
+   {
+      int size = request->pathSize > 0 ? 2 * request->pathSize : 8;
+      char** grown = realloc(request->paths, size * sizeof(char*));
+      if (grown != NULL)
+      {
+         request->paths = grown;
+         request->pathSize = size;
+      }
+   }
+   char* copy = request->pathCount < request->pathSize ? strdup(path) : NULL;
+   if (copy == NULL)
+   {
+      if (groupCommitSyncPath(path) == -1 && request->error == 0)
+      {
+         request->error = errno;
+      }
+      return;
+   }
+   request->paths[request->pathCount++] = copy;
+}
+
+void groupCommitReset(struct commitRequest* request)
+{
+   for (int i = 0; i < request->pathCount; ++i)
+   {
+      free(request->paths[i]);
+   }
+   request->pathCount = 0;
+   request->error = 0;
+   request->finished = 0;
+   request->next = NULL;
+}
+
+void groupCommitRelease(struct commitRequest* request)
+{
+   groupCommitReset(request);
+   free(request->paths);
+   request->paths = NULL;
+   request->pathSize = 0;
+}
+
+void groupCommitSubmit(struct commitRequest* request)
+{
+   pthread_once(&atforkOnce, registerAtfork);
+   request->finished = 0;
+   request->next = NULL;
+
+   pthread_mutex_lock(&lock);
+   if (!running && startLocked() == -1)
+   {
+      ///////////////////////////////////////////////////////////////////////////////
+      // no committer, the request is its own group
+      pthread_mutex_unlock(&lock);
+      commitGroup(request);
+      return;
+   }
+   if (queueTail == NULL)
+   {
+      queueHead = request;
+   }
+   else
+   {
+      queueTail->next = request;
+   }
+   queueTail = request;
+   ++queueLength;
+   pthread_cond_signal(&queued);
+   pthread_mutex_unlock(&lock);
+}
+
+int groupCommitWait(struct commitRequest* request)
+{
+   request->done = NULL;
+   groupCommitSubmit(request);
+
+   pthread_mutex_lock(&lock);
+   while (!request->finished)
+   {
+      pthread_cond_wait(&completed, &lock);
+   }
+   pthread_mutex_unlock(&lock);
+
+   if (request->error != 0)
+   {
+      errno = request->error;
+      return -1;
+   }
+   return 0;
+}
+
+void groupCommitStats(unsigned long* groups, unsigned long* requests, unsigned long* syncs)
+{
+   *groups = __atomic_load_n(&groupCount, __ATOMIC_RELAXED);
+   *requests = __atomic_load_n(&requestCount, __ATOMIC_RELAXED);
+   *syncs = __atomic_load_n(&syncCount, __ATOMIC_RELAXED);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the window starts with the first request of a group, not with the last one,
+   // so no request waits longer than window plus one sync
+static void *commitLoop(void *data)
+{
+   struct timespec deadline;
+
+   pthread_mutex_lock(&lock);
+   while (1)
+   {
+      while (queueHead == NULL && !stopping)
+      {
+         pthread_cond_wait(&queued, &lock);
+      }
+      if (queueHead == NULL)
+      {
+         break;
+      }
+      if (window > 0 && !stopping)
+      {
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_nsec += (long)window * 1000;
+         deadline.tv_sec += deadline.tv_nsec / 1000000000;
+         deadline.tv_nsec %= 1000000000;
+         while (queueLength < COMMIT_GROUP_MAX && !stopping &&
+                pthread_cond_timedwait(&queued, &lock, &deadline) != ETIMEDOUT)
+         {
+         }
+      }
+      struct commitRequest* group = queueHead;
+      queueHead = NULL;
+      queueTail = NULL;
+      queueLength = 0;
+      pthread_mutex_unlock(&lock);
+
+      commitGroup(group);
+
+      pthread_mutex_lock(&lock);
+   }
+   pthread_mutex_unlock(&lock);
+   return NULL;
+}
+
+static void commitGroup(struct commitRequest* group)
+{
+   int pathCount = 0;
+   int requests = 0;
+
+   for (struct commitRequest* request = group; request != NULL; request = request->next)
+   {
+      pathCount += request->pathCount;
+      ++requests;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // without memory for the list every request is synced on its own
+   const char** paths = malloc((pathCount > 0 ? pathCount : 1) * sizeof(char*));
+   pathCount = 0;
+   for (struct commitRequest* request = group; request != NULL; request = request->next)
+   {
+      for (int i = 0; i < request->pathCount; ++i)
+      {
+         if (paths != NULL)
+         {
+            paths[pathCount++] = request->paths[i];
+         }
+         else if (groupCommitSyncPath(request->paths[i]) == -1 && request->error == 0)
+         {
+            request->error = errno;
+         }
+      }
+   }
+   if (pathCount > 1)
+   {
+      qsort(paths, pathCount, sizeof(paths[0]), comparePaths);
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // every file once, a request fails if one of its files failed
+   int syncs = 0;
+   for (int i = 0; i < pathCount; ++i)
+   {
+      if (i > 0 && strcmp(paths[i], paths[i - 1]) == 0)
+      {
+         continue;
+      }
+      ++syncs;
+      if (groupCommitSyncPath(paths[i]) == -1)
+      {
+         int error = errno;
+         perror("group commit - sync");
+         for (struct commitRequest* request = group; request != NULL; request = request->next)
+         {
+            for (int j = 0; j < request->pathCount; ++j)
+            {
+               if (request->error == 0 && strcmp(request->paths[j], paths[i]) == 0)
+               {
+                  request->error = error;
+               }
+            }
+         }
+      }
+   }
+   free(paths);
+   __atomic_add_fetch(&groupCount, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&requestCount, requests, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&syncCount, syncs, __ATOMIC_RELAXED);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // next is read before done, the submitter may reuse the request right away
+   struct commitRequest* request = group;
+   while (request != NULL)
+   {
+      struct commitRequest* next = request->next;
+      if (request->done != NULL)
+      {
+         request->finished = 1;
+         request->done(request);
+      }
+      else
+      {
+         pthread_mutex_lock(&lock);
+         request->finished = 1;
+         pthread_cond_broadcast(&completed);
+         pthread_mutex_unlock(&lock);
+      }
+      request = next;
+   }
+}
+
+static int comparePaths(const void* first, const void* second)
+{
+   return strcmp(*(const char**)first, *(const char**)second);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // fdatasync is enough for files, a directory needs fsync for its new names
+int groupCommitSyncPath(const char* path)
+{
+   struct stat status;
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   int result;
+   if (fstat(fd, &status) == 0 && S_ISDIR(status.st_mode))
+   {
+      result = fsync(fd);
+   }
+   else
+   {
+      result = fdatasync(fd);
+   }
+   int error = errno;
+   close(fd);
+   errno = error;
+   return result;
+}
+
+static int startLocked()
+{
+   if (running)
+   {
+      return 0;
+   }
+   if (pthread_create(&committer, NULL, commitLoop, NULL) != 0)
+   {
+      return -1;
+   }
+   running = 1;
+   return 0;
+}
+
+static void registerAtfork()
+{
+   pthread_atfork(beforeFork, afterForkParent, afterForkChild);
+}
+
+static void beforeFork()
+{
+   pthread_mutex_lock(&lock);
+}
+
+static void afterForkParent()
+{
+   pthread_mutex_unlock(&lock);
+}
+
+static void afterForkChild()
+{
+   running = 0;
+   stopping = 0;
+   queueHead = NULL;
+   queueTail = NULL;
+   queueLength = 0;
+   pthread_mutex_unlock(&lock);
+}
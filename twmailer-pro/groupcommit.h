@@ -0,0 +1,79 @@
+#ifndef GROUPCOMMIT_H
+#define GROUPCOMMIT_H
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro group commit                                                 //
+   //                                                                           //
+   // in durable mode a SEND is only answered once the message is on disk,     //
+   // an fdatasync per message would make that as slow as the disk, so the     //
+   // files written by all SENDs that arrive within the commit window are      //
+   // collected and synced once for the whole group by a committer thread      //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // COMMIT_WINDOW: microseconds the committer waits for more requests after the
+   // first one of a group arrived, 0 syncs right away (requests that come in
+   // while a sync is running still end up in the same group)
+   // COMMIT_GROUP_MAX: a group that is this large is synced without waiting
+#define COMMIT_WINDOW 1000
+#define COMMIT_GROUP_MAX 256
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the files one SEND wrote, a directory is in there if a name was added to it
+   // (a SEND to many receivers writes to many mailboxes, paths grows as needed)
+   // error is the errno of the first sync that failed, 0 if the request is durable
+   // done is called by the committer thread when the group is synced,
+   // data is for whoever submitted the request
+struct commitRequest{
+   char** paths;
+   int pathCount;
+   int pathSize;
+   int error;
+   int finished;
+   void (*done)(struct commitRequest* request);
+   void* data;
+   struct commitRequest* next;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // must be called before the first request, windowMicros < 0 keeps the default
+void groupCommitConfigure(int windowMicros);
+int groupCommitWindow();
+
+int groupCommitStart();
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // syncs what is still queued and stops the committer thread
+void groupCommitStop();
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // remembers a file that has to be synced, request may be NULL (not durable)
+void groupCommitAdd(struct commitRequest* request, const char* path);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // frees the paths so the request can be used again,
+   // groupCommitRelease also frees the list before the request itself goes away
+void groupCommitReset(struct commitRequest* request);
+void groupCommitRelease(struct commitRequest* request);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // queues the request, done is called once it is durable
+void groupCommitSubmit(struct commitRequest* request);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // queues the request and blocks until it is durable,
+   // returns 0 or -1 with errno set
+int groupCommitWait(struct commitRequest* request);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // syncs one file or directory right away, outside of any group,
+   // returns 0 or -1 with errno set
+int groupCommitSyncPath(const char* path);
+
+void groupCommitStats(unsigned long* groups, unsigned long* requests, unsigned long* syncs);
+
+#endif
@@ -0,0 +1,521 @@
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "ldappool.h"
+#include "ldapasync.h"
+#include "logging.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // workers push their requests to submitted and wake the directory thread
+   // with wakeEvent, everything else is only touched by the directory thread:
+   // waiting holds the requests that wait for a free connection, in order,
+   // every connection lists the requests in flight on it
+
+struct asyncConnection{
+   LDAP *ld;
+   int bindService;
+   struct ldapRequest *inFlight;
+   int count;
+};
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ldapRequest *submitted = NULL;
+static int wakeEvent = -1;
+static int running = 0;
+static int stopping = 0;
+static int timeoutMilliseconds = LDAP_REQUEST_TIMEOUT;
+
+static struct asyncConnection searchConnection = {NULL, 1, NULL, 0};
+static struct asyncConnection verifyConnections[LDAP_POOL_MAX];
+static int verifyCount = 0;
+
+static struct ldapRequest *waiting = NULL;
+static struct ldapRequest **waitingEnd = &waiting;
+
+static unsigned long answered = 0;
+static unsigned long expired = 0;
+static int inFlight = 0;
+static int peak = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void *directoryLoop(void *data);
+static void takeSubmitted();
+static void dispatch();
+static int startRequest(struct ldapRequest *request);
+static int sendRequest(struct asyncConnection *connection, struct ldapRequest *request);
+static void collect(struct asyncConnection *connection);
+static void expire(struct asyncConnection *connection, const struct timespec *now);
+static void dropConnection(struct asyncConnection *connection);
+static void finish(struct ldapRequest *request, int result);
+static int failure(const struct ldapRequest *request);
+static int pastDeadline(const struct ldapRequest *request, const struct timespec *now);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int ldapAsyncStart(int connections, int timeout)
+{
+   verifyCount = connections < 1 ? 1 : connections > LDAP_POOL_MAX ? LDAP_POOL_MAX : connections;
+   for (int i = 0; i < verifyCount; ++i)
+   {
+      verifyConnections[i].ld = NULL;
+      verifyConnections[i].bindService = 0;
+      verifyConnections[i].inFlight = NULL;
+      verifyConnections[i].count = 0;
+   }
+   timeoutMilliseconds = timeout > 0 ? timeout : LDAP_REQUEST_TIMEOUT;
+   stopping = 0;
+   if ((wakeEvent = eventfd(0, EFD_NONBLOCK)) == -1)
+   {
+      perror("eventfd directory");
+      return -1;
+   }
+   if (pthread_create(&thread, NULL, directoryLoop, NULL) != 0)
+   {
+      perror("pthread_create directory");
+      close(wakeEvent);
+      wakeEvent = -1;
+      return -1;
+   }
+   running = 1;
+   return 0;
+}
+
+int ldapAsyncRunning()
+{
+   return running;
+}
+
+void ldapAsyncSubmit(struct ldapRequest *request)
+{
+   uint64_t wakeup = 1;
+
+   clock_gettime(CLOCK_MONOTONIC, &request->deadline);
+   request->deadline.tv_sec += timeoutMilliseconds / 1000;
+   request->deadline.tv_nsec += timeoutMilliseconds % 1000 * 1000000L;
+   if (request->deadline.tv_nsec >= 1000000000L)
+   {
+      ++request->deadline.tv_sec;
+      request->deadline.tv_nsec -= 1000000000L;
+   }
+   request->connection = NULL;
+
+   pthread_mutex_lock(&lock);
+   request->next = submitted;
+   submitted = request;
+   pthread_mutex_unlock(&lock);
+   if (write(wakeEvent, &wakeup, sizeof(wakeup)) == -1)
+   {
+      perror("write directory event");
+   }
+}
+
+void ldapAsyncStop()
+{
+   uint64_t wakeup = 1;
+
+   if (!running)
+   {
+      return;
+   }
+   pthread_mutex_lock(&lock);
+   stopping = 1;
+   pthread_mutex_unlock(&lock);
+   if (write(wakeEvent, &wakeup, sizeof(wakeup)) == -1)
+   {
+      perror("write directory event");
+   }
+   pthread_join(thread, NULL);
+   close(wakeEvent);
+   wakeEvent = -1;
+   running = 0;
+}
+
+void ldapAsyncStats(unsigned long *answeredCount, unsigned long *expiredCount, int *peakCount)
+{
+   *answeredCount = __atomic_load_n(&answered, __ATOMIC_RELAXED);
+   *expiredCount = __atomic_load_n(&expired, __ATOMIC_RELAXED);
+   *peakCount = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // sends what can be sent, waits for the connections that have requests in
+   // flight (and new requests), collects the answers and fails whatever ran
+   // out of time, until ldapAsyncStop fails the rest
+static void *directoryLoop(void *data)
+{
+   struct pollfd descriptors[LDAP_POOL_MAX + 2];
+   uint64_t count;
+
+   while (1)
+   {
+      takeSubmitted();
+      if (__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+      {
+         break;
+      }
+      dispatch();
+
+      int used = 0;
+      descriptors[used].fd = wakeEvent;
+      descriptors[used].events = POLLIN;
+      ++used;
+      for (int i = -1; i < verifyCount; ++i)
+      {
+         struct asyncConnection *connection = i == -1 ? &searchConnection : &verifyConnections[i];
+         int fd = -1;
+         if (connection->count == 0 || ldap_get_option(connection->ld, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS || fd < 0)
+         {
+            continue;
+         }
+         descriptors[used].fd = fd;
+         descriptors[used].events = POLLIN;
+         ++used;
+      }
+
+      ///////////////////////////////////////////////////////////////////////////////
+      // nothing to wait for but new requests: sleep until one arrives
+      int busy = waiting != NULL || inFlight > 0;
+      if (poll(descriptors, used, busy ? LDAP_ASYNC_TICK : -1) == -1 && errno != EINTR)
+      {
+         perror("poll directory");
+      }
+      if (descriptors[0].revents & POLLIN)
+      {
+         if (read(wakeEvent, &count, sizeof(count)) == -1 && errno != EAGAIN)
+         {
+            perror("read directory event");
+         }
+      }
+
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      for (int i = -1; i < verifyCount; ++i)
+      {
+         struct asyncConnection *connection = i == -1 ? &searchConnection : &verifyConnections[i];
+         if (connection->count > 0)
+         {
+            collect(connection);
+            expire(connection, &now);
+         }
+      }
+      for (struct ldapRequest **request = &waiting; *request != NULL;)
+      {
+         if (pastDeadline(*request, &now))
+         {
+            struct ldapRequest *late = *request;
+            *request = late->next;
+            __atomic_add_fetch(&expired, 1, __ATOMIC_RELAXED);
+            finish(late, failure(late));
+            continue;
+         }
+         request = &(*request)->next;
+      }
+      waitingEnd = &waiting;
+      while (*waitingEnd != NULL)
+      {
+         waitingEnd = &(*waitingEnd)->next;
+      }
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // nobody waits for an answer anymore
+   while (waiting != NULL)
+   {
+      struct ldapRequest *request = waiting;
+      waiting = request->next;
+      finish(request, failure(request));
+   }
+   dropConnection(&searchConnection);
+   for (int i = 0; i < verifyCount; ++i)
+   {
+      dropConnection(&verifyConnections[i]);
+   }
+   return NULL;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // submitted is pushed to at the front, so it is reversed to keep the order
+static void takeSubmitted()
+{
+   pthread_mutex_lock(&lock);
+   struct ldapRequest *request = submitted;
+   submitted = NULL;
+   pthread_mutex_unlock(&lock);
+
+   struct ldapRequest *ordered = NULL;
+   while (request != NULL)
+   {
+      struct ldapRequest *next = request->next;
+      request->next = ordered;
+      ordered = request;
+      request = next;
+   }
+   *waitingEnd = ordered;
+   while (*waitingEnd != NULL)
+   {
+      waitingEnd = &(*waitingEnd)->next;
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // starts the waiting requests in order, a bind that finds no free
+   // connection keeps its place, searches behind it may still go out
+static void dispatch()
+{
+   for (struct ldapRequest **request = &waiting; *request != NULL;)
+   {
+      struct ldapRequest *current = *request;
+      struct ldapRequest *next = current->next; // sendRequest links it into the connection
+      int started = startRequest(current);
+      if (started == 0)
+      {
+         request = &current->next;
+         continue;
+      }
+      *request = next;
+      if (started == -1)
+      {
+         finish(current, failure(current));
+      }
+   }
+   waitingEnd = &waiting;
+   while (*waitingEnd != NULL)
+   {
+      waitingEnd = &(*waitingEnd)->next;
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 if the request is in flight, 0 if all connections for binds are
+   // busy and -1 if it failed (the directory can't be reached)
+   // a connection that broke while it was idle is only noticed when it is used,
+   // in that case it is replaced and the request is sent once more
+static int startRequest(struct ldapRequest *request)
+{
+   struct asyncConnection *connection = NULL;
+
+   if (request->password == NULL)
+   {
+      connection = &searchConnection;
+   }
+   else
+   {
+      for (int i = 0; i < verifyCount; ++i)
+      {
+         if (verifyConnections[i].count == 0 &&
+             (connection == NULL || (connection->ld == NULL && verifyConnections[i].ld != NULL)))
+         {
+            connection = &verifyConnections[i];
+         }
+      }
+      if (connection == NULL)
+      {
+         return 0;
+      }
+   }
+
+   for (int attempt = 0; attempt < 2; ++attempt)
+   {
+      if (connection->ld == NULL && (connection->ld = ldapOpen(connection->bindService)) == NULL)
+      {
+         return -1;
+      }
+      int sent = sendRequest(connection, request);
+      if (sent != -1)
+      {
+         return sent == 1 ? 1 : -1;
+      }
+      dropConnection(connection);
+   }
+   return -1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 if the request went out, -1 if the connection is broken and
+   // -2 if the request can't be sent at all (an empty password, a uid that
+   // can't be part of a dn, no memory for the filter)
+static int sendRequest(struct asyncConnection *connection, struct ldapRequest *request)
+{
+   int l;
+
+   if (request->password != NULL)
+   {
+      char dn[512];
+      ////////////////////////////////////////////////////////////////////////////
+      // a simple bind with an empty password is an unauthenticated bind which
+      // succeeds for every dn, so it must never count as a login
+      if (request->password[0] == '\0' || !ldapUserDn(dn, sizeof(dn), request->uid))
+      {
+         return -2;
+      }
+      BerValue bindCredentials;
+      bindCredentials.bv_val = (char *)request->password;
+      bindCredentials.bv_len = strlen(request->password);
+      l = ldap_sasl_bind(connection->ld, dn, LDAP_SASL_SIMPLE, &bindCredentials, NULL, NULL, &request->msgid);
+   }
+   else
+   {
+      char *attributes[] = {"uid", NULL};
+      struct timeval limit = {timeoutMilliseconds / 1000, timeoutMilliseconds % 1000 * 1000};
+      char *filter = ldapUidFilter(request->uids, request->count);
+      if (filter == NULL)
+      {
+         return -2;
+      }
+      l = ldap_search_ext(connection->ld, ldapSearchBase(), LDAP_SCOPE_SUBTREE, filter, attributes, 0,
+                          NULL, NULL, &limit, request->count + 500, &request->msgid);
+      free(filter);
+   }
+   if (l != LDAP_SUCCESS)
+   {
+      logError("%s\n", ldap_err2string(l));
+      return -1;
+   }
+
+   request->connection = connection;
+   request->next = connection->inFlight;
+   connection->inFlight = request;
+   ++connection->count;
+   ++inFlight;
+   if (inFlight > __atomic_load_n(&peak, __ATOMIC_RELAXED))
+   {
+      __atomic_store_n(&peak, inFlight, __ATOMIC_RELAXED);
+   }
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // takes every complete answer off the connection without waiting
+   // a search is complete once its result arrived, LDAP_MSG_ALL hands out
+   // its entries together with it
+static void collect(struct asyncConnection *connection)
+{
+   struct timeval zero = {0, 0};
+
+   for (struct ldapRequest **request = &connection->inFlight; *request != NULL;)
+   {
+      struct ldapRequest *current = *request;
+      LDAPMessage *res = NULL;
+      int type = ldap_result(connection->ld, current->msgid, LDAP_MSG_ALL, &zero, &res);
+      if (type == 0)
+      {
+         request = &current->next;
+         continue;
+      }
+      if (type == -1)
+      {
+         logError("directory connection lost\n");
+         if (res != NULL)
+         {
+            ldap_msgfree(res);
+         }
+         dropConnection(connection);
+         return;
+      }
+
+      *request = current->next;
+      --connection->count;
+      --inFlight;
+      int code = -1;
+      int result = failure(current);
+      if (ldap_parse_result(connection->ld, res, &code, NULL, NULL, NULL, NULL, 0) == LDAP_SUCCESS)
+      {
+         if (current->password != NULL)
+         {
+            result = code == LDAP_SUCCESS;
+         }
+         else if (code == LDAP_SUCCESS || code == LDAP_SIZELIMIT_EXCEEDED)
+         {
+            for (int i = 0; i < current->count; ++i)
+            {
+               current->exists[i] = 0;
+            }
+            int resultCount = ldapMatchEntries(connection->ld, res, current->uids, current->count, current->exists);
+            logDebug("Total results for %d searched uids: %d\n", current->count, resultCount);
+            result = 0;
+         }
+      }
+      if (code != LDAP_SUCCESS)
+      {
+         logInfo("%s\n", ldap_err2string(code));
+      }
+      ldap_msgfree(res);
+      __atomic_add_fetch(&answered, 1, __ATOMIC_RELAXED);
+      finish(current, result);
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // abandons what ran out of time, a bind that was abandoned leaves the
+   // connection bound as nobody knows who, so it is replaced
+static void expire(struct asyncConnection *connection, const struct timespec *now)
+{
+   for (struct ldapRequest **request = &connection->inFlight; *request != NULL;)
+   {
+      struct ldapRequest *current = *request;
+      if (!pastDeadline(current, now))
+      {
+         request = &current->next;
+         continue;
+      }
+      logInfo("directory did not answer in time\n");
+      ldap_abandon_ext(connection->ld, current->msgid, NULL, NULL);
+      *request = current->next;
+      --connection->count;
+      --inFlight;
+      __atomic_add_fetch(&expired, 1, __ATOMIC_RELAXED);
+      finish(current, failure(current));
+      if (!connection->bindService)
+      {
+         dropConnection(connection);
+         return;
+      }
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // closes the connection and fails what is in flight on it
+static void dropConnection(struct asyncConnection *connection)
+{
+   while (connection->inFlight != NULL)
+   {
+      struct ldapRequest *request = connection->inFlight;
+      connection->inFlight = request->next;
+      --inFlight;
+      finish(request, failure(request));
+   }
+   connection->count = 0;
+   if (connection->ld != NULL)
+   {
+      ldap_unbind_ext_s(connection->ld, NULL, NULL);
+      connection->ld = NULL;
+   }
+}
+
+static void finish(struct ldapRequest *request, int result)
+{
+   request->result = result;
+   request->connection = NULL;
+   request->next = NULL;
+   request->done(request);
+}
+
+static int failure(const struct ldapRequest *request)
+{
+   return request->password != NULL ? 0 : -1;
+}
+
+static int pastDeadline(const struct ldapRequest *request, const struct timespec *now)
+{
+   return now->tv_sec > request->deadline.tv_sec ||
+          (now->tv_sec == request->deadline.tv_sec && now->tv_nsec >= request->deadline.tv_nsec);
+}
@@ -0,0 +1,86 @@
+#ifndef LDAPASYNC_H
+#define LDAPASYNC_H
+
+#include <time.h>
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro asynchronous directory requests                              //
+   //                                                                           //
+   // the blocking calls of ldappool.h stall the thread that makes them until  //
+   // the directory answers, a worker of the event loop would stall all of    //
+   // its clients, so workers hand logins and receiver lookups to the          //
+   // directory thread instead and serve their other clients meanwhile         //
+   // the directory thread sends the requests with ldap_sasl_bind and          //
+   // ldap_search_ext, waits in poll for the connections and collects the     //
+   // answers with ldap_result, every request has a deadline after which it   //
+   // is abandoned and fails                                                   //
+   // searches share one connection, any number of them in flight at once,    //
+   // a bind changes who a connection is bound as and no other request may    //
+   // be sent on it until it is answered, so binds go over up to the pool     //
+   // size connections, one bind in flight on each                            //
+   // opening a connection (TLS and the bind of the service account) still   //
+   // blocks, but only the directory thread, and only once per connection     //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // milliseconds a request may take, also the time limit the directory gets
+   // for a search
+#define LDAP_REQUEST_TIMEOUT 5000
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // milliseconds the directory thread waits in poll at most, TLS may hold an
+   // answer that was already read from the socket, so the connections are
+   // also checked when their descriptor is quiet
+#define LDAP_ASYNC_TICK 100
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a bind if password is set, a search for the count uids otherwise
+   // the strings and arrays belong to the caller and must stay valid until
+   // done is called
+   // result: 1 if the password is right, 0 if not or if the directory didn't
+   // answer in time; a search returns 0 and sets exists[i] for every uid, or
+   // -1 if the directory couldn't be asked
+   // done is called in the directory thread, data is left to the caller
+   // connection and the fields after it are used by the directory thread
+struct ldapRequest{
+   const char* uid;
+   const char* password;
+   const char** uids;
+   int count;
+   int* exists;
+   int result;
+   void (*done)(struct ldapRequest* request);
+   void* data;
+   void* connection;
+   int msgid;
+   struct timespec deadline;
+   struct ldapRequest* next;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // starts the directory thread with connections for connections binds at
+   // once (at most LDAP_POOL_MAX) and timeout milliseconds per request
+   // returns 0 or -1 if the thread can't be started
+int ldapAsyncStart(int connections, int timeout);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 if the directory thread runs
+int ldapAsyncRunning();
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // queues the request, done is called once it is answered or failed
+void ldapAsyncSubmit(struct ldapRequest* request);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // fails what is still queued or in flight and stops the thread
+void ldapAsyncStop();
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // requests answered, requests that ran out of time, most in flight at once
+void ldapAsyncStats(unsigned long* answered, unsigned long* expired, int* peak);
+
+#endif
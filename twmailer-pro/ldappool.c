@@ -0,0 +1,560 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <ldap.h>
+#include <lber.h>
+#include "ldappool.h"
+#include "logging.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // every pooled connection remembers when it was used last, so connections
+   // the server (or a firewall in between) might have dropped in the meantime
+   // are checked before they are used again
+struct ldapConnection{
+   LDAP *ld;
+   time_t lastUsed;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // idle holds the connections nobody uses right now, open counts idle and
+   // used ones together and never exceeds size
+   // bindService: 1 if the connections are bound with the service account,
+   // 0 if they are only used to verify user passwords
+struct ldapPool{
+   pthread_mutex_t lock;
+   pthread_cond_t available;
+   struct ldapConnection idle[LDAP_POOL_MAX];
+   int idleCount;
+   int open;
+   int size;
+   int bindService;
+};
+
+static struct ldapPool searchPool = {
+   PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {{NULL, 0}}, 0, 0, LDAP_POOL_SIZE, 1
+};
+static struct ldapPool verifyPool = {
+   PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {{NULL, 0}}, 0, 0, LDAP_POOL_SIZE, 0
+};
+
+static const char *directoryUri = LDAP_URI;
+static const char *searchBase = LDAP_SEARCH_BASE;
+static int timeoutMilliseconds = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static int ldapAlive(LDAP *ld);
+static int ldapBroken(int error);
+static int ldapAcquire(struct ldapPool *pool, struct ldapConnection *connection);
+static void ldapRelease(struct ldapPool *pool, struct ldapConnection *connection, int broken);
+static void ldapEscape(char *target, const char *value, size_t size);
+static struct timeval *ldapTimeout(struct timeval *timeout);
+
+///////////////////////////////////////////////////////////////////////////////
+
+void ldapPoolSetSize(int size)
+{
+   if (size < 1)
+   {
+      size = 1;
+   }
+   if (size > LDAP_POOL_MAX)
+   {
+      size = LDAP_POOL_MAX;
+   }
+   searchPool.size = size;
+   verifyPool.size = size;
+}
+
+void ldapPoolSetDirectory(const char *uri, const char *base)
+{
+   if (uri != NULL)
+   {
+      directoryUri = uri;
+   }
+   if (base != NULL)
+   {
+      searchBase = base;
+   }
+}
+
+void ldapPoolSetTimeout(int milliseconds)
+{
+   timeoutMilliseconds = milliseconds;
+}
+
+void ldapPoolDestroy()
+{
+   struct ldapPool *pools[] = {&searchPool, &verifyPool};
+   for (int i = 0; i < 2; ++i)
+   {
+      pthread_mutex_lock(&pools[i]->lock);
+      while (pools[i]->idleCount > 0)
+      {
+         --pools[i]->idleCount;
+         --pools[i]->open;
+         ldap_unbind_ext_s(pools[i]->idle[pools[i]->idleCount].ld, NULL, NULL);
+      }
+      pthread_mutex_unlock(&pools[i]->lock);
+   }
+}
+
+int ldapUserExists(const char *uid)
+{
+   int exists;
+   if (ldapUsersExist(&uid, 1, &exists) == -1)
+   {
+      return -1;
+   }
+   return exists; // i.e. 1 if person found, 0 if not
+}
+
+int ldapUsersExist(const char **uids, int count, int *exists)
+{
+   // search settings
+   const char *base = searchBase; // search base
+   ber_int_t scope = LDAP_SCOPE_SUBTREE;
+   char *attributes[] = {"uid", NULL};
+   struct ldapConnection connection;
+   LDAPMessage *res = NULL;
+
+   char *filter = ldapUidFilter(uids, count);
+   if (filter == NULL)
+   {
+      return -1;
+   }
+   for (int i = 0; i < count; ++i)
+   {
+      exists[i] = 0;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // a connection that broke while it was idle is only noticed when it is
+   // used, in that case it is dropped and the search is repeated once with a
+   // fresh connection
+   for (int attempt = 0; attempt < 2; ++attempt)
+   {
+      if (!ldapAcquire(&searchPool, &connection))
+      {
+         free(filter);
+         return -1;
+      }
+
+      ////////////////////////////////////////////////////////////////////////////
+      // perform ldap search
+      // https://linux.die.net/man/3/ldap_search_ext_s
+      // _s : synchronous
+      // int ldap_search_ext_s(
+      //     LDAP *ld,
+      //     char *base,
+      //     int scope,
+      //     char *filter,
+      //     char *attrs[],
+      //     int attrsonly,
+      //     LDAPControl **serverctrls,
+      //     LDAPControl **clientctrls,
+      //     struct timeval *timeout,
+      //     int sizelimit,
+      //     LDAPMessage **res );
+      struct timeval timeout;
+      int l = ldap_search_ext_s(connection.ld, base, scope, filter, attributes, 0, NULL, NULL, ldapTimeout(&timeout), count + 500, &res);
+      if (l != LDAP_SUCCESS)
+      {
+         logError("%s\n", ldap_err2string(l));
+         perror("ldap_search_ext_s - Error: ");
+         if (res != NULL)
+         {
+            ldap_msgfree(res);
+            res = NULL;
+         }
+         ldapRelease(&searchPool, &connection, ldapBroken(l));
+         if (ldapBroken(l))
+         {
+            continue;
+         }
+         free(filter);
+         return -1;
+      }
+
+      int resultCount = ldapMatchEntries(connection.ld, res, uids, count, exists);
+      logDebug("Total results for %d searched uids: %d\n", count, resultCount);
+
+      // free memory
+      ldap_msgfree(res);
+      ldapRelease(&searchPool, &connection, 0);
+      free(filter);
+      return 0;
+   }
+   free(filter);
+   return -1;
+}
+
+int ldapVerifyUser(const char *uid, const char *pwd)
+{
+   struct ldapConnection connection;
+   char fulluid[512];
+
+   ////////////////////////////////////////////////////////////////////////////
+   // a simple bind with an empty password is an unauthenticated bind which
+   // succeeds for every dn, so it must never count as a login
+   if (pwd[0] == '\0')
+   {
+      return 0;
+   }
+
+   if (!ldapUserDn(fulluid, sizeof(fulluid), uid))
+   {
+      return 0;
+   }
+
+   for (int attempt = 0; attempt < 2; ++attempt)
+   {
+      if (!ldapAcquire(&verifyPool, &connection))
+      {
+         return 0;
+      }
+
+      ////////////////////////////////////////////////////////////////////////////
+      // bind credentials
+      // https://linux.die.net/man/3/lber-types
+      // SASL (Simple Authentication and Security Layer)
+      // https://linux.die.net/man/3/ldap_sasl_bind_s
+      // binding again on a connection is allowed and simply replaces the
+      // identity of the previous bind, so the connection can be reused
+      // for the next login afterwards, even if this bind failed
+      BerValue bindCredentials; //BerValue = public class // storage units of a variety of sizes
+      bindCredentials.bv_val = (char *)pwd; //if bv is NULL, routine does nothing
+      bindCredentials.bv_len = strlen(pwd);
+      BerValue *servercredp = NULL;
+      int l = ldap_sasl_bind_s(connection.ld, fulluid, LDAP_SASL_SIMPLE, &bindCredentials, NULL, NULL, &servercredp);
+      if (servercredp != NULL)
+      {
+         ber_bvfree(servercredp);
+      }
+      if (l != LDAP_SUCCESS)
+      {
+         logInfo("%s\n", ldap_err2string(l));
+         ldapRelease(&verifyPool, &connection, ldapBroken(l));
+         if (ldapBroken(l))
+         {
+            continue;
+         }
+         return 0;
+      }
+      ldapRelease(&verifyPool, &connection, 0);
+      return 1;
+   }
+   return 0;
+}
+
+LDAP *ldapOpen(int bindService)
+{
+   ////////////////////////////////////////////////////////////////////////////
+   // setup LDAP connection
+   // https://linux.die.net/man/3/ldap_initialize
+   LDAP *ld;
+   int l = ldap_initialize(&ld, directoryUri);
+   if (l != LDAP_OPT_SUCCESS)
+   {
+      logError("%s\n", ldap_err2string(l));
+      perror("ldap_initialize - Error: ");
+      return NULL;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // set verison options
+   // https://linux.die.net/man/3/ldap_set_option
+   int ldapVersion = LDAP_VERSION3;
+
+   l = ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &ldapVersion);
+   if (l != LDAP_OPT_SUCCESS)
+   {
+      logError("%s\n", ldap_err2string(l));
+      perror("ldap_set_option - Error: ");
+      ldap_unbind_ext_s(ld, NULL, NULL);
+      return NULL;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // connecting and every synchronous request give up after the timeout
+   // instead of waiting for a directory that doesn't answer
+   struct timeval timeout;
+   if (ldapTimeout(&timeout) != NULL)
+   {
+      ldap_set_option(ld, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+      ldap_set_option(ld, LDAP_OPT_TIMEOUT, &timeout);
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // start connection secure (initialize TLS)
+   // https://linux.die.net/man/3/ldap_start_tls_s
+   // int ldap_start_tls_s(LDAP *ld,
+   //                      LDAPControl **serverctrls,
+   //                      LDAPControl **clientctrls);
+   // https://linux.die.net/man/3/ldap
+   // https://docs.oracle.com/cd/E19957-01/817-6707/controls.html
+   //    The LDAPv3, as documented in RFC 2251 - Lightweight Directory Access
+   //    Protocol (v3) (http://www.faqs.org/rfcs/rfc2251.html), allows clients
+   //    and servers to use controls as a mechanism for extending an LDAP
+   //    operation. A control is a way to specify additional information as
+   //    part of a request and a response. For example, a client can send a
+   //    control to a server as part of a search request to indicate that the
+   //    server should sort the search results before sending the results back
+   //    to the client.
+   // this handshake is the expensive part, which is why it is done only once
+   // per pooled connection
+   l = ldap_start_tls_s(ld, NULL, NULL);
+   if (l != LDAP_SUCCESS)
+   {
+      logError("%s\n", ldap_err2string(l));
+      perror("ldap_start_tls_s - Error: ");
+      ldap_unbind_ext_s(ld, NULL, NULL);
+      return NULL;
+   }
+
+   if (!bindService)
+   {
+      return ld;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // bind with the service account, no credentials mean an anonymous bind
+   // int ldap_sasl_bind_s(
+   //       LDAP *ld,
+   //       const char *dn,
+   //       const char *mechanism,
+   //       struct berval *cred,
+   //       LDAPControl *sctrls[],
+   //       LDAPControl *cctrls[],
+   //       struct berval **servercredp);
+   const char *bindDn = getenv("LDAP_BIND_DN");
+   const char *bindPassword = getenv("LDAP_BIND_PW");
+   BerValue bindCredentials;
+   bindCredentials.bv_val = (char *)(bindPassword != NULL ? bindPassword : "");
+   bindCredentials.bv_len = strlen(bindCredentials.bv_val);
+   BerValue *servercredp = NULL;
+   l = ldap_sasl_bind_s(ld, bindDn, LDAP_SASL_SIMPLE, &bindCredentials, NULL, NULL, &servercredp);
+   if (servercredp != NULL)
+   {
+      ber_bvfree(servercredp);
+   }
+   if (l != LDAP_SUCCESS)
+   {
+      logError("%s\n", ldap_err2string(l));
+      perror("ldap_sasl_bind_s - Error: ");
+      ldap_unbind_ext_s(ld, NULL, NULL);
+      return NULL;
+   }
+   return ld;
+}
+
+char *ldapUidFilter(const char **uids, int count)
+{
+   ////////////////////////////////////////////////////////////////////////////
+   // exact match, the uids come from the client so characters with a meaning
+   // in filters (* ( ) \) are escaped, more than one uid are or-ed together
+   size_t size = 4;
+   for (int i = 0; i < count; ++i)
+   {
+      size += 3 * strlen(uids[i]) + 7;
+   }
+   char *filter = malloc(size);
+   if (filter == NULL)
+   {
+      perror("malloc filter");
+      return NULL;
+   }
+   size_t length = 0;
+   if (count > 1)
+   {
+      length += sprintf(filter, "(|");
+   }
+   for (int i = 0; i < count; ++i)
+   {
+      length += sprintf(filter + length, "(uid=");
+      ldapEscape(filter + length, uids[i], size - length - 2);
+      length += strlen(filter + length);
+      filter[length++] = ')';
+   }
+   if (count > 1)
+   {
+      filter[length++] = ')';
+   }
+   filter[length] = '\0';
+   return filter;
+}
+
+int ldapMatchEntries(LDAP *ld, LDAPMessage *res, const char **uids, int count, int *exists)
+{
+   ////////////////////////////////////////////////////////////////////////////
+   // every entry found names the uid it matched
+   int resultCount = 0;
+   for (LDAPMessage *entry = ldap_first_entry(ld, res); entry != NULL; entry = ldap_next_entry(ld, entry))
+   {
+      struct berval **values = ldap_get_values_len(ld, entry, "uid");
+      for (int v = 0; values != NULL && values[v] != NULL; ++v)
+      {
+         for (int i = 0; i < count; ++i)
+         {
+            if (!exists[i] && strlen(uids[i]) == values[v]->bv_len &&
+                strncasecmp(uids[i], values[v]->bv_val, values[v]->bv_len) == 0)
+            {
+               exists[i] = 1;
+            }
+         }
+      }
+      ldap_value_free_len(values);
+      ++resultCount;
+   }
+   return resultCount;
+}
+
+int ldapUserDn(char *target, size_t size, const char *uid)
+{
+   ////////////////////////////////////////////////////////////////////////////
+   // the uid comes from the client, characters with a meaning in a dn
+   // (RFC 4514) would bind as someone else, no uid of the directory has them
+   if (uid[0] == '\0' || strpbrk(uid, ",+\"\\<>;=#") != NULL)
+   {
+      return 0;
+   }
+   return snprintf(target, size, "uid=%s,ou=people,%s", uid, searchBase) < (int)size;
+}
+
+const char *ldapSearchBase()
+{
+   return searchBase;
+}
+
+int ldapTimeoutMilliseconds()
+{
+   return timeoutMilliseconds;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // health check for connections that were idle for a while
+   // whoami is the cheapest request that still needs an answer from the server
+static int ldapAlive(LDAP *ld)
+{
+   struct berval *authzid = NULL;
+   int l = ldap_whoami_s(ld, &authzid, NULL, NULL);
+   if (authzid != NULL)
+   {
+      ber_bvfree(authzid);
+   }
+   return l == LDAP_SUCCESS;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // errors after which the connection can't be used anymore
+static int ldapBroken(int error)
+{
+   return error == LDAP_SERVER_DOWN || error == LDAP_CONNECT_ERROR || error == LDAP_TIMEOUT;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // hands out an idle connection or opens a new one if the pool is not full yet,
+   // otherwise waits until another thread releases one
+   // connecting happens outside the lock so a slow handshake doesn't stall
+   // the threads that only want to give a connection back
+   // returns 1 on success and 0 if no connection could be opened
+static int ldapAcquire(struct ldapPool *pool, struct ldapConnection *connection)
+{
+   pthread_mutex_lock(&pool->lock);
+   while (pool->idleCount == 0 && pool->open >= pool->size)
+   {
+      pthread_cond_wait(&pool->available, &pool->lock);
+   }
+   if (pool->idleCount > 0)
+   {
+      *connection = pool->idle[--pool->idleCount];
+      pthread_mutex_unlock(&pool->lock);
+      if (time(NULL) - connection->lastUsed < LDAP_IDLE_CHECK || ldapAlive(connection->ld))
+      {
+         return 1;
+      }
+      ////////////////////////////////////////////////////////////////////////////
+      // stale connection: replace it, the slot in open stays taken
+      logInfo("ldap connection failed health check, reconnecting\n");
+      ldap_unbind_ext_s(connection->ld, NULL, NULL);
+   }
+   else
+   {
+      ++pool->open;
+      pthread_mutex_unlock(&pool->lock);
+   }
+
+   connection->ld = ldapOpen(pool->bindService);
+   if (connection->ld == NULL)
+   {
+      pthread_mutex_lock(&pool->lock);
+      --pool->open;
+      pthread_cond_signal(&pool->available);
+      pthread_mutex_unlock(&pool->lock);
+      return 0;
+   }
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // puts the connection back, broken connections are closed instead and free
+   // their slot for a new one
+static void ldapRelease(struct ldapPool *pool, struct ldapConnection *connection, int broken)
+{
+   if (broken)
+   {
+      ////////////////////////////////////////////////////////////////////////////
+      // https://linux.die.net/man/3/ldap_unbind_ext_s
+      ldap_unbind_ext_s(connection->ld, NULL, NULL);
+   }
+   connection->lastUsed = time(NULL);
+
+   pthread_mutex_lock(&pool->lock);
+   if (broken)
+   {
+      --pool->open;
+   }
+   else
+   {
+      pool->idle[pool->idleCount++] = *connection;
+   }
+   pthread_cond_signal(&pool->available);
+   pthread_mutex_unlock(&pool->lock);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // escapes a value for an ldap filter as described in RFC 4515,
+   // target must hold 3 * strlen(value) + 1 characters, longer values are cut
+static void ldapEscape(char *target, const char *value, size_t size)
+{
+   size_t length = 0;
+   for (; *value != '\0' && length + 4 <= size; ++value)
+   {
+      if (*value == '*' || *value == '(' || *value == ')' || *value == '\\')
+      {
+         length += sprintf(target + length, "\\%02x", (unsigned char)*value);
+      }
+      else
+      {
+         target[length++] = *value;
+      }
+   }
+   target[length] = '\0';
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the configured timeout, NULL if there is none
+static struct timeval *ldapTimeout(struct timeval *timeout)
+{
+   if (timeoutMilliseconds <= 0)
+   {
+      return NULL;
+   }
+   timeout->tv_sec = timeoutMilliseconds / 1000;
+   timeout->tv_usec = timeoutMilliseconds % 1000 * 1000;
+   return timeout;
+}
@@ -0,0 +1,95 @@
+#ifndef LDAPPOOL_H
+#define LDAPPOOL_H
+
+#include <stddef.h>
+#include <ldap.h>
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro LDAP connection pool                                         //
+   //                                                                           //
+   // instead of ldap_initialize + start tls + bind + unbind on every login     //
+   // and every SEND, the server keeps a few connections open and reuses them   //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define LDAP_URI "ldap://ldap.technikum-wien.at:389"
+#define LDAP_SEARCH_BASE "dc=technikum-wien,dc=at"
+
+#define LDAP_POOL_SIZE 4
+#define LDAP_POOL_MAX 64
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a connection that was idle for longer than this (in seconds) is checked with
+   // a whoami request before it is handed out again
+#define LDAP_IDLE_CHECK 30
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // maximum number of open connections per pool, at most LDAP_POOL_MAX
+   // must be called before the first request
+void ldapPoolSetSize(int size);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the directory to use instead of LDAP_URI and LDAP_SEARCH_BASE, NULL keeps
+   // the default, the strings must stay valid
+   // must be called before the first request
+void ldapPoolSetDirectory(const char* uri, const char* base);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // milliseconds connecting and every synchronous request may take, 0 (the
+   // default) waits as long as the library does
+void ldapPoolSetTimeout(int milliseconds);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // closes all idle connections, connections in use are closed when released
+void ldapPoolDestroy();
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // searches the uid with a connection of the search pool, which is bound
+   // with the service account from LDAP_BIND_DN and LDAP_BIND_PW (anonymous if
+   // those are not set)
+   // returns the number of entries found, i.e. 1 if the user exists and 0 if not,
+   // -1 if the directory could not be asked
+int ldapUserExists(const char* uid);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the same for count uids with a single search (uid=a)|(uid=b)|..., sets
+   // exists[i] to 1 or 0 for every uid, uids are compared ignoring case like
+   // the directory does, returns 0 or -1 if the directory could not be asked
+int ldapUsersExist(const char** uids, int count, int* exists);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // checks the password with a bind as uid=<uid>,ou=people,<search base> on a
+   // connection of the verify pool
+   // the connection stays open for the next login no matter if the bind worked
+   // returns 1 if the credentials are valid and 0 if not
+int ldapVerifyUser(const char* uid, const char* pwd);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the parts of the requests above the directory thread (ldapasync.h) sends
+   // on connections of its own
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // opens a new connection with TLS and binds it with the service account
+   // if it is meant for searches, returns NULL if anything fails
+LDAP *ldapOpen(int bindService);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the filter that searches all count uids, to be freed, NULL if memory is out
+char *ldapUidFilter(const char **uids, int count);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // sets exists[i] to 1 for every uid an entry of res names, the others are
+   // left alone, returns the number of entries
+int ldapMatchEntries(LDAP *ld, LDAPMessage *res, const char **uids, int count, int *exists);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the dn a user binds as, returns 0 if uid can't be part of a dn
+int ldapUserDn(char *target, size_t size, const char *uid);
+
+const char *ldapSearchBase();
+int ldapTimeoutMilliseconds();
+
+#endif
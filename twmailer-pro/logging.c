@@ -0,0 +1,677 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include "logging.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // the ring is a bounded queue with a sequence number per slot (Vyukov):
+   // a producer claims the slot at tail with a compare and swap, fills it and
+   // publishes it by setting its sequence to position + 1, the log thread
+   // (the only consumer) takes it once it sees that sequence and hands it
+   // back by setting it to position + LOG_RING
+   // an argument is kept as the widest type of its kind, a string is copied
+   // into text and the argument is its offset there
+#define LOG_ARGUMENTS 16
+#define LOG_TEXT 384
+#define LOG_LINE 1024
+#define LOG_BATCH (64 * 1024)
+#define LOG_NAP_NANOSECONDS 10000000
+
+union logArgument{
+   long long integer;
+   unsigned long long unsignedInteger;
+   double real;
+   const void* pointer;
+   int offset;
+};
+
+struct logRecord{
+   unsigned long sequence;
+   const char* format;
+   struct timespec time;
+   unsigned char level;
+   unsigned char count;
+   unsigned short textLength;
+   union logArgument arguments[LOG_ARGUMENTS];
+   char text[LOG_TEXT];
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // what a conversion takes, see scanConversion
+enum argumentKind{
+   kindSigned,
+   kindUnsigned,
+   kindReal,
+   kindString,
+   kindPointer,
+   kindUnsupported
+};
+
+struct conversion{
+   const char* start;
+   const char* end;
+   int stars;
+   int precision;
+   char length[3];
+   enum argumentKind kind;
+};
+
+enum logLevel logLevel = LOG_LEVEL;
+
+static struct logRecord ring[LOG_RING];
+static unsigned long tail = 0;
+static unsigned long head = 0;
+static int running = 0;
+static int stopping = 0;
+static pthread_t logThread;
+static pthread_once_t forkHandler = PTHREAD_ONCE_INIT;
+
+static unsigned long long rateWindow = 0;
+static unsigned long dropped = 0;
+static unsigned long limited = 0;
+
+static const char* levelNames[] = {"error", "info", "debug"};
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void ringReset();
+static void registerForkHandler();
+static void forgetThread();
+static int rateAllows(time_t second);
+static void capture(struct logRecord* record, const char* format, va_list arguments);
+static int render(const struct logRecord* record, char* line, int size);
+static int endLine(char* line, int length, int size);
+static int renderPrefix(enum logLevel level, const struct timespec* time, char* line, int size);
+static const char* scanConversion(const char* position, struct conversion* conversion);
+static int drain(char* batch, int* length);
+static void *logLoop(void *data);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int logParseLevel(const char* name)
+{
+   for (int i = 0; i < (int)(sizeof(levelNames) / sizeof(levelNames[0])); ++i)
+   {
+      if (strcmp(name, levelNames[i]) == 0)
+      {
+         return i;
+      }
+   }
+   return -1;
+}
+
+int logStart()
+{
+   sigset_t blocked, previous;
+
+   pthread_once(&forkHandler, registerForkHandler);
+   ringReset();
+   stopping = 0;
+   __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // signals are for the main thread
+   sigfillset(&blocked);
+   pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+   int created = pthread_create(&logThread, NULL, logLoop, NULL);
+   pthread_sigmask(SIG_SETMASK, &previous, NULL);
+   if (created != 0)
+   {
+      perror("log thread");
+      __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+      return -1;
+   }
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // records that came in after the log thread looked for the last time are
+   // written here, no new ones go into the ring once running is cleared
+void logStop()
+{
+   char* batch = NULL;
+   int length = 0;
+
+   if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+   {
+      return;
+   }
+   __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+   pthread_join(logThread, NULL);
+   __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+   if ((batch = malloc(LOG_BATCH)) != NULL)
+   {
+      while (drain(batch, &length))
+      {
+      }
+      fwrite(batch, 1, length, stdout);
+      free(batch);
+   }
+   fflush(stdout);
+}
+
+void logWrite(enum logLevel level, const char* format, ...)
+{
+   va_list arguments;
+   struct timespec now;
+
+   clock_gettime(CLOCK_REALTIME, &now);
+   if (level != levelError && !rateAllows(now.tv_sec))
+   {
+      __atomic_add_fetch(&limited, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // without the log thread the line is formatted here
+   if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+   {
+      char line[LOG_LINE];
+      int length = renderPrefix(level, &now, line, sizeof(line));
+      va_start(arguments, format);
+      length += vsnprintf(line + length, sizeof(line) - length, format, arguments);
+      va_end(arguments);
+      endLine(line, length, sizeof(line));
+      fputs(line, stdout);
+      return;
+   }
+
+   unsigned long position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+   struct logRecord* record;
+   while (1)
+   {
+      record = &ring[position & (LOG_RING - 1)];
+      long difference = (long)(__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) - position);
+      if (difference == 0)
+      {
+         if (__atomic_compare_exchange_n(&tail, &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+         {
+            break;
+         }
+      }
+      else if (difference < 0)
+      {
+         __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+         return;
+      }
+      else
+      {
+         position = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+      }
+   }
+
+   record->format = format;
+   record->time = now;
+   record->level = level;
+   va_start(arguments, format);
+   capture(record, format, arguments);
+   va_end(arguments);
+   __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+static void ringReset()
+{
+   for (unsigned long i = 0; i < LOG_RING; ++i)
+   {
+      ring[i].sequence = i;
+   }
+   head = 0;
+   tail = 0;
+}
+
+static void registerForkHandler()
+{
+   pthread_atfork(NULL, NULL, forgetThread);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a forked child has no log thread, it writes its lines itself unless it
+   // starts one of its own, what the parent still had in the ring is the
+   // parent's to write
+static void forgetThread()
+{
+   running = 0;
+   stopping = 0;
+   ringReset();
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the second and the records taken in it share one word, so a single
+   // compare and swap counts a record
+static int rateAllows(time_t second)
+{
+   unsigned long long window = __atomic_load_n(&rateWindow, __ATOMIC_RELAXED);
+   unsigned long long next;
+
+   do
+   {
+      if (window >> 32 != (unsigned long long)(uint32_t)second)
+      {
+         next = (unsigned long long)(uint32_t)second << 32 | 1;
+      }
+      else if ((window & 0xffffffffull) >= LOG_RATE)
+      {
+         return 0;
+      }
+      else
+      {
+         next = window + 1;
+      }
+   } while (!__atomic_compare_exchange_n(&rateWindow, &window, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // takes the arguments the conversions of format ask for, a string only as
+   // far as its precision reaches and as long as there is room in text
+   // count ends up as the number of arguments taken, render stops there
+static void capture(struct logRecord* record, const char* format, va_list arguments)
+{
+   struct conversion conversion;
+   int count = 0;
+   int textLength = 0;
+
+   while ((format = scanConversion(format, &conversion)) != NULL)
+   {
+      if (conversion.kind == kindUnsupported || count + conversion.stars + 1 > LOG_ARGUMENTS)
+      {
+         break;
+      }
+      for (int i = 0; i < conversion.stars; ++i)
+      {
+         int value = va_arg(arguments, int);
+         record->arguments[count++].integer = value;
+         if (i == conversion.stars - 1 && conversion.precision == -2)
+         {
+            conversion.precision = value < 0 ? -1 : value;
+         }
+      }
+      union logArgument* argument = &record->arguments[count++];
+      switch (conversion.kind)
+      {
+         case kindSigned:
+            if (strcmp(conversion.length, "ll") == 0 || strcmp(conversion.length, "j") == 0)
+            {
+               argument->integer = va_arg(arguments, long long);
+            }
+            else if (conversion.length[0] == 'l' || conversion.length[0] == 'z' || conversion.length[0] == 't')
+            {
+               argument->integer = va_arg(arguments, long);
+            }
+            else
+            {
+               argument->integer = va_arg(arguments, int);
+               if (strcmp(conversion.length, "hh") == 0)
+               {
+                  argument->integer = (signed char)argument->integer;
+               }
+               else if (conversion.length[0] == 'h')
+               {
+                  argument->integer = (short)argument->integer;
+               }
+            }
+            break;
+         case kindUnsigned:
+            if (strcmp(conversion.length, "ll") == 0 || strcmp(conversion.length, "j") == 0)
+            {
+               argument->unsignedInteger = va_arg(arguments, unsigned long long);
+            }
+            else if (conversion.length[0] == 'l' || conversion.length[0] == 'z' || conversion.length[0] == 't')
+            {
+               argument->unsignedInteger = va_arg(arguments, unsigned long);
+            }
+            else
+            {
+               argument->unsignedInteger = va_arg(arguments, unsigned int);
+               if (strcmp(conversion.length, "hh") == 0)
+               {
+                  argument->unsignedInteger = (unsigned char)argument->unsignedInteger;
+               }
+               else if (conversion.length[0] == 'h')
+               {
+                  argument->unsignedInteger = (unsigned short)argument->unsignedInteger;
+               }
+            }
+            break;
+         case kindReal:
+            if (conversion.length[0] == 'L')
+            {
+               argument->real = va_arg(arguments, long double);
+            }
+            else
+            {
+               argument->real = va_arg(arguments, double);
+            }
+            break;
+         case kindString:
+         {
+            const char* string = va_arg(arguments, const char *);
+            if (string == NULL)
+            {
+               string = "(null)";
+            }
+            if (textLength == LOG_TEXT)
+            {
+               // text is full, the last string ends at its end
+               argument->offset = LOG_TEXT - 1;
+               break;
+            }
+            size_t length = conversion.precision >= 0 ? strnlen(string, conversion.precision) : strlen(string);
+            if (length > (size_t)(LOG_TEXT - 1 - textLength))
+            {
+               length = LOG_TEXT - 1 - textLength;
+            }
+            memcpy(record->text + textLength, string, length);
+            record->text[textLength + length] = '\0';
+            argument->offset = textLength;
+            textLength += length + 1;
+            break;
+         }
+         case kindPointer:
+            argument->pointer = va_arg(arguments, void *);
+            break;
+         default:
+            break;
+      }
+   }
+   record->count = count;
+   record->textLength = textLength;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // writes the line of the record to line and returns its length
+   // every conversion is handed to snprintf on its own with the argument that
+   // was taken for it, integers as long long (the length is rewritten), reals
+   // as double
+static int render(const struct logRecord* record, char* line, int size)
+{
+   const char* position = record->format;
+   struct conversion conversion;
+   int length = renderPrefix(record->level, &record->time, line, size);
+   int next = 0;
+
+#define APPEND(...) (length += snprintf(line + length, size - length, __VA_ARGS__), \
+                     length = length < size ? length : size - 1)
+
+   while (length < size - 1)
+   {
+      const char* literal = position;
+      const char* found = scanConversion(position, &conversion);
+      const char* literalEnd = found != NULL ? conversion.start : position + strlen(position);
+      for (const char* c = literal; c < literalEnd && length < size - 1; ++c)
+      {
+         if (c[0] == '%' && c[1] == '%')
+         {
+            ++c;
+         }
+         line[length++] = *c;
+      }
+      if (found == NULL)
+      {
+         break;
+      }
+      if (conversion.kind == kindUnsupported || next + conversion.stars + 1 > record->count)
+      {
+         APPEND("...");
+         break;
+      }
+
+      ///////////////////////////////////////////////////////////////////////////////
+      // the conversion without its length, "ll" in front of an integer one
+      char spec[32];
+      int specLength = 0;
+      for (const char* c = conversion.start; c < conversion.end - 1 && specLength < (int)sizeof(spec) - 4; ++c)
+      {
+         if (strchr("hlLzjtq", *c) == NULL)
+         {
+            spec[specLength++] = *c;
+         }
+      }
+      int character = conversion.end[-1] == 'c';
+      if ((conversion.kind == kindSigned && !character) || conversion.kind == kindUnsigned)
+      {
+         spec[specLength++] = 'l';
+         spec[specLength++] = 'l';
+      }
+      spec[specLength++] = conversion.end[-1];
+      spec[specLength] = '\0';
+
+      int stars[2] = {0, 0};
+      for (int i = 0; i < conversion.stars; ++i)
+      {
+         stars[i] = (int)record->arguments[next++].integer;
+      }
+      const union logArgument* argument = &record->arguments[next++];
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#define APPEND_VALUE(value) (conversion.stars == 0 ? APPEND(spec, value) : \
+                             conversion.stars == 1 ? APPEND(spec, stars[0], value) : \
+                             APPEND(spec, stars[0], stars[1], value))
+      switch (conversion.kind)
+      {
+         case kindSigned:
+            if (character)
+            {
+               APPEND_VALUE((int)argument->integer);
+            }
+            else
+            {
+               APPEND_VALUE(argument->integer);
+            }
+            break;
+         case kindUnsigned:
+            APPEND_VALUE(argument->unsignedInteger);
+            break;
+         case kindReal:
+            APPEND_VALUE(argument->real);
+            break;
+         case kindString:
+            APPEND_VALUE(record->text + argument->offset);
+            break;
+         case kindPointer:
+            APPEND_VALUE(argument->pointer);
+            break;
+         default:
+            break;
+      }
+#undef APPEND_VALUE
+#pragma GCC diagnostic pop
+      position = conversion.end;
+   }
+#undef APPEND
+   return endLine(line, length, size);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a line that was cut off or came without one ends with a newline, too
+static int endLine(char* line, int length, int size)
+{
+   if (length >= size - 1)
+   {
+      length = size - 2;
+   }
+   if (line[length - 1] != '\n')
+   {
+      line[length++] = '\n';
+   }
+   line[length] = '\0';
+   return length;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // "2022-11-20 13:37:00.123 debug " in local time
+static int renderPrefix(enum logLevel level, const struct timespec* time, char* line, int size)
+{
+   struct tm local;
+
+   localtime_r(&time->tv_sec, &local);
+   int length = strftime(line, size, "%Y-%m-%d %H:%M:%S", &local);
+   length += snprintf(line + length, size - length, ".%03ld %s ", time->tv_nsec / 1000000, levelNames[level]);
+   return length < size ? length : size - 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // finds the next conversion from position on ("%%" is none) and returns
+   // where the scan goes on, NULL if there is none
+   // precision is -2 if it is an argument, -1 if there is none
+static const char* scanConversion(const char* position, struct conversion* conversion)
+{
+   while ((position = strchr(position, '%')) != NULL && position[1] == '%')
+   {
+      position += 2;
+   }
+   if (position == NULL)
+   {
+      return NULL;
+   }
+
+   memset(conversion, 0, sizeof(struct conversion));
+   conversion->start = position++;
+   conversion->precision = -1;
+   while (*position != '\0' && strchr("-+ #0'", *position) != NULL)
+   {
+      ++position;
+   }
+   if (*position == '*')
+   {
+      ++conversion->stars;
+      ++position;
+   }
+   while (*position >= '0' && *position <= '9')
+   {
+      ++position;
+   }
+   if (*position == '.')
+   {
+      ++position;
+      conversion->precision = 0;
+      if (*position == '*')
+      {
+         ++conversion->stars;
+         conversion->precision = -2;
+         ++position;
+      }
+      while (*position >= '0' && *position <= '9')
+      {
+         conversion->precision = conversion->precision * 10 + *position++ - '0';
+      }
+   }
+   int length = 0;
+   while (*position != '\0' && strchr("hlLzjt", *position) != NULL && length < 2)
+   {
+      conversion->length[length++] = *position++;
+   }
+
+   switch (*position)
+   {
+      case 'd': case 'i': case 'c':
+         conversion->kind = kindSigned;
+         break;
+      case 'u': case 'o': case 'x': case 'X':
+         conversion->kind = kindUnsigned;
+         break;
+      case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+         conversion->kind = kindReal;
+         break;
+      case 's':
+         conversion->kind = conversion->length[0] == 'l' ? kindUnsupported : kindString;
+         break;
+      case 'p':
+         conversion->kind = kindPointer;
+         break;
+      case '\0':
+         conversion->kind = kindUnsupported;
+         conversion->end = position;
+         return position;
+      default:
+         conversion->kind = kindUnsupported;
+         break;
+   }
+   conversion->end = position + 1;
+   return conversion->end;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // renders the records that are ready into batch, writes the batch when it
+   // is full, returns the number of records taken
+static int drain(char* batch, int* length)
+{
+   int taken = 0;
+
+   while (1)
+   {
+      struct logRecord* record = &ring[head & (LOG_RING - 1)];
+      if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != head + 1)
+      {
+         return taken;
+      }
+      if (*length > LOG_BATCH - LOG_LINE)
+      {
+         fwrite(batch, 1, *length, stdout);
+         *length = 0;
+      }
+      *length += render(record, batch + *length, LOG_LINE);
+      __atomic_store_n(&record->sequence, head + LOG_RING, __ATOMIC_RELEASE);
+      ++head;
+      ++taken;
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // naps while the ring is empty, producers never wake it up, that would be
+   // a system call again
+   // what was lost is reported once a second at most
+static void *logLoop(void *data)
+{
+   static char batch[LOG_BATCH];
+   unsigned long reportedDropped = 0;
+   unsigned long reportedLimited = 0;
+   time_t reported = 0;
+   struct timespec nap = {0, LOG_NAP_NANOSECONDS};
+
+   while (1)
+   {
+      int length = 0;
+      int taken = drain(batch, &length);
+
+      unsigned long droppedNow = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+      unsigned long limitedNow = __atomic_load_n(&limited, __ATOMIC_RELAXED);
+      if (length > 0)
+      {
+         fwrite(batch, 1, length, stdout);
+      }
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      if ((droppedNow != reportedDropped || limitedNow != reportedLimited) && now.tv_sec != reported)
+      {
+         char line[LOG_LINE];
+         int prefix = renderPrefix(levelError, &now, line, sizeof(line));
+         snprintf(line + prefix, sizeof(line) - prefix, "log: %lu records dropped (ring full), %lu over the rate limit\n",
+                  droppedNow - reportedDropped, limitedNow - reportedLimited);
+         fputs(line, stdout);
+         reportedDropped = droppedNow;
+         reportedLimited = limitedNow;
+         reported = now.tv_sec;
+      }
+      if (taken > 0 || length > 0)
+      {
+         fflush(stdout);
+      }
+      if (taken == 0)
+      {
+         if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+         {
+            return NULL;
+         }
+         nanosleep(&nap, NULL);
+      }
+   }
+}
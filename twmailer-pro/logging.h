@@ -0,0 +1,64 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro logging                                                      //
+   //                                                                           //
+   // what the server prints for every connection and every request (bytes    //
+   // received, the requests themselves, ...) is debug output, it is only     //
+   // logged with --log-level debug, errors (perror) and what the server      //
+   // prints at start and at the end are always printed                       //
+   // a thread that logs doesn't format anything and makes no system call:   //
+   // logWrite copies the arguments into a record of a fixed size (strings   //
+   // cut to what fits), puts it into a lock free ring and returns, the log   //
+   // thread formats the records with their time and level and writes them   //
+   // in batches                                                               //
+   // a full ring drops records instead of waiting, and at most LOG_RATE      //
+   // records a second are taken, a line in the log counts what was lost     //
+   // before logStart, in forked children and after logStop the records are  //
+   // formatted and written right away                                         //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+enum logLevel{
+   levelError,
+   levelInfo,
+   levelDebug
+};
+
+#define LOG_LEVEL levelInfo
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // records the ring holds (a power of two), records taken per second
+#define LOG_RING 4096
+#define LOG_RATE 20000
+
+extern enum logLevel logLevel;
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // "error", "info" or "debug", returns -1 for anything else
+int logParseLevel(const char* name);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // starts the log thread, returns 0 or -1 if it can't be started (records
+   // are written right away then)
+   // logStop writes what is left in the ring and stops it
+int logStart();
+void logStop();
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // format is kept in the record as it is, it has to be a string literal
+   // %n and the wide conversions are not supported
+void logWrite(enum logLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the arguments are not even evaluated below the level, logError is
+   // logged at every level and not counted against LOG_RATE
+#define logError(...) logWrite(levelError, __VA_ARGS__)
+#define logInfo(...) do { if (logLevel >= levelInfo) logWrite(levelInfo, __VA_ARGS__); } while (0)
+#define logDebug(...) do { if (logLevel >= levelDebug) logWrite(levelDebug, __VA_ARGS__); } while (0)
+
+#endif
@@ -0,0 +1,253 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "loginlimit.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // a bucket is kept as the time it will be full again (GCRA): a login
+   // moves that time one interval further, a login that would move it more
+   // than burst - 1 intervals past now is refused, a time in the past is a
+   // full bucket
+   // every key is a single 64 bit slot, a tag of the hash of the key in the
+   // upper 24 bits and the time in milliseconds of CLOCK_MONOTONIC in the
+   // lower 40 bits, so a bucket is read with one load and changed with one
+   // compare and swap, no locks, which also works between processes
+   // a key can only be in one set of LIMIT_WAYS slots (one cache line), the
+   // slot that is full again soonest makes room for a new key, 0 is an empty
+   // slot
+   // two keys with the same set and tag share their bucket, which only makes
+   // the limit stricter for them, the hash is seeded at random so nobody can
+   // pick keys that collide on purpose
+#define LIMIT_WAYS 8
+#define TIME_BITS 40
+#define TIME_MASK ((1ull << TIME_BITS) - 1)
+
+struct limitTable{
+   uint64_t* slots;
+   unsigned int sets;
+   uint64_t interval;
+   uint64_t tolerance;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the counters are shared with the forked children, like the slots
+struct limitCounters{
+   unsigned long attempts;
+   unsigned long blocked;
+};
+
+static struct limitTable uids;
+static struct limitTable addresses;
+static struct limitCounters* counters = NULL;
+static unsigned long long seed = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void tableInit(struct limitTable* table, uint64_t* slots, int rate, int burst);
+static int tableAcquire(struct limitTable* table, unsigned long long hash, uint64_t now);
+static void tableRelease(struct limitTable* table, unsigned long long hash);
+static uint64_t milliseconds();
+static unsigned long long keyHash(const unsigned char* key, size_t length, int foldCase);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int loginLimitInit(int uidRate, int uidBurst, int addressRate, int addressBurst)
+{
+   memset(&uids, 0, sizeof(uids));
+   memset(&addresses, 0, sizeof(addresses));
+   if (uidRate <= 0 && addressRate <= 0)
+   {
+      return 0;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the counters take the first cache line, the slots of both tables follow
+   size_t tableSize = LOGIN_LIMIT_SIZE * sizeof(uint64_t);
+   char* memory = mmap(NULL, 64 + 2 * tableSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (memory == MAP_FAILED)
+   {
+      perror("mmap login limit");
+      return -1;
+   }
+   if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed))
+   {
+      seed = ((unsigned long long)time(NULL) << 32) ^ getpid();
+   }
+   counters = (struct limitCounters *)memory;
+   tableInit(&uids, (uint64_t *)(memory + 64), uidRate, uidBurst);
+   tableInit(&addresses, (uint64_t *)(memory + 64 + tableSize), addressRate, addressBurst);
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the address is asked first, a client that is refused there doesn't use
+   // up the tokens of the uid it tries
+   // both cost a few loads and at most a few compare and swaps, a refused
+   // login takes no longer than an allowed one
+int loginLimitAcquire(uint32_t address, const char* uid)
+{
+   if (counters == NULL)
+   {
+      return 1;
+   }
+   uint64_t now = milliseconds();
+   int allowed = tableAcquire(&addresses, keyHash((const unsigned char *)&address, sizeof(address), 0), now) &&
+                 tableAcquire(&uids, keyHash((const unsigned char *)uid, strlen(uid), 1), now);
+
+   __atomic_add_fetch(&counters->attempts, 1, __ATOMIC_RELAXED);
+   if (!allowed)
+   {
+      __atomic_add_fetch(&counters->blocked, 1, __ATOMIC_RELAXED);
+   }
+   return allowed;
+}
+
+void loginLimitRelease(uint32_t address, const char* uid)
+{
+   if (counters == NULL)
+   {
+      return;
+   }
+   tableRelease(&addresses, keyHash((const unsigned char *)&address, sizeof(address), 0));
+   tableRelease(&uids, keyHash((const unsigned char *)uid, strlen(uid), 1));
+}
+
+void loginLimitStats(unsigned long* attempts, unsigned long* blocked)
+{
+   *attempts = counters != NULL ? __atomic_load_n(&counters->attempts, __ATOMIC_RELAXED) : 0;
+   *blocked = counters != NULL ? __atomic_load_n(&counters->blocked, __ATOMIC_RELAXED) : 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // rate is per minute, a table without a rate lets everybody in
+static void tableInit(struct limitTable* table, uint64_t* slots, int rate, int burst)
+{
+   if (rate <= 0)
+   {
+      return;
+   }
+   if (burst < 1)
+   {
+      burst = 1;
+   }
+   table->slots = slots;
+   table->sets = LOGIN_LIMIT_SIZE / LIMIT_WAYS;
+   table->interval = rate < 60000 ? 60000 / rate : 1;
+   table->tolerance = table->interval * (burst - 1);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 and takes a token, or 0 if the bucket is empty
+   // the loop only runs again if another thread changed the set in between
+static int tableAcquire(struct limitTable* table, unsigned long long hash, uint64_t now)
+{
+   if (table->slots == NULL)
+   {
+      return 1;
+   }
+   uint64_t* set = &table->slots[(hash % table->sets) * LIMIT_WAYS];
+   uint64_t tag = (hash >> TIME_BITS) != 0 ? hash >> TIME_BITS : 1;
+
+   for (;;)
+   {
+      uint64_t* victim = &set[0];
+      uint64_t victimValue = UINT64_MAX;
+      uint64_t* slot = NULL;
+      uint64_t value = 0;
+
+      for (int i = 0; i < LIMIT_WAYS; ++i)
+      {
+         uint64_t current = __atomic_load_n(&set[i], __ATOMIC_ACQUIRE);
+         if (current >> TIME_BITS == tag)
+         {
+            slot = &set[i];
+            value = current;
+            break;
+         }
+         if ((current & TIME_MASK) < (victimValue & TIME_MASK))
+         {
+            victim = &set[i];
+            victimValue = current;
+         }
+      }
+
+      uint64_t full = now;
+      if (slot != NULL)
+      {
+         full = value & TIME_MASK;
+         if (full < now)
+         {
+            full = now;
+         }
+         if (full - now > table->tolerance)
+         {
+            return 0;
+         }
+      }
+      else
+      {
+         slot = victim;
+         value = victimValue;
+      }
+      uint64_t next = tag << TIME_BITS | ((full + table->interval) & TIME_MASK);
+      if (__atomic_compare_exchange_n(slot, &value, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+         return 1;
+      }
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // if the key was pushed out in the meantime there is nothing to give back
+static void tableRelease(struct limitTable* table, unsigned long long hash)
+{
+   if (table->slots == NULL)
+   {
+      return;
+   }
+   uint64_t* set = &table->slots[(hash % table->sets) * LIMIT_WAYS];
+   uint64_t tag = (hash >> TIME_BITS) != 0 ? hash >> TIME_BITS : 1;
+
+   for (int i = 0; i < LIMIT_WAYS; ++i)
+   {
+      uint64_t value = __atomic_load_n(&set[i], __ATOMIC_ACQUIRE);
+      while (value >> TIME_BITS == tag)
+      {
+         uint64_t full = value & TIME_MASK;
+         full = full > table->interval ? full - table->interval : 0;
+         if (__atomic_compare_exchange_n(&set[i], &value, tag << TIME_BITS | full, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+         {
+            return;
+         }
+      }
+   }
+}
+
+static uint64_t milliseconds()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // FNV-1a over the seed and the key, uids are compared without case like
+   // the directory does
+static unsigned long long keyHash(const unsigned char* key, size_t length, int foldCase)
+{
+   unsigned long long hash = 14695981039346656037ull ^ seed;
+
+   for (size_t i = 0; i < length; ++i)
+   {
+      hash ^= foldCase ? (unsigned char)tolower(key[i]) : key[i];
+      hash *= 1099511628211ull;
+   }
+   return hash;
+}
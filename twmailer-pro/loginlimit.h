@@ -0,0 +1,54 @@
+#ifndef LOGINLIMIT_H
+#define LOGINLIMIT_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro login limit                                                  //
+   //                                                                           //
+   // every password login costs a token of the bucket of the client address  //
+   // and one of the bucket of the uid before the providers are asked, a      //
+   // login that finds either bucket empty fails right away and never reaches //
+   // the directory, a successful login gets both tokens back, so only       //
+   // guesses add up (and logins that are still being checked)                //
+   // the buckets live in two tables of a fixed size (addresses and uids),     //
+   // a key that doesn't fit pushes out the one closest to a full bucket, so  //
+   // a flood of new addresses or uids can't make the tables grow and can't   //
+   // push out the keys that are being limited                                 //
+   // the tables are shared memory, forked children and prefork processes    //
+   // count against the same buckets                                           //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // logins per minute and burst, per uid and per client address, and the
+   // keys each table can hold
+#define LOGIN_UID_RATE 10
+#define LOGIN_UID_BURST 5
+#define LOGIN_ADDRESS_RATE 600
+#define LOGIN_ADDRESS_BURST 100
+#define LOGIN_LIMIT_SIZE 65536
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // rate 0 turns the limit of that table off
+   // must be called before the server forks, returns -1 if the tables can't
+   // be mapped
+int loginLimitInit(int uidRate, int uidBurst, int addressRate, int addressBurst);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // takes a token for the address (in network byte order) and the uid,
+   // returns 1 if the login may be checked, 0 if it has to fail
+int loginLimitAcquire(uint32_t address, const char* uid);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // gives the tokens of a successful login back
+void loginLimitRelease(uint32_t address, const char* uid);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // logins checked against the limit and logins that failed because of it
+void loginLimitStats(unsigned long* attempts, unsigned long* blocked);
+
+#endif
@@ -0,0 +1,265 @@
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "mailcache.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // a mailbox has exactly one slot (by the hash of its path) and the
+   // generation of that slot, two mailboxes with the same slot take it from
+   // each other
+   // a slot is written under a sequence lock: the process that fills it makes
+   // the sequence odd with a compare and swap (if it is odd already somebody
+   // else is filling it and the listing is not kept), writes and makes it even
+   // again, a reader copies the slot and uses the copy only if the sequence
+   // was even and didn't change meanwhile, nobody waits for anybody
+   // the generation is read before the index, so a listing that misses a SEND
+   // or a DEL is kept with a generation that is already over
+#define CACHE_MAILBOX 100
+
+struct cacheSlot{
+   unsigned long sequence;
+   unsigned long generation;
+   long count;
+   unsigned int length;
+   char mailbox[CACHE_MAILBOX];
+   char listing[MAIL_CACHE_LISTING];
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a message in the listing, its subject (without '\0') follows, the next
+   // message starts at the next multiple of 8
+struct cachedMessage{
+   uint64_t id;
+   int64_t time;
+   int64_t size;
+   int32_t number;
+   uint16_t subjectLength;
+};
+
+struct cacheCounters{
+   unsigned long hits;
+   unsigned long misses;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the listing of a mailbox while it is read from the index
+struct listingBuilder{
+   char* listing;
+   unsigned int length;
+   int overflow;
+   mailVisitor visitor;
+   void* data;
+   int stopped;
+};
+
+static struct cacheSlot* slots = NULL;
+static unsigned long* generations = NULL;
+static struct cacheCounters* counters = NULL;
+static unsigned int slotCount = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static unsigned int slotOf(const char* mailbox);
+static int cacheRead(struct cacheSlot* slot, const char* mailbox, unsigned long generation, char* listing, long* count, unsigned int* length);
+static void cacheWrite(struct cacheSlot* slot, const char* mailbox, unsigned long generation, const char* listing, long count, unsigned int length);
+static void replay(const char* listing, unsigned int length, mailVisitor visitor, void* data);
+static int buildVisitor(int number, const struct mailEntry* entry, void* data);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int mailCacheInit(int mailboxes)
+{
+   if (mailboxes <= 0)
+   {
+      return 0;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the counters take the first cache line, the generations and the slots
+   // follow, only the pages of slots that are used are ever touched
+   size_t generationSize = ((mailboxes * sizeof(unsigned long) + 63) / 64) * 64;
+   char* memory = mmap(NULL, 64 + generationSize + mailboxes * sizeof(struct cacheSlot),
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (memory == MAP_FAILED)
+   {
+      perror("mmap mailbox cache");
+      return -1;
+   }
+   counters = (struct cacheCounters *)memory;
+   generations = (unsigned long *)(memory + 64);
+   slots = (struct cacheSlot *)(memory + 64 + generationSize);
+   slotCount = mailboxes;
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a hit costs a copy of the listing and no system call at all
+   // the listing is built on the stack, it is not larger than a page or four
+long mailCacheList(const char* mailbox, mailVisitor visitor, void* data)
+{
+   char listing[MAIL_CACHE_LISTING];
+   long count;
+   unsigned int length;
+
+   if (slots == NULL || strlen(mailbox) >= CACHE_MAILBOX)
+   {
+      return mailIndexList(mailbox, visitor, data);
+   }
+   unsigned int index = slotOf(mailbox);
+   struct cacheSlot* slot = &slots[index];
+   unsigned long generation = __atomic_load_n(&generations[index], __ATOMIC_ACQUIRE);
+   if (cacheRead(slot, mailbox, generation, listing, &count, &length))
+   {
+      __atomic_add_fetch(&counters->hits, 1, __ATOMIC_RELAXED);
+      replay(listing, length, visitor, data);
+      return count;
+   }
+   __atomic_add_fetch(&counters->misses, 1, __ATOMIC_RELAXED);
+
+   struct listingBuilder builder = {listing, 0, 0, visitor, data, 0};
+   count = mailIndexList(mailbox, buildVisitor, &builder);
+   if (count != -1 && !builder.overflow && !builder.stopped)
+   {
+      cacheWrite(slot, mailbox, generation, listing, count, builder.length);
+   }
+   return count;
+}
+
+void mailCacheTouch(const char* mailbox)
+{
+   if (slots == NULL)
+   {
+      return;
+   }
+   __atomic_add_fetch(&generations[slotOf(mailbox)], 1, __ATOMIC_RELEASE);
+}
+
+void mailCacheStats(unsigned long* hits, unsigned long* misses)
+{
+   *hits = counters != NULL ? __atomic_load_n(&counters->hits, __ATOMIC_RELAXED) : 0;
+   *misses = counters != NULL ? __atomic_load_n(&counters->misses, __ATOMIC_RELAXED) : 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // FNV-1a of the path
+static unsigned int slotOf(const char* mailbox)
+{
+   uint64_t hash = 14695981039346656037ULL;
+
+   for (const unsigned char* c = (const unsigned char *)mailbox; *c != '\0'; ++c)
+   {
+      hash = (hash ^ *c) * 1099511628211ULL;
+   }
+   return hash % slotCount;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // copies the listing of slot if it is the one of mailbox in generation,
+   // returns 1 if the copy can be used
+   // what is read before the sequence is checked again may be torn, it is
+   // only used after the check
+static int cacheRead(struct cacheSlot* slot, const char* mailbox, unsigned long generation, char* listing, long* count, unsigned int* length)
+{
+   unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+   if ((sequence & 1) || sequence == 0)
+   {
+      return 0;
+   }
+   if (__atomic_load_n(&slot->generation, __ATOMIC_RELAXED) != generation ||
+       strncmp(slot->mailbox, mailbox, CACHE_MAILBOX) != 0)
+   {
+      return 0;
+   }
+   *count = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+   *length = __atomic_load_n(&slot->length, __ATOMIC_RELAXED);
+   if (*length > MAIL_CACHE_LISTING)
+   {
+      return 0;
+   }
+   memcpy(listing, slot->listing, *length);
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   return __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the sequence is 0 until the slot is written the first time
+static void cacheWrite(struct cacheSlot* slot, const char* mailbox, unsigned long generation, const char* listing, long count, unsigned int length)
+{
+   unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+   if ((sequence & 1) ||
+       !__atomic_compare_exchange_n(&slot->sequence, &sequence, sequence + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+   {
+      return;
+   }
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   __atomic_store_n(&slot->generation, generation, __ATOMIC_RELAXED);
+   __atomic_store_n(&slot->count, count, __ATOMIC_RELAXED);
+   __atomic_store_n(&slot->length, length, __ATOMIC_RELAXED);
+   strncpy(slot->mailbox, mailbox, CACHE_MAILBOX);
+   memcpy(slot->listing, listing, length);
+   __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // hands the messages of a listing to the visitor as the index would
+static void replay(const char* listing, unsigned int length, mailVisitor visitor, void* data)
+{
+   struct mailEntry entry;
+   struct cachedMessage message;
+   unsigned int position = 0;
+
+   memset(&entry, 0, sizeof(entry));
+   while (position < length)
+   {
+      memcpy(&message, listing + position, sizeof(message));
+      entry.id = message.id;
+      entry.time = message.time;
+      entry.size = message.size;
+      memcpy(entry.subject, listing + position + sizeof(message), message.subjectLength);
+      entry.subject[message.subjectLength] = '\0';
+      position += (sizeof(message) + message.subjectLength + 7) & ~7u;
+      if (visitor != NULL && !visitor(message.number, &entry, data))
+      {
+         break;
+      }
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // passes every message on to the visitor of the caller and appends it to
+   // the listing as long as it fits
+static int buildVisitor(int number, const struct mailEntry* entry, void* data)
+{
+   struct listingBuilder* builder = data;
+   struct cachedMessage message;
+
+   size_t subjectLength = strnlen(entry->subject, sizeof(entry->subject) - 1);
+   size_t size = (sizeof(message) + subjectLength + 7) & ~(size_t)7;
+   if (builder->length + size > MAIL_CACHE_LISTING)
+   {
+      builder->overflow = 1;
+   }
+   if (!builder->overflow)
+   {
+      memset(&message, 0, sizeof(message));
+      message.id = entry->id;
+      message.time = entry->time;
+      message.size = entry->size;
+      message.number = number;
+      message.subjectLength = subjectLength;
+      memcpy(builder->listing + builder->length, &message, sizeof(message));
+      memcpy(builder->listing + builder->length + sizeof(message), entry->subject, subjectLength);
+      builder->length += size;
+   }
+   if (builder->visitor != NULL && !builder->visitor(number, entry, builder->data))
+   {
+      builder->stopped = 1;
+      return 0;
+   }
+   return 1;
+}
@@ -0,0 +1,47 @@
+#ifndef MAILCACHE_H
+#define MAILCACHE_H
+
+#include "mailindex.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro mailbox cache                                                //
+   //                                                                           //
+   // keeps what LIST shows of a mailbox (number, id, time, size and subject  //
+   // of every message) in shared memory, so a client that polls with LIST    //
+   // is answered without opening, locking and reading the index every time   //
+   // every mailbox has a generation, SEND and DEL (mailStoreAdd and           //
+   // mailStoreRemove) count it up once they changed the index, a listing    //
+   // that was read under an older generation is not used anymore             //
+   // the memory is shared by forked children and prefork processes, so a     //
+   // SEND in one process is seen by a LIST in any other one, but not by a    //
+   // second server that was started on its own on the same spool             //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // mailboxes the cache holds, a mailbox whose listing doesn't fit into
+   // MAIL_CACHE_LISTING bytes is always read from the index
+#define MAIL_CACHE_SIZE 1024
+#define MAIL_CACHE_LISTING 16256
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // mailboxes is the number of listings held, 0 turns the cache off
+   // must be called before the server forks, returns -1 if the memory can't be
+   // mapped
+int mailCacheInit(int mailboxes);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // mailIndexList through the cache, the entries the visitor gets from the
+   // cache only have id, time, size and subject set
+long mailCacheList(const char* mailbox, mailVisitor visitor, void* data);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // counts the generation of mailbox up, after every change of its index
+void mailCacheTouch(const char* mailbox);
+
+void mailCacheStats(unsigned long* hits, unsigned long* misses);
+
+#endif
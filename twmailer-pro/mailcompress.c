@@ -0,0 +1,457 @@
+#define _GNU_SOURCE // memfd_create
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <zstd.h>
+#include "mailcompress.h"
+#include "logging.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // every thread keeps its own zstd contexts (they are not thread safe and
+   // expensive to set up), the dictionaries are shared, they are only read
+   // the dictionaries of compressed messages are loaded from the spool the
+   // first time a message needs them, at most DICTIONARIES different ones
+#define DICTIONARIES 16
+
+struct threadContexts{
+   ZSTD_CCtx* compression;
+   ZSTD_DCtx* decompression;
+};
+
+struct loadedDictionary{
+   unsigned int id;
+   ZSTD_DDict* dictionary;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // shared with the forked children
+struct compressCounters{
+   unsigned long messages;
+   unsigned long compressed;
+   unsigned long long sent;
+   unsigned long long stored;
+};
+
+static char spoolDirectory[PATH_MAX - 64];
+static int compressionLevel = 0;
+static ZSTD_CDict* compressionDictionary = NULL;
+static unsigned int dictionaryId = 0;
+static struct compressCounters* counters = NULL;
+
+static pthread_once_t contextOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t contextKey;
+static pthread_mutex_t dictionaryLock = PTHREAD_MUTEX_INITIALIZER;
+static struct loadedDictionary dictionaries[DICTIONARIES];
+static int dictionaryCount = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static struct threadContexts* contexts();
+static void createContextKey();
+static void freeContexts(void *data);
+static const ZSTD_DDict* findDictionary(unsigned int id);
+static int saveDictionary(const char* data, size_t size, unsigned int id);
+static char* readFile(const char* path, size_t* size);
+static int readFully(int fd, char* buffer, size_t size, off_t offset);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int mailCompressInit(const char* spool, int level, const char* dictionary)
+{
+   snprintf(spoolDirectory, sizeof(spoolDirectory), "%s", spool);
+   compressionLevel = level;
+   if (level <= 0)
+   {
+      return 0;
+   }
+
+   counters = mmap(NULL, sizeof(struct compressCounters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (counters == MAP_FAILED)
+   {
+      perror("mmap compression counters");
+      counters = NULL;
+      return -1;
+   }
+   if (dictionary == NULL)
+   {
+      return 0;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the dictionary is kept in the spool before the first message needs it
+   size_t size;
+   char* data = readFile(dictionary, &size);
+   if (data == NULL)
+   {
+      perror(dictionary);
+      return -1;
+   }
+   dictionaryId = ZSTD_getDictID_fromDict(data, size);
+   if (dictionaryId == 0)
+   {
+      fprintf(stderr, "%s: not a zstd dictionary (zstd --train makes one)\n", dictionary);
+      free(data);
+      return -1;
+   }
+   if (saveDictionary(data, size, dictionaryId) == -1)
+   {
+      perror("save dictionary");
+      free(data);
+      return -1;
+   }
+   compressionDictionary = ZSTD_createCDict(data, size, level);
+   dictionaries[0].id = dictionaryId;
+   dictionaries[0].dictionary = ZSTD_createDDict(data, size);
+   dictionaryCount = 1;
+   free(data);
+   if (compressionDictionary == NULL || dictionaries[0].dictionary == NULL)
+   {
+      fprintf(stderr, "%s: dictionary can't be loaded\n", dictionary);
+      return -1;
+   }
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a message that doesn't get at least 1/16 smaller isn't worth decompressing
+   // on every READ
+int mailCompress(struct mailSource* source)
+{
+   if (counters == NULL)
+   {
+      return 0;
+   }
+   __atomic_add_fetch(&counters->messages, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&counters->sent, source->length, __ATOMIC_RELAXED);
+   if (source->length < MAIL_COMPRESS_MINIMUM || source->length > MAIL_COMPRESS_MAXIMUM)
+   {
+      __atomic_add_fetch(&counters->stored, source->length, __ATOMIC_RELAXED);
+      return 0;
+   }
+
+   struct threadContexts* context = contexts();
+   char* input = (char *)source->data;
+   char* output = NULL;
+   size_t length = 0;
+   if (context != NULL && input == NULL && (input = malloc(source->length)) != NULL &&
+       readFully(source->fd, input, source->length, source->offset) == -1)
+   {
+      perror("read message to compress");
+      free(input);
+      input = NULL;
+   }
+   if (context != NULL && input != NULL && (output = malloc(ZSTD_compressBound(source->length))) != NULL)
+   {
+      if (compressionDictionary != NULL)
+      {
+         length = ZSTD_compress_usingCDict(context->compression, output, ZSTD_compressBound(source->length),
+                                           input, source->length, compressionDictionary);
+      }
+      else
+      {
+         length = ZSTD_compressCCtx(context->compression, output, ZSTD_compressBound(source->length),
+                                    input, source->length, compressionLevel);
+      }
+   }
+   if (input != source->data)
+   {
+      free(input);
+   }
+   if (output == NULL || ZSTD_isError(length) || length >= (size_t)(source->length - source->length / 16))
+   {
+      free(output);
+      __atomic_add_fetch(&counters->stored, source->length, __ATOMIC_RELAXED);
+      return 0;
+   }
+
+   source->compressed = output;
+   source->data = output;
+   source->fd = -1;
+   source->offset = 0;
+   source->path = NULL;
+   source->length = length;
+   source->hash = mailStoreHash(MAIL_HASH_SEED, output, length);
+   __atomic_add_fetch(&counters->compressed, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&counters->stored, length, __ATOMIC_RELAXED);
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the message is decompressed into a memfd, so READ sends it the same way
+   // as a message that is stored as it is
+int mailDecompress(int fd, off_t offset, off_t size, off_t* plain)
+{
+   struct threadContexts* context = contexts();
+   char* input = NULL;
+   char* output = NULL;
+   int result = -1;
+
+   if (context == NULL)
+   {
+      return -1;
+   }
+   if (size > MAIL_COMPRESS_MAXIMUM)
+   {
+      errno = EFBIG;
+      return -1;
+   }
+   if ((input = malloc(size)) == NULL || readFully(fd, input, size, offset) == -1)
+   {
+      free(input);
+      return -1;
+   }
+
+   unsigned long long length = ZSTD_getFrameContentSize(input, size);
+   unsigned int id = ZSTD_getDictID_fromFrame(input, size);
+   const ZSTD_DDict* dictionary = id != 0 ? findDictionary(id) : NULL;
+   if (length == ZSTD_CONTENTSIZE_UNKNOWN || length == ZSTD_CONTENTSIZE_ERROR || length > MAIL_COMPRESS_MAXIMUM)
+   {
+      logError("compressed message without its size\n");
+      errno = EIO;
+   }
+   else if (id != 0 && dictionary == NULL)
+   {
+      logError("dictionary %u of a compressed message is missing in %s\n", id, MAIL_DICTIONARIES);
+      errno = EIO;
+   }
+   else if ((output = malloc(length + 1)) != NULL)
+   {
+      size_t decompressed = dictionary != NULL ?
+         ZSTD_decompress_usingDDict(context->decompression, output, length, input, size, dictionary) :
+         ZSTD_decompressDCtx(context->decompression, output, length, input, size);
+      int messageFile = -1;
+      if (ZSTD_isError(decompressed) || decompressed != length)
+      {
+         logError("compressed message is damaged\n");
+         errno = EIO;
+      }
+      else if ((messageFile = memfd_create("message", MFD_CLOEXEC)) != -1)
+      {
+         size_t written = 0;
+         while (written < length)
+         {
+            ssize_t bytes = write(messageFile, output + written, length - written);
+            if (bytes == -1)
+            {
+               close(messageFile);
+               messageFile = -1;
+               break;
+            }
+            written += bytes;
+         }
+      }
+      if (messageFile != -1)
+      {
+         *plain = length;
+         result = messageFile;
+      }
+   }
+   free(input);
+   free(output);
+   return result;
+}
+
+void mailCompressSettings(int* level, unsigned int* dictionary)
+{
+   *level = compressionLevel;
+   *dictionary = dictionaryId;
+}
+
+void mailCompressStats(unsigned long* messages, unsigned long* compressed,
+                       unsigned long long* sent, unsigned long long* stored)
+{
+   *messages = counters != NULL ? __atomic_load_n(&counters->messages, __ATOMIC_RELAXED) : 0;
+   *compressed = counters != NULL ? __atomic_load_n(&counters->compressed, __ATOMIC_RELAXED) : 0;
+   *sent = counters != NULL ? __atomic_load_n(&counters->sent, __ATOMIC_RELAXED) : 0;
+   *stored = counters != NULL ? __atomic_load_n(&counters->stored, __ATOMIC_RELAXED) : 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // created the first time a thread needs them, freed when it ends
+static struct threadContexts* contexts()
+{
+   pthread_once(&contextOnce, createContextKey);
+   struct threadContexts* context = pthread_getspecific(contextKey);
+   if (context != NULL)
+   {
+      return context;
+   }
+   if ((context = malloc(sizeof(struct threadContexts))) == NULL)
+   {
+      return NULL;
+   }
+   context->compression = ZSTD_createCCtx();
+   context->decompression = ZSTD_createDCtx();
+   if (context->compression == NULL || context->decompression == NULL || pthread_setspecific(contextKey, context) != 0)
+   {
+      freeContexts(context);
+      errno = ENOMEM;
+      return NULL;
+   }
+   return context;
+}
+
+static void createContextKey()
+{
+   pthread_key_create(&contextKey, freeContexts);
+}
+
+static void freeContexts(void *data)
+{
+   struct threadContexts* context = data;
+
+   ZSTD_freeCCtx(context->compression);
+   ZSTD_freeDCtx(context->decompression);
+   free(context);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a dictionary is never freed, the one a message needs is found without
+   // the lock once it is loaded
+static const ZSTD_DDict* findDictionary(unsigned int id)
+{
+   char path[PATH_MAX];
+   const ZSTD_DDict* found = NULL;
+
+   int count = __atomic_load_n(&dictionaryCount, __ATOMIC_ACQUIRE);
+   for (int i = 0; i < count; ++i)
+   {
+      if (dictionaries[i].id == id)
+      {
+         return dictionaries[i].dictionary;
+      }
+   }
+
+   pthread_mutex_lock(&dictionaryLock);
+   for (int i = 0; i < dictionaryCount; ++i)
+   {
+      if (dictionaries[i].id == id)
+      {
+         found = dictionaries[i].dictionary;
+      }
+   }
+   if (found == NULL && dictionaryCount < DICTIONARIES)
+   {
+      size_t size;
+      snprintf(path, sizeof(path), "%s/%s/%u", spoolDirectory, MAIL_DICTIONARIES, id);
+      char* data = readFile(path, &size);
+      if (data != NULL)
+      {
+         ZSTD_DDict* dictionary = ZSTD_createDDict(data, size);
+         free(data);
+         if (dictionary != NULL)
+         {
+            dictionaries[dictionaryCount].id = id;
+            dictionaries[dictionaryCount].dictionary = dictionary;
+            __atomic_store_n(&dictionaryCount, dictionaryCount + 1, __ATOMIC_RELEASE);
+            found = dictionary;
+         }
+      }
+   }
+   pthread_mutex_unlock(&dictionaryLock);
+   return found;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // <spool>/.dictionaries/<id>, written to a temporary file first, a
+   // dictionary that is there already is left alone (the id names its content)
+static int saveDictionary(const char* data, size_t size, unsigned int id)
+{
+   char directory[PATH_MAX - 32];
+   char path[PATH_MAX];
+   char temporary[PATH_MAX];
+
+   snprintf(directory, sizeof(directory), "%s/%s", spoolDirectory, MAIL_DICTIONARIES);
+   if (mkdir(directory, 0755) == -1 && errno != EEXIST)
+   {
+      return -1;
+   }
+   snprintf(path, sizeof(path), "%s/%u", directory, id);
+   if (access(path, F_OK) == 0)
+   {
+      return 0;
+   }
+   snprintf(temporary, sizeof(temporary), "%s/.%u.%d", directory, id, getpid());
+   int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (fd == -1)
+   {
+      return -1;
+   }
+   size_t written = 0;
+   while (written < size)
+   {
+      ssize_t bytes = write(fd, data + written, size - written);
+      if (bytes == -1)
+      {
+         close(fd);
+         unlink(temporary);
+         return -1;
+      }
+      written += bytes;
+   }
+   if (fsync(fd) == -1 || close(fd) == -1 || rename(temporary, path) == -1)
+   {
+      unlink(temporary);
+      return -1;
+   }
+   return 0;
+}
+
+static char* readFile(const char* path, size_t* size)
+{
+   struct stat status;
+
+   int fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd == -1)
+   {
+      return NULL;
+   }
+   char* data = NULL;
+   if (fstat(fd, &status) == 0 && (data = malloc(status.st_size + 1)) != NULL &&
+       readFully(fd, data, status.st_size, 0) == -1)
+   {
+      free(data);
+      data = NULL;
+   }
+   close(fd);
+   if (data != NULL)
+   {
+      *size = status.st_size;
+   }
+   return data;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a file that is shorter than it should be is damaged
+static int readFully(int fd, char* buffer, size_t size, off_t offset)
+{
+   size_t done = 0;
+
+   while (done < size)
+   {
+      ssize_t bytes = pread(fd, buffer + done, size - done, offset + done);
+      if (bytes == -1 && errno == EINTR)
+      {
+         continue;
+      }
+      if (bytes <= 0)
+      {
+         if (bytes == 0)
+         {
+            errno = EIO;
+         }
+         return -1;
+      }
+      done += bytes;
+   }
+   return 0;
+}
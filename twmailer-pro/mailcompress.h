@@ -0,0 +1,65 @@
+#ifndef MAILCOMPRESS_H
+#define MAILCOMPRESS_H
+
+#include <sys/types.h>
+#include "mailstore.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro compression at rest                                          //
+   //                                                                           //
+   // with --compress a message is compressed with zstd before it goes into    //
+   // the body store, so the body, the inbox and the outbox all hold the       //
+   // compressed message and the index marks it MAIL_COMPRESSED, READ gets    //
+   // it back as it was sent                                                   //
+   // mail is short and repetitive text, a dictionary trained on it (zstd      //
+   // --train <messages> -o <dictionary>) makes even short messages smaller,   //
+   // the server keeps a copy of every dictionary it used in the spool, named  //
+   // after its id, so the messages stay readable without the option          //
+   // a message that doesn't get smaller is stored as it is                    //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define MAIL_DICTIONARIES ".dictionaries"
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // highest level --compress takes (zstd goes up to 22, the levels above 19
+   // need a lot of memory for little gain)
+#define MAIL_COMPRESS_LEVEL_MAX 19
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // messages shorter than MAIL_COMPRESS_MINIMUM are not worth it, longer than
+   // MAIL_COMPRESS_MAXIMUM are streamed SENDs that are stored as they are
+#define MAIL_COMPRESS_MINIMUM 64
+#define MAIL_COMPRESS_MAXIMUM (4 * 1024 * 1024)
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // level 0 stores new messages as they are (compressed ones are read anyway),
+   // dictionary is the path of a zstd dictionary or NULL
+   // must be called before the server forks, returns -1 if the dictionary
+   // can't be used
+int mailCompressInit(const char* spool, int level, const char* dictionary);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // compresses the message of source into a buffer of its own and points
+   // source at it (compressed is set, the caller frees it with mailStoreDone),
+   // returns 1 if it did, 0 if the message is stored as it is
+int mailCompress(struct mailSource* source);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the message that is size bytes at offset in fd as it was sent: returns a
+   // new descriptor that holds only the message (*plain bytes) or -1
+int mailDecompress(int fd, off_t offset, off_t size, off_t* plain);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // level and dictionary id (0 without one) new messages are compressed with
+   // messages is how many messages were stored since the start, compressed
+   // how many of them compressed, sent and stored what they took before and
+   // after
+void mailCompressSettings(int* level, unsigned int* dictionary);
+void mailCompressStats(unsigned long* messages, unsigned long* compressed,
+                       unsigned long long* sent, unsigned long long* stored);
+
+#endif
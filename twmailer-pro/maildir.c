@@ -0,0 +1,75 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include "mailstore.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // maildir backend: every message of the inbox is the file in/<id>, a hard
+   // link to the body if there is one
+
+static int maildirAdd(const char* mailbox, struct mailEntry* entry, struct mailSource* source, struct commitRequest* commit);
+
+struct mailStore maildirStore = {"maildir", maildirAdd, NULL, NULL};
+
+///////////////////////////////////////////////////////////////////////////////
+
+static int maildirAdd(const char* mailbox, struct mailEntry* entry, struct mailSource* source, struct commitRequest* commit)
+{
+   struct mailIndex index;
+   char target[PATH_MAX];
+   char directory[PATH_MAX];
+
+   if (mailIndexOpen(&index, mailbox, LOCK_EX) == -1)
+   {
+      return -1;
+   }
+   entry->flags = source->compressed != NULL ? MAIL_COMPRESSED : 0;
+   entry->segment = 0;
+   entry->offset = 0;
+   entry->size = source->length;
+   if (mailIndexTakeId(&index, &entry->id) == -1)
+   {
+      mailIndexClose(&index);
+      return -1;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a message that is in the body store or had to be spooled to a file only
+   // needs a new name, LIST doesn't know the file until its entry is appended
+   mailIndexFile(mailbox, entry->id, target, sizeof(target));
+   int stored = -1;
+   if (source->body[0] != '\0')
+   {
+      stored = link(source->body, target);
+   }
+   if (stored == -1 && source->path != NULL && source->offset == 0)
+   {
+      stored = rename(source->path, target);
+   }
+   if (stored == -1)
+   {
+      stored = mailStoreWrite(mailbox, target, source);
+   }
+   int number = stored == -1 ? -1 : mailIndexAppend(&index, entry);
+   mailIndexClose(&index);
+   if (number == -1)
+   {
+      return -1;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the message, its name in the in directory and its entry
+   groupCommitAdd(commit, target);
+   snprintf(directory, sizeof(directory), "%s/in", mailbox);
+   groupCommitAdd(commit, directory);
+   snprintf(directory, sizeof(directory), "%s/%s", mailbox, MAIL_INDEX_NAME);
+   groupCommitAdd(commit, directory);
+   return number;
+}
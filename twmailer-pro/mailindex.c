@@ -0,0 +1,424 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include "mailindex.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // the header is the first thing in the file, entry n (counting from 1) starts
+   // at sizeof(header) + (n - 1) * sizeof(entry)
+   // ids are never used twice so a message file can't be mixed up with one
+   // that was deleted before
+   // the file is in host byte order, it never leaves the machine
+#define INDEX_MAGIC "TWIX"
+#define INDEX_VERSION 1
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // entries LIST reads with one pread
+#define INDEX_BATCH 64
+
+///////////////////////////////////////////////////////////////////////////////
+
+static int indexCreate(struct mailIndex* index, const char* mailbox);
+static int indexImport(struct mailIndex* index, const char* mailbox);
+static int indexReadHeader(struct mailIndex* index);
+static off_t entryOffset(int number);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int mailIndexOpen(struct mailIndex* index, const char* mailbox, int operation)
+{
+   char path[PATH_MAX];
+
+   snprintf(path, sizeof(path), "%s/%s", mailbox, MAIL_INDEX_NAME);
+   index->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+   if (index->fd == -1)
+   {
+      return -1;
+   }
+   while (flock(index->fd, operation) == -1)
+   {
+      if (errno != EINTR)
+      {
+         mailIndexClose(index);
+         return -1;
+      }
+   }
+   int valid = indexReadHeader(index);
+   if (valid == 1)
+   {
+      return 0;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // building the index needs the exclusive lock, someone else might have
+   // done it while we were waiting for that, so look again
+   if (valid != -1 && operation != LOCK_EX)
+   {
+      if (flock(index->fd, LOCK_EX) == -1)
+      {
+         mailIndexClose(index);
+         return -1;
+      }
+      valid = indexReadHeader(index);
+   }
+   if (valid == 0)
+   {
+      valid = indexCreate(index, mailbox) == 0 ? 1 : -1;
+   }
+   if (valid == 1 && operation != LOCK_EX && flock(index->fd, operation) == -1)
+   {
+      valid = -1;
+   }
+   if (valid != 1)
+   {
+      mailIndexClose(index);
+      return -1;
+   }
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // closing the descriptor releases the lock, errno of a failed call survives
+void mailIndexClose(struct mailIndex* index)
+{
+   int error = errno;
+   close(index->fd);
+   index->fd = -1;
+   errno = error;
+}
+
+int mailIndexSave(struct mailIndex* index)
+{
+   ssize_t size = pwrite(index->fd, &index->header, sizeof(struct mailIndexHeader), 0);
+   if (size != sizeof(struct mailIndexHeader))
+   {
+      if (size != -1)
+      {
+         errno = EIO;
+      }
+      return -1;
+   }
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a partly written entry at the end (server died in the middle of it)
+   // is not counted and gets overwritten
+int mailIndexSlots(struct mailIndex* index)
+{
+   struct stat status;
+   if (fstat(index->fd, &status) == -1 || status.st_size < (off_t)sizeof(struct mailIndexHeader))
+   {
+      return 0;
+   }
+   return (status.st_size - sizeof(struct mailIndexHeader)) / sizeof(struct mailEntry);
+}
+
+int mailIndexRead(struct mailIndex* index, int number, struct mailEntry* entry)
+{
+   if (number < 1)
+   {
+      return 0;
+   }
+   ssize_t size = pread(index->fd, entry, sizeof(struct mailEntry), entryOffset(number));
+   if (size == -1)
+   {
+      return -1;
+   }
+   return size == sizeof(struct mailEntry);
+}
+
+int mailIndexWrite(struct mailIndex* index, int number, struct mailEntry* entry)
+{
+   ssize_t size = pwrite(index->fd, entry, sizeof(struct mailEntry), entryOffset(number));
+   if (size != sizeof(struct mailEntry))
+   {
+      if (size != -1)
+      {
+         errno = EIO;
+      }
+      return -1;
+   }
+   return 0;
+}
+
+int mailIndexTakeId(struct mailIndex* index, uint64_t* id)
+{
+   *id = index->header.nextId++;
+   return mailIndexSave(index);
+}
+
+int mailIndexAppend(struct mailIndex* index, struct mailEntry* entry)
+{
+   int number = mailIndexSlots(index) + 1;
+   if (mailIndexWrite(index, number, entry) == -1)
+   {
+      return -1;
+   }
+   ++index->header.count;
+   if (mailIndexSave(index) == -1)
+   {
+      return -1;
+   }
+   return number;
+}
+
+int mailIndexGet(const char* mailbox, int number, struct mailEntry* entry)
+{
+   struct mailIndex index;
+
+   if (mailIndexOpen(&index, mailbox, LOCK_SH) == -1)
+   {
+      return -1;
+   }
+   int found = mailIndexRead(&index, number, entry);
+   if (found == 1 && (entry->flags & MAIL_DELETED))
+   {
+      found = 0;
+   }
+   mailIndexClose(&index);
+   return found;
+}
+
+int mailIndexRemove(const char* mailbox, int number, struct mailEntry* entry)
+{
+   struct mailIndex index;
+   struct mailEntry last;
+
+   if (mailIndexOpen(&index, mailbox, LOCK_EX) == -1)
+   {
+      return -1;
+   }
+   int found = mailIndexRead(&index, number, entry);
+   if (found != 1 || (entry->flags & MAIL_DELETED))
+   {
+      mailIndexClose(&index);
+      return found == -1 ? -1 : 0;
+   }
+
+   entry->flags |= MAIL_DELETED;
+   if (mailIndexWrite(&index, number, entry) == -1)
+   {
+      mailIndexClose(&index);
+      return -1;
+   }
+   entry->flags &= ~MAIL_DELETED;
+   --index.header.count;
+   mailIndexSave(&index);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // deleted entries at the end are cut off, that doesn't change the number of
+   // any message that is left and keeps the index from only ever growing
+   int slots = mailIndexSlots(&index);
+   while (slots > 0 && mailIndexRead(&index, slots, &last) == 1 && (last.flags & MAIL_DELETED))
+   {
+      --slots;
+   }
+   if (ftruncate(index.fd, entryOffset(slots + 1)) == -1)
+   {
+      perror("ftruncate index");
+   }
+   mailIndexClose(&index);
+   return 1;
+}
+
+long mailIndexList(const char* mailbox, mailVisitor visitor, void* data)
+{
+   struct mailIndex index;
+   struct mailEntry entries[INDEX_BATCH];
+
+   if (mailIndexOpen(&index, mailbox, LOCK_SH) == -1)
+   {
+      return -1;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the number of messages is in the header, the entries are only read as long
+   // as the visitor wants more of them
+   int number = 1;
+   while (visitor != NULL)
+   {
+      ssize_t size = pread(index.fd, entries, sizeof(entries), entryOffset(number));
+      if (size == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         mailIndexClose(&index);
+         return -1;
+      }
+      int count = size / sizeof(struct mailEntry);
+      if (count == 0)
+      {
+         break;
+      }
+      int more = 1;
+      for (int i = 0; i < count && more; ++i, ++number)
+      {
+         if (!(entries[i].flags & MAIL_DELETED))
+         {
+            more = visitor(number, &entries[i], data);
+         }
+      }
+      if (!more)
+      {
+         break;
+      }
+   }
+   mailIndexClose(&index);
+   return index.header.count;
+}
+
+void mailIndexFile(const char* mailbox, uint64_t id, char* path, int size)
+{
+   snprintf(path, size, "%s/in/%llu", mailbox, (unsigned long long)id);
+}
+
+static int indexCreate(struct mailIndex* index, const char* mailbox)
+{
+   memset(&index->header, 0, sizeof(struct mailIndexHeader));
+   memcpy(index->header.magic, INDEX_MAGIC, sizeof(index->header.magic));
+   index->header.version = INDEX_VERSION;
+   index->header.nextId = 1;
+   index->header.count = 0;
+   index->header.segment = 0;
+   ///////////////////////////////////////////////////////////////////////////////
+   // whatever could be imported is kept, the header must be written anyway or
+   // the entries that are there already would make the index unreadable
+   if (indexImport(index, mailbox) == -1)
+   {
+      perror("import mailbox");
+   }
+   return mailIndexSave(index);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // indexes the messages older servers left in the in directory, they were
+   // named after their subject and start with "from: <sender>"
+   // the names are collected first because readdir might see renamed files again
+   // ids start above every name that is a number already, so renaming can never
+   // replace a file that wasn't imported yet
+static int indexImport(struct mailIndex* index, const char* mailbox)
+{
+   char directory[PATH_MAX];
+   char file[PATH_MAX + 256];
+   char target[PATH_MAX];
+   char** names = NULL;
+   int nameCount = 0;
+   int result = 0;
+   struct dirent *dir;
+
+   snprintf(directory, sizeof(directory), "%s/in", mailbox);
+   DIR *dr = opendir(directory);
+   if (dr == NULL)
+   {
+      return errno == ENOENT ? 0 : -1;
+   }
+   while ((dir = readdir(dr)) != NULL)
+   {
+      if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, ".."))
+      {
+         continue;
+      }
+      char** grown = realloc(names, (nameCount + 1) * sizeof(char*));
+      if (grown == NULL || (grown[nameCount] = strdup(dir->d_name)) == NULL)
+      {
+         names = grown != NULL ? grown : names;
+         result = -1;
+         break;
+      }
+      names = grown;
+      ++nameCount;
+
+      char* end;
+      unsigned long long id = strtoull(dir->d_name, &end, 10);
+      if (*end == '\0' && id >= index->header.nextId)
+      {
+         index->header.nextId = id + 1;
+      }
+   }
+   closedir(dr);
+
+   int number = 0;
+   for (int i = 0; i < nameCount && result == 0; ++i)
+   {
+      struct mailEntry entry;
+      struct stat status;
+
+      snprintf(file, sizeof(file), "%s/%s", directory, names[i]);
+      if (stat(file, &status) == -1 || !S_ISREG(status.st_mode))
+      {
+         continue;
+      }
+      memset(&entry, 0, sizeof(entry));
+      entry.id = index->header.nextId++;
+      entry.time = status.st_mtime;
+      entry.size = status.st_size;
+      snprintf(entry.subject, sizeof(entry.subject), "%s", names[i]);
+
+      FILE* messageFile = fopen(file, "r");
+      if (messageFile != NULL)
+      {
+         char line[sizeof(entry.sender) + 5];
+         if (fgets(line, sizeof(line), messageFile) != NULL && strncmp(line, "from: ", 6) == 0)
+         {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(entry.sender, sizeof(entry.sender), "%s", line + 6);
+         }
+         fclose(messageFile);
+      }
+
+      mailIndexFile(mailbox, entry.id, target, sizeof(target));
+      if (rename(file, target) == -1 || mailIndexWrite(index, number + 1, &entry) == -1)
+      {
+         result = -1;
+         break;
+      }
+      ++number;
+      ++index->header.count;
+   }
+
+   for (int i = 0; i < nameCount; ++i)
+   {
+      free(names[i]);
+   }
+   free(names);
+   return result;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 if the header is valid, 0 if the index is empty and -1 on error
+static int indexReadHeader(struct mailIndex* index)
+{
+   struct mailIndexHeader* header = &index->header;
+   ssize_t size = pread(index->fd, header, sizeof(struct mailIndexHeader), 0);
+   if (size == 0)
+   {
+      return 0;
+   }
+   if (size != sizeof(struct mailIndexHeader) || memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+       header->version != INDEX_VERSION)
+   {
+      if (size != -1)
+      {
+         errno = EIO;
+      }
+      return -1;
+   }
+   return 1;
+}
+
+static off_t entryOffset(int number)
+{
+   return sizeof(struct mailIndexHeader) + (off_t)(number - 1) * sizeof(struct mailEntry);
+}
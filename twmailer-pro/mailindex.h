@@ -0,0 +1,120 @@
+#ifndef MAILINDEX_H
+#define MAILINDEX_H
+
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro mailbox index                                                //
+   //                                                                           //
+   // every inbox has a file "index" next to its in directory: a small header  //
+   // followed by one fixed size entry per message, the message number is the  //
+   // position of the entry, so READ and DEL seek straight to it and LIST      //
+   // reads the file from the front instead of scanning the directory          //
+   // DEL only marks the entry, the numbers of the other messages never change //
+   // the index only knows where a message is, the storage backends (see      //
+   // mailstore.h) decide how it gets there                                    //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define MAIL_INDEX_NAME "index"
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // MAIL_DELETED: the message was deleted, its entry is a tombstone
+   // MAIL_SEGMENT: the message is size bytes at offset in the segment log/<segment>,
+   // otherwise it is the file in/<id>
+   // MAIL_COMPRESSED: what is stored is a zstd frame of the message (see
+   // mailcompress.h), size is the size of the frame
+#define MAIL_DELETED 0x1
+#define MAIL_SEGMENT 0x2
+#define MAIL_COMPRESSED 0x4
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // one message of the inbox
+   // time is when it was delivered, size the length of the message
+struct mailEntry{
+   uint64_t id;
+   int64_t time;
+   int64_t size;
+   int64_t offset;
+   uint32_t flags;
+   uint32_t segment;
+   char sender[128];
+   char subject[256];
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // count is the number of messages that are not deleted, nextId the id the
+   // next message gets, segment the segment new messages are appended to
+struct mailIndexHeader{
+   char magic[4];
+   uint32_t version;
+   uint64_t nextId;
+   uint64_t count;
+   uint32_t segment;
+   char reserved[36];
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // an open and locked index
+struct mailIndex{
+   int fd;
+   struct mailIndexHeader header;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // called by mailIndexList for every message that is not deleted,
+   // returns 0 to stop the listing
+typedef int (*mailVisitor)(int number, const struct mailEntry* entry, void* data);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // all functions take the directory of the user (/var/spool/mail/<user>)
+   // the index is locked with flock while it is used, so worker threads and
+   // forked servers can share a mailbox
+   // an inbox without index (from older servers) is indexed on first use,
+   // its messages are renamed to their ids in the order readdir finds them
+   // errors return -1 with errno set
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // opens the index of mailbox and locks it with operation (LOCK_SH or LOCK_EX),
+   // mailIndexClose writes nothing, changes to the header need mailIndexSave
+int mailIndexOpen(struct mailIndex* index, const char* mailbox, int operation);
+void mailIndexClose(struct mailIndex* index);
+int mailIndexSave(struct mailIndex* index);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // number of entries, deleted ones included
+int mailIndexSlots(struct mailIndex* index);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // mailIndexRead returns 1 if the entry was read and 0 if number is out of range
+int mailIndexRead(struct mailIndex* index, int number, struct mailEntry* entry);
+int mailIndexWrite(struct mailIndex* index, int number, struct mailEntry* entry);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // takes the next id for good, even if the server dies before the entry is
+   // written it is never handed out again
+int mailIndexTakeId(struct mailIndex* index, uint64_t* id);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // appends entry (its id must be taken already) and returns the message number
+int mailIndexAppend(struct mailIndex* index, struct mailEntry* entry);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the same for a mailbox that is not open yet:
+   // mailIndexGet returns 1 and fills entry if the message exists, 0 if not
+   // mailIndexRemove marks the message deleted and returns 1 with its old entry,
+   // 0 if it didn't exist, the caller removes the message itself
+   // mailIndexList returns the number of messages and calls visitor for each of
+   // them, visitor may be NULL if only the number is wanted
+int mailIndexGet(const char* mailbox, int number, struct mailEntry* entry);
+int mailIndexRemove(const char* mailbox, int number, struct mailEntry* entry);
+long mailIndexList(const char* mailbox, mailVisitor visitor, void* data);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // path of the file that holds the message with id
+void mailIndexFile(const char* mailbox, uint64_t id, char* path, int size);
+
+#endif
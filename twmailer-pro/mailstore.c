@@ -0,0 +1,546 @@
+#define _GNU_SOURCE // copy_file_range
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include "mailstore.h"
+#include "mailcache.h"
+#include "mailcompress.h"
+#include "logging.h"
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // bodies with the same hash and length but different content get the next
+   // number, after this many the message is stored without a body
+#define BODY_NAMES 4
+#define COMPARE_CHUNK (64 * 1024)
+
+static struct mailStore *stores[] = {&maildirStore, &segmentStore};
+static struct mailStore *current = &maildirStore;
+static int compactInterval = MAIL_COMPACT_INTERVAL;
+
+static pthread_t sweepThread;
+static pthread_mutex_t sweepLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sweepWakeup = PTHREAD_COND_INITIALIZER;
+static int sweepRunning = 0;
+static unsigned long temporaries = 0;
+
+static void temporaryPath(const char* mailbox, char* path, int size);
+static int sameContent(int fd, struct mailSource* source);
+static void *sweepLoop(void *data);
+static void sweepBodies();
+
+///////////////////////////////////////////////////////////////////////////////
+
+int mailStoreUse(const char* name)
+{
+   for (unsigned int i = 0; i < sizeof(stores) / sizeof(stores[0]); ++i)
+   {
+      if (strcmp(stores[i]->name, name) == 0)
+      {
+         current = stores[i];
+         return 0;
+      }
+   }
+   return -1;
+}
+
+void mailStoreCompactEvery(int seconds)
+{
+   compactInterval = seconds;
+}
+
+int mailStoreCompactInterval()
+{
+   return compactInterval;
+}
+
+int mailStoreStart()
+{
+   if (compactInterval > 0)
+   {
+      sweepRunning = 1;
+      if (pthread_create(&sweepThread, NULL, sweepLoop, NULL) != 0)
+      {
+         sweepRunning = 0;
+         return -1;
+      }
+   }
+   return current->start != NULL ? current->start() : 0;
+}
+
+void mailStoreStop()
+{
+   if (current->stop != NULL)
+   {
+      current->stop();
+   }
+   pthread_mutex_lock(&sweepLock);
+   if (!sweepRunning)
+   {
+      pthread_mutex_unlock(&sweepLock);
+      return;
+   }
+   sweepRunning = 0;
+   pthread_cond_signal(&sweepWakeup);
+   pthread_mutex_unlock(&sweepLock);
+   pthread_join(sweepThread, NULL);
+}
+
+uint64_t mailStoreHash(uint64_t hash, const void* data, size_t length)
+{
+   const unsigned char* bytes = data;
+   for (size_t i = 0; i < length; ++i)
+   {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+   }
+   return hash;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a body that is still being written (or was cut short by a crash) simply
+   // doesn't compare equal, the message then takes the next name
+int mailStoreBody(const char* spool, struct mailSource* source)
+{
+   char directory[PATH_MAX - 64]; // room for the name of the body
+
+   source->body[0] = '\0';
+   if (source->compressed == NULL)
+   {
+      mailCompress(source);
+   }
+   int slash = spool[0] != '\0' && spool[strlen(spool) - 1] == '/';
+   snprintf(directory, sizeof(directory), "%s%s%s", spool, slash ? "" : "/", MAIL_BODIES);
+   if (mkdir(directory, 0777) == -1 && errno != EEXIST)
+   {
+      return -1;
+   }
+   for (int attempt = 0; attempt < BODY_NAMES; ++attempt)
+   {
+      snprintf(source->body, sizeof(source->body), "%s/%016llx-%lld-%d", directory,
+               (unsigned long long)source->hash, (long long)source->length, attempt);
+      int existing = open(source->body, O_RDONLY | O_CLOEXEC);
+      if (existing != -1)
+      {
+         int same = sameContent(existing, source);
+         ///////////////////////////////////////////////////////////////////////////////
+         // the sweeper leaves bodies alone that were used recently
+         if (same == 1 && futimens(existing, NULL) == -1)
+         {
+            perror("futimens body");
+         }
+         close(existing);
+         if (same == 1)
+         {
+            return 0;
+         }
+         if (same == -1)
+         {
+            source->body[0] = '\0';
+            return -1;
+         }
+         continue;
+      }
+      if (errno != ENOENT)
+      {
+         source->body[0] = '\0';
+         return -1;
+      }
+
+      int stored;
+      if (source->path != NULL && source->offset == 0)
+      {
+         stored = link(source->path, source->body);
+      }
+      else
+      {
+         stored = mailStoreCreate(source->body, source);
+      }
+      if (stored == 0)
+      {
+         return 0;
+      }
+      if (errno != EEXIST)
+      {
+         source->body[0] = '\0';
+         return -1;
+      }
+      ///////////////////////////////////////////////////////////////////////////////
+      // stored by someone else just now, the next name is fine too
+   }
+   source->body[0] = '\0';
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the listing the mailbox cache has of the mailbox is over either way, the
+   // index may have changed even if the backend failed
+int mailStoreAdd(const char* mailbox, struct mailEntry* entry, struct mailSource* source, struct commitRequest* commit)
+{
+   int number = current->add(mailbox, entry, source, commit);
+   mailCacheTouch(mailbox);
+   return number;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // if the subject has a message already, the link is made in tmp and renamed
+   // over it, rename does nothing if both are links to the same body already,
+   // so the temporary link is removed afterwards either way
+   // the old out/<subject> is usually a link to a body that inboxes share, so
+   // without a link the message is written to a file of its own and renamed
+   // over it as well, never written into it
+int mailStoreKeep(const char* mailbox, const char* subject, struct mailSource* source, struct commitRequest* commit)
+{
+   char target[PATH_MAX];
+   char temporary[PATH_MAX];
+   int linked = 0;
+
+   snprintf(target, sizeof(target), "%s/out/%s", mailbox, subject);
+   if (source->body[0] != '\0')
+   {
+      linked = link(source->body, target) == 0;
+      if (!linked && errno == EEXIST)
+      {
+         temporaryPath(mailbox, temporary, sizeof(temporary));
+         if (link(source->body, temporary) == 0)
+         {
+            linked = rename(temporary, target) == 0;
+            unlink(temporary);
+         }
+      }
+   }
+   if (!linked && mailStoreWrite(mailbox, target, source) == -1)
+   {
+      return -1;
+   }
+   groupCommitAdd(commit, target);
+   snprintf(target, sizeof(target), "%s/out", mailbox);
+   groupCommitAdd(commit, target);
+   return 0;
+}
+
+int mailStoreOpen(const char* mailbox, int number, int* fd, off_t* offset, off_t* size)
+{
+   struct mailIndex index;
+   struct mailEntry entry;
+   char file[PATH_MAX];
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the file is opened while the index is locked, a DEL or a compaction that
+   // comes later can remove it but not take it away from us anymore
+   if (mailIndexOpen(&index, mailbox, LOCK_SH) == -1)
+   {
+      return -1;
+   }
+   int found = mailIndexRead(&index, number, &entry);
+   if (found != 1 || (entry.flags & MAIL_DELETED))
+   {
+      mailIndexClose(&index);
+      return found == -1 ? -1 : 0;
+   }
+   if (entry.flags & MAIL_SEGMENT)
+   {
+      snprintf(file, sizeof(file), "%s/log/%u", mailbox, entry.segment);
+      *offset = entry.offset;
+      *size = entry.size;
+   }
+   else
+   {
+      mailIndexFile(mailbox, entry.id, file, sizeof(file));
+      *offset = 0;
+      *size = -1;
+   }
+   *fd = open(file, O_RDONLY | O_CLOEXEC);
+   mailIndexClose(&index);
+   if (*fd == -1)
+   {
+      return -1;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a message file is as long as it is, whatever the index says
+   struct stat status;
+   if (*size == -1)
+   {
+      if (fstat(*fd, &status) == -1)
+      {
+         close(*fd);
+         return -1;
+      }
+      *size = status.st_size;
+   }
+   if (entry.flags & MAIL_COMPRESSED)
+   {
+      int plain = mailDecompress(*fd, *offset, *size, size);
+      close(*fd);
+      if (plain == -1)
+      {
+         return -1;
+      }
+      *fd = plain;
+      *offset = 0;
+   }
+   return 1;
+}
+
+void mailStoreDone(struct mailSource* source)
+{
+   free(source->compressed);
+   source->compressed = NULL;
+}
+
+int mailStoreRemove(const char* mailbox, int number)
+{
+   struct mailEntry entry;
+   char file[PATH_MAX];
+
+   int removed = mailIndexRemove(mailbox, number, &entry);
+   if (removed == 1)
+   {
+      mailCacheTouch(mailbox);
+   }
+   if (removed != 1)
+   {
+      return removed;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // in a segment the message is only dead space now, compaction takes care of it
+   if (!(entry.flags & MAIL_SEGMENT))
+   {
+      mailIndexFile(mailbox, entry.id, file, sizeof(file));
+      if (unlink(file) == -1 && errno != ENOENT)
+      {
+         perror("unlink message");
+      }
+   }
+   return 1;
+}
+
+int mailStoreCopy(int out, off_t* position, struct mailSource* source)
+{
+   off_t remaining = source->length;
+
+   if (source->data != NULL)
+   {
+      const char* data = source->data;
+      while (remaining > 0)
+      {
+         ssize_t written = pwrite(out, data, remaining, *position);
+         if (written == -1)
+         {
+            if (errno == EINTR)
+            {
+               continue;
+            }
+            return -1;
+         }
+         data += written;
+         remaining -= written;
+         *position += written;
+      }
+      return 0;
+   }
+
+   off_t in = source->offset;
+   while (remaining > 0)
+   {
+      ssize_t copied = copy_file_range(source->fd, &in, out, position, remaining, 0);
+      if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+      {
+         ///////////////////////////////////////////////////////////////////////////////
+         // sendfile writes at the file position of out, not at an offset
+         if (lseek(out, *position, SEEK_SET) == -1)
+         {
+            return -1;
+         }
+         copied = sendfile(out, source->fd, &in, remaining);
+         if (copied > 0)
+         {
+            *position += copied;
+         }
+      }
+      if (copied == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return -1;
+      }
+      if (copied == 0)
+      {
+         errno = EIO;
+         return -1;
+      }
+      remaining -= copied;
+   }
+   return 0;
+}
+
+int mailStoreWrite(const char* mailbox, const char* path, struct mailSource* source)
+{
+   char temporary[PATH_MAX];
+
+   temporaryPath(mailbox, temporary, sizeof(temporary));
+   if (mailStoreCreate(temporary, source) == -1)
+   {
+      return -1;
+   }
+   if (rename(temporary, path) == -1)
+   {
+      int error = errno;
+      unlink(temporary);
+      errno = error;
+      return -1;
+   }
+   return 0;
+}
+
+int mailStoreCreate(const char* path, struct mailSource* source)
+{
+   off_t position = 0;
+   int out = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+   if (out == -1)
+   {
+      return -1;
+   }
+   if (mailStoreCopy(out, &position, source) == -1)
+   {
+      int error = errno;
+      close(out);
+      unlink(path);
+      errno = error;
+      return -1;
+   }
+   return close(out);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a name in the tmp directory of mailbox no other thread or process uses
+static void temporaryPath(const char* mailbox, char* path, int size)
+{
+   snprintf(path, size, "%s/tmp/keep.%d.%lu", mailbox, getpid(),
+            __atomic_add_fetch(&temporaries, 1, __ATOMIC_RELAXED));
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 if the file fd holds exactly the message, 0 if not, -1 on error
+static int sameContent(int fd, struct mailSource* source)
+{
+   struct stat status;
+   char mine[COMPARE_CHUNK];
+   char theirs[COMPARE_CHUNK];
+
+   if (fstat(fd, &status) == -1)
+   {
+      return -1;
+   }
+   if (status.st_size != source->length)
+   {
+      return 0;
+   }
+   for (off_t done = 0; done < source->length; )
+   {
+      size_t wanted = source->length - done < COMPARE_CHUNK ? source->length - done : COMPARE_CHUNK;
+      ssize_t got = pread(fd, theirs, wanted, done);
+      if (got <= 0)
+      {
+         return got == 0 ? 0 : -1;
+      }
+      const char* compared = source->data + done;
+      if (source->data == NULL)
+      {
+         ssize_t read = pread(source->fd, mine, got, source->offset + done);
+         if (read != got)
+         {
+            return read == -1 ? -1 : 0;
+         }
+         compared = mine;
+      }
+      if (memcmp(compared, theirs, got) != 0)
+      {
+         return 0;
+      }
+      done += got;
+   }
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a body that no mailbox links to has a link count of 1, it is removed once
+   // it wasn't used for an interval (a SEND that found it just now still
+   // links to it, see mailStoreBody)
+static void *sweepLoop(void *data)
+{
+   struct timespec wakeup;
+
+   pthread_mutex_lock(&sweepLock);
+   while (sweepRunning)
+   {
+      clock_gettime(CLOCK_REALTIME, &wakeup);
+      wakeup.tv_sec += compactInterval;
+      while (sweepRunning && pthread_cond_timedwait(&sweepWakeup, &sweepLock, &wakeup) != ETIMEDOUT)
+      {
+      }
+      if (!sweepRunning)
+      {
+         break;
+      }
+      pthread_mutex_unlock(&sweepLock);
+      sweepBodies();
+      pthread_mutex_lock(&sweepLock);
+   }
+   pthread_mutex_unlock(&sweepLock);
+   return NULL;
+}
+
+static void sweepBodies()
+{
+   char path[PATH_MAX + 256];
+   struct dirent *dir;
+   struct stat status;
+   int swept = 0;
+
+   snprintf(path, sizeof(path), "%s%s", SPOOL, MAIL_BODIES);
+   DIR *dr = opendir(path);
+   if (dr == NULL)
+   {
+      if (errno != ENOENT)
+      {
+         perror("sweep - opendir bodies");
+      }
+      return;
+   }
+   time_t old = time(NULL) - compactInterval;
+   while ((dir = readdir(dr)) != NULL)
+   {
+      if (dir->d_name[0] == '.')
+      {
+         continue;
+      }
+      snprintf(path, sizeof(path), "%s%s/%s", SPOOL, MAIL_BODIES, dir->d_name);
+      if (stat(path, &status) == 0 && status.st_nlink == 1 && status.st_mtime < old)
+      {
+         if (unlink(path) == 0)
+         {
+            ++swept;
+         }
+      }
+   }
+   closedir(dr);
+   if (swept > 0)
+   {
+      logInfo("swept %d bodies\n", swept);
+   }
+}
@@ -0,0 +1,134 @@
+#ifndef MAILSTORE_H
+#define MAILSTORE_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <limits.h>
+#include "mailindex.h"
+#include "groupcommit.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro mail storage                                                 //
+   //                                                                           //
+   // the server stores messages through these functions, how they end up on  //
+   // disk is up to the backend that is chosen at startup:                     //
+   //    maildir : one file per message in in/, the way it always was          //
+   //    segment : messages are appended to a few large segment files in log/, //
+   //              DEL leaves a tombstone in the index and a background thread //
+   //              copies the messages that are left out of segments that are  //
+   //              mostly deleted                                              //
+   // both use the same index (mailindex.h) and can read each other's messages,//
+   // so a spool can be switched from one to the other                         //
+   // the body of a SEND is written once to the body store (.bodies in the     //
+   // spool, named after its content), the outbox of the sender and the maildir//
+   // inbox are hard links to it, identical bodies are stored only once         //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define SPOOL "/var/spool/mail/"
+#define MAIL_BODIES ".bodies"
+
+#define MAIL_STORE "maildir"
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // seconds between two compaction runs of the segment backend, bodies that no
+   // mailbox links to anymore are swept as often
+#define MAIL_COMPACT_INTERVAL 60
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // FNV-1a, a body is found by hash and length and then compared byte by byte
+#define MAIL_HASH_SEED 14695981039346656037ULL
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a message that is about to be stored: length bytes at data, or if data is
+   // NULL, length bytes at offset in the file fd
+   // path is set if fd is a temporary file the backend may take over by renaming
+   // hash is mailStoreHash of the message, body is its file in the body store
+   // once mailStoreBody put it there (empty before), backends link to it
+   // compressed is NULL unless mailStoreBody compressed the message, data
+   // points to it then and length is its compressed length
+struct mailSource{
+   const char* data;
+   int fd;
+   off_t offset;
+   off_t length;
+   const char* path;
+   uint64_t hash;
+   char body[PATH_MAX];
+   char* compressed;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // what a backend has to provide
+   // add: stores a message in the inbox of mailbox and appends its entry
+   //      (sender, subject and time are set, it marks the entry MAIL_COMPRESSED
+   //      if source is compressed), returns the message number
+   //      it names every file it changed in commit (if it isn't NULL), so the
+   //      caller can make the message durable with a group commit
+   // start/stop: background work, NULL if there is none
+   // errors return -1 with errno set
+   // the outbox is the same for every backend, see mailStoreKeep
+struct mailStore{
+   const char* name;
+   int (*add)(const char* mailbox, struct mailEntry* entry, struct mailSource* source, struct commitRequest* commit);
+   int (*start)();
+   void (*stop)();
+};
+
+extern struct mailStore maildirStore;
+extern struct mailStore segmentStore;
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // compacts the segments of one mailbox right away, the compaction thread of
+   // the segment backend does it for every mailbox of the spool each interval
+void segmentCompact(const char* mailbox);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // chooses the backend by name, returns -1 if there is none of that name
+   // must be called before mailStoreStart
+int mailStoreUse(const char* name);
+void mailStoreCompactEvery(int seconds);
+int mailStoreCompactInterval();
+
+int mailStoreStart();
+void mailStoreStop();
+
+uint64_t mailStoreHash(uint64_t hash, const void* data, size_t length);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a SEND stores its message with mailStoreBody first (in the body store of
+   // spool, usually SPOOL), then with mailStoreAdd for the receiver and
+   // mailStoreKeep for the sender, keep links out/<subject> to the body
+   // (the last message of every subject is kept)
+   // if the body store or a link fails, the message is copied as it used to be
+   // with compression turned on mailStoreBody compresses the message first,
+   // mailStoreDone frees it once the message is stored everywhere
+int mailStoreBody(const char* spool, struct mailSource* source);
+int mailStoreAdd(const char* mailbox, struct mailEntry* entry, struct mailSource* source, struct commitRequest* commit);
+int mailStoreKeep(const char* mailbox, const char* subject, struct mailSource* source, struct commitRequest* commit);
+void mailStoreDone(struct mailSource* source);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the same for every backend, the index says where a message is:
+   // mailStoreOpen returns 1 and a descriptor to read size bytes at offset from,
+   // 0 if the message doesn't exist, a compressed message is decompressed into
+   // a descriptor of its own
+   // mailStoreRemove returns 1 if the message was deleted, 0 if it didn't exist
+int mailStoreOpen(const char* mailbox, int number, int* fd, off_t* offset, off_t* size);
+int mailStoreRemove(const char* mailbox, int number);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // for the backends: writes the message to out at position, which is moved on
+   // file to file copies stay in the kernel (copy_file_range or sendfile)
+   // mailStoreWrite creates (or replaces) the file path with the message: it is
+   // written to a new file in the tmp directory of mailbox and renamed over
+   // path, so a file other mailboxes link to is never changed
+   // mailStoreCreate fails with EEXIST instead of replacing it
+int mailStoreCopy(int out, off_t* position, struct mailSource* source);
+int mailStoreWrite(const char* mailbox, const char* path, struct mailSource* source);
+int mailStoreCreate(const char* path, struct mailSource* source);
+
+#endif
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE // accept4
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include "metrics.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // a histogram counts a duration in the bucket of its power of two in
+   // microseconds: bucket b holds everything up to 2^b us, the last one the
+   // rest (above 4 s)
+   // a thread takes the next shard the first time it counts, with more
+   // threads than shards some share one, the adds are atomic either way
+   // (a forked child takes a fresh one, see metricsInit)
+#define METRICS_SHARDS 64
+#define METRICS_BUCKETS 24
+
+struct metricsShard{
+   unsigned long buckets[metricCount][METRICS_BUCKETS];
+   unsigned long nanoseconds[metricCount];
+   unsigned long received;
+   unsigned long sent;
+   unsigned long opened;
+   unsigned long closed;
+} __attribute__((aligned(64)));
+
+struct metricsMemory{
+   struct metricsShard shards[METRICS_SHARDS];
+   int nextShard;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // name, label and help of every metric in the exposition, the help of the
+   // first one of a name is used
+static const struct{
+   const char* name;
+   const char* label;
+   const char* help;
+} metricNames[metricCount] = {
+   {"twmailer_request_duration_seconds", "command=\"login\"", "From the complete request to the last byte of the answer."},
+   {"twmailer_request_duration_seconds", "command=\"send\"", NULL},
+   {"twmailer_request_duration_seconds", "command=\"list\"", NULL},
+   {"twmailer_request_duration_seconds", "command=\"read\"", NULL},
+   {"twmailer_request_duration_seconds", "command=\"del\"", NULL},
+   {"twmailer_request_duration_seconds", "command=\"token\"", NULL},
+   {"twmailer_request_duration_seconds", "command=\"stats\"", NULL},
+   {"twmailer_request_duration_seconds", "command=\"quit\"", NULL},
+   {"twmailer_request_duration_seconds", "command=\"invalid\"", NULL},
+   {"twmailer_directory_duration_seconds", "operation=\"bind\"", "From the question to the answer of the directory, queueing included."},
+   {"twmailer_directory_duration_seconds", "operation=\"search\"", NULL},
+   {"twmailer_store_duration_seconds", "operation=\"deliver\"", "Calls of the storage backend."},
+   {"twmailer_store_duration_seconds", "operation=\"list\"", NULL},
+   {"twmailer_store_duration_seconds", "operation=\"open\"", NULL},
+   {"twmailer_store_duration_seconds", "operation=\"remove\"", NULL}
+};
+
+static struct metricsMemory* memory = NULL;
+static __thread int shardNumber = -1;
+
+static int listener = -1;
+static int stopEvent = -1;
+static pthread_t adminThread;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static struct metricsShard* shard();
+static void forgetShard();
+static void writeHistograms(struct output* output, const struct metricsShard* total);
+static void *adminLoop(void *data);
+static void answer(int client);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int metricsInit()
+{
+   memory = mmap(NULL, sizeof(struct metricsMemory), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (memory == MAP_FAILED)
+   {
+      perror("mmap metrics");
+      memory = NULL;
+      return -1;
+   }
+   pthread_atfork(NULL, NULL, forgetShard);
+   return 0;
+}
+
+uint64_t metricsNow()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec + 1;
+}
+
+void metricsObserve(enum metric metric, uint64_t nanoseconds)
+{
+   struct metricsShard* counters = shard();
+   if (counters == NULL)
+   {
+      return;
+   }
+   uint64_t microseconds = nanoseconds / 1000;
+   int bucket = microseconds == 0 ? 0 : 64 - __builtin_clzll(microseconds);
+   if (bucket >= METRICS_BUCKETS)
+   {
+      bucket = METRICS_BUCKETS - 1;
+   }
+   __atomic_add_fetch(&counters->buckets[metric][bucket], 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&counters->nanoseconds[metric], nanoseconds, __ATOMIC_RELAXED);
+}
+
+void metricsReceived(size_t bytes)
+{
+   struct metricsShard* counters = shard();
+   if (counters != NULL)
+   {
+      __atomic_add_fetch(&counters->received, bytes, __ATOMIC_RELAXED);
+   }
+}
+
+void metricsSent(size_t bytes)
+{
+   struct metricsShard* counters = shard();
+   if (counters != NULL)
+   {
+      __atomic_add_fetch(&counters->sent, bytes, __ATOMIC_RELAXED);
+   }
+}
+
+void metricsSessionOpened()
+{
+   struct metricsShard* counters = shard();
+   if (counters != NULL)
+   {
+      __atomic_add_fetch(&counters->opened, 1, __ATOMIC_RELAXED);
+   }
+}
+
+void metricsSessionClosed()
+{
+   struct metricsShard* counters = shard();
+   if (counters != NULL)
+   {
+      __atomic_add_fetch(&counters->closed, 1, __ATOMIC_RELAXED);
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the shards are added up into one first, a session opened in one thread
+   // and closed in another counts right in the sum only
+void metricsWrite(struct output* output)
+{
+   struct metricsShard total;
+
+   memset(&total, 0, sizeof(total));
+   if (memory != NULL)
+   {
+      for (int i = 0; i < METRICS_SHARDS; ++i)
+      {
+         const struct metricsShard* counters = &memory->shards[i];
+         for (int m = 0; m < metricCount; ++m)
+         {
+            for (int b = 0; b < METRICS_BUCKETS; ++b)
+            {
+               total.buckets[m][b] += __atomic_load_n(&counters->buckets[m][b], __ATOMIC_RELAXED);
+            }
+            total.nanoseconds[m] += __atomic_load_n(&counters->nanoseconds[m], __ATOMIC_RELAXED);
+         }
+         total.received += __atomic_load_n(&counters->received, __ATOMIC_RELAXED);
+         total.sent += __atomic_load_n(&counters->sent, __ATOMIC_RELAXED);
+         total.opened += __atomic_load_n(&counters->opened, __ATOMIC_RELAXED);
+         total.closed += __atomic_load_n(&counters->closed, __ATOMIC_RELAXED);
+      }
+   }
+
+   outputPrintf(output, "# HELP twmailer_sessions_active Client connections open right now.\n");
+   outputPrintf(output, "# TYPE twmailer_sessions_active gauge\n");
+   outputPrintf(output, "twmailer_sessions_active %ld\n", (long)(total.opened - total.closed));
+   outputPrintf(output, "# HELP twmailer_sessions_total Client connections accepted.\n");
+   outputPrintf(output, "# TYPE twmailer_sessions_total counter\n");
+   outputPrintf(output, "twmailer_sessions_total %lu\n", total.opened);
+   outputPrintf(output, "# HELP twmailer_received_bytes_total Bytes read from clients.\n");
+   outputPrintf(output, "# TYPE twmailer_received_bytes_total counter\n");
+   outputPrintf(output, "twmailer_received_bytes_total %lu\n", total.received);
+   outputPrintf(output, "# HELP twmailer_sent_bytes_total Bytes written to clients, messages of READ included.\n");
+   outputPrintf(output, "# TYPE twmailer_sent_bytes_total counter\n");
+   outputPrintf(output, "twmailer_sent_bytes_total %lu\n", total.sent);
+   writeHistograms(output, &total);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the buckets of the exposition are cumulative, every metric of the same
+   // name shares one HELP and TYPE line
+static void writeHistograms(struct output* output, const struct metricsShard* total)
+{
+   for (int m = 0; m < metricCount; ++m)
+   {
+      if (m == 0 || strcmp(metricNames[m].name, metricNames[m - 1].name) != 0)
+      {
+         outputPrintf(output, "# HELP %s %s\n", metricNames[m].name, metricNames[m].help);
+         outputPrintf(output, "# TYPE %s histogram\n", metricNames[m].name);
+      }
+      unsigned long count = 0;
+      for (int b = 0; b < METRICS_BUCKETS; ++b)
+      {
+         count += total->buckets[m][b];
+         if (b < METRICS_BUCKETS - 1)
+         {
+            outputPrintf(output, "%s_bucket{%s,le=\"%.6f\"} %lu\n", metricNames[m].name, metricNames[m].label,
+                         (double)(1ul << b) / 1000000, count);
+         }
+      }
+      outputPrintf(output, "%s_bucket{%s,le=\"+Inf\"} %lu\n", metricNames[m].name, metricNames[m].label, count);
+      outputPrintf(output, "%s_sum{%s} %.9f\n", metricNames[m].name, metricNames[m].label,
+                   (double)total->nanoseconds[m] / 1000000000);
+      outputPrintf(output, "%s_count{%s} %lu\n", metricNames[m].name, metricNames[m].label, count);
+   }
+}
+
+int metricsServe(int port)
+{
+   struct sockaddr_in address;
+   int reuseValue = 1;
+
+   if ((listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+   {
+      perror("metrics socket");
+      return -1;
+   }
+   setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuseValue, sizeof(reuseValue));
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_port = htons(port);
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listener, 16) == -1)
+   {
+      perror("metrics bind");
+      close(listener);
+      listener = -1;
+      return -1;
+   }
+   if ((stopEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+   {
+      perror("metrics eventfd");
+      close(listener);
+      listener = -1;
+      return -1;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // signals are for the main thread, the admin thread is created with all
+   // of them blocked
+   sigset_t blocked, previous;
+   sigfillset(&blocked);
+   pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+   int created = pthread_create(&adminThread, NULL, adminLoop, NULL);
+   pthread_sigmask(SIG_SETMASK, &previous, NULL);
+   if (created != 0)
+   {
+      perror("metrics thread");
+      close(stopEvent);
+      close(listener);
+      stopEvent = listener = -1;
+      return -1;
+   }
+   return 0;
+}
+
+void metricsStop()
+{
+   uint64_t stop = 1;
+
+   if (listener == -1)
+   {
+      return;
+   }
+   if (write(stopEvent, &stop, sizeof(stop)) == -1)
+   {
+      perror("write metrics stop");
+   }
+   pthread_join(adminThread, NULL);
+   close(stopEvent);
+   close(listener);
+   stopEvent = listener = -1;
+}
+
+static struct metricsShard* shard()
+{
+   if (memory == NULL)
+   {
+      return NULL;
+   }
+   if (shardNumber == -1)
+   {
+      shardNumber = __atomic_fetch_add(&memory->nextShard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS;
+   }
+   return &memory->shards[shardNumber];
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a forked child would keep counting into the shard of the thread that
+   // forked it, together with all its siblings
+static void forgetShard()
+{
+   shardNumber = -1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // one scrape at a time, they are rare and the answer is quick
+static void *adminLoop(void *data)
+{
+   struct pollfd descriptors[2] = {{listener, POLLIN, 0}, {stopEvent, POLLIN, 0}};
+
+   while (1)
+   {
+      if (poll(descriptors, 2, -1) == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("metrics poll");
+         return NULL;
+      }
+      if (descriptors[1].revents != 0)
+      {
+         return NULL;
+      }
+      int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+      if (client == -1)
+      {
+         continue;
+      }
+      answer(client);
+      close(client);
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // reads the request line (a client gets a second for it) and answers
+   // HTTP/1.0, anything but GET /metrics is a 404
+static void answer(int client)
+{
+   struct timeval timeout = {1, 0};
+   char request[1024];
+   int length = 0;
+
+   setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   while (length < (int)sizeof(request) - 1 && memchr(request, '\n', length) == NULL)
+   {
+      int size = recv(client, request + length, sizeof(request) - 1 - length, 0);
+      if (size <= 0)
+      {
+         return;
+      }
+      length += size;
+   }
+   request[length] = '\0';
+
+   struct output body;
+   if (outputInit(&body) == -1)
+   {
+      return;
+   }
+   int found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0;
+   if (found)
+   {
+      metricsWrite(&body);
+   }
+   else
+   {
+      outputSet(&body, "not found\n");
+   }
+
+   char header[256];
+   int headerLength = snprintf(header, sizeof(header),
+                               "HTTP/1.0 %s\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %d\r\n"
+                               "Connection: close\r\n\r\n",
+                               found ? "200 OK" : "404 Not Found", outputLength(&body));
+   if (send(client, header, headerLength, MSG_NOSIGNAL | MSG_MORE) == headerLength)
+   {
+      const char* text = outputText(&body);
+      int sent = 0;
+      while (sent < outputLength(&body))
+      {
+         int size = send(client, text + sent, outputLength(&body) - sent, MSG_NOSIGNAL);
+         if (size <= 0)
+         {
+            break;
+         }
+         sent += size;
+      }
+   }
+   outputFree(&body);
+}
@@ -0,0 +1,79 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "output.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro metrics                                                      //
+   //                                                                           //
+   // counters and latency histograms of the server, served as text (the     //
+   // Prometheus exposition format) on a port of its own that only listens   //
+   // on the loopback address:                                                 //
+   //    curl http://127.0.0.1:6544/metrics                                    //
+   // every thread counts into a shard of its own (one per thread as long as //
+   // there are enough), the admin thread adds the shards up when it is       //
+   // asked, so counting costs an add to a cache line nobody else writes      //
+   // the shards are shared memory, forked children and prefork processes    //
+   // count into the same ones the admin thread reads                          //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define METRICS_PORT 6544
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // everything with a latency histogram: the requests of the clients (from
+   // the complete request to the last byte of the answer), the directory
+   // (from the question to the answer, waiting for a connection included)
+   // and the storage backend
+enum metric{
+   metricLogin,
+   metricSend,
+   metricList,
+   metricRead,
+   metricDelete,
+   metricToken,
+   metricStats,
+   metricQuit,
+   metricInvalid,
+   metricDirectoryBind,
+   metricDirectorySearch,
+   metricStoreDeliver,
+   metricStoreList,
+   metricStoreOpen,
+   metricStoreRemove,
+   metricCount
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // maps the shared memory, must be called before the server forks and
+   // before anything is counted, without it counting does nothing
+   // returns -1 if the memory can't be mapped
+int metricsInit();
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // nanoseconds of CLOCK_MONOTONIC, never 0
+uint64_t metricsNow();
+
+void metricsObserve(enum metric metric, uint64_t nanoseconds);
+void metricsReceived(size_t bytes);
+void metricsSent(size_t bytes);
+void metricsSessionOpened();
+void metricsSessionClosed();
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // appends all metrics in the text exposition format
+void metricsWrite(struct output* output);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // starts the admin thread on 127.0.0.1:port, it answers every HTTP GET of
+   // /metrics and closes the connection
+   // returns 0 or -1 if the port can't be opened or the thread not started
+int metricsServe(int port);
+void metricsStop();
+
+#endif
@@ -1,13 +1,20 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <termio.h>
+#include <getopt.h>
 #include <iostream>
+#include <string>
+#include <vector>
+#include "framing.h"
+#include "sessiontoken.h"
 
 ///////////////////////////////////////////////////////////////////////////////
    ///////////////////////////////////////////////////////////////////////////////
@@ -27,7 +34,34 @@
 #define BUF 1024
 #define PORT 6543
 
+   ///////////////////////////////////////////////////////////////////////////////
+   // requests and bytes a pipelining client has on their way before it waits
+   // for the first answer: while the server writes an answer the client doesn't
+   // read yet (a large READ) it may stop reading requests, so what the client
+   // sent meanwhile has to fit into the socket buffers or both sides block,
+   // counting requests isn't enough when a SEND carries a large body
+   // a request larger than PIPELINE_BYTES is only sent when nothing else is
+   // on its way, the server can always read one request without answering
+#define PIPELINE_DEPTH 32
+#define PIPELINE_BYTES (16 * 1024)
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // handled by the client: LIST, then READ of every listed message, the READs
+   // are pipelined so they cost one round trip together
+#define READ_ALL "READALL\n."
+
+void printUsage();
 const char* getpass();
+int sendRequest(int socket, int framed, const char* data, size_t length);
+char* receiveAnswer(int socket, int framed);
+int readRequest(std::string& request);
+int runRequests(int socket, int framed, const std::vector<std::string>& requests);
+int pipelineRequests(int socket, int framed, const std::vector<std::string>& requests);
+int readAll(int socket, int framed);
+std::string loadToken(const char* path, const char* server, const char* uid);
+void storeToken(const char* path, const char* server, const char* uid, const char* token);
+int tokenLogin(int socket, const char* token);
+void fetchToken(int socket, const char* path, const char* server, const char* uid);
 ///////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char **argv)
@@ -36,9 +70,33 @@ int main(int argc, char **argv)
    char buffer[BUF];
    struct sockaddr_in address;
    int size;
-   int messageSize = BUF-1;
    int isQuit;
-   int bytesSent;
+   int framed = 0;
+   int batch = 0;
+   const char* tokenFile = NULL;
+   const char* server = "127.0.0.1";
+   int option;
+
+   struct option longOptions[] = {
+      {"batch", no_argument, NULL, 'b'},
+      {"token-file", required_argument, NULL, 't'},
+      {NULL, 0, NULL, 0}
+   };
+   while ((option = getopt_long(argc, argv, "bt:", longOptions, NULL)) != -1)
+   {
+      switch (option)
+      {
+         case 'b':
+            batch = 1;
+            break;
+         case 't':
+            tokenFile = optarg;
+            break;
+         default:
+            printUsage();
+            return EXIT_FAILURE;
+      }
+   }
 
    ////////////////////////////////////////////////////////////////////////////
    // CREATE A SOCKET
@@ -60,14 +118,11 @@ int main(int argc, char **argv)
    // https://man7.org/linux/man-pages/man3/htons.3.html
    address.sin_port = htons(PORT);
    // https://man7.org/linux/man-pages/man3/inet_aton.3.html
-   if (argc < 2)
-   {
-      inet_aton("127.0.0.1", &address.sin_addr);
-   }
-   else
+   if (optind < argc)
    {
-      inet_aton(argv[1], &address.sin_addr);
+      server = argv[optind];
    }
+   inet_aton(server, &address.sin_addr);
 
    ////////////////////////////////////////////////////////////////////////////
    // CREATE A CONNECTION
@@ -102,6 +157,20 @@ int main(int argc, char **argv)
    {
       buffer[size] = '\0';
       printf("%s", buffer); // ignore error
+
+      ///////////////////////////////////////////////////////////////////////////////
+      // the server offers framing in its welcome message, accept it by sending
+      // the magic, from then on every message is sent and received as frames
+      // (see framing.h), an older server just keeps using BUF - 1 sized records
+      if (strstr(buffer, FRAME_CAPABILITY) != NULL)
+      {
+         if (send(create_socket, FRAME_MAGIC, FRAME_MAGIC_LENGTH, 0) == -1)
+         {
+            perror("send error");
+            return EXIT_FAILURE;
+         }
+         framed = 1;
+      }
    }
    ///////////////////////////////////////////////////////////////////////////////
    // CHECK USER ID & PW
@@ -117,39 +186,57 @@ int main(int argc, char **argv)
       //https://stackoverflow.com/questions/2693776/removing-trailing-newline-character-from-fgets-input
       //printf("Enter pw: ");
       char pwd[256];
-      strcpy(pwd, getpass());
-      bytesSent = send(create_socket, rawuid, messageSize, 0);
-      if(bytesSent == -1)
+      snprintf(pwd, sizeof(pwd), "%s", getpass());
+
+      ///////////////////////////////////////////////////////////////////////////////
+      // with --token-file a token of an earlier login is tried first, the server
+      // only checks its signature instead of asking the directory
+      // the password is read anyway, so a script needs the same input either
+      // way, and it is sent if the token isn't accepted (anymore)
+      if (tokenFile != NULL && framed)
       {
-         perror("send error");
-         break;
+         std::string token = loadToken(tokenFile, server, rawuid);
+         if (!token.empty())
+         {
+            int resumed = tokenLogin(create_socket, token.c_str());
+            if (resumed == -1)
+            {
+               break;
+            }
+            if (resumed)
+            {
+               loginSuccess = true;
+               break;
+            }
+            storeToken(tokenFile, server, rawuid, NULL);
+         }
       }
-      bytesSent = send(create_socket, pwd, messageSize, 0);
-      if(bytesSent == -1)
+      if(sendRequest(create_socket, framed, rawuid, strlen(rawuid)) == -1)
       {
          perror("send error");
          break;
       }
-      size = recv(create_socket, buffer, messageSize, 0);
-      //printf("size: %d\n", size);
-      if (size == -1)
+      if(sendRequest(create_socket, framed, pwd, strlen(pwd)) == -1)
       {
-         printf("recv size = -1");
-         perror("recv error");
+         perror("send error");
          break;
       }
-      else if (size == 0)
+      char *answer = receiveAnswer(create_socket, framed);
+      if (answer == NULL)
       {
-         printf("Server closed remote socket\n"); // ignore error
          break;
       }
       else
       {
-         buffer[size] = '\0';
-         printf("<< %s\n", buffer); // ignore error
-         if(strcmp(buffer, "LOGINOK") == 0)
+         printf("<< %s\n", answer); // ignore error
+         loginSuccess = strcmp(answer, "LOGINOK") == 0;
+         free(answer);
+         if(loginSuccess)
          {
-            loginSuccess = true;
+            if (tokenFile != NULL && framed)
+            {
+               fetchToken(create_socket, tokenFile, server, rawuid);
+            }
             break;
          }
          else
@@ -168,84 +255,42 @@ int main(int argc, char **argv)
    }
 
    //printf("rawuid: %s\nfulluid: %s\npw: %s\n", rawuid, fulluid, pwd); //test
+   std::string request;
+   std::vector<std::string> requests;
    do
    {
       ///////////////////////////////////////////////////////////////////////////////
-      // loop to get characters until .\n is entered (end of request as defined in the task)
-      // or until maximum messagesize (BUF - 1) is reached
-      for(int i = 0; i < messageSize; ++i)
-      {
-         buffer[i] = fgetc(stdin);
-         if(buffer[i] == '\n' && !feof(stdin))
-         {
-            if(i > 0)
-            {
-               if(buffer[i-1] == '.')
-               {
-                  buffer[i] = '\0'; //string ends here
-                  break;
-               }
-            }
-         }
-      }
-      
-      if(buffer != NULL)
+      // get lines until a line with only a . is entered (end of request as defined in the task)
+      // the request can be as long as needed, it is only cut to BUF - 1 when the
+      // server does not support framing
+      // in batch mode every request up to the end of the input (or quit) is
+      // read first and they are all sent without waiting for the answers
+      requests.clear();
+      do
       {
-      
-         isQuit = strcmp(buffer, "quit\n.") == 0;
-
-         //////////////////////////////////////////////////////////////////////
-         // SEND DATA
-         // https://man7.org/linux/man-pages/man2/send.2.html
-         // send will fail if connection is closed, but does not set
-         // the error of send, but still the count of bytes sent
-         bytesSent = send(create_socket, buffer, messageSize, 0);
-         //printf("bytes sent: %d\n", bytesSent); //ab dem zweiten kommando: bytes sent: 3 >> Fehler im client
-         if (bytesSent == -1) 
+         if(!readRequest(request))
          {
-            ///////////////////////////////////////////////////////////////////////////////
-            // in case the server is gone offline we will still not enter
-            // this part of code: see docs: https://linux.die.net/man/3/send
-            // >> Successful completion of a call to send() does not guarantee 
-            // >> delivery of the message. A return value of -1 indicates only 
-            // >> locally-detected errors.
-            // ... but
-            // to check the connection before send is sense-less because
-            // after checking the communication can fail (so we would need
-            // to have 1 atomic operation to check...)
-            perror("send error");
-            break;
+            request = "quit\n.";
          }
+         isQuit = request == "quit\n.";
+         requests.push_back(request);
+      } while (batch && !isQuit);
 
-         //////////////////////////////////////////////////////////////////////
-         // RECEIVE FEEDBACK
-         // consider: reconnect handling might be appropriate in somes cases
-         //           How can we determine that the command sent was received 
-         //           or not? 
-         //           - Resend, might change state too often. 
-         //           - Else a command might have been lost.
-         //
-         // solution 1: adding meta-data (unique command id) and check on the
-         //             server if already processed.
-         // solution 2: add an infrastructure component for messaging (broker)
-         //
-         size = recv(create_socket, buffer, messageSize, 0);
-         //printf("size: %d\n", size);
-         if (size == -1)
-         {
-            perror("recv error");
-            break;
-         }
-         else if (size == 0)
-         {
-            printf("Server closed remote socket\n"); // ignore error
-            break;
-         }
-         else
-         {
-            buffer[size] = '\0';
-            printf("<< %s\n", buffer); // ignore error
-         }
+      //////////////////////////////////////////////////////////////////////
+      // SEND DATA AND RECEIVE FEEDBACK
+      // consider: reconnect handling might be appropriate in somes cases
+      //           How can we determine that the command sent was received 
+      //           or not? 
+      //           - Resend, might change state too often. 
+      //           - Else a command might have been lost.
+      //
+      // solution 1: adding meta-data (unique command id) and check on the
+      //             server if already processed.
+      // solution 2: add an infrastructure component for messaging (broker)
+      //
+      if (runRequests(create_socket, framed, requests) == -1)
+      {
+         break;
       }
    } while (!isQuit);
 
@@ -268,6 +313,16 @@ int main(int argc, char **argv)
    return EXIT_SUCCESS;
 }
 
+void printUsage()
+{
+   printf("Usage: ./myclient [-b|--batch] [-t|--token-file <path>] [<server address>]\n");
+   printf("  -b, --batch      read all requests up to the end of the input first and send them\n");
+   printf("                   pipelined, the answers are printed in the same order\n");
+   printf("  -t, --token-file keep the session tokens of the server in path and log in with them,\n");
+   printf("                   which spares the server asking the directory for the password\n");
+   printf("the request READALL reads every message LIST shows with one round trip for the READs\n");
+}
+
 int getch()
 {
     int ch;
@@ -312,7 +367,10 @@ const char *getpass()
     const char RETURN = 10;
 
     unsigned char ch = 0;
-    std::string password;
+    ///////////////////////////////////////////////////////////////////////////////
+    // static, the caller copies the password after this function returned
+    static std::string password;
+    password.clear();
 
     printf("Password: ");
 
@@ -340,4 +398,329 @@ const char *getpass()
     }
     printf("\n");
     return password.c_str();
-}
\ No newline at end of file
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // sends a uid, password or request as a frame, or as a record of BUF - 1
+   // bytes to a server that does not support framing
+   // returns 0 on success and -1 on error
+int sendRequest(int socket, int framed, const char* data, size_t length)
+{
+   if (framed)
+   {
+      return frameSend(socket, data, length);
+   }
+
+   char record[BUF];
+   memset(record, 0, sizeof(record));
+   memcpy(record, data, length < BUF - 1 ? length : BUF - 1);
+   size_t sent = 0;
+   while (sent < BUF - 1)
+   {
+      ssize_t bytesSent = send(socket, record + sent, BUF - 1 - sent, 0);
+      if (bytesSent == -1)
+      {
+         return -1;
+      }
+      sent += bytesSent;
+   }
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // receives the next answer of the server, the caller has to free it
+   // returns NULL if the connection is gone
+char* receiveAnswer(int socket, int framed)
+{
+   if (framed)
+   {
+      size_t length;
+      char *answer = frameReceive(socket, &length);
+      if (answer == NULL)
+      {
+         printf("Server closed remote socket\n"); // ignore error
+      }
+      return answer;
+   }
+
+   char *answer = (char *)malloc(BUF);
+   if (answer == NULL)
+   {
+      perror("malloc error");
+      return NULL;
+   }
+   int size = recv(socket, answer, BUF - 1, 0);
+   if (size == -1)
+   {
+      perror("recv error");
+      free(answer);
+      return NULL;
+   }
+   else if (size == 0)
+   {
+      printf("Server closed remote socket\n"); // ignore error
+      free(answer);
+      return NULL;
+   }
+   answer[size] = '\0';
+   return answer;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // reads lines from stdin until a line with only a . and stores them in request,
+   // the newline after the . is left out like the server expects it
+   // returns 0 if stdin ended before a request was entered
+int readRequest(std::string& request)
+{
+   char line[BUF];
+   request.clear();
+   while (fgets(line, sizeof(line), stdin) != NULL)
+   {
+      int lineStart = request.empty() || request[request.length() - 1] == '\n';
+      request += line;
+      if (lineStart && (strcmp(line, ".\n") == 0 || strcmp(line, ".") == 0))
+      {
+         if (request[request.length() - 1] == '\n')
+         {
+            request.resize(request.length() - 1);
+         }
+         return 1;
+      }
+   }
+   return !request.empty();
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // sends the requests and prints their answers, READALL is expanded on the way
+   // returns -1 if the connection is gone
+int runRequests(int socket, int framed, const std::vector<std::string>& requests)
+{
+   std::vector<std::string> pending;
+   for (size_t i = 0; i < requests.size(); ++i)
+   {
+      if (requests[i] != READ_ALL)
+      {
+         pending.push_back(requests[i]);
+         continue;
+      }
+      if (pipelineRequests(socket, framed, pending) == -1 || readAll(socket, framed) == -1)
+      {
+         return -1;
+      }
+      pending.clear();
+   }
+   return pipelineRequests(socket, framed, pending);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // keeps up to PIPELINE_DEPTH requests and PIPELINE_BYTES on their way, the
+   // server answers in order, so the next answer always belongs to the oldest
+   // request
+   // old servers read one record at a time and are sent one request at a time,
+   // their records don't reliably arrive one per recv
+   // returns -1 if the connection is gone (also after quit, which has no answer)
+int pipelineRequests(int socket, int framed, const std::vector<std::string>& requests)
+{
+   size_t depth = framed ? PIPELINE_DEPTH : 1;
+   size_t sent = 0;
+   size_t answered = 0;
+   size_t bytes = 0;
+
+   while (answered < requests.size())
+   {
+      while (sent < requests.size() && sent - answered < depth &&
+             (sent == answered || bytes + requests[sent].length() <= PIPELINE_BYTES))
+      {
+         ///////////////////////////////////////////////////////////////////////////////
+         // in case the server is gone offline we will still not enter
+         // this part of code: see docs: https://linux.die.net/man/3/send
+         // >> Successful completion of a call to send() does not guarantee 
+         // >> delivery of the message. A return value of -1 indicates only 
+         // >> locally-detected errors.
+         // ... but
+         // to check the connection before send is sense-less because
+         // after checking the communication can fail (so we would need
+         // to have 1 atomic operation to check...)
+         if (sendRequest(socket, framed, requests[sent].c_str(), requests[sent].length()) == -1)
+         {
+            perror("send error");
+            return -1;
+         }
+         bytes += requests[sent].length();
+         ++sent;
+      }
+
+      char *answer = receiveAnswer(socket, framed);
+      if (answer == NULL)
+      {
+         return -1;
+      }
+      printf("<< %s\n", answer); // ignore error
+      free(answer);
+      bytes -= requests[answered].length();
+      ++answered;
+   }
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // LIST answers with a line per message, "<number>: <subject>", after the
+   // line with the count, every one of them becomes a READ
+   // returns -1 if the connection is gone
+int readAll(int socket, int framed)
+{
+   std::vector<std::string> reads;
+   std::string list = "LIST\n.";
+
+   if (sendRequest(socket, framed, list.c_str(), list.length()) == -1)
+   {
+      perror("send error");
+      return -1;
+   }
+   char *answer = receiveAnswer(socket, framed);
+   if (answer == NULL)
+   {
+      return -1;
+   }
+   printf("<< %s\n", answer); // ignore error
+
+   char *line = strchr(answer, '\n');
+   while (line != NULL)
+   {
+      char *end;
+      ++line;
+      long number = strtol(line, &end, 10);
+      if (end != line && *end == ':')
+      {
+         reads.push_back("READ\n" + std::to_string(number) + "\n.");
+      }
+      line = strchr(line, '\n');
+   }
+   free(answer);
+   return pipelineRequests(socket, framed, reads);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the token file has one line per server and uid:
+   //    <server> <uid> <token>
+   // returns the token for uid on server, empty if there is none
+std::string loadToken(const char* path, const char* server, const char* uid)
+{
+   FILE* file = fopen(path, "r");
+   char line[512];
+   std::string token;
+
+   if (file == NULL)
+   {
+      return token;
+   }
+   while (fgets(line, sizeof(line), file) != NULL)
+   {
+      char lineServer[128], lineUid[128], lineToken[TOKEN_MAX];
+      if (sscanf(line, "%127s %127s %255s", lineServer, lineUid, lineToken) == 3 &&
+          strcmp(lineServer, server) == 0 && strcmp(lineUid, uid) == 0)
+      {
+         token = lineToken;
+         break;
+      }
+   }
+   fclose(file);
+   return token;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // replaces the token for uid on server, NULL removes it
+   // the file is written next to the old one and renamed over it, readable
+   // only by the user because a token is as good as the password until it
+   // expires
+void storeToken(const char* path, const char* server, const char* uid, const char* token)
+{
+   std::vector<std::string> lines;
+   char line[512];
+
+   FILE* file = fopen(path, "r");
+   if (file != NULL)
+   {
+      while (fgets(line, sizeof(line), file) != NULL)
+      {
+         char lineServer[128], lineUid[128];
+         if (sscanf(line, "%127s %127s", lineServer, lineUid) == 2 &&
+             !(strcmp(lineServer, server) == 0 && strcmp(lineUid, uid) == 0))
+         {
+            lines.push_back(line);
+         }
+      }
+      fclose(file);
+   }
+   if (token != NULL)
+   {
+      lines.push_back(std::string(server) + " " + uid + " " + token + "\n");
+   }
+
+   std::string temporary = std::string(path) + ".tmp";
+   int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+   if (fd == -1 || (file = fdopen(fd, "w")) == NULL)
+   {
+      perror("open token file");
+      if (fd != -1)
+      {
+         close(fd);
+      }
+      return;
+   }
+   for (size_t i = 0; i < lines.size(); ++i)
+   {
+      fputs(lines[i].c_str(), file);
+   }
+   if (fclose(file) != 0 || rename(temporary.c_str(), path) == -1)
+   {
+      perror("write token file");
+      unlink(temporary.c_str());
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 if the server took the token, 0 if not and -1 if the
+   // connection is gone
+int tokenLogin(int socket, const char* token)
+{
+   std::string record = std::string(TOKEN_PREFIX) + token;
+   if (sendRequest(socket, 1, record.c_str(), record.length()) == -1)
+   {
+      perror("send error");
+      return -1;
+   }
+   char *answer = receiveAnswer(socket, 1);
+   if (answer == NULL)
+   {
+      return -1;
+   }
+   printf("<< %s\n", answer); // ignore error
+   int resumed = strcmp(answer, "LOGINOK") == 0;
+   free(answer);
+   return resumed;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // asks for a token after a login with the password and keeps it for the
+   // next connection, a server with tokens turned off answers with an error
+void fetchToken(int socket, const char* path, const char* server, const char* uid)
+{
+   const char request[] = "TOKEN\n.";
+   if (sendRequest(socket, 1, request, strlen(request)) == -1)
+   {
+      perror("send error");
+      return;
+   }
+   char *answer = receiveAnswer(socket, 1);
+   if (answer == NULL)
+   {
+      return;
+   }
+   char token[TOKEN_MAX];
+   if (sscanf(answer, "OK\n%255s", token) == 1)
+   {
+      storeToken(path, server, uid, token);
+   }
+   free(answer);
+}
@@ -1,18 +1,45 @@
+#define _GNU_SOURCE // accept4, sched_setaffinity
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
 #include <dirent.h>
-#include <ldap.h>
-#include <lber.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <limits.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "ldappool.h"
+#include "uidcache.h"
+#include "authprovider.h"
+#include "ldapasync.h"
+#include "sessiontoken.h"
+#include "loginlimit.h"
+#include "framing.h"
+#include "mailstore.h"
+#include "mailcache.h"
+#include "mailcompress.h"
+#include "parser.h"
+#include "acceptqueue.h"
+#include "output.h"
+#include "metrics.h"
+#include "logging.h"
 
 ///////////////////////////////////////////////////////////////////////////////
    ///////////////////////////////////////////////////////////////////////////////
@@ -29,66 +56,617 @@
 
 ///////////////////////////////////////////////////////////////////////////////
    ///////////////////////////////////////////////////////////////////////////////
-   // enum to distinguish the type of request in a switch
-   // none is only used to first initialize the type before we have parsed the request
-enum command{
-   none,
-   sendMessage,
-   listMessages,
-   readMessage,
-   deleteMessage,
-   quit
+   // every connection is a small state machine instead of a blocking sequence
+   // of recv and send calls: first the uid is expected, then the password and
+   // after a successful login the commands, until the client quits
+enum sessionState{
+   awaitingUid,
+   awaitingPassword,
+   loggedIn,
+   closing
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+#define BUF 1024
+#define PORT 6543
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // old clients send every uid, password and request as a record of BUF - 1 bytes
+   // and expect the answers the same way, so such a request is complete as soon as
+   // RECORD bytes have arrived, no matter how many recv calls that took
+#define RECORD (BUF - 1)
+
    ///////////////////////////////////////////////////////////////////////////////
-   // inOrOut must be "/in/" or "/out/"
-   // depending if the message should be persisted in the inbox of receiver or the outbox of sender
-   // saveMail returns 1 on success and 0 on failure
-int saveMail(char* user, char* sender, char* subject, char* message, char* inOrOut);
+   // BODY_TAIL: bytes of a streamed body held back, the terminating "\n." and
+   // line endings after it must not end up in the mail
+   // the longest request a framing client may send is PARSER_MAX_MESSAGE (see
+   // parser.h), the body of a SEND doesn't count because it is streamed to the
+   // mailbox (see sessionStream)
+#define BODY_TAIL 8
 
-void listMail(char* username);
-void readMail(char* username, int msgnumber);
-void deleteMail(char* username, int msgnumber);
+   ///////////////////////////////////////////////////////////////////////////////
+   // a message up to this long is handed to the storage backend from memory,
+   // a longer one is spooled to a temporary file while it arrives
+#define DELIVERY_MEMORY (16 * BUF)
 
    ///////////////////////////////////////////////////////////////////////////////
-   // errorhandling is a switch(errno),
-   // those errnos that might be set by the called functions according to the man pages are handled
-   // the function sets the response to "ERR" and the respective error message
-void errorHandling(int error);
+   // receivers a single SEND may have, separated by commas in the receiver line
+#define MAX_RECIPIENTS 256
+
+#define WORKERS 4
+#define MAX_EVENTS 64
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // connections the kernel queues for a listener before it drops new ones
+   // (it is capped at net.core.somaxconn), and how many of them the event loop
+   // takes with one round of accept4 calls before it polls again
+#define LISTEN_BACKLOG 1024
+#define ACCEPT_BATCH 64
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // how long a thread of the pool waits in recv before it checks abortRequested
+#define ABORT_CHECK_SECONDS 1
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // --fork: children that may serve clients at the same time and seconds a
+   // child may serve its client, 0 is no limit
+#define MAX_CHILDREN 256
+#define CHILD_LIFETIME 0
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // everything that used to live on the stack of clientCommunication (and the
+   // global response) is kept per connection, so a worker can put a session
+   // aside when the socket would block and pick it up again on the next event
+   // in holds what was received but not parsed yet, parser takes the requests
+   // out of it (see parser.h), a request that can't be handed out in place is
+   // assembled in the message of the parser
+   // response holds the answer that is being sent (see output.h), preceded by
+   // frameHeader for framing clients and followed by outLength - its length
+   // zero bytes that pad the record of an old client, outSent counts how much
+   // of all of them already went out, corked is set while the last of it went
+   // out with MSG_MORE (see sessionPush)
+   // while a SEND is streamed, sending is set and delivery is the file the body
+   // goes to (NULL if the body is thrown away because the SEND failed already)
+   // the answer of a READ is followed by the message itself, which is sent from
+   // outFile from outFileOffset up to outFileEnd (a segment holds more than one
+   // message), outFileOffset moves on as it goes out
+   // in durable mode commit collects the files a SEND wrote, while committing is
+   // set the answer is held back until the group commit is through
+   // while authenticating is set a worker waits for the directory to answer
+   // a login or the receivers of a SEND (see struct authCheck), a complete
+   // request stays in the parser as held until then
+   // the committer and the directory thread hand the session back to its
+   // worker through nextReturned
+   // requestStarted is when the request being answered was complete (0 while
+   // there is none), its latency counts for requestMetric once the answer is out
+struct session{
+   int socket;
+   enum sessionState state;
+   struct sockaddr_in address;
+   char rawuid[128];
+   char pwd[256];
+   struct ring in;
+   struct parser parser;
+   unsigned char frameHeader[FRAME_HEADER];
+   int outHeaderLength;
+   struct output response;
+   int outLength;
+   int outSent;
+   int corked;
+   int sending;
+   long bodyLength;
+   struct delivery* delivery;
+   int outFile;
+   off_t outFileOffset;
+   off_t outFileEnd;
+   struct commitRequest* commit;
+   int committing;
+   struct authCheck* check;
+   int authenticating;
+   struct view held;
+   struct worker* worker;
+   struct session* nextReturned;
+   uint64_t requestStarted;
+   enum metric requestMetric;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // one receiver of a SEND, status is empty as long as nothing went wrong for
+   // it, otherwise the error it gets in the answer
+struct recipient{
+   char name[128];
+   char status[64];
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // what a worker asks the auth provider without waiting for the answer:
+   // the login of the session or the receivers of a SEND, which are parsed
+   // into recipients, uids are the names that still need an answer and
+   // asked[j] is the recipient of uids[j]
+   // ready is set once the statuses of the recipients are known, deliveryBegin
+   // takes them from here then
+   // allocated the first time a session of the event loop needs it, the
+   // blocking servers ask the provider directly
+struct authCheck{
+   struct authRequest request;
+   struct recipient* recipients;
+   int count;
+   const char* uids[MAX_RECIPIENTS];
+   int asked[MAX_RECIPIENTS];
+   int exists[MAX_RECIPIENTS];
+   int unknown;
+   int ready;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a message on its way into the mailboxes of its recipients: it is collected
+   // in buffer, or in the file path (fd) in the tmp directory of the sender once
+   // it gets long, and only stored when it is complete, so LIST and READ never
+   // see half a message
+   // failed remembers the errno of the first write that went wrong, hash is
+   // updated with every write so the body store doesn't have to read it again
+struct delivery{
+   char* buffer;
+   int fd;
+   char path[PATH_MAX];
+   struct recipient* recipients;
+   int recipientCount;
+   char sender[128];
+   char subject[256];
+   off_t length;
+   int failed;
+   uint64_t hash;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // each worker thread owns an epoll instance, the main thread accepts the
+   // connections and hands them to the workers round robin
+   // sessions whose group commit is through or whose auth check is answered
+   // are pushed to returned by the committer or the directory thread, which
+   // then wakes the worker up with returnedEvent
+struct worker{
+   pthread_t thread;
+   int epollFd;
+   int returnedEvent;
+   pthread_mutex_t returnedLock;
+   struct session* returned;
+};
 
-int ldapCredentials(char* fulluid, char* searchedUid, char* pwd);
 ///////////////////////////////////////////////////////////////////////////////
 
-#define BUF 1024
-#define PORT 6543
+   ///////////////////////////////////////////////////////////////////////////////
+   // a message is saved in pieces: deliveryBegin starts it for a list of
+   // receivers, deliveryWrite appends to it as often as needed and
+   // deliveryCommit hands it to the storage backend (see mailstore.h) for the
+   // inboxes of the receivers and the outbox of the sender, deliveryAbort
+   // throws it away
+   // deliveryBegin takes the receivers from check if it is ready (the receivers
+   // of the event loop are looked up before), otherwise it looks them up itself
+   // deliveryBegin returns 1 if at least one receiver can get the message,
+   // deliveryCommit returns the number of receivers that got it, both write
+   // the answer with the status of every receiver that failed (deliveryReport)
+   // all storage functions write their answer to the response of the calling session
+int createMailbox(char* user);
+int validName(char* name);
+int deliveryBegin(struct output* response, struct delivery* delivery, struct view receivers, char* sender, struct view subject, struct authCheck* check);
+void deliveryWrite(struct delivery* delivery, const char* data, int length);
+void deliveryWriteFile(struct delivery* delivery, const char* data, int length);
+int deliveryCommit(struct output* response, struct delivery* delivery, struct commitRequest* commit);
+int deliveryStore(struct output* response, struct delivery* delivery, struct commitRequest* commit);
+void deliveryAbort(struct delivery* delivery);
+void deliveryReport(struct output* response, struct delivery* delivery, int delivered);
+
+void listMail(struct output* response, char* username);
+int listVisitor(int number, const struct mailEntry* entry, void* data);
+int openMail(struct output* response, char* username, int msgnumber, off_t* offset, off_t* end);
+void deleteMail(struct output* response, char* username, int msgnumber);
+void statsReport(struct output* response);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // errorhandling is a switch(errno),
+   // those errnos that might be set by the called functions according to the man pages are handled
+   // errorText returns "ERR" and the respective error message, errorHandling
+   // sets the response to it
+const char* errorText(int error);
+void errorHandling(struct output* response, int error);
 
 ///////////////////////////////////////////////////////////////////////////////
 
-int abortRequested = 0;
+   ///////////////////////////////////////////////////////////////////////////////
+   // abortRequested is set by the signal handler and read by every thread
+   // new_socket is the connection of a forked child, the signal handler closes
+   // it, the threads keep theirs to themselves
+volatile sig_atomic_t abortRequested = 0;
 int create_socket = -1;
 int new_socket = -1;
 
    ///////////////////////////////////////////////////////////////////////////////
-   // globally scoped char array to set the response to the client
-   // either OK or ERR and additional information
-   // depending on the type of request that is being
-   // responded to
-char response[BUF];
+   // forked children, counted by runForking and childHandler
+volatile sig_atomic_t activeChildren = 0;
+volatile sig_atomic_t forkedChildren = 0;
+volatile sig_atomic_t reapedChildren = 0;
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // eventfd that wakes up all workers when the server shuts down
+int shutdownEvent = -1;
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // --durable: SEND is only answered once the message is synced to disk
+int durable = 0;
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // checks logins and receivers, put together in main (see authprovider.h)
+struct authProvider* authProvider = NULL;
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the directory thread of the event loop (see ldapasync.h) binds over as
+   // many connections as the ldap pool has and gives up on a request after
+   // directoryTimeout milliseconds
+int directoryConnections = LDAP_POOL_SIZE;
+int directoryTimeout = LDAP_REQUEST_TIMEOUT;
 
 ///////////////////////////////////////////////////////////////////////////////
 
+void printUsage();
+int parseLimit(const char* text, int* rate, int* burst);
+int createListener(int backlog);
+void printStats();
+int runEventLoop(int workerCount);
+int workerStart(struct worker* worker);
+void workerAdd(struct worker* worker, int clientSocket, struct sockaddr_in* address);
+int runPrefork(int listenerCount, int workerCount, int backlog, int pinning);
+void pinToCpu(int number);
+int runForking(int maxChildren, int childLifetime);
+int runThreadPool(int threadCount);
+void *workerLoop(void *data);
+void *poolLoop(void *data);
+void workerReturned(struct worker* worker);
+
+void sessionInit(struct session* session, int socket, struct sockaddr_in* address);
+void sessionEvent(struct session* session);
+int sessionProcess(struct session* session);
+int sessionReceive(struct session* session);
+void sessionStream(struct session* session);
+int sessionStartSend(struct session* session);
+void sessionStreamBody(struct session* session);
+void sessionFinishSend(struct session* session);
+void sessionCommit(struct session* session);
+void sessionCommitted(struct commitRequest* request);
+void sessionReturn(struct session* session);
+struct authCheck* sessionCheck(struct session* session);
+int sessionCheckReceivers(struct session* session, struct view receivers);
+void sessionAnswered(struct authRequest* request);
+void sessionResume(struct session* session);
+void sessionLogin(struct session* session, int loginSuccess);
+void sessionTime(struct session* session, enum metric metric);
+void checkAnswered(struct authCheck* check);
+void checkRelease(struct authCheck* check);
+int sessionFlush(struct session* session);
+void sessionPush(struct session* session);
+void sessionReply(struct session* session);
+void sessionFree(struct session* session);
+void sessionClose(struct session* session);
+void handleRecord(struct session* session, struct view record);
+void handleCommand(struct session* session, struct view message);
+int parseRecipients(struct view line, struct recipient** recipients);
+int recipientsValid(struct recipient* recipients, int count);
+int recipientsUnknown(struct recipient* recipients, int count, const char** uids, int* asked);
+int recipientsMark(struct recipient* recipients, int count, const int* asked, int unknown, int answered, const int* exists);
+
 void *clientCommunication(void *data);
 void signalHandler(int sig);
+void childHandler(int sig);
+void recycleHandler(int sig);
 
 ///////////////////////////////////////////////////////////////////////////////
 
-int main(void)
+int main(int argc, char **argv)
 {
-   socklen_t addrlen;
-   struct sockaddr_in address, cliaddress;
-   int reuseValue = 1;
+   int forking = 0;
+   int workerCount = WORKERS;
+   int threadCount = 0;
+   int preforkCount = 0;
+   int backlog = LISTEN_BACKLOG;
+   int pinning = 0;
+   int maxChildren = MAX_CHILDREN;
+   int childLifetime = CHILD_LIFETIME;
+   int option;
+   int result;
+   int uidCacheSize = UID_CACHE_SIZE;
+   int uidCacheTtl = UID_CACHE_TTL;
+   const char* authFile = NULL;
+   int authFallback = 0;
+   const char* ldapUri = NULL;
+   const char* ldapBase = NULL;
+   int tokenLifetime = TOKEN_LIFETIME;
+   int uidRate = LOGIN_UID_RATE;
+   int uidBurst = LOGIN_UID_BURST;
+   int addressRate = LOGIN_ADDRESS_RATE;
+   int addressBurst = LOGIN_ADDRESS_BURST;
+   int metricsPort = 0;
+   int mailboxCacheSize = MAIL_CACHE_SIZE;
+   int compressionLevel = 0;
+   const char* compressionDictionary = NULL;
+
+   ////////////////////////////////////////////////////////////////////////////
+   // parse options with getopt
+   // by default all clients are served by a few event driven worker threads,
+   // --fork brings back the old process per client, --threads serves each
+   // client the same blocking way from a pool of threads, --prefork runs the
+   // event loop in several processes with a listener of their own
+   struct option longOptions[] = {
+      {"fork", no_argument, NULL, 'f'},
+      {"threads", required_argument, NULL, 't'},
+      {"workers", required_argument, NULL, 'w'},
+      {"ldap-pool", required_argument, NULL, 'l'},
+      {"uid-cache-size", required_argument, NULL, 'C'},
+      {"uid-cache-ttl", required_argument, NULL, 'T'},
+      {"store", required_argument, NULL, 's'},
+      {"compact-interval", required_argument, NULL, 'c'},
+      {"durable", no_argument, NULL, 'D'},
+      {"commit-window", required_argument, NULL, 'W'},
+      {"prefork", required_argument, NULL, 'P'},
+      {"backlog", required_argument, NULL, 'b'},
+      {"pin-cpus", no_argument, NULL, 'p'},
+      {"max-children", required_argument, NULL, 'm'},
+      {"child-lifetime", required_argument, NULL, 'L'},
+      {"auth-file", required_argument, NULL, 'A'},
+      {"auth-fallback", no_argument, NULL, 'F'},
+      {"ldap-uri", required_argument, NULL, 'U'},
+      {"ldap-base", required_argument, NULL, 'B'},
+      {"ldap-timeout", required_argument, NULL, 'o'},
+      {"token-lifetime", required_argument, NULL, 'k'},
+      {"login-limit", required_argument, NULL, 'r'},
+      {"address-limit", required_argument, NULL, 'R'},
+      {"metrics-port", required_argument, NULL, 'M'},
+      {"log-level", required_argument, NULL, 'v'},
+      {"mailbox-cache", required_argument, NULL, 'S'},
+      {"compress", required_argument, NULL, 'z'},
+      {"compress-dictionary", required_argument, NULL, 'Z'},
+      {NULL, 0, NULL, 0}
+   };
+   while ((option = getopt_long(argc, argv, "ft:w:l:C:T:s:c:DW:P:b:pm:L:A:FU:B:o:k:r:R:M:v:S:z:Z:", longOptions, NULL)) != -1)
+   {
+      switch (option)
+      {
+         case 'f':
+            forking = 1;
+            break;
+         case 't':
+            threadCount = atoi(optarg);
+            if (threadCount < 1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'w':
+            workerCount = atoi(optarg);
+            if (workerCount < 1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'l':
+            if (atoi(optarg) < 1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            ldapPoolSetSize(atoi(optarg));
+            directoryConnections = atoi(optarg);
+            break;
+         case 'C':
+            uidCacheSize = atoi(optarg);
+            break;
+         case 'T':
+            uidCacheTtl = atoi(optarg);
+            break;
+         case 's':
+            if (mailStoreUse(optarg) == -1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'c':
+            mailStoreCompactEvery(atoi(optarg));
+            break;
+         case 'D':
+            durable = 1;
+            break;
+         case 'W':
+            if (atoi(optarg) < 0)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            groupCommitConfigure(atoi(optarg));
+            break;
+         case 'P':
+            preforkCount = atoi(optarg);
+            if (preforkCount < 1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'b':
+            backlog = atoi(optarg);
+            if (backlog < 1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'p':
+            pinning = 1;
+            break;
+         case 'm':
+            maxChildren = atoi(optarg);
+            if (maxChildren < 1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'L':
+            childLifetime = atoi(optarg);
+            if (childLifetime < 0)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'A':
+            authFile = optarg;
+            break;
+         case 'F':
+            authFallback = 1;
+            break;
+         case 'U':
+            ldapUri = optarg;
+            break;
+         case 'B':
+            ldapBase = optarg;
+            break;
+         case 'o':
+            directoryTimeout = atoi(optarg);
+            if (directoryTimeout < 1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'k':
+            tokenLifetime = atoi(optarg);
+            if (tokenLifetime < 0)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'r':
+            if (parseLimit(optarg, &uidRate, &uidBurst) == -1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'R':
+            if (parseLimit(optarg, &addressRate, &addressBurst) == -1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'M':
+            metricsPort = atoi(optarg);
+            if (metricsPort < 1 || metricsPort > 65535)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'v':
+            if (logParseLevel(optarg) == -1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            logLevel = logParseLevel(optarg);
+            break;
+         case 'S':
+            mailboxCacheSize = atoi(optarg);
+            if (mailboxCacheSize < 0)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'z':
+            compressionLevel = atoi(optarg);
+            if (compressionLevel < 0 || compressionLevel > MAIL_COMPRESS_LEVEL_MAX)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'Z':
+            compressionDictionary = optarg;
+            break;
+         default:
+            printUsage();
+            return EXIT_FAILURE;
+      }
+   }
+
+   if (preforkCount > 0 && (forking || threadCount > 0))
+   {
+      printUsage();
+      return EXIT_FAILURE;
+   }
+   if (authFallback && authFile == NULL)
+   {
+      printUsage();
+      return EXIT_FAILURE;
+   }
+   if (compressionDictionary != NULL && compressionLevel == 0)
+   {
+      printUsage();
+      return EXIT_FAILURE;
+   }
+   uidCacheConfigure(uidCacheSize, uidCacheTtl);
+   ldapPoolSetDirectory(ldapUri, ldapBase);
+   ldapPoolSetTimeout(directoryTimeout);
+   if (tokenInit(tokenLifetime) == -1)
+   {
+      return EXIT_FAILURE;
+   }
+   if (loginLimitInit(uidRate, uidBurst, addressRate, addressBurst) == -1)
+   {
+      return EXIT_FAILURE;
+   }
+   if (mailCacheInit(mailboxCacheSize) == -1)
+   {
+      return EXIT_FAILURE;
+   }
+   if (mailCompressInit(SPOOL, compressionLevel, compressionDictionary) == -1)
+   {
+      return EXIT_FAILURE;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // the metrics are only counted if somebody can ask for them
+   if (metricsPort > 0 && (metricsInit() == -1 || metricsServe(metricsPort) == -1))
+   {
+      return EXIT_FAILURE;
+   }
+   logStart();
+
+   ////////////////////////////////////////////////////////////////////////////
+   // the directory is asked through the uid cache, with --auth-file users are
+   // looked up in the file instead, --auth-fallback asks the directory for
+   // the users the file doesn't list
+   struct authProvider* directory = authLdapProvider();
+   if (uidCacheTtl > 0)
+   {
+      directory = authCacheProvider(directory);
+   }
+   authProvider = directory;
+   if (authFile != NULL)
+   {
+      authProvider = authFileProvider(authFile, authFallback ? directory : NULL);
+      if (authProvider == NULL)
+      {
+         return EXIT_FAILURE;
+      }
+   }
+   char authChain[128];
+   authDescribe(authProvider, authChain, sizeof(authChain));
+   printf("auth: %s\n", authChain);
 
    ////////////////////////////////////////////////////////////////////////////
    // SIGNAL HANDLER
@@ -100,16 +678,174 @@ int main(void)
       return EXIT_FAILURE;
    }
 
+   ////////////////////////////////////////////////////////////////////////////
+   // sendfile has no MSG_NOSIGNAL, a client that goes away in the middle of
+   // a READ must not kill the whole server
+   if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+   {
+      perror("signal can not be ignored");
+      return EXIT_FAILURE;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // with --prefork every process gets a listener of its own, see runPrefork
+   if (preforkCount == 0 && (create_socket = createListener(backlog)) == -1)
+   {
+      return EXIT_FAILURE;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // background work of the storage backend (compaction), it runs in this
+   // process only, forked children just store their messages
+   if (mailStoreStart() == -1)
+   {
+      perror("mail store can not be started");
+      return EXIT_FAILURE;
+   }
+
+   if (preforkCount > 0)
+   {
+      result = runPrefork(preforkCount, workerCount, backlog, pinning);
+   }
+   else if (forking)
+   {
+      result = runForking(maxChildren, childLifetime);
+   }
+   else if (threadCount > 0)
+   {
+      result = runThreadPool(threadCount);
+   }
+   else
+   {
+      result = runEventLoop(workerCount);
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // frees the descriptor
+   if (create_socket != -1)
+   {
+      if (shutdown(create_socket, SHUT_RDWR) == -1)
+      {
+         perror("shutdown create_socket");
+      }
+      if (close(create_socket) == -1)
+      {
+         perror("close create_socket");
+      }
+      create_socket = -1;
+   }
+   
+   // wait for all child (the prefork listeners, runForking waits for its own)
+   while(wait(NULL) > 0);
+
+   metricsStop();
+   groupCommitStop();
+   mailStoreStop();
+   ldapPoolDestroy();
+   logStop();
+   printStats();
+   
+   return result;
+}
+
+void printUsage()
+{
+   printf("Usage: ./myserver [-f|--fork [-m|--max-children <count>] [-L|--child-lifetime <seconds>]]\n");
+   printf("                  [-t|--threads <count>] [-w|--workers <count>] [-l|--ldap-pool <size>]\n");
+   printf("                  [-C|--uid-cache-size <count>] [-T|--uid-cache-ttl <seconds>]\n");
+   printf("                  [-s|--store maildir|segment] [-c|--compact-interval <seconds>]\n");
+   printf("                  [-D|--durable] [-W|--commit-window <microseconds>]\n");
+   printf("                  [-P|--prefork <count> [-p|--pin-cpus]] [-b|--backlog <count>]\n");
+   printf("                  [-A|--auth-file <path> [-F|--auth-fallback]]\n");
+   printf("                  [-U|--ldap-uri <uri>] [-B|--ldap-base <dn>] [-o|--ldap-timeout <milliseconds>]\n");
+   printf("                  [-k|--token-lifetime <seconds>]\n");
+   printf("                  [-r|--login-limit <rate>[/<burst>]] [-R|--address-limit <rate>[/<burst>]]\n");
+   printf("                  [-M|--metrics-port <port>] [-v|--log-level error|info|debug]\n");
+   printf("                  [-S|--mailbox-cache <count>] [-z|--compress <level> [-Z|--compress-dictionary <path>]]\n");
+   printf("  -f, --fork       fork one process per client instead of using worker threads\n");
+   printf("  -m, --max-children    clients served by forked children at the same time (default %d)\n", MAX_CHILDREN);
+   printf("  -L, --child-lifetime  seconds a forked child may serve its client, 0 is no limit (default %d)\n", CHILD_LIFETIME);
+   printf("  -t, --threads    serve every client from a pool of count threads, one client per thread\n");
+   printf("  -w, --workers    number of event loop worker threads (default %d)\n", WORKERS);
+   printf("  -l, --ldap-pool  ldap connections kept open for searches and for logins (default %d)\n", LDAP_POOL_SIZE);
+   printf("  -C, --uid-cache-size  receivers remembered by the uid cache (default %d)\n", UID_CACHE_SIZE);
+   printf("  -T, --uid-cache-ttl   seconds a receiver lookup is remembered, 0 turns the cache off (default %d)\n", UID_CACHE_TTL);
+   printf("  -s, --store      storage backend, maildir (one file per message) or segment (append only log)\n");
+   printf("                   (default %s)\n", MAIL_STORE);
+   printf("  -c, --compact-interval  seconds between compactions of the segment backend, 0 turns it off (default %d)\n", MAIL_COMPACT_INTERVAL);
+   printf("  -D, --durable    answer SEND only after the message is synced to disk, SENDs that arrive\n");
+   printf("                   together share one sync per file\n");
+   printf("  -W, --commit-window  microseconds a group commit waits for more SENDs (default %d)\n", COMMIT_WINDOW);
+   printf("  -P, --prefork    run the event loop in count processes, each with its own listener on the port\n");
+   printf("  -p, --pin-cpus   pin every prefork process to a cpu of its own\n");
+   printf("  -b, --backlog    connections the kernel queues for a listener (default %d)\n", LISTEN_BACKLOG);
+   printf("  -A, --auth-file  check logins and receivers against a file of \"<uid> <password>\" lines\n");
+   printf("                   instead of the directory, for benchmarks, tests and offline servers\n");
+   printf("  -F, --auth-fallback   ask the directory for users the auth file doesn't list\n");
+   printf("  -U, --ldap-uri   the directory (default %s)\n", LDAP_URI);
+   printf("  -B, --ldap-base  where users are searched, logins bind as uid=<uid>,ou=people,<dn>\n");
+   printf("                   (default %s)\n", LDAP_SEARCH_BASE);
+   printf("  -o, --ldap-timeout    milliseconds a login or a receiver lookup may wait for the directory\n");
+   printf("                   before it fails (default %d)\n", LDAP_REQUEST_TIMEOUT);
+   printf("  -k, --token-lifetime  seconds a session token (the TOKEN request) lets a client log in\n");
+   printf("                   again without its password, 0 turns tokens off (default %d)\n", TOKEN_LIFETIME);
+   printf("  -r, --login-limit     password logins per minute and burst per uid, only failed ones and\n");
+   printf("                   the ones still being checked count, 0 turns the limit off (default %d/%d)\n", LOGIN_UID_RATE, LOGIN_UID_BURST);
+   printf("                   a login beyond the limit fails without asking the directory\n");
+   printf("  -R, --address-limit   the same per client address (default %d/%d)\n", LOGIN_ADDRESS_RATE, LOGIN_ADDRESS_BURST);
+   printf("  -M, --metrics-port    serve counters and latency histograms on 127.0.0.1:port/metrics\n");
+   printf("                   (e.g. %d), off by default\n", METRICS_PORT);
+   printf("  -v, --log-level  debug prints every connection and request, info only what happens at\n");
+   printf("                   start and at the end (default info)\n");
+   printf("  -S, --mailbox-cache   mailboxes whose listing LIST keeps in memory, 0 turns the cache off\n");
+   printf("                   (default %d)\n", MAIL_CACHE_SIZE);
+   printf("  -z, --compress   store new messages compressed with zstd at level 1 to %d, READ returns\n", MAIL_COMPRESS_LEVEL_MAX);
+   printf("                   them as they were sent, the STATS request shows the ratio (default 0, off)\n");
+   printf("  -Z, --compress-dictionary  compress with a dictionary trained on typical messages\n");
+   printf("                   (zstd --train <messages> -o <path>), it is kept in the spool\n");
+   printf("searches bind as LDAP_BIND_DN with LDAP_BIND_PW from the environment, anonymous if unset\n");
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // "<rate>" or "<rate>/<burst>", the burst stays what it was without one
+   // returns -1 if text is neither
+int parseLimit(const char* text, int* rate, int* burst)
+{
+   int parsedRate, parsedBurst;
+
+   int count = sscanf(text, "%d/%d", &parsedRate, &parsedBurst);
+   if (count < 1 || parsedRate < 0 || (count == 2 && parsedBurst < 1))
+   {
+      return -1;
+   }
+   *rate = parsedRate;
+   if (count == 2)
+   {
+      *burst = parsedBurst;
+   }
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns a socket that listens on PORT, or -1
+   // SO_REUSEPORT lets several of them listen on the same port, the kernel
+   // spreads the incoming connections over them (see runPrefork)
+int createListener(int backlog)
+{
+   struct sockaddr_in address;
+   int reuseValue = 1;
+   int listener;
+
    ////////////////////////////////////////////////////////////////////////////
    // CREATE A SOCKET
    // https://man7.org/linux/man-pages/man2/socket.2.html
    // https://man7.org/linux/man-pages/man7/ip.7.html
    // https://man7.org/linux/man-pages/man7/tcp.7.html
    // IPv4, TCP (connection oriented), IP (same as client)
-   if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+   if ((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1)
    {
       perror("Socket error"); // errno set by socket()
-      return EXIT_FAILURE;
+      return -1;
    }
 
    ////////////////////////////////////////////////////////////////////////////
@@ -117,24 +853,26 @@ int main(void)
    // https://man7.org/linux/man-pages/man2/setsockopt.2.html
    // https://man7.org/linux/man-pages/man7/socket.7.html
    // socket, level, optname, optvalue, optlen
-   if (setsockopt(create_socket,
+   if (setsockopt(listener,
                   SOL_SOCKET,
                   SO_REUSEADDR,
                   &reuseValue,
                   sizeof(reuseValue)) == -1)
    {
       perror("set socket options - reuseAddr");
-      return EXIT_FAILURE;
+      close(listener);
+      return -1;
    }
 
-   if (setsockopt(create_socket,
+   if (setsockopt(listener,
                   SOL_SOCKET,
                   SO_REUSEPORT,
                   &reuseValue,
                   sizeof(reuseValue)) == -1)
    {
       perror("set socket options - reusePort");
-      return EXIT_FAILURE;
+      close(listener);
+      return -1;
    }
 
    ////////////////////////////////////////////////////////////////////////////
@@ -147,32 +885,547 @@ int main(void)
 
    ////////////////////////////////////////////////////////////////////////////
    // ASSIGN AN ADDRESS WITH PORT TO SOCKET
-   if (bind(create_socket, (struct sockaddr *)&address, sizeof(address)) == -1)
+   if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1)
    {
       perror("bind error");
-      return EXIT_FAILURE;
+      close(listener);
+      return -1;
    }
 
    ////////////////////////////////////////////////////////////////////////////
    // ALLOW CONNECTION ESTABLISHING
    // Socket, Backlog (= count of waiting connections allowed)
-   if (listen(create_socket, 5) == -1)
+   if (listen(listener, backlog) == -1)
    {
       perror("listen error");
+      close(listener);
+      return -1;
+   }
+
+   return listener;
+}
+
+void printStats()
+{
+   unsigned long hits, misses;
+   uidCacheStats(&hits, &misses);
+   printf("uid cache: %lu hits, %lu misses\n", hits, misses);
+   mailCacheStats(&hits, &misses);
+   if (hits + misses > 0)
+   {
+      printf("mailbox cache: %lu hits, %lu misses\n", hits, misses);
+   }
+   unsigned long messages, compressed;
+   unsigned long long sent, stored;
+   mailCompressStats(&messages, &compressed, &sent, &stored);
+   if (messages > 0)
+   {
+      printf("compression: %lu of %lu messages compressed, %llu bytes stored for %llu (ratio %.2f)\n",
+             compressed, messages, stored, sent, stored > 0 ? (double)sent / stored : 1.0);
+   }
+   if (durable)
+   {
+      unsigned long groups, requests, syncs;
+      groupCommitStats(&groups, &requests, &syncs);
+      printf("group commit: %lu groups, %lu sends, %lu syncs\n", groups, requests, syncs);
+   }
+   unsigned long issued, accepted, rejected;
+   tokenStats(&issued, &accepted, &rejected);
+   if (issued + accepted + rejected > 0)
+   {
+      printf("session tokens: %lu issued, %lu logins, %lu rejected\n", issued, accepted, rejected);
+   }
+   unsigned long attempts, blocked;
+   loginLimitStats(&attempts, &blocked);
+   if (blocked > 0)
+   {
+      printf("login limit: %lu of %lu password logins refused\n", blocked, attempts);
+   }
+   unsigned long answered, expired;
+   int peak;
+   ldapAsyncStats(&answered, &expired, &peak);
+   if (answered + expired > 0)
+   {
+      printf("directory: %lu answered, %lu timed out, %d in flight at most\n", answered, expired, peak);
+   }
+}
+
+int runEventLoop(int workerCount)
+{
+   socklen_t addrlen;
+   struct sockaddr_in cliaddress;
+   struct worker workers[workerCount];
+   sigset_t blocked, previous;
+   int next = 0;
+   int clientSocket;
+
+   ////////////////////////////////////////////////////////////////////////////
+   // the shutdown event is added level triggered to every epoll instance,
+   // once it is written all workers see it and return
+   if ((shutdownEvent = eventfd(0, EFD_NONBLOCK)) == -1)
+   {
+      perror("eventfd error");
       return EXIT_FAILURE;
    }
 
-   while (!abortRequested)
+   ////////////////////////////////////////////////////////////////////////////
+   // START WORKERS
+   // SIGINT is blocked while the threads are created so it is always
+   // delivered to the main thread which is the one waiting in accept
+   sigemptyset(&blocked);
+   sigaddset(&blocked, SIGINT);
+   pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+   int started = 0;
+   while (started < workerCount && workerStart(&workers[started]) == 0)
    {
-      /////////////////////////////////////////////////////////////////////////
-      // ignore errors here... because only information message
-      // https://linux.die.net/man/3/printf
-      printf("Waiting for connections...\n");
+      ++started;
+   }
 
-      /////////////////////////////////////////////////////////////////////////
-      // ACCEPTS CONNECTION SETUP
-      // blocking, might have an accept-error on ctrl+c
-      addrlen = sizeof(struct sockaddr_in);
+   ////////////////////////////////////////////////////////////////////////////
+   // the workers hand logins and receiver lookups to the directory thread,
+   // without it they ask the directory themselves and wait for it
+   if (started == workerCount && ldapAsyncStart(directoryConnections, directoryTimeout) == -1)
+   {
+      perror("directory thread can not be started");
+   }
+   pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+   ////////////////////////////////////////////////////////////////////////////
+   // the listener doesn't block, the main thread waits in poll and then
+   // accepts every connection that is queued (up to ACCEPT_BATCH) before it
+   // waits again, so a burst of clients costs one wakeup instead of one each
+   // accept4 makes the sockets non blocking right away, the workers never
+   // block on a client
+   int failed = started < workerCount;
+   if (!failed && fcntl(create_socket, F_SETFL, fcntl(create_socket, F_GETFL) | O_NONBLOCK) == -1)
+   {
+      perror("fcntl error");
+      failed = 1;
+   }
+   int waiting = 1;
+   while (!failed && !abortRequested)
+   {
+      /////////////////////////////////////////////////////////////////////////
+      // ignore errors here... because only information message
+      // https://linux.die.net/man/3/printf
+      if (waiting)
+      {
+         logDebug("Waiting for connections...\n");
+         waiting = 0;
+      }
+
+      /////////////////////////////////////////////////////////////////////////
+      // the timeout catches a SIGINT that arrives right before poll
+      struct pollfd listener = {create_socket, POLLIN, 0};
+      if (poll(&listener, 1, ABORT_CHECK_SECONDS * 1000) == -1 && errno != EINTR)
+      {
+         perror("poll error");
+         break;
+      }
+
+      /////////////////////////////////////////////////////////////////////////
+      // ACCEPTS CONNECTION SETUP
+      // might have an accept-error on ctrl+c
+      clientSocket = -1;
+      for (int i = 0; i < ACCEPT_BATCH; ++i)
+      {
+         addrlen = sizeof(struct sockaddr_in);
+         if ((clientSocket = accept4(create_socket,
+                                     (struct sockaddr *)&cliaddress,
+                                     &addrlen,
+                                     SOCK_NONBLOCK)) == -1)
+         {
+            break;
+         }
+         workerAdd(&workers[next], clientSocket, &cliaddress);
+         next = (next + 1) % workerCount;
+         waiting = 1;
+      }
+      if (clientSocket == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+          errno != EINTR && errno != ECONNABORTED)
+      {
+         if (abortRequested)
+         {
+            perror("accept error after aborted");
+            break;
+         }
+         perror("accept error");
+         if (errno == EBADF || errno == EINVAL)
+         {
+            break;
+         }
+
+         /////////////////////////////////////////////////////////////////////////
+         // out of descriptors or memory, the connection stays queued, give the
+         // workers a moment to close some before trying again
+         struct timespec pause = {0, 10 * 1000 * 1000};
+         nanosleep(&pause, NULL);
+      }
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // STOP WORKERS
+   // sockets of sessions that are still open are closed on exit, if the
+   // setup failed only the workers that were started are stopped
+   uint64_t wakeup = 1;
+   if (write(shutdownEvent, &wakeup, sizeof(wakeup)) == -1)
+   {
+      perror("write shutdown event");
+   }
+   for (int i = 0; i < started; ++i)
+   {
+      pthread_join(workers[i].thread, NULL);
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // commits and directory requests that are still queued call back into the
+   // workers, so their events must stay open until both threads are gone
+   ldapAsyncStop();
+   groupCommitStop();
+   for (int i = 0; i < started; ++i)
+   {
+      close(workers[i].epollFd);
+      close(workers[i].returnedEvent);
+      pthread_mutex_destroy(&workers[i].returnedLock);
+   }
+   close(shutdownEvent);
+   shutdownEvent = -1;
+
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // creates the epoll instance and the returned event of worker and starts
+   // its thread, returns -1 with nothing left open if any of it fails
+int workerStart(struct worker* worker)
+{
+   struct epoll_event event;
+
+   if ((worker->epollFd = epoll_create1(0)) == -1)
+   {
+      perror("epoll_create1 error");
+      return -1;
+   }
+   event.events = EPOLLIN;
+   event.data.ptr = NULL;
+   if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, shutdownEvent, &event) == -1)
+   {
+      perror("epoll_ctl error");
+      close(worker->epollFd);
+      return -1;
+   }
+   if ((worker->returnedEvent = eventfd(0, EFD_NONBLOCK)) == -1)
+   {
+      perror("eventfd error");
+      close(worker->epollFd);
+      return -1;
+   }
+   pthread_mutex_init(&worker->returnedLock, NULL);
+   worker->returned = NULL;
+   event.events = EPOLLIN;
+   event.data.ptr = worker;
+   if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->returnedEvent, &event) == -1 ||
+       pthread_create(&worker->thread, NULL, workerLoop, worker) != 0)
+   {
+      perror("start worker");
+      close(worker->epollFd);
+      close(worker->returnedEvent);
+      pthread_mutex_destroy(&worker->returnedLock);
+      return -1;
+   }
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // HAND OVER TO A WORKER
+   // edge triggered: the worker is only notified when something changes,
+   // so it reads and writes until the socket would block.
+   // the socket is writable right away, so the first event sends the
+   // welcome message. from here on only this worker touches the session
+void workerAdd(struct worker* worker, int clientSocket, struct sockaddr_in* address)
+{
+   struct session *session = malloc(sizeof(struct session));
+   if (session == NULL)
+   {
+      perror("malloc session");
+      close(clientSocket);
+      return;
+   }
+   sessionInit(session, clientSocket, address);
+   logDebug("Client connected from %s:%d...\n",
+            inet_ntoa(address->sin_addr),
+          ntohs(address->sin_port));
+
+   struct epoll_event event;
+   session->worker = worker;
+   event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+   event.data.ptr = session;
+   if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, clientSocket, &event) == -1)
+   {
+      perror("epoll_ctl error");
+      close(clientSocket);
+      sessionFree(session);
+      free(session);
+   }
+}
+
+void *workerLoop(void *data)
+{
+   struct worker *worker = (struct worker *)data;
+   struct epoll_event events[MAX_EVENTS];
+
+   while (1)
+   {
+      int ready = epoll_wait(worker->epollFd, events, MAX_EVENTS, -1);
+      if (ready == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("epoll_wait error");
+         break;
+      }
+      int returned = 0;
+      for (int i = 0; i < ready; ++i)
+      {
+         struct session *session = (struct session *)events[i].data.ptr;
+         if (session == NULL)
+         {
+            // shutdown event
+            return NULL;
+         }
+         if (events[i].data.ptr == worker)
+         {
+            returned = 1;
+            continue;
+         }
+         ///////////////////////////////////////////////////////////////////////////////
+         // the committer still knows a committing session and the directory
+         // thread an authenticating one, it is closed once it comes back and
+         // its answer can't be sent
+         if ((events[i].events & EPOLLERR) && !session->committing && !session->authenticating)
+         {
+            sessionClose(session);
+            continue;
+         }
+         sessionEvent(session);
+      }
+
+      ///////////////////////////////////////////////////////////////////////////////
+      // after the events of the sockets: a returned session may be closed, a
+      // later event of this round would still point to it
+      if (returned)
+      {
+         workerReturned(worker);
+      }
+   }
+   return NULL;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // picks up the sessions whose group commit is through and sends their answer,
+   // a SEND that didn't make it to the disk is answered with the error instead
+   // sessions the directory answered go on with their login or SEND
+void workerReturned(struct worker* worker)
+{
+   uint64_t count;
+   if (read(worker->returnedEvent, &count, sizeof(count)) == -1 && errno != EAGAIN)
+   {
+      perror("read returned event");
+   }
+   pthread_mutex_lock(&worker->returnedLock);
+   struct session* session = worker->returned;
+   worker->returned = NULL;
+   pthread_mutex_unlock(&worker->returnedLock);
+
+   while (session != NULL)
+   {
+      struct session* next = session->nextReturned;
+      if (session->authenticating)
+      {
+         session->authenticating = 0;
+         sessionResume(session);
+         sessionEvent(session);
+         session = next;
+         continue;
+      }
+      session->committing = 0;
+      if (session->commit->error != 0)
+      {
+         errorHandling(&session->response, session->commit->error);
+         sessionReply(session);
+      }
+      groupCommitReset(session->commit);
+      sessionEvent(session);
+      session = next;
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // starts listenerCount processes that each run the event loop on a
+   // listener of their own, all bound to PORT with SO_REUSEPORT, so the kernel
+   // spreads new connections over them instead of queueing them behind one
+   // accept, every process has its own workers, ldap pool and group commit
+   // the listeners are created here, so a port that is taken fails right away
+   // this process only forwards SIGINT to them and compacts the store, main
+   // waits for them to finish
+int runPrefork(int listenerCount, int workerCount, int backlog, int pinning)
+{
+   int listeners[listenerCount];
+   pid_t children[listenerCount];
+   sigset_t blocked, previous;
+
+   for (int i = 0; i < listenerCount; ++i)
+   {
+      if ((listeners[i] = createListener(backlog)) == -1)
+      {
+         while (i-- > 0)
+         {
+            close(listeners[i]);
+         }
+         return EXIT_FAILURE;
+      }
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // SIGINT is blocked until sigsuspend waits for it, so it can't get lost
+   // between the check of abortRequested and the wait
+   sigemptyset(&blocked);
+   sigaddset(&blocked, SIGINT);
+   sigprocmask(SIG_BLOCK, &blocked, &previous);
+   for (int i = 0; i < listenerCount; ++i)
+   {
+      fflush(stdout);
+      children[i] = fork();
+      if (children[i] == 0)
+      {
+         sigprocmask(SIG_SETMASK, &previous, NULL);
+         for (int j = 0; j < listenerCount; ++j)
+         {
+            if (j != i)
+            {
+               close(listeners[j]);
+            }
+         }
+         create_socket = listeners[i];
+         if (pinning)
+         {
+            pinToCpu(i);
+         }
+         logStart();
+         int result = runEventLoop(workerCount);
+         if (create_socket != -1)
+         {
+            close(create_socket);
+            create_socket = -1;
+         }
+         ldapPoolDestroy();
+         logStop();
+         printStats();
+         exit(result);
+      }
+      if (children[i] == -1)
+      {
+         perror("fork error");
+         continue;
+      }
+      printf("listener %d: pid %d\n", i, children[i]);
+   }
+   for (int i = 0; i < listenerCount; ++i)
+   {
+      close(listeners[i]);
+   }
+
+   while (!abortRequested)
+   {
+      sigsuspend(&previous);
+   }
+   sigprocmask(SIG_SETMASK, &previous, NULL);
+   for (int i = 0; i < listenerCount; ++i)
+   {
+      if (children[i] > 0 && kill(children[i], SIGINT) == -1)
+      {
+         perror("kill listener");
+      }
+   }
+   return EXIT_SUCCESS;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the threads started afterwards inherit the affinity
+void pinToCpu(int number)
+{
+   cpu_set_t cpus;
+   long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+   CPU_ZERO(&cpus);
+   CPU_SET(number % (count > 0 ? count : 1), &cpus);
+   if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1)
+   {
+      perror("sched_setaffinity");
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // one process per client, managed: children are reaped by childHandler as
+   // soon as they exit, so no zombies pile up while the server runs
+   // once maxChildren are busy no more connections are accepted, new clients
+   // wait in the backlog of the listener until a child is gone
+   // a child that serves its client for more than childLifetime seconds (0 is
+   // no limit) finishes the request it is working on and ends the session, so
+   // no child stays around forever
+int runForking(int maxChildren, int childLifetime)
+{
+   socklen_t addrlen;
+   struct sockaddr_in cliaddress;
+   struct sigaction action;
+   sigset_t blocked, previous;
+
+   ////////////////////////////////////////////////////////////////////////////
+   // SA_RESTART: accept and wait go on when a child is reaped meanwhile
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = childHandler;
+   action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+   sigemptyset(&action.sa_mask);
+   if (sigaction(SIGCHLD, &action, NULL) == -1)
+   {
+      perror("sigaction SIGCHLD");
+      return EXIT_FAILURE;
+   }
+   sigemptyset(&blocked);
+   sigaddset(&blocked, SIGCHLD);
+
+   while (!abortRequested)
+   {
+      /////////////////////////////////////////////////////////////////////////
+      // BACKPRESSURE
+      // SIGCHLD is blocked until sigsuspend waits for it, so a child that
+      // exits between the check and the wait can't be missed
+      sigprocmask(SIG_BLOCK, &blocked, &previous);
+      if (activeChildren >= maxChildren)
+      {
+         printf("%d children busy, waiting for one to finish...\n", (int)activeChildren);
+      }
+      while (activeChildren >= maxChildren && !abortRequested)
+      {
+         sigsuspend(&previous);
+      }
+      sigprocmask(SIG_SETMASK, &previous, NULL);
+      if (abortRequested)
+      {
+         break;
+      }
+
+      /////////////////////////////////////////////////////////////////////////
+      // ignore errors here... because only information message
+      // https://linux.die.net/man/3/printf
+      logDebug("Waiting for connections...\n");
+
+      /////////////////////////////////////////////////////////////////////////
+      // ACCEPTS CONNECTION SETUP
+      // blocking, might have an accept-error on ctrl+c
+      addrlen = sizeof(struct sockaddr_in);
       if ((new_socket = accept(create_socket,
                                (struct sockaddr *)&cliaddress,
                                &addrlen)) == -1)
@@ -191,165 +1444,1307 @@ int main(void)
       // FORKEN
       // parent closes new_socket (connectionsocket)
       // child closes create_socket (listeningsocket)
-      // parent must wait at some point
-      // NEED : Lock File Description For The Synchronization
+      // SIGCHLD stays blocked until the child is counted, or it could be
+      // reaped before it was counted
+      sigprocmask(SIG_BLOCK, &blocked, &previous);
+      fflush(stdout);
       pid_t pid = fork();
       switch (pid)
       {
          case 0:
+         {
             // child. do stuff
+            sigprocmask(SIG_SETMASK, &previous, NULL);
+            signal(SIGCHLD, SIG_DFL);
             close(create_socket);
+            create_socket = -1;
+            if (childLifetime > 0)
+            {
+               ///////////////////////////////////////////////////////////////////////////////
+               // no SA_RESTART, a recv that is waiting for the client returns
+               memset(&action, 0, sizeof(action));
+               action.sa_handler = recycleHandler;
+               sigemptyset(&action.sa_mask);
+               sigaction(SIGALRM, &action, NULL);
+               alarm(childLifetime);
+            }
             /////////////////////////////////////////////////////////////////////////
             // START CLIENT
             // ignore printf error handling
-            printf("Client connected from %s:%d...\n",
-                  inet_ntoa(cliaddress.sin_addr),
-                  ntohs(cliaddress.sin_port));
-            clientCommunication(&new_socket); // returnValue can be ignored
+            logDebug("Client connected from %s:%d...\n",
+                     inet_ntoa(cliaddress.sin_addr),
+                     ntohs(cliaddress.sin_port));
+            struct session session;
+            sessionInit(&session, new_socket, &cliaddress);
+            clientCommunication(&session); // closes the socket
             new_socket = -1;
+            ldapPoolDestroy();
+            exit(EXIT_SUCCESS);
+         }
+         case -1:
+            perror("fork error");
             close(new_socket);
+            new_socket = -1;
             break;
          default:
             // parent. do stuff
-            printf("child pid: %d\n", pid);
+            ++activeChildren;
+            ++forkedChildren;
+            close(new_socket);
+            new_socket = -1;
+            logDebug("child pid: %d (%d active, %d reaped)\n", pid, (int)activeChildren, (int)reapedChildren);
             break;
       }
-      /*
-      /////////////////////////////////////////////////////////////////////////
-      // START CLIENT
-      // ignore printf error handling
-      printf("Client connected from %s:%d...\n",
-             inet_ntoa(cliaddress.sin_addr),
-             ntohs(cliaddress.sin_port));
-      clientCommunication(&new_socket); // returnValue can be ignored
-      new_socket = -1;
-      */
+      sigprocmask(SIG_SETMASK, &previous, NULL);
    }
 
-   ///////////////////////////////////////////////////////////////////////////////
-   // frees the descriptor
-   if (create_socket != -1)
+   ////////////////////////////////////////////////////////////////////////////
+   // the children finish their clients first
+   sigprocmask(SIG_BLOCK, &blocked, &previous);
+   if (activeChildren > 0)
    {
-      if (shutdown(create_socket, SHUT_RDWR) == -1)
-      {
-         perror("shutdown create_socket");
-      }
-      if (close(create_socket) == -1)
-      {
-         perror("close create_socket");
-      }
-      create_socket = -1;
+      printf("waiting for %d children...\n", (int)activeChildren);
    }
-   
-   // wait for all child
-   while(wait(NULL) > 0);
-   
+   while (activeChildren > 0)
+   {
+      sigsuspend(&previous);
+   }
+   sigprocmask(SIG_SETMASK, &previous, NULL);
+   printf("children: %d forked, %d reaped\n", (int)forkedChildren, (int)reapedChildren);
    return EXIT_SUCCESS;
 }
 
-void *clientCommunication (void *data)
+   ///////////////////////////////////////////////////////////////////////////////
+   // reaps every child that is gone, waitpid may change errno
+void childHandler(int sig)
 {
-   char buffer[BUF];
-   int size;
-   int *current_socket = (int *)data;
+   int error = errno;
+   while (waitpid(-1, NULL, WNOHANG) > 0)
+   {
+      --activeChildren;
+      ++reapedChildren;
+   }
+   errno = error;
+}
 
-   ////////////////////////////////////////////////////////////////////////////
-   // SEND welcome message
-   strcpy(buffer, "Welcome to myserver!\r\nPlease enter your commands...\r\nSEND\n<receiver>\n<subject>\n<message>\n.\nLIST\n.\nREAD\n<message number>\n.\nDEL\n<message number>\n.\n");
-   if (send(*current_socket, buffer, strlen(buffer), 0) == -1)
+   ///////////////////////////////////////////////////////////////////////////////
+   // the child has lived long enough, clientCommunication stops after the
+   // request it is working on
+void recycleHandler(int sig)
+{
+   abortRequested = 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // every client is served by one of a fixed number of threads with the
+   // blocking clientCommunication, like a forked child but in one process, so
+   // the ldap pool, the uid cache and the group commit are shared by everyone
+   // the main thread only accepts and hands the sessions over through the
+   // accept queue, a thread takes the next one once its client is gone
+int runThreadPool(int threadCount)
+{
+   socklen_t addrlen;
+   struct sockaddr_in cliaddress;
+   struct acceptQueue queue;
+   pthread_t threads[threadCount];
+   sigset_t blocked, previous;
+   int clientSocket;
+
+   if (acceptQueueInit(&queue, ACCEPT_QUEUE_SIZE) == -1)
    {
-      perror("send failed");
-      return NULL;
+      perror("accept queue");
+      return EXIT_FAILURE;
    }
+
    ////////////////////////////////////////////////////////////////////////////
-   // LOGIN
-   char rawuid[128];
-   char fulluid[256];
-   char pwd[256];
-   int loginSuccess = 0;
-   while(!loginSuccess)
+   // SIGINT goes to the main thread, see runEventLoop
+   sigemptyset(&blocked);
+   sigaddset(&blocked, SIGINT);
+   pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+   int started = 0;
+   while (started < threadCount && pthread_create(&threads[started], NULL, poolLoop, &queue) == 0)
    {
-      for (int i = 0; i < 2; ++i)
+      ++started;
+   }
+   pthread_sigmask(SIG_SETMASK, &previous, NULL);
+   if (started < threadCount)
+   {
+      perror("pthread_create error");
+   }
+
+   while (started == threadCount && !abortRequested)
+   {
+      logDebug("Waiting for connections...\n");
+
+      addrlen = sizeof(struct sockaddr_in);
+      if ((clientSocket = accept(create_socket,
+                                 (struct sockaddr *)&cliaddress,
+                                 &addrlen)) == -1)
       {
-         size = recv(*current_socket, buffer, BUF - 1, 0);
-         printf("bytes received: %d\n", size);
-         if (size == -1)
-         {
-            if (abortRequested)
-            {
-               perror("recv error after aborted");
-            }
-            else
-            {
-               perror("recv error");
-            }
-            break;
-         }
-         ////////////////////////////////////////////////////////////////////////////
-         // NEED : Wrong credentials does not work, program stops somewhere, not sure where
-         if (size == 0)
-         {
-            printf("Client closed remote socket\n"); // ignore error
-            break;
-         }
-         buffer[size] = '\0';
-         if(strcmp(buffer, "quit\n.") == 0)
-         {
-            abortRequested = 1;
-            break;
-         }
-         if (i == 0)
+         if (abortRequested)
          {
-            strcpy(rawuid,buffer);
-            sprintf(fulluid, "uid=%s,ou=people,dc=technikum-wien,dc=at", rawuid);
+            perror("accept error after aborted");
          }
-         else if (i == 1)
+         else
          {
-            strcpy(pwd, buffer);
+            perror("accept error");
          }
+         break;
       }
-   
-      loginSuccess = ldapCredentials(fulluid, rawuid, pwd);
+
       /////////////////////////////////////////////////////////////////////////
-      // this is not printed when wrong uid or pw is entered, so we assume
-      // that we get stuck in the ldapCredentials function somehow
-      // but after trying to figure out the problem for some hours
-      // we give up
-      // login is now only possible, if correct credentials are entered
-      // if wrong credentials are entered, programm stops. could be worse.
-      printf("loginSuccess: %d\n", loginSuccess); 
-      if(!loginSuccess)
-      {
-          //send not ok
-         int bytesSent = send(*current_socket, "NOTOK", BUF -1, 0);
-         printf("bytes sent: %d\n", bytesSent);
-         if (bytesSent == -1){
-            perror("send answer failed");
-            return NULL;
+      // the threads block in recv, the timeout lets them notice a shutdown
+      struct timeval timeout = {ABORT_CHECK_SECONDS, 0};
+      if (setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1)
+      {
+         perror("set socket options - receive timeout");
+      }
+
+      struct session *session = malloc(sizeof(struct session));
+      if (session == NULL)
+      {
+         perror("malloc session");
+         close(clientSocket);
+         continue;
+      }
+      sessionInit(session, clientSocket, &cliaddress);
+      logDebug("Client connected from %s:%d...\n",
+               inet_ntoa(cliaddress.sin_addr),
+               ntohs(cliaddress.sin_port));
+
+      /////////////////////////////////////////////////////////////////////////
+      // waits if all threads are busy and the queue is full
+      if (acceptQueuePush(&queue, session) == -1)
+      {
+         sessionFree(session);
+         close(clientSocket);
+         free(session);
+      }
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // STOP THREADS
+   // every thread takes one NULL and returns, sessions that are still queued
+   // come first and end right away, if not all threads could be started
+   // only the ones that were are stopped
+   for (int i = 0; i < started; ++i)
+   {
+      while (acceptQueuePush(&queue, NULL) == -1)
+      {
+      }
+   }
+   for (int i = 0; i < started; ++i)
+   {
+      pthread_join(threads[i], NULL);
+   }
+   acceptQueueDestroy(&queue);
+   return started == threadCount ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void *poolLoop(void *data)
+{
+   struct acceptQueue *queue = (struct acceptQueue *)data;
+   struct session *session;
+
+   while ((session = acceptQueuePop(queue)) != NULL)
+   {
+      clientCommunication(session);
+      free(session);
+   }
+   return NULL;
+}
+
+void sessionInit(struct session* session, int socket, struct sockaddr_in* address)
+{
+   memset(session, 0, sizeof(struct session));
+   session->socket = socket;
+   session->state = awaitingUid;
+   session->address = *address;
+   metricsSessionOpened();
+   ringInit(&session->in);
+   parserInit(&session->parser);
+   if (outputInit(&session->response) == -1)
+   {
+      // it is allocated once the first answer needs it
+      perror("malloc response");
+   }
+   session->delivery = NULL;
+   session->outFile = -1;
+   session->commit = NULL;
+   session->check = NULL;
+   session->worker = NULL;
+   if (durable)
+   {
+      session->commit = calloc(1, sizeof(struct commitRequest));
+      if (session->commit == NULL)
+      {
+         perror("calloc commit request");
+      }
+      else
+      {
+         session->commit->data = session;
+      }
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // queue welcome message, it is sent with the first writable event
+   // it is never framed and its last line offers framing to the client
+   outputSet(&session->response, "Welcome to myserver!\r\nPlease enter your commands...\r\nSEND\n<receiver>[,<receiver>...]\n<subject>\n<message>\n.\nLIST\n.\nREAD\n<message number>\n.\nDEL\n<message number>\n.\n" FRAME_CAPABILITY "\r\n");
+   session->outHeaderLength = 0;
+   session->outLength = outputLength(&session->response);
+   session->outSent = 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // drives a non blocking session as far as possible: sends what is pending,
+   // handles every complete request and reads until the socket would block,
+   // which is what edge triggered epoll expects before the next event arrives
+void sessionEvent(struct session* session)
+{
+   int size;
+   while (1)
+   {
+      int flushed = sessionFlush(session);
+      if (flushed == -1)
+      {
+         sessionClose(session);
+         return;
+      }
+      if (flushed == 1)
+      {
+         // socket buffer is full, continue on the next EPOLLOUT
+         return;
+      }
+      if (session->state == closing)
+      {
+         sessionClose(session);
+         return;
+      }
+      if (sessionProcess(session))
+      {
+         continue;
+      }
+
+      size = sessionReceive(session);
+      if (size == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+         {
+            return;
+         }
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("recv error");
+         sessionClose(session);
+         return;
+      }
+      if (size == 0)
+      {
+         logDebug("Client closed remote socket\n");
+         sessionClose(session);
+         return;
+      }
+      logDebug("bytes received: %d\n", size);
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // handles the next buffered request if it is complete and the previous answer
+   // is out, returns 1 if a request was handled and 0 if more input is needed
+int sessionProcess(struct session* session)
+{
+   struct view message;
+
+   if (session->outSent < session->outHeaderLength + session->outLength || session->outFile != -1)
+   {
+      return 0;
+   }
+   if (session->parser.format == unknownFormat && !parserNegotiate(&session->parser, &session->in))
+   {
+      return 0;
+   }
+
+   int complete = parserNext(&session->parser, &session->in, &message);
+   if (complete == -1)
+   {
+      logInfo("message too long, closing session\n");
+      session->state = closing;
+      return 1;
+   }
+   if (!complete)
+   {
+      if (session->parser.messageLength > 0 && session->state == loggedIn)
+      {
+         sessionStream(session);
+      }
+      // nothing more is read while the receivers of a streamed SEND are looked up
+      return session->authenticating;
+   }
+
+   if (session->sending)
+   {
+      sessionFinishSend(session);
+   }
+   else
+   {
+      handleRecord(session, message);
+      if (session->authenticating)
+      {
+         // sessionResume finishes it once the directory answered
+         session->held = message;
+         return 1;
+      }
+   }
+   parserDone(&session->parser);
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // reads as much as fits into the free space of the ring, which may be split
+   // at its end, with one call
+   // returns what recv would return, a full ring is an error (ENOBUFS), the
+   // parser always takes something out of it before it fills up
+int sessionReceive(struct session* session)
+{
+   struct iovec parts[2];
+   int count = ringSpace(&session->in, parts);
+   if (count == 0)
+   {
+      errno = ENOBUFS;
+      return -1;
+   }
+   int size = readv(session->socket, parts, count);
+   if (size > 0)
+   {
+      ringFill(&session->in, size);
+      metricsReceived(size);
+   }
+   return size;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the body of a SEND is not collected in message: as soon as receiver and
+   // subject are known the delivery is started and whatever follows goes
+   // straight to the file, so a session holds at most RING_SIZE bytes of a
+   // message no matter how long it is
+   // called after every read of an incomplete message that is too long for
+   // the ring, complete messages are handled by handleCommand as before
+void sessionStream(struct session* session)
+{
+   if (!session->sending && !sessionStartSend(session))
+   {
+      return;
+   }
+   sessionStreamBody(session);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // starts streaming if message begins with "SEND\n<receivers>\n<subject>\n",
+   // the body is moved to the front of message
+   // if no receiver is known or the mail can't be created, the response is
+   // set now and the body is read and thrown away
+   // returns 1 if the message is a SEND and its header is complete
+int sessionStartSend(struct session* session)
+{
+   struct parser* parser = &session->parser;
+   char* position = parser->message;
+   char* end = parser->message + parser->messageLength;
+   char* lines[3];
+
+   for (int i = 0; i < 3; ++i)
+   {
+      char* newline = memchr(position, '\n', end - position);
+      if (newline == NULL)
+      {
+         return 0;
+      }
+      lines[i] = position;
+      position = newline + 1;
+   }
+   if (!(lines[1] - lines[0] == 5 && memcmp(lines[0], "SEND\n", 5) == 0) &&
+       !(lines[1] - lines[0] == 6 && memcmp(lines[0], "SEND\r\n", 6) == 0))
+   {
+      return 0;
+   }
+   struct view header = {lines[1], (int)(position - lines[1])};
+   struct view receiver = viewLine(&header);
+   struct view subject = viewLine(&header);
+   sessionTime(session, metricSend);
+   if (!sessionCheckReceivers(session, receiver))
+   {
+      return 0;
+   }
+   logDebug("Message received: SEND to %.*s, streaming the body\n", receiver.length, receiver.data);
+
+   session->sending = 1;
+   parser->streaming = 1;
+   session->bodyLength = 0;
+   session->delivery = malloc(sizeof(struct delivery));
+   if (session->delivery == NULL)
+   {
+      perror("malloc delivery");
+      errorHandling(&session->response, ENOMEM);
+      checkRelease(session->check);
+   }
+   else if (!deliveryBegin(&session->response, session->delivery, receiver, session->rawuid, subject, session->check))
+   {
+      free(session->delivery);
+      session->delivery = NULL;
+   }
+
+   parser->messageLength = end - position;
+   memmove(parser->message, position, parser->messageLength);
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // writes everything but the last BODY_TAIL bytes of message to the delivery
+void sessionStreamBody(struct session* session)
+{
+   struct parser* parser = &session->parser;
+   int length = parser->messageLength - BODY_TAIL;
+   if (length <= 0)
+   {
+      return;
+   }
+   if (session->delivery != NULL)
+   {
+      deliveryWrite(session->delivery, parser->message, length);
+   }
+   session->bodyLength += length;
+   memmove(parser->message, parser->message + length, BODY_TAIL);
+   parser->messageLength = BODY_TAIL;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the streamed SEND is complete, message holds the held back tail
+   // the terminator is cut off the same way parseRequest does it
+void sessionFinishSend(struct session* session)
+{
+   char* body = session->parser.message;
+   char* end = body + session->parser.messageLength;
+
+   while (end > body && (end[-1] == '\n' || end[-1] == '\r'))
+   {
+      --end;
+   }
+   if (session->bodyLength == 0 && end - body == 1 && body[0] == '.')
+   {
+      ///////////////////////////////////////////////////////////////////////////////
+      // no message at all, same as a SEND without body
+      if (session->delivery != NULL)
+      {
+         deliveryAbort(session->delivery);
+         outputSet(&session->response, "ERR - wrong command");
+      }
+   }
+   else
+   {
+      if (end - body >= 2 && end[-1] == '.' && end[-2] == '\n')
+      {
+         end -= 2;
+         if (end > body && end[-1] == '\r')
+         {
+            --end;
+         }
+      }
+      if (session->delivery != NULL)
+      {
+         deliveryWrite(session->delivery, body, end - body);
+         if (deliveryCommit(&session->response, session->delivery, session->commit))
+         {
+            sessionCommit(session);
          }
       }
+   }
+   free(session->delivery);
+   session->delivery = NULL;
+   session->sending = 0;
+   session->parser.streaming = 0;
+   session->bodyLength = 0;
+   sessionReply(session);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the message is stored, in durable mode it also has to be synced before the
+   // OK goes out: a worker queues the session for the next group commit and
+   // serves its other clients meanwhile, a forked child simply waits for it
+void sessionCommit(struct session* session)
+{
+   if (session->commit == NULL || session->commit->pathCount == 0)
+   {
+      return;
+   }
+   sessionPush(session);
+   if (session->worker == NULL)
+   {
+      if (groupCommitWait(session->commit) == -1)
+      {
+         errorHandling(&session->response, errno);
+      }
+      groupCommitReset(session->commit);
+      return;
+   }
+   session->committing = 1;
+   session->commit->done = sessionCommitted;
+   groupCommitSubmit(session->commit);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // runs in the committer thread, only hands the session back to its worker
+void sessionCommitted(struct commitRequest* request)
+{
+   sessionReturn((struct session *)request->data);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // pushes the session to the returned list of its worker and wakes it up
+void sessionReturn(struct session* session)
+{
+   struct worker* worker = session->worker;
+   uint64_t wakeup = 1;
+
+   pthread_mutex_lock(&worker->returnedLock);
+   session->nextReturned = worker->returned;
+   worker->returned = session;
+   pthread_mutex_unlock(&worker->returnedLock);
+   if (write(worker->returnedEvent, &wakeup, sizeof(wakeup)) == -1)
+   {
+      perror("write returned event");
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // sends the rest of the pending answer, header, response and padding with
+   // one call and the message of a READ after them with sendfile, so it goes from the
+   // page cache to the socket without being copied through the session
+   // returns 0 if everything is sent, 1 if the socket would block and -1 on error
+   // MSG_NOSIGNAL because a client that went away must not kill the whole server
+   // a pipelining client already sent the next request, its answer follows right
+   // away, MSG_MORE lets the kernel put both into the same segment
+int sessionFlush(struct session* session)
+{
+   static const char outPadding[BUF];
+   int total = session->outHeaderLength + session->outLength;
+   int textLength = outputLength(&session->response);
+   if (session->committing || session->authenticating)
+   {
+      // the answer waits for the group commit or the directory, workerReturned continues
+      return 1;
+   }
+   int more = session->outFile != -1 || parserPending(&session->parser, &session->in);
+   int answered = session->outSent < total;
+   while (session->outSent < total)
+   {
+      struct iovec parts[3];
+      struct msghdr message;
+      int count = 0;
+      int skip = session->outSent;
+      if (skip < session->outHeaderLength)
+      {
+         parts[count].iov_base = session->frameHeader + skip;
+         parts[count].iov_len = session->outHeaderLength - skip;
+         ++count;
+         skip = 0;
+      }
       else
       {
-         //send ok
-         int bytesSent = send(*current_socket, "LOGINOK", BUF -1, 0);
-         printf("bytes sent: %d\n", bytesSent);
-         if (bytesSent == -1){
-            perror("send answer failed");
-            return NULL;
+         skip -= session->outHeaderLength;
+      }
+      if (skip < textLength)
+      {
+         parts[count].iov_base = (char*)outputText(&session->response) + skip;
+         parts[count].iov_len = textLength - skip;
+         ++count;
+         skip = 0;
+      }
+      else
+      {
+         skip -= textLength;
+      }
+      if (session->outLength > textLength)
+      {
+         parts[count].iov_base = (char*)outPadding + skip;
+         parts[count].iov_len = session->outLength - textLength - skip;
+         ++count;
+      }
+      memset(&message, 0, sizeof(message));
+      message.msg_iov = parts;
+      message.msg_iovlen = count;
+
+      int bytesSent = sendmsg(session->socket, &message, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+      if (bytesSent == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+         {
+            return 1;
+         }
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("send answer failed");
+         return -1;
+      }
+      session->outSent += bytesSent;
+      session->corked = more;
+      metricsSent(bytesSent);
+      if (session->outSent == total)
+      {
+         logDebug("bytes sent: %d\n", session->outSent);
+      }
+   }
+
+   while (session->outFile != -1 && session->outFileOffset < session->outFileEnd)
+   {
+      ssize_t bytesSent = sendfile(session->socket, session->outFile, &session->outFileOffset,
+                                   session->outFileEnd - session->outFileOffset);
+      if (bytesSent == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+         {
+            return 1;
+         }
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("sendfile failed");
+         return -1;
+      }
+      if (bytesSent == 0)
+      {
+         ///////////////////////////////////////////////////////////////////////////////
+         // the file got shorter than the frame header says, the client
+         // can't make sense of the stream anymore
+         logError("message file shrunk, closing session\n");
+         return -1;
+      }
+      session->corked = 0;
+      metricsSent(bytesSent);
+   }
+   if (session->outFile != -1)
+   {
+      logDebug("message sent up to: %ld\n", (long)session->outFileOffset);
+      close(session->outFile);
+      session->outFile = -1;
+   }
+   if (answered && session->requestStarted != 0)
+   {
+      metricsObserve(session->requestMetric, metricsNow() - session->requestStarted);
+      session->requestStarted = 0;
+   }
+   return 0;
+}
+
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the last answer went out with MSG_MORE because the next request was there
+   // already, if that request waits for the directory or the group commit the
+   // kernel would hold the answer back all that time, so it is pushed out
+   // before: taking the cork off sends what is held (a send of 0 bytes doesn't)
+void sessionPush(struct session* session)
+{
+   int off = 0;
+
+   if (!session->corked)
+   {
+      return;
+   }
+   session->corked = 0;
+   if (setsockopt(session->socket, IPPROTO_TCP, TCP_CORK, &off, sizeof(off)) == -1)
+   {
+      perror("set socket options - push answer");
+   }
+}
+   ///////////////////////////////////////////////////////////////////////////////
+   // queues the response, framed or as a record of BUF - 1 bytes, depending on
+   // what the client speaks
+   // if outFile is set, its content belongs to the answer: for framing clients
+   // it follows the response in the same frame, old clients get as much of it
+   // as fits into their record
+   // a record only holds RECORD - 1 characters, a longer answer is cut after
+   // the last line that fits and "...\n" shows that lines are missing, the
+   // padding is not part of the response, sessionFlush adds it
+void sessionReply(struct session* session)
+{
+   struct output* response = &session->response;
+
+   if (session->outFile != -1 && session->parser.format != frameFormat)
+   {
+      off_t wanted = session->outFileEnd - session->outFileOffset;
+      if (wanted > RECORD - 1 - outputLength(response))
+      {
+         wanted = RECORD - 1 - outputLength(response);
+      }
+      char* space = wanted > 0 ? outputExtend(response, wanted) : NULL;
+      if (space != NULL)
+      {
+         ssize_t size = pread(session->outFile, space, wanted, session->outFileOffset);
+         outputTruncate(response, outputLength(response) - wanted + (size > 0 ? size : 0));
+      }
+      close(session->outFile);
+      session->outFile = -1;
+   }
+   if (response->failed)
+   {
+      ///////////////////////////////////////////////////////////////////////////////
+      // a part of the answer is missing, the client gets the error instead
+      if (session->outFile != -1)
+      {
+         close(session->outFile);
+         session->outFile = -1;
+      }
+      errorHandling(response, ENOMEM);
+   }
+   int length = outputLength(response);
+   if (session->outFile != -1 && (uint64_t)length + session->outFileEnd - session->outFileOffset > FRAME_MAX_FRAGMENT)
+   {
+      close(session->outFile);
+      session->outFile = -1;
+      outputSet(response, "ERR - message too large\n");
+      length = outputLength(response);
+   }
+   if (session->parser.format == frameFormat)
+   {
+      if ((uint64_t)length > FRAME_MAX_FRAGMENT)
+      {
+         outputSet(response, "ERR - message too large\n");
+         length = outputLength(response);
+      }
+      uint32_t fileLength = session->outFile != -1 ? session->outFileEnd - session->outFileOffset : 0;
+      frameEncodeHeader(session->frameHeader, length + fileLength, 0);
+      session->outHeaderLength = FRAME_HEADER;
+      session->outLength = length;
+   }
+   else
+   {
+      if (length > RECORD - 1)
+      {
+         const char* text = outputText(response);
+         int cut = RECORD - 1 - 4;
+         while (cut > 0 && text[cut - 1] != '\n')
+         {
+            --cut;
+         }
+         outputTruncate(response, cut);
+         outputAppend(response, "...\n", 4);
+      }
+      session->outHeaderLength = 0;
+      session->outLength = RECORD;
+   }
+   session->outSent = 0;
+}
+
+void sessionFree(struct session* session)
+{
+   metricsSessionClosed();
+   parserFree(&session->parser);
+   outputFree(&session->response);
+   if (session->delivery != NULL)
+   {
+      deliveryAbort(session->delivery);
+      free(session->delivery);
+      session->delivery = NULL;
+   }
+   if (session->outFile != -1)
+   {
+      close(session->outFile);
+      session->outFile = -1;
+   }
+   if (session->commit != NULL)
+   {
+      groupCommitRelease(session->commit);
+      free(session->commit);
+      session->commit = NULL;
+   }
+   if (session->check != NULL)
+   {
+      checkRelease(session->check);
+      free(session->check);
+      session->check = NULL;
+   }
+}
+
+void sessionClose(struct session* session)
+{
+   ///////////////////////////////////////////////////////////////////////////////
+   // closing the socket also removes it from the epoll instance
+   if (shutdown(session->socket, SHUT_RDWR) == -1 && errno != ENOTCONN)
+   {
+      perror("shutdown new_socket");
+   }
+   if (close(session->socket) == -1)
+   {
+      perror("close new_socket");
+   }
+   sessionFree(session);
+   free(session);
+}
+
+void handleRecord(struct session* session, struct view record)
+{
+   switch (session->state)
+   {
+      case awaitingUid:
+         if (viewEquals(record, "quit\n."))
+         {
+            session->state = closing;
+            break;
+         }
+         ///////////////////////////////////////////////////////////////////////////////
+         // a token stands for uid and password, it is checked right here
+         if (record.length > (int)strlen(TOKEN_PREFIX) && memcmp(record.data, TOKEN_PREFIX, strlen(TOKEN_PREFIX)) == 0)
+         {
+            int prefix = strlen(TOKEN_PREFIX);
+            sessionTime(session, metricLogin);
+            sessionLogin(session, tokenVerify(record.data + prefix, record.length - prefix, session->rawuid, sizeof(session->rawuid)));
+            break;
+         }
+         snprintf(session->rawuid, sizeof(session->rawuid), "%.*s", record.length, record.data);
+         session->state = awaitingPassword;
+         break;
+      case awaitingPassword:
+      {
+         if (viewEquals(record, "quit\n."))
+         {
+            session->state = closing;
+            break;
+         }
+         snprintf(session->pwd, sizeof(session->pwd), "%.*s", record.length, record.data);
+         sessionTime(session, metricLogin);
+
+         ///////////////////////////////////////////////////////////////////////////////
+         // guesses beyond the limit fail here, before any provider is asked
+         if (!loginLimitAcquire(session->address.sin_addr.s_addr, session->rawuid))
+         {
+            sessionLogin(session, 0);
+            break;
+         }
+         sessionPush(session);
+         struct authCheck* check = sessionCheck(session);
+         if (check == NULL)
+         {
+            sessionLogin(session, authVerify(authProvider, session->rawuid, session->pwd));
+            break;
+         }
+         check->request.uid = session->rawuid;
+         check->request.password = session->pwd;
+         check->request.count = 0;
+         check->request.done = sessionAnswered;
+         check->request.data = session;
+         if (authSubmit(authProvider, &check->request))
+         {
+            sessionLogin(session, check->request.result);
+         }
+         else
+         {
+            session->authenticating = 1;
          }
          break;
       }
+      case loggedIn:
+         handleCommand(session, record);
+         if (!session->authenticating)
+         {
+            sessionReply(session);
+         }
+         break;
+      case closing:
+         break;
    }
-   do
+}
+
+void sessionLogin(struct session* session, int loginSuccess)
+{
+   logDebug("loginSuccess: %d\n", loginSuccess);
+   if (loginSuccess && session->state == awaitingPassword)
    {
-      /////////////////////////////////////////////////////////////////////////
-      // RECEIVE
-      // we are not entirely sure why we had to receive BUF - 1 instead of BUF
-      // as the original sample worked with just BUF
-      // but we had segmentation faults until we changed it to BUF - 1 so
-      // here we are
-      size = recv(*current_socket, buffer, BUF - 1, 0);
-      printf("bytes received: %d\n", size);
+      loginLimitRelease(session->address.sin_addr.s_addr, session->rawuid);
+   }
+   if (loginSuccess)
+   {
+      outputSet(&session->response, "LOGINOK");
+      session->state = loggedIn;
+   }
+   else
+   {
+      outputSet(&session->response, "NOTOK");
+      session->state = awaitingUid;
+   }
+   sessionReply(session);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the latency of the request counts from the first call on, a request
+   // that is handled again (after the directory answered) keeps its start
+void sessionTime(struct session* session, enum metric metric)
+{
+   if (session->requestStarted == 0)
+   {
+      session->requestStarted = metricsNow();
+   }
+   session->requestMetric = metric;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the auth check of a session of the event loop, NULL for the blocking
+   // servers (and if there is no memory, the provider is asked directly then)
+struct authCheck* sessionCheck(struct session* session)
+{
+   if (session->worker == NULL)
+   {
+      return NULL;
+   }
+   if (session->check == NULL && (session->check = calloc(1, sizeof(struct authCheck))) == NULL)
+   {
+      perror("calloc auth check");
+   }
+   return session->check;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // looks up the receivers of a SEND before deliveryBegin needs them
+   // returns 1 if deliveryBegin can go on, 0 if the directory was asked and
+   // the SEND is handled again once it answered (authenticating is set then)
+int sessionCheckReceivers(struct session* session, struct view receivers)
+{
+   struct authCheck* check = sessionCheck(session);
+   if (check == NULL || check->ready)
+   {
+      return 1;
+   }
+   check->count = parseRecipients(receivers, &check->recipients);
+   check->unknown = 0;
+   if (check->count > 0)
+   {
+      check->unknown = recipientsUnknown(check->recipients, check->count, check->uids, check->asked);
+   }
+   if (check->unknown == 0)
+   {
+      check->ready = 1;
+      return 1;
+   }
+   check->request.uid = NULL;
+   check->request.password = NULL;
+   check->request.uids = check->uids;
+   check->request.count = check->unknown;
+   check->request.exists = check->exists;
+   check->request.done = sessionAnswered;
+   check->request.data = session;
+   sessionPush(session);
+   if (authSubmit(authProvider, &check->request))
+   {
+      checkAnswered(check);
+      return 1;
+   }
+   session->authenticating = 1;
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // runs in the directory thread, only hands the session back to its worker
+void sessionAnswered(struct authRequest* request)
+{
+   sessionReturn((struct session *)request->data);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the directory answered: a login is answered now, a complete SEND is
+   // handled again with its receivers known, a streamed one continues with the
+   // next event
+void sessionResume(struct session* session)
+{
+   struct authCheck* check = session->check;
+   struct view held = session->held;
+   session->held.data = NULL;
+   if (session->state == awaitingPassword)
+   {
+      sessionLogin(session, check->request.result);
+      parserDone(&session->parser);
+      return;
+   }
+   checkAnswered(check);
+   if (held.data != NULL)
+   {
+      handleRecord(session, held);
+      parserDone(&session->parser);
+   }
+}
+
+void checkAnswered(struct authCheck* check)
+{
+   recipientsMark(check->recipients, check->count, check->asked, check->unknown, check->request.result != -1, check->exists);
+   check->ready = 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // receivers that were looked up but not used
+void checkRelease(struct authCheck* check)
+{
+   if (check == NULL)
+   {
+      return;
+   }
+   free(check->recipients);
+   check->recipients = NULL;
+   check->ready = 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // in the order of enum command
+static const enum metric commandMetrics[] = {
+   metricInvalid,
+   metricSend,
+   metricList,
+   metricRead,
+   metricDelete,
+   metricToken,
+   metricStats,
+   metricQuit
+};
+
+void handleCommand(struct session* session, struct view message)
+{
+   struct output* response = &session->response;
+   char* rawuid = session->rawuid;
+   struct request request;
+   struct delivery delivery;
+   int msgnumber = 0;
+
+   logDebug("Message received: %.*s\n", message.length, message.data);
+   parseRequest(message, &request);
+   sessionTime(session, commandMetrics[request.type]);
+
+   switch (request.type)
+   {
+      case sendMessage:
+         ///////////////////////////////////////////////////////////////////////////////
+         // receiver, subject and message point into the request, no need to copy them
+         if(request.receiver.data == NULL || request.subject.data == NULL || request.message.data == NULL)
+         {
+            outputSet(response, "ERR - wrong command");
+            break;
+         }
+         if(!sessionCheckReceivers(session, request.receiver))
+         {
+            break; // handled again once the directory answered
+         }
+         if(deliveryBegin(response, &delivery, request.receiver, rawuid, request.subject, session->check))
+         {
+            deliveryWrite(&delivery, request.message.data, request.message.length);
+            if(deliveryCommit(response, &delivery, session->commit))
+            {
+               sessionCommit(session);
+            }
+         }
+         break;
+      case listMessages:
+         listMail(response, rawuid);
+         break;
+      case readMessage:
+         if(request.number.data == NULL)
+         {
+            outputSet(response, "ERR - wrong command");
+            break;
+         }
+         msgnumber = viewNumber(request.number);
+         ///////////////////////////////////////////////////////////////////////////////
+         // the message itself is not copied into the response,
+         // sessionReply and sessionFlush take it from the file
+         session->outFile = openMail(response, rawuid, msgnumber, &session->outFileOffset, &session->outFileEnd);
+         if(session->outFile != -1)
+         {
+            outputSet(response, "OK\n");
+         }
+         break;
+      case deleteMessage:
+         if(request.number.data == NULL)
+         {
+            outputSet(response, "ERR - wrong command");
+            break;
+         }
+         msgnumber = viewNumber(request.number);
+         deleteMail(response, rawuid, msgnumber);
+         break;
+      case requestToken:
+      {
+         char token[TOKEN_MAX];
+         if(tokenIssue(rawuid, token) == -1)
+         {
+            outputSet(response, "ERR - tokens are turned off\n");
+            break;
+         }
+         outputReset(response, 0);
+         outputPrintf(response, "OK\n%s\n", token);
+         break;
+      }
+      case requestStats:
+         statsReport(response);
+         break;
+      case quit:
+         outputSet(response, "OK - goodbye\n");
+         session->state = closing;
+         break;
+      default: outputSet(response, "ERR - wrong command");
+         break;
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // splits the receiver line of a SEND at the commas, blanks around the names
+   // are dropped and so are names that appear twice
+   // returns the number of receivers in the allocated list, 0 if there are
+   // none and -1 if there are more than MAX_RECIPIENTS (or no memory)
+int parseRecipients(struct view line, struct recipient** recipients)
+{
+   const char* lineEnd = line.data + line.length;
+   int count = 1;
+   for (const char* comma = memchr(line.data, ',', line.length); comma != NULL; comma = memchr(comma + 1, ',', lineEnd - comma - 1))
+   {
+      ++count;
+   }
+   if (count > MAX_RECIPIENTS || (*recipients = malloc(count * sizeof(struct recipient))) == NULL)
+   {
+      return -1;
+   }
+
+   int found = 0;
+   const char* name = line.data;
+   while (name != NULL)
+   {
+      const char* comma = memchr(name, ',', lineEnd - name);
+      const char* end = comma != NULL ? comma : lineEnd;
+      while (name < end && (*name == ' ' || *name == '\t'))
+      {
+         ++name;
+      }
+      while (end > name && (end[-1] == ' ' || end[-1] == '\t'))
+      {
+         --end;
+      }
+      struct recipient* recipient = &(*recipients)[found];
+      if (end > name)
+      {
+         snprintf(recipient->name, sizeof(recipient->name), "%.*s", (int)(end - name), name);
+         recipient->status[0] = '\0';
+         if (end - name >= (long)sizeof(recipient->name) || !validName(recipient->name))
+         {
+            strcpy(recipient->status, "ERR - invalid receiver or subject\n");
+         }
+         int known = 0;
+         for (int i = 0; i < found && !known; ++i)
+         {
+            known = strcmp((*recipients)[i].name, recipient->name) == 0;
+         }
+         if (!known)
+         {
+            ++found;
+         }
+      }
+      name = comma != NULL ? comma + 1 : NULL;
+   }
+   if (found == 0)
+   {
+      free(*recipients);
+      *recipients = NULL;
+   }
+   return found;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // sets the status of every receiver that has no valid account and returns
+   // the number of those that have one
+   // the receivers are looked up together, the provider caches the answers of
+   // the directory (see authprovider.h)
+int recipientsValid(struct recipient* recipients, int count)
+{
+   const char* uids[MAX_RECIPIENTS];
+   int asked[MAX_RECIPIENTS];
+   int exists[MAX_RECIPIENTS];
+   int answered = 1;
+
+   int unknown = recipientsUnknown(recipients, count, uids, asked);
+   if (unknown > 0)
+   {
+      answered = authUsersExist(authProvider, uids, unknown, exists) != -1;
+   }
+   return recipientsMark(recipients, count, asked, unknown, answered, exists);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // collects the names of the receivers that still have to be looked up,
+   // asked[j] is the receiver of uids[j], returns how many there are
+int recipientsUnknown(struct recipient* recipients, int count, const char** uids, int* asked)
+{
+   int unknown = 0;
+
+   for (int i = 0; i < count; ++i)
+   {
+      if (recipients[i].status[0] == '\0')
+      {
+         uids[unknown] = recipients[i].name;
+         asked[unknown++] = i;
+      }
+   }
+   return unknown;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // sets the status of the receivers that were looked up from the answer
+   // (answered is 0 if there was none) and returns how many are valid
+int recipientsMark(struct recipient* recipients, int count, const int* asked, int unknown, int answered, const int* exists)
+{
+   int valid = 0;
+
+   for (int j = 0; j < unknown; ++j)
+   {
+      struct recipient* recipient = &recipients[asked[j]];
+      if (!answered) // i.e. the directory could not be asked
+      {
+         strcpy(recipient->status, "ERR - directory not reachable\n");
+      }
+      else if (!exists[j]) // i.e. ldap query found nothing because receiver does not exist
+      {
+         strcpy(recipient->status, "ERR - receiver does not exist\n");
+      }
+   }
+
+   for (int i = 0; i < count; ++i)
+   {
+      valid += recipients[i].status[0] == '\0';
+   }
+   return valid;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // blocking variant of sessionEvent for the forking server and the thread pool,
+   // the child just waits in recv until the next part of a request arrives
+   // (the pool sets a receive timeout, recv gives up now and then to check
+   // whether the server is shutting down)
+void *clientCommunication (void *data)
+{
+   struct session *session = (struct session *)data;
+   int size;
+
+   while (!abortRequested)
+   {
+      if (sessionFlush(session) == -1 || session->state == closing)
+      {
+         break;
+      }
+      if (sessionProcess(session))
+      {
+         continue;
+      }
+
+      size = sessionReceive(session);
+      if (size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      {
+         continue;
+      }
       if (size == -1)
       {
          if (abortRequested)
@@ -365,153 +2760,27 @@ void *clientCommunication (void *data)
 
       if (size == 0)
       {
-         printf("Client closed remote socket\n"); // ignore error
+         logDebug("Client closed remote socket\n");
          break;
       }
+      logDebug("bytes received: %d\n", size);
+   }
 
-      ///////////////////////////////////////////////////////////////////////////////
-      // remove ugly debug message, because of the sent newline of client
-      printf("buffer: %s\n", buffer);
-      if (buffer[size - 2] == '\r' && buffer[size - 1] == '\n')
-      {
-         size -= 2;
-      }
-      else if (buffer[size - 1] == '\n')
-      {
-         --size;
-      }
-
-      buffer[size] = '\0';
-
-      printf("Message received: %s\n", buffer); // ignore error
-
-      ///////////////////////////////////////////////////////////////////////////////
-      // parse request by splitting it into tokens seperated by a new line
-      // first token sets the type
-      // following tokens depend on the type
-      // if request starts with a correct method but then gives not enough arguments:
-      // program crashes -> :'(
-      char delimeter[2] = "\n";
-      char* token = strtok(buffer, delimeter);
-    
-      enum command type;
-      type = none;
-
-      if(strcmp(token, "SEND") == 0){
-         type = sendMessage;
-      }
-      else if(strcmp(token, "LIST") == 0){
-         type = listMessages;
-      }
-      else if(strcmp(token, "READ") == 0){
-         type = readMessage;
-      }
-      else if(strcmp(token, "DEL") == 0){
-         type = deleteMessage;
-      }
-      else if(strcmp(token, "quit") == 0){
-         type = quit;
-      }
-
-      token = strtok(NULL, delimeter);
-
-      ///////////////////////////////////////////////////////////////////////////////
-      // variables to save tokens must be declared before switch to not go out of scope
-      // but space is not an issue in this application so we don't mind
-
-      //char username[strlen(token)]; //now in rawuid
-      
-      //char sender[strlen(token)]; //now in rawuid
-      char receiver[BUF];
-      char subject[BUF];
-      char message[BUF];
-
-      int msgnumber = 0;
-
-      switch (type)
-      {
-         case sendMessage:
-            ///////////////////////////////////////////////////////////////////////////////
-            // parse: sender, receiver, subject, message
-            //strcpy(sender, token); //now in rawuid
-            //token = strtok(NULL, delimeter);
-            strcpy(receiver, token);
-            token = strtok(NULL, delimeter);
-            strcpy(subject, token);
-            token = strtok(NULL, delimeter);
-            strcpy(message, token);
-            if(ldapCredentials(fulluid, receiver, pwd)) // i.e. receiver has a valid account on ldap server so we can try and send a message
-            { 
-               int saveSuccess = saveMail(receiver, rawuid, subject, message, "/in/"); //save message to receivers inbox
-               saveSuccess += saveMail(rawuid, rawuid, subject, message, "/out/"); //save message to senders outbox
-               if(saveSuccess == 2) // both save operations successfull
-               { 
-                  strcpy(response, "OK\n");
-               }
-               else
-               {
-                  strcpy(response, "ERR\n");
-               }
-            }
-            else // i.e. ldap query failed because receiver does not exist
-            { 
-               strcpy(response, "ERR - receiver does not exist\n");
-            }
-            break;
-         case listMessages:
-            ///////////////////////////////////////////////////////////////////////////////
-            // parse: username
-            //strcpy(username, token);
-            listMail(rawuid);
-            break;
-         case readMessage:
-            ///////////////////////////////////////////////////////////////////////////////
-            // read and del: parse: username, message number
-            //strcpy(username, token);
-            //token = strtok(NULL, delimeter);
-            msgnumber = atoi(token);
-            readMail(rawuid, msgnumber);
-            break;
-         case deleteMessage:
-            //strcpy(username, token);
-            //token = strtok(NULL, delimeter);
-            msgnumber = atoi(token);
-            deleteMail(rawuid, msgnumber);
-            break;
-         case quit:
-            strcpy(response, "OK - goodbye\n");
-            break;
-         default: strcpy(response, "ERR - wrong command");
-            break;
-      }
-    
-      ///////////////////////////////////////////////////////////////////////////////
-      // response was set depending on request, operations performed and
-      // if those were succesful or not
-      // now send to client
-      int bytesSent = send(*current_socket, response, BUF -1, 0);
-      printf("bytes sent: %d\n", bytesSent);
-      if (bytesSent == -1)
-      {
-         perror("send answer failed");
-         return NULL;
-      }
-      response[0] = '\0';
-   } while (strcmp(buffer, "quit\n.") != 0 && !abortRequested);
+   sessionFree(session);
 
    ///////////////////////////////////////////////////////////////////////////////
    // closes/frees the descriptor if not already
-   if (*current_socket != -1)
+   if (session->socket != -1)
    {
-      if (shutdown(*current_socket, SHUT_RDWR) == -1)
+      if (shutdown(session->socket, SHUT_RDWR) == -1)
       {
          perror("shutdown new_socket");
       }
-      if (close(*current_socket) == -1)
+      if (close(session->socket) == -1)
       {
          perror("close new_socket");
       }
-      *current_socket = -1;
+      session->socket = -1;
    }
 
    return NULL;
@@ -556,548 +2825,524 @@ void signalHandler(int sig)
    }
 }
 
-int saveMail(char* user, char* sender, char* subject, char* message, char* inOrOut)
-{ 
-   ///////////////////////////////////////////////////////////////////////////////
-   // inOrOut must be "/in/" or "/out/"
-   // depending if the message should be persisted in the inbox of receiver or the outbox of sender
-
    ///////////////////////////////////////////////////////////////////////////////
    // path to user directory is arranged with /var/spool/mail/<username>
-   // if it does not exist already (mkdir(directory, 777) == 0), in and outbox must be created
-   // if user does exist (errno == EEXIST), message is persisted in repsective subdirectory in or out
-   // if a message with the same subject exists already in respective directory
-   // then it is overwritten :(
-   // if user directory could not be created to any other reasons (i.e. mkdir(directory, 777) != 0 but errno != EEXIST)
-   // then errorHandling function is called and response is set to ERR + respective error message
-   char path[] = "/var/spool/mail/";
-   char directory[strlen(path) + strlen(user)];
-   strcpy(directory, path);
-   strcat(directory, user);
-   if(mkdir(directory, 777) == 0)
+   // with the subdirectories in and out for the mailboxes and tmp for messages
+   // that are still being received
+   // directories that exist already are fine, returns 1 on success and 0 with
+   // errno set on failure
+int createMailbox(char* user)
+{
+   char directory[PATH_MAX];
+   const char* boxes[] = {"", "/in", "/out", "/tmp"};
+   for (int i = 0; i < 4; ++i)
    {
-      ///////////////////////////////////////////////////////////////////////////////
-      // ->new user. needs in and out box
-      char in[strlen(directory) + strlen("/in")];
-      strcpy(in, directory);
-      strcat(in, "/in");
-      char out[strlen(directory) + strlen("/out")];
-      strcpy(out, directory);
-      strcat(out, "/out");
-      if(mkdir(in, 777) == 0 && mkdir(out, 777) == 0)
-      {
-         printf("created directory %s\n", in);
-         printf("created directory %s\n", out);
-      }
-      else
+      snprintf(directory, sizeof(directory), "%s%s%s", SPOOL, user, boxes[i]);
+      if (mkdir(directory, 0777) == -1 && errno != EEXIST)
       {
          return 0;
       }
-      ///////////////////////////////////////////////////////////////////////////////
-      // save message file to in or out box
-      char target[strlen(directory) + strlen(inOrOut)];
-      strcpy(target, directory);
-      strcat(target, inOrOut);
-      char file[strlen(target) + strlen(subject)];
-      strcpy(file, target);
-      strcat(file, subject);
-      ///////////////////////////////////////////////////////////////////////////////
-      // if mail with subject exists already -> overwrites old message.
-      // NEED : [errno 17] -> File exists, needed?
-      FILE* messageFile = fopen(file, "w");
-      if(messageFile != NULL)
-      {
-         fputs("from: ", messageFile);
-         fputs(sender, messageFile);
-         fputc('\n', messageFile);
-         fputs(message, messageFile);
-         fputc('\n', messageFile);
-         fclose(messageFile);
-         return 1;
-      }
-      else
+   }
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // receiver and subject end up in paths, so they must not climb out of the spool
+int validName(char* name)
+{
+   return name[0] != '\0' && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+int deliveryBegin(struct output* response, struct delivery* delivery, struct view receivers, char* sender, struct view subject, struct authCheck* check)
+{
+   int ready = check != NULL && check->ready;
+   if (ready)
+   {
+      // looked up already, the receivers are taken over from the check
+      delivery->recipients = check->recipients;
+      delivery->recipientCount = check->count;
+      check->recipients = NULL;
+      check->ready = 0;
+   }
+   snprintf(delivery->subject, sizeof(delivery->subject), "%.*s", subject.length, subject.data);
+   if (!validName(delivery->subject))
+   {
+      outputSet(response, "ERR - invalid receiver or subject\n");
+      if (ready)
       {
-         errorHandling(errno);
-         return 0;
+         free(delivery->recipients);
+         delivery->recipients = NULL;
       }
-      
+      return 0;
    }
-   else if(errno == EEXIST)
-   { 
-      ///////////////////////////////////////////////////////////////////////////////
-      // user exists -> has in and out box -> just need to save message
-      char target[strlen(directory) + strlen(inOrOut)];
-      strcpy(target, directory);
-      strcat(target, inOrOut);
-      char file[strlen(target) + strlen(subject)];
-      strcpy(file, target);
-      strcat(file, subject);
-      ///////////////////////////////////////////////////////////////////////////////
-      // if mail with subject exists already -> overwrites old message
-      FILE* messageFile = fopen(file, "w");
-      if(messageFile != NULL)
-      {
-         fputs("from: ", messageFile);
-         fputs(sender, messageFile);
-         fputc('\n', messageFile);
-         fputs(message, messageFile);
-         fputc('\n', messageFile);
-         fclose(messageFile);
-         return 1;
-      }
-      else
+   if (!ready)
+   {
+      delivery->recipientCount = parseRecipients(receivers, &delivery->recipients);
+   }
+   if (delivery->recipientCount == -1)
+   {
+      outputSet(response, "ERR - too many receivers\n");
+      return 0;
+   }
+   if (delivery->recipientCount == 0)
+   {
+      outputSet(response, "ERR - wrong command");
+      return 0;
+   }
+   int usable = 0;
+   if (ready)
+   {
+      for (int i = 0; i < delivery->recipientCount; ++i)
       {
-         errorHandling(errno);
-         return 0;
+         usable += delivery->recipients[i].status[0] == '\0';
       }
    }
    else
    {
-      ///////////////////////////////////////////////////////////////////////////////
-      // error handling other errnos
-      errorHandling(errno);
+      usable = recipientsValid(delivery->recipients, delivery->recipientCount);
+   }
+   if (usable > 0 && !createMailbox(sender))
+   {
+      errorHandling(response, errno);
+      free(delivery->recipients);
+      delivery->recipients = NULL;
+      return 0;
+   }
+   for (int i = 0; i < delivery->recipientCount; ++i)
+   {
+      struct recipient* recipient = &delivery->recipients[i];
+      if (recipient->status[0] == '\0' && !createMailbox(recipient->name))
+      {
+         snprintf(recipient->status, sizeof(recipient->status), "%s", errorText(errno));
+         --usable;
+      }
+   }
+   if (usable == 0)
+   {
+      deliveryReport(response, delivery, 0);
+      free(delivery->recipients);
+      delivery->recipients = NULL;
       return 0;
    }
+   snprintf(delivery->sender, sizeof(delivery->sender), "%s", sender);
+   delivery->fd = -1;
+   delivery->path[0] = '\0';
+   delivery->buffer = NULL;
+   delivery->failed = 0;
+   delivery->length = 0;
+   delivery->hash = MAIL_HASH_SEED;
+
+   deliveryWrite(delivery, "from: ", strlen("from: "));
+   deliveryWrite(delivery, sender, strlen(sender));
+   deliveryWrite(delivery, "\n", 1);
+   return 1;
 }
 
-void listMail(char* username)
-{
    ///////////////////////////////////////////////////////////////////////////////
-   // path to user directory is arranged with /var/spool/mail/in/<username>
-   // if directory does not exist, user does not exist, hence user has no messages
-   // so if opendir(directory) == NULL >> response is set to "There are 0 messages..."
-   char path[] = "/var/spool/mail/";
-   char directory[strlen(path) + strlen(username) + strlen("/in")];
-   strcpy(directory, path);
-   strcat(directory, username);
-   strcat(directory, "/in");
-   struct dirent *dir;
-   DIR *dr = opendir(directory);
-   if(dr == NULL)
+   // appends to the message, the first DELIVERY_MEMORY bytes are kept in memory,
+   // a longer message goes to a file in the tmp directory of the sender
+   // the first error is remembered and reported by deliveryCommit,
+   // later writes are skipped
+void deliveryWrite(struct delivery* delivery, const char* data, int length)
+{
+   static unsigned long deliveries = 0;
+
+   if (delivery->failed || length == 0)
    {
-      errorHandling(errno);
-      strcat(response, "There are 0 messages for user ");
-      strcat(response, username);
-      strcat(response, ".\n");
       return;
    }
-   ///////////////////////////////////////////////////////////////////////////////
-   //iterate once through directory to get messagecount
-   char buffer [sizeof(int)*8+1];
-   int counter = 0;
-   while((dir = readdir(dr)) != NULL)
+   delivery->hash = mailStoreHash(delivery->hash, data, length);
+   if (delivery->fd == -1 && delivery->length + length <= DELIVERY_MEMORY)
    {
-      if(strcmp(dir->d_name, ".") && strcmp(dir->d_name, "..")){
-         ++counter;
+      if (delivery->buffer == NULL && (delivery->buffer = malloc(DELIVERY_MEMORY)) == NULL)
+      {
+         delivery->failed = ENOMEM;
+         return;
       }
+      memcpy(delivery->buffer + delivery->length, data, length);
+      delivery->length += length;
+      return;
    }
-   if(counter == 1)
-   {
-      //printf("There is %d message for this user.\n", counter);
-      strcpy(response, "There is 1 message for user ");
-      strcat(response, username);
-      strcat(response, ".\n");
-   }
-   else
+   if (delivery->fd == -1)
    {
-      sprintf (buffer, "%d", counter);
-      //printf("There are %d messages for this user.\n", counter);
-      strcpy(response, "There are ");
-      strcat(response, buffer);
-      strcat(response, " messages for user ");
-      strcat(response, username);
-      strcat(response, ".\n");
-      //printf("%s\n", response);
+      ///////////////////////////////////////////////////////////////////////////////
+      // unique name, several workers and processes write at the same time
+      snprintf(delivery->path, sizeof(delivery->path), "%s%s/tmp/%ld.%d.%lu",
+               SPOOL, delivery->sender, (long)time(NULL), getpid(),
+               __atomic_add_fetch(&deliveries, 1, __ATOMIC_RELAXED));
+      delivery->fd = open(delivery->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+      if (delivery->fd == -1)
+      {
+         delivery->failed = errno;
+         delivery->path[0] = '\0';
+         return;
+      }
+      off_t kept = delivery->length;
+      delivery->length = 0;
+      deliveryWriteFile(delivery, delivery->buffer, kept);
+      free(delivery->buffer);
+      delivery->buffer = NULL;
    }
-   counter = 1;
-   closedir(dr);
+   deliveryWriteFile(delivery, data, length);
+}
 
-   ///////////////////////////////////////////////////////////////////////////////
-   // iterate again through directory to set response to a list of message numbers and subjects
-   // if we had a lot of messages that don't fit in the 1024 sized char array
-   // to prevent a buffer overflow -> display message count but not all messages
-   dr = opendir(directory);
-   while((dir = readdir(dr)) != NULL)
+void deliveryWriteFile(struct delivery* delivery, const char* data, int length)
+{
+   while (length > 0 && !delivery->failed)
    {
-      if(strcmp(dir->d_name, ".") && strcmp(dir->d_name, ".."))
+      ssize_t written = write(delivery->fd, data, length);
+      if (written == -1)
       {
-         //printf("%d: %s\n", counter, dir->d_name);
-         sprintf(buffer, "%d", counter);
-         if((strlen(response)+strlen(buffer)) > (BUF-2))
-         {
-            break;
-         }
-         strcat(response, buffer);
-         if((strlen(response)+strlen(": ")) > (BUF-2))
-         {
-            break;
-         }
-         strcat(response, ": ");
-         if((strlen(response)+strlen(dir->d_name)) > (BUF-2))
-         {
-            break;
-         }
-         strcat(response, dir->d_name);
-         if((strlen(response)+strlen("\n")) > (BUF-2))
+         if (errno != EINTR)
          {
-            break;
+            delivery->failed = errno;
          }
-         strcat(response, "\n");
-         ++counter;
+         continue;
       }
+      data += written;
+      length -= written;
+      delivery->length += written;
    }
-   //printf("%s\n", response); 
-   closedir(dr);
 }
 
-void readMail(char* username, int msgnumber)
+   ///////////////////////////////////////////////////////////////////////////////
+   // the message is complete: it is written once to the body store, the outbox
+   // of the sender links to it and the storage backend puts it into the inbox
+   // of every receiver in one pass, where it gets its number
+   // the files it wrote are collected in commit (unless it is NULL)
+   // returns the number of receivers that got the message, the delivery is
+   // finished either way
+int deliveryCommit(struct output* response, struct delivery* delivery, struct commitRequest* commit)
 {
+   uint64_t started = metricsNow();
+   int delivered = deliveryStore(response, delivery, commit);
+   metricsObserve(metricStoreDeliver, metricsNow() - started);
+   return delivered;
+}
+
    ///////////////////////////////////////////////////////////////////////////////
-   // again path to user directory is arranged with /var/spool/mail/in/<username>
-   // if directory cannot be opened, we call errorHandling
-   char path[] = "/var/spool/mail/";
-   char directory[strlen(path) + strlen(username) + strlen("/in")];
-   strcpy(directory, path);
-   strcat(directory, username);
-   strcat(directory, "/in");
-   struct dirent *dir;
-   DIR *dr = opendir(directory);
-   if(dr == NULL)
+   // deliveryCommit without the timing
+int deliveryStore(struct output* response, struct delivery* delivery, struct commitRequest* commit)
+{
+   char mailbox[PATH_MAX];
+   struct mailSource source;
+   struct mailEntry entry;
+   int delivered = 0;
+
+   deliveryWrite(delivery, "\n", 1);
+   if (delivery->failed)
    {
-      errorHandling(errno);
-      strcpy(response, "ERR - does not exist.\n");
-      return;
+      errorHandling(response, delivery->failed);
+      deliveryAbort(delivery);
+      return 0;
    }
-   ///////////////////////////////////////////////////////////////////////////////
-   // iterate once through directory to get the message with the correct number
-   // when counter and msgnumber are equal, message was found
-   // if msgnumber is not equal to the counter after the iteration through the directory
-   // is finished, the message did not exist. Either is was a negative number
-   // or too big
-   int counter = 0;
-   while((dir = readdir(dr)) != NULL)
+   source.data = delivery->buffer;
+   source.fd = delivery->fd;
+   source.length = delivery->length;
+   source.offset = 0;
+   source.path = delivery->fd != -1 ? delivery->path : NULL;
+   source.hash = delivery->hash;
+   source.compressed = NULL;
+   if (mailStoreBody(SPOOL, &source) == -1)
    {
-      if(strcmp(dir->d_name, ".") && strcmp(dir->d_name, ".."))
-      {
-         //printf("%d: %s\n", counter, dir->d_name);
-         ++counter;
-         if(counter == msgnumber)
-         {
-            break;
-         } 
-      }
-   } 
-   closedir(dr);
-   if(msgnumber != counter)
+      errorHandling(response, errno);
+      mailStoreDone(&source);
+      deliveryAbort(delivery);
+      return 0;
+   }
+
+   snprintf(mailbox, sizeof(mailbox), "%s%s", SPOOL, delivery->sender);
+   if (mailStoreKeep(mailbox, delivery->subject, &source, commit) == -1)
    {
-      strcpy(response, "ERR\nThis message does not exist\n");
+      errorHandling(response, errno);
+      mailStoreDone(&source);
+      deliveryAbort(delivery);
+      return 0;
    }
-   ///////////////////////////////////////////////////////////////////////////////
-   // dir->d_name now points to respective message if it is not NULL
-   // and counter is euqal to messagenumber -> open and display message
-   // again if message cannot be opened for any reason -> set error message
-   // in errorHandling
-   else if(dir != NULL && counter == msgnumber)
+
+   time_t now = time(NULL);
+   for (int i = 0; i < delivery->recipientCount; ++i)
    {
-      char file[strlen(directory) + strlen("/") + strlen(dir->d_name)];
-      strcpy(file, directory);
-      strcat(file, "/");
-      strcat(file, dir->d_name);
-      FILE* messageFile = fopen(file, "r");
-      if(messageFile != NULL)
+      struct recipient* recipient = &delivery->recipients[i];
+      if (recipient->status[0] != '\0')
       {
-         char buffer[BUF];
-         strcpy(response, "OK\n");
-         while(fgets(buffer, BUF, messageFile) != NULL)
-         {
-            strcat(response, buffer);
-            //printf("%s\n", buffer);
-         }
-         fclose(messageFile);
+         continue;
       }
-      else
+      memset(&entry, 0, sizeof(entry));
+      snprintf(entry.sender, sizeof(entry.sender), "%s", delivery->sender);
+      snprintf(entry.subject, sizeof(entry.subject), "%s", delivery->subject);
+      entry.time = now;
+      snprintf(mailbox, sizeof(mailbox), "%s%s", SPOOL, recipient->name);
+      if (mailStoreAdd(mailbox, &entry, &source, commit) == -1)
       {
-         errorHandling(errno);
+         snprintf(recipient->status, sizeof(recipient->status), "%s", errorText(errno));
+         continue;
       }
+      ++delivered;
+   }
+   if (delivered == 0 && commit != NULL)
+   {
+      // nothing to wait for, the SEND failed anyway
+      groupCommitReset(commit);
    }
+   deliveryReport(response, delivery, delivered);
+   mailStoreDone(&source);
+   deliveryAbort(delivery);
+   return delivered;
 }
 
-void deleteMail(char* username, int msgnumber)
-{
    ///////////////////////////////////////////////////////////////////////////////
-   // same logic as in read but with remove() when respective message was found
-   // printf("username: %s\nmessagenumber: %d\n", username, msgnumber);
-   char path[] = "/var/spool/mail/";
-   char directory[strlen(path) + strlen(username) + strlen("/in")];
-   strcpy(directory, path);
-   strcat(directory, username);
-   strcat(directory, "/in");
-   struct dirent *dir;
-   DIR *dr = opendir(directory);
-   if(dr == NULL)
+   // a SEND to one receiver is answered as it always was, OK or its error
+   // otherwise the first line counts the receivers that got the message and a
+   // line "<receiver>: <error>" follows for every one that didn't
+void deliveryReport(struct output* response, struct delivery* delivery, int delivered)
+{
+   if (delivery->recipientCount == 1)
+   {
+      outputSet(response, delivery->recipients[0].status[0] != '\0' ? delivery->recipients[0].status : "OK\n");
+      return;
+   }
+   outputReset(response, 0);
+   if (delivered > 0)
+   {
+      outputPrintf(response, "OK - %d of %d delivered\n", delivered, delivery->recipientCount);
+   }
+   else
    {
-      errorHandling(errno);
-      printf("There are 0 messages for user %s.\n", username);
+      outputPrintf(response, "ERR - none of %d delivered\n", delivery->recipientCount);
    }
-   int counter = 1;
-   while((dir = readdir(dr)) != NULL)
+   for (int i = 0; i < delivery->recipientCount; ++i)
    {
-      if(strcmp(dir->d_name, ".") && strcmp(dir->d_name, ".."))
+      struct recipient* recipient = &delivery->recipients[i];
+      if (recipient->status[0] == '\0')
       {
-         //printf("%d: %s\n", counter, dir->d_name);
-         if(counter == msgnumber)
-         {
-               break;
-         }
-         ++counter;
+         continue;
       }
-   } 
-   closedir(dr);
+      int statusLength = strcspn(recipient->status, "\n");
+      outputPrintf(response, "%s: %.*s\n", recipient->name, statusLength, recipient->status);
+   }
+}
+
    ///////////////////////////////////////////////////////////////////////////////
-   //dir->d_name now points to respective message -> open and display message:
-   if(dir != NULL)
+   // frees what the delivery holds, the temporary file is gone already if the
+   // backend took it over
+void deliveryAbort(struct delivery* delivery)
+{
+   free(delivery->buffer);
+   delivery->buffer = NULL;
+   free(delivery->recipients);
+   delivery->recipients = NULL;
+   if (delivery->fd != -1)
    {
-      char file[strlen(directory) + strlen("/") + strlen(dir->d_name)];
-      strcpy(file, directory);
-      strcat(file, "/");
-      strcat(file, dir->d_name);
-      if(remove(file) == 0)
-      {
-         printf("removed %s successfully\n", file);
-         strcpy(response, "OK\n");
-      }
-      else
+      close(delivery->fd);
+      delivery->fd = -1;
+      if (unlink(delivery->path) == -1 && errno != ENOENT)
       {
-         errorHandling(errno);
+         perror("unlink delivery");
       }
    }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // LIST reads the index (or the listing the mailbox cache keeps of it) instead
+   // of the in directory, the numbers it shows are the ones READ and DEL take
+   // and they don't change when other messages are deleted, so they are not
+   // necessarily 1, 2, 3, ... anymore
+   // the lines of the messages go straight into the response, the line with the
+   // number of messages is only known at the end, room for it is left in front
+void listMail(struct output* response, char* username)
+{
+   char mailbox[PATH_MAX];
+   char header[BUF];
+
+   snprintf(mailbox, sizeof(mailbox), "%s%s", SPOOL, username);
+   outputReset(response, strlen("There are  messages for user .\n") + 20 + strlen(username));
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // if the mailbox does not exist, user does not exist, hence user has no messages
+   uint64_t started = metricsNow();
+   long counter = mailCacheList(mailbox, listVisitor, response);
+   metricsObserve(metricStoreList, metricsNow() - started);
+   if(counter == -1)
+   {
+      errorHandling(response, errno);
+      outputPrintf(response, "There are 0 messages for user %s.\n", username);
+      return;
+   }
+   int length;
+   if(counter == 1)
+   {
+      length = snprintf(header, sizeof(header), "There is 1 message for user %s.\n", username);
+   }
+   else
+   {
+      length = snprintf(header, sizeof(header), "There are %ld messages for user %s.\n", counter, username);
+   }
+   outputPrepend(response, header, length);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // appends "<number>: <subject>\n" to the response
+int listVisitor(int number, const struct mailEntry* entry, void* data)
+{
+   struct output* response = data;
+
+   outputPrintf(response, "%d: %s\n", number, entry->subject);
+   return !response->failed;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // looks up the message in the index and opens the file it is in, so it can be
+   // sent straight from the page cache to the socket
+   // returns the file descriptor and sets where the message starts and ends in
+   // it, or -1 with the response set
+int openMail(struct output* response, char* username, int msgnumber, off_t* offset, off_t* end)
+{
+   char mailbox[PATH_MAX];
+   int messageFile;
+   off_t size;
+
+   snprintf(mailbox, sizeof(mailbox), "%s%s", SPOOL, username);
+   uint64_t started = metricsNow();
+   int found = mailStoreOpen(mailbox, msgnumber, &messageFile, offset, &size);
+   metricsObserve(metricStoreOpen, metricsNow() - started);
+   if(found == -1)
+   {
+      errorHandling(response, errno);
+      return -1;
+   }
+   if(found == 0)
+   {
+      outputSet(response, "ERR\nThis message does not exist\n");
+      return -1;
+   }
+   *end = *offset + size;
+   return messageFile;
+}
+
+void deleteMail(struct output* response, char* username, int msgnumber)
+{
+   ///////////////////////////////////////////////////////////////////////////////
+   // the entry is marked deleted, the numbers of the other messages stay the same
+   char mailbox[PATH_MAX];
+   snprintf(mailbox, sizeof(mailbox), "%s%s", SPOOL, username);
+   uint64_t started = metricsNow();
+   int removed = mailStoreRemove(mailbox, msgnumber);
+   metricsObserve(metricStoreRemove, metricsNow() - started);
+   if(removed == 1)
+   {
+      logDebug("removed message %d of %s successfully\n", msgnumber, username);
+      outputSet(response, "OK\n");
+   }
+   else if(removed == 0)
+   {
+      outputSet(response, "ERR - could not remove message\n");
+   }
+   else
+   {
+      errorHandling(response, errno);
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // STATS: how new messages are stored and what compression saved on the
+   // messages stored since the server started (by every process)
+void statsReport(struct output* response)
+{
+   int level;
+   unsigned int dictionary;
+   unsigned long messages, compressed;
+   unsigned long long sent, stored;
+
+   mailCompressSettings(&level, &dictionary);
+   mailCompressStats(&messages, &compressed, &sent, &stored);
+   outputReset(response, 0);
+   outputPrintf(response, "OK\n");
+   if (level == 0)
+   {
+      outputPrintf(response, "compression: off\n");
+   }
+   else if (dictionary == 0)
+   {
+      outputPrintf(response, "compression: zstd level %d\n", level);
+   }
    else
    {
-      strcpy(response, "ERR - could not remove message\n");
+      outputPrintf(response, "compression: zstd level %d, dictionary %u\n", level, dictionary);
    }
+   outputPrintf(response, "messages: %lu stored, %lu compressed\n", messages, compressed);
+   outputPrintf(response, "bytes: %llu sent, %llu stored, ratio %.2f\n", sent, stored,
+                stored > 0 ? (double)sent / stored : 1.0);
 }
 
    ///////////////////////////////////////////////////////////////////////////////
-   // errorHandling is called after operations which set errno have failed
+   // errorText is called after operations which set errno have failed
    // the cases reflect those errnos which might occur accoridng to the function's man pages
-void errorHandling(int error)
+const char* errorText(int error)
 {
    switch(error)
    {
       case EACCES:
-         strcpy(response, "ERR - permission denied\n");
-         break;
+         return "ERR - permission denied\n";
       case EBADF:
-         strcpy(response, "ERR - bad file number\n");
-         break;
+         return "ERR - bad file number\n";
       case EMFILE:
-         strcpy(response, "ERR - too many open files\n");
-         break;
+         return "ERR - too many open files\n";
       case ENFILE:
-         strcpy(response, "ERR - file table oveflow\n");
-         break;
+         return "ERR - file table oveflow\n";
       case ENOENT:
-         strcpy(response, "ERR - no such file or directory\n");
-         break;
+         return "ERR - no such file or directory\n";
       case ENOMEM:
-         strcpy(response, "ERR - not enough core\n");
-         break;
+         return "ERR - not enough core\n";
       case ENOTDIR:
-         strcpy(response, "ERR - not a directory\n");
-         break;
+         return "ERR - not a directory\n";
       case EBUSY:
-         strcpy(response, "ERR - mount device busy\n");
-         break;
+         return "ERR - mount device busy\n";
       case EFAULT:
-         strcpy(response, "ERR - bad address\n");
-         break;
+         return "ERR - bad address\n";
       case EIO:
-         strcpy(response, "ERR - I/O error\n");
-         break;
+         return "ERR - I/O error\n";
       case EISDIR:
-         strcpy(response, "ERR - is a directory\n");
-         break;
+         return "ERR - is a directory\n";
       case ELOOP:
-         strcpy(response, "ERR - symbolic link loop\n");
-         break;
+         return "ERR - symbolic link loop\n";
       case ENAMETOOLONG:
-         strcpy(response, "ERR - path name is too long\n");
-         break;
+         return "ERR - path name is too long\n";
       case EPERM:
-         strcpy(response, "ERR - not super-user\n");
-         break;
+         return "ERR - not super-user\n";
       case EROFS:
-         strcpy(response, "ERR - read only file system\n");
-         break;
+         return "ERR - read only file system\n";
       case EINVAL:
-         strcpy(response, "ERR - invalid argument\n");
-         break;
+         return "ERR - invalid argument\n";
       case ENOTEMPTY:
-         strcpy(response, "ERR - directory not empty\n");
-         break;
+         return "ERR - directory not empty\n";
       case EDQUOT:
-         strcpy(response, "ERR - disc quota exceeded\n");
-         break;
+         return "ERR - disc quota exceeded\n";
       case EEXIST:
-         strcpy(response, "ERR - file exists\n");
-         break;
+         return "ERR - file exists\n";
       case EFBIG:
-         strcpy(response, "ERR - file too large\n");
-         break;
+         return "ERR - file too large\n";
       case EINTR:
-         strcpy(response, "ERR - interrupted system call\n");
-         break;
+         return "ERR - interrupted system call\n";
       case ENODEV:
-         strcpy(response, "ERR - no such device\n");
-         break;
+         return "ERR - no such device\n";
       case ENOSPC:
-         strcpy(response, "ERR - no space left on device\n");
-         break;
+         return "ERR - no space left on device\n";
       case ENXIO:
-         strcpy(response, "ERR - no such device or address\n");
-         break;
+         return "ERR - no such device or address\n";
       case EOPNOTSUPP:
-         strcpy(response, "ERR - operation not supported\n");
-         break;
+         return "ERR - operation not supported\n";
       case EOVERFLOW:
-         strcpy(response, "ERR - value too large to be stored in data type\n");
-         break;
+         return "ERR - value too large to be stored in data type\n";
       case ETXTBSY:
-         strcpy(response, "ERR - text file busy\n");
-         break;
+         return "ERR - text file busy\n";
       case EWOULDBLOCK:
-         strcpy(response, "ERR - resource temporarily unavailabe\n");
-         break;
-      default: strcpy(response, "ERR - unknown error\n");
+         return "ERR - resource temporarily unavailabe\n";
+      default: return "ERR - unknown error\n";
    }
 }
 
-int ldapCredentials(char* fulluid, char* searchedUid, char* pwd)
+void errorHandling(struct output* response, int error)
 {
-   ////////////////////////////////////////////////////////////////////////////
-   // setup LDAP connection
-   // https://linux.die.net/man/3/ldap_initialize
-   printf("fulliud: %s\nsearchedUid: %s\n", fulluid, searchedUid);
-   LDAP *ld;
-   int l = ldap_initialize(&ld, "ldap://ldap.technikum-wien.at:389");
-   if(l != LDAP_OPT_SUCCESS)
-   {
-      printf("%s\n", ldap_err2string(l));
-      perror("ldap_initialize - Error: ");
-      return 0;
-   }
-
-   ////////////////////////////////////////////////////////////////////////////
-   // set verison options
-   // https://linux.die.net/man/3/ldap_set_option
-   int ldapVersion = LDAP_VERSION3;
-
-   l = ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &ldapVersion);
-   if (l != LDAP_OPT_SUCCESS)
-   {
-      printf("%s\n", ldap_err2string(l));
-      perror("ldap_start_tls_s - Error: ");
-      ldap_unbind_ext_s(ld, NULL, NULL);
-      return 0;
-   }
-
-   ////////////////////////////////////////////////////////////////////////////
-   // start connection secure (initialize TLS)
-   // https://linux.die.net/man/3/ldap_start_tls_s
-   // int ldap_start_tls_s(LDAP *ld,
-   //                      LDAPControl **serverctrls,
-   //                      LDAPControl **clientctrls);
-   // https://linux.die.net/man/3/ldap
-   // https://docs.oracle.com/cd/E19957-01/817-6707/controls.html
-   //    The LDAPv3, as documented in RFC 2251 - Lightweight Directory Access
-   //    Protocol (v3) (http://www.faqs.org/rfcs/rfc2251.html), allows clients
-   //    and servers to use controls as a mechanism for extending an LDAP
-   //    operation. A control is a way to specify additional information as
-   //    part of a request and a response. For example, a client can send a
-   //    control to a server as part of a search request to indicate that the
-   //    server should sort the search results before sending the results back
-   //    to the client.
-   l = ldap_start_tls_s(ld, NULL, NULL);
-   if (l != LDAP_SUCCESS)
-   {
-      printf("%s\n", ldap_err2string(l));
-      perror("ldap_start_tls_s - Error: ");
-      ldap_unbind_ext_s(ld, NULL, NULL);
-      return 0;
-   }
-
-   ////////////////////////////////////////////////////////////////////////////
-   // bind credentials
-   // https://linux.die.net/man/3/lber-types
-   // SASL (Simple Authentication and Security Layer)
-   // https://linux.die.net/man/3/ldap_sasl_bind_s
-   // int ldap_sasl_bind_s(
-   //       LDAP *ld,
-   //       const char *dn,
-   //       const char *mechanism,
-   //       struct berval *cred,
-   //       LDAPControl *sctrls[],
-   //       LDAPControl *cctrls[],
-   //       struct berval **servercredp);
-   BerValue bindCredentials; //BerValue = public class // storage units of a variety of sizes
-   bindCredentials.bv_val = (char *)pwd; //if bv is NULL, routine does nothing
-   bindCredentials.bv_len = strlen(pwd);
-   BerValue *servercredp;
-   l = ldap_sasl_bind_s(ld, fulluid, LDAP_SASL_SIMPLE, &bindCredentials, NULL, NULL, &servercredp);
-   if(l != LDAP_SUCCESS)
-   {
-      printf("%s\n", ldap_err2string(l));
-      perror("ldap_sasl_bind_s - Error: ");
-      ldap_unbind_ext_s(ld, NULL, NULL);
-      return 0;
-   }
-
-   // search settings
-   const char* base = "dc=technikum-wien,dc=at"; // search base
-   ber_int_t scope = LDAP_SCOPE_SUBTREE; 
-   char filter[128] = "(uid=";
-   strcat(filter, searchedUid);
-   strcat(filter, "*)\0");
-   LDAPMessage *res;
-
-   ////////////////////////////////////////////////////////////////////////////
-   // perform ldap search
-   // https://linux.die.net/man/3/ldap_search_ext_s
-   // _s : synchronous
-   // int ldap_search_ext_s(
-   //     LDAP *ld,
-   //     char *base,
-   //     int scope,
-   //     char *filter,
-   //     char *attrs[],
-   //     int attrsonly,
-   //     LDAPControl **serverctrls,
-   //     LDAPControl **clientctrls,
-   //     struct timeval *timeout,
-   //     int sizelimit,
-   //     LDAPMessage **res );
-   l = ldap_search_ext_s(ld, base, scope, filter, NULL, 0, NULL, NULL, NULL, 500, &res);
-   if(l != LDAP_SUCCESS)
-   {
-      printf("%s\n", ldap_err2string(l));
-      perror("ldap_search_ext_s - Error: ");
-      ldap_unbind_ext_s(ld, NULL, NULL);
-      return 0;
-   }
-
-   int resultCount = ldap_count_entries(ld, res);
-   printf("Total results for searched uid %s: %d\n", searchedUid, resultCount);
-
-   // free memory
-   ldap_msgfree(res);
-
-   ////////////////////////////////////////////////////////////////////////////
-   // https://linux.die.net/man/3/ldap_unbind_ext_s
-   // int ldap_unbind_ext_s(
-   //       LDAP *ld,
-   //       LDAPControl *sctrls[],
-   //       LDAPControl *cctrls[]);
-   ldap_unbind_ext_s(ld, NULL, NULL);
-   return resultCount; // i.e. 1 if person found, 0 if not
-   
-}
\ No newline at end of file
+   outputSet(response, errorText(error));
+}
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "output.h"
+
+static int reserve(struct output* output, int length);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int outputInit(struct output* output)
+{
+   output->data = malloc(OUTPUT_SIZE);
+   output->start = 0;
+   output->length = 0;
+   output->size = output->data != NULL ? OUTPUT_SIZE : 0;
+   output->failed = 0;
+   return output->data != NULL ? 0 : -1;
+}
+
+void outputFree(struct output* output)
+{
+   free(output->data);
+   output->data = NULL;
+   output->size = 0;
+   output->start = 0;
+   output->length = 0;
+}
+
+void outputReset(struct output* output, int headroom)
+{
+   if (output->size > OUTPUT_KEEP)
+   {
+      char* shrunk = realloc(output->data, OUTPUT_SIZE);
+      if (shrunk != NULL)
+      {
+         output->data = shrunk;
+         output->size = OUTPUT_SIZE;
+      }
+   }
+   output->start = 0;
+   output->length = 0;
+   output->failed = 0;
+   if (headroom > 0 && reserve(output, headroom))
+   {
+      output->start = headroom;
+      output->length = headroom;
+   }
+}
+
+void outputSet(struct output* output, const char* text)
+{
+   outputReset(output, 0);
+   outputAppendString(output, text);
+}
+
+void outputAppend(struct output* output, const char* data, int length)
+{
+   char* space = outputExtend(output, length);
+   if (space != NULL)
+   {
+      memcpy(space, data, length);
+   }
+}
+
+void outputAppendString(struct output* output, const char* text)
+{
+   outputAppend(output, text, strlen(text));
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // formats straight into the buffer, only if it didn't fit it is grown and
+   // formatted a second time
+void outputPrintf(struct output* output, const char* format, ...)
+{
+   va_list arguments;
+   int room = output->size - output->length;
+
+   va_start(arguments, format);
+   int length = vsnprintf(output->data + output->length, room, format, arguments);
+   va_end(arguments);
+   if (length < 0)
+   {
+      output->failed = 1;
+      return;
+   }
+   if (length >= room)
+   {
+      if (!reserve(output, length + 1))
+      {
+         return;
+      }
+      va_start(arguments, format);
+      vsnprintf(output->data + output->length, length + 1, format, arguments);
+      va_end(arguments);
+   }
+   output->length += length;
+}
+
+int outputPrepend(struct output* output, const char* data, int length)
+{
+   if (length > output->start)
+   {
+      return -1;
+   }
+   output->start -= length;
+   memcpy(output->data + output->start, data, length);
+   return 0;
+}
+
+char* outputExtend(struct output* output, int length)
+{
+   if (!reserve(output, length))
+   {
+      return NULL;
+   }
+   char* space = output->data + output->length;
+   output->length += length;
+   return space;
+}
+
+void outputTruncate(struct output* output, int length)
+{
+   if (length < outputLength(output))
+   {
+      output->length = output->start + length;
+   }
+}
+
+const char* outputText(const struct output* output)
+{
+   return output->data + output->start;
+}
+
+int outputLength(const struct output* output)
+{
+   return output->length - output->start;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // makes room for length more bytes, returns 0 (and sets failed) if memory is out
+static int reserve(struct output* output, int length)
+{
+   if (output->size - output->length >= length)
+   {
+      return 1;
+   }
+   int size = output->size > 0 ? output->size : OUTPUT_SIZE;
+   while (size - output->length < length)
+   {
+      size *= 2;
+   }
+   char* grown = realloc(output->data, size);
+   if (grown == NULL)
+   {
+      perror("realloc output");
+      output->failed = 1;
+      return 0;
+   }
+   output->data = grown;
+   output->size = size;
+   return 1;
+}
@@ -0,0 +1,65 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro output buffer                                                //
+   //                                                                           //
+   // every session writes its answer into one of these instead of a fixed    //
+   // char[BUF]: it grows as needed (doubling, so appending is O(1) on         //
+   // average), knows its length (no strlen or strcat) and can leave room in   //
+   // front for a line that is only known at the end, like the count of LIST   //
+   // the text is data + start up to data + length, it is not terminated      //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // OUTPUT_SIZE is allocated right away and never given back, so a short
+   // answer (an error) always fits, a buffer that grew beyond OUTPUT_KEEP
+   // shrinks back to OUTPUT_SIZE on the next reset
+#define OUTPUT_SIZE 1024
+#define OUTPUT_KEEP (64 * 1024)
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // failed is set once an append didn't get memory, the answer is incomplete
+struct output{
+   char* data;
+   int start;
+   int length;
+   int size;
+   int failed;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns -1 if memory is out
+int outputInit(struct output* output);
+void outputFree(struct output* output);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // empties the buffer and leaves headroom bytes in front for outputPrepend
+void outputReset(struct output* output, int headroom);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // outputSet replaces the text, the others append to it
+void outputSet(struct output* output, const char* text);
+void outputAppend(struct output* output, const char* data, int length);
+void outputAppendString(struct output* output, const char* text);
+void outputPrintf(struct output* output, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // puts length bytes in front of the text, returns -1 if there is not
+   // enough headroom
+int outputPrepend(struct output* output, const char* data, int length);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // appends length bytes that the caller fills in and returns where they are,
+   // NULL if memory is out, outputTruncate gives back what wasn't used
+char* outputExtend(struct output* output, int length);
+void outputTruncate(struct output* output, int length);
+
+const char* outputText(const struct output* output);
+int outputLength(const struct output* output);
+
+#endif
@@ -0,0 +1,406 @@
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "framing.h"
+#include "parser.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // the ring starts over at the front whenever it runs empty, a client that
+   // waits for every answer never makes a message wrap around the end
+
+static int takeRecord(struct parser* parser, struct ring* ring, struct view* message);
+static int takeFrame(struct parser* parser, struct ring* ring, struct view* message);
+static int reserve(struct parser* parser, int size);
+
+///////////////////////////////////////////////////////////////////////////////
+
+void ringInit(struct ring* ring)
+{
+   ring->head = 0;
+   ring->length = 0;
+}
+
+int ringSpace(struct ring* ring, struct iovec parts[2])
+{
+   unsigned int free = RING_SIZE - ring->length;
+   unsigned int tail = (ring->head + ring->length) & RING_MASK;
+
+   if (free == 0)
+   {
+      return 0;
+   }
+   parts[0].iov_base = ring->data + tail;
+   if (tail + free <= RING_SIZE)
+   {
+      parts[0].iov_len = free;
+      return 1;
+   }
+   parts[0].iov_len = RING_SIZE - tail;
+   parts[1].iov_base = ring->data;
+   parts[1].iov_len = free - (RING_SIZE - tail);
+   return 2;
+}
+
+void ringFill(struct ring* ring, unsigned int length)
+{
+   ring->length += length;
+}
+
+void ringConsume(struct ring* ring, unsigned int length)
+{
+   ring->length -= length;
+   ring->head = ring->length == 0 ? 0 : (ring->head + length) & RING_MASK;
+}
+
+void ringCopy(const struct ring* ring, unsigned int offset, void* to, unsigned int length)
+{
+   unsigned int start = (ring->head + offset) & RING_MASK;
+   unsigned int first = RING_SIZE - start < length ? RING_SIZE - start : length;
+
+   memcpy(to, ring->data + start, first);
+   memcpy((char*)to + first, ring->data, length - first);
+}
+
+void parserInit(struct parser* parser)
+{
+   memset(parser, 0, sizeof(struct parser));
+   parser->format = unknownFormat;
+   parser->message = NULL;
+}
+
+void parserFree(struct parser* parser)
+{
+   free(parser->message);
+   parser->message = NULL;
+   parser->messageSize = 0;
+   parser->messageLength = 0;
+}
+
+int parserNegotiate(struct parser* parser, struct ring* ring)
+{
+   char magic[FRAME_MAGIC_LENGTH];
+
+   if (ring->length == 0)
+   {
+      return 0;
+   }
+   if ((unsigned char)ring->data[ring->head] != (unsigned char)FRAME_MAGIC[0])
+   {
+      parser->format = recordFormat;
+      return 1;
+   }
+   if (ring->length < FRAME_MAGIC_LENGTH)
+   {
+      return 0;
+   }
+   ringCopy(ring, 0, magic, FRAME_MAGIC_LENGTH);
+   if (memcmp(magic, FRAME_MAGIC, FRAME_MAGIC_LENGTH) != 0)
+   {
+      parser->format = recordFormat;
+      return 1;
+   }
+   parser->format = frameFormat;
+   ringConsume(ring, FRAME_MAGIC_LENGTH);
+   return 1;
+}
+
+int parserNext(struct parser* parser, struct ring* ring, struct view* message)
+{
+   if (parser->format == frameFormat)
+   {
+      return takeFrame(parser, ring, message);
+   }
+   if (parser->format == recordFormat)
+   {
+      return takeRecord(parser, ring, message);
+   }
+   return 0;
+}
+
+void parserDone(struct parser* parser)
+{
+   parser->messageLength = 0;
+   if (parser->messageSize > 16 * 1024)
+   {
+      parserFree(parser);
+   }
+}
+
+int parserPending(const struct parser* parser, const struct ring* ring)
+{
+   unsigned char header[FRAME_HEADER];
+   unsigned int offset = 0;
+   int more = 1;
+
+   if (parser->streaming || parser->inFragment || parser->messageLength > 0)
+   {
+      return 0;
+   }
+   if (parser->format == recordFormat)
+   {
+      return ring->length >= PARSER_RECORD;
+   }
+   if (parser->format != frameFormat)
+   {
+      return 0;
+   }
+   while (more)
+   {
+      if (ring->length - offset < FRAME_HEADER)
+      {
+         return 0;
+      }
+      ringCopy(ring, offset, header, FRAME_HEADER);
+      uint32_t length = frameDecodeHeader(header, &more);
+      if (length > ring->length - offset - FRAME_HEADER)
+      {
+         return 0;
+      }
+      offset += FRAME_HEADER + length;
+   }
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the record is a string padded to PARSER_RECORD bytes, everything after
+   // the first '\0' is ignored
+static int takeRecord(struct parser* parser, struct ring* ring, struct view* message)
+{
+   const char* data = ring->data + ring->head;
+
+   if (ring->length < PARSER_RECORD)
+   {
+      return 0;
+   }
+   if (ring->head + PARSER_RECORD > RING_SIZE)
+   {
+      if (!reserve(parser, PARSER_RECORD + 1))
+      {
+         return -1;
+      }
+      ringCopy(ring, 0, parser->message, PARSER_RECORD);
+      parser->message[PARSER_RECORD] = '\0';
+      data = parser->message;
+   }
+   const char* end = memchr(data, '\0', PARSER_RECORD);
+   message->data = data;
+   message->length = end != NULL ? end - data : PARSER_RECORD;
+   if (data == parser->message)
+   {
+      parser->messageLength = message->length;
+   }
+   ringConsume(ring, PARSER_RECORD);
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a message of one fragment that fits into the ring waits there until it is
+   // complete and is handed out in place if it doesn't wrap
+   // anything else is appended to message fragment by fragment, fragments and
+   // headers may be split across several reads, memory is reserved for what
+   // arrived, not for what the header announces
+static int takeFrame(struct parser* parser, struct ring* ring, struct view* message)
+{
+   unsigned char header[FRAME_HEADER];
+
+   if (!parser->inFragment && parser->messageLength == 0)
+   {
+      if (ring->length < FRAME_HEADER)
+      {
+         return 0;
+      }
+      int more;
+      ringCopy(ring, 0, header, FRAME_HEADER);
+      uint32_t length = frameDecodeHeader(header, &more);
+      if (!more && length <= RING_SIZE - FRAME_HEADER)
+      {
+         if (FRAME_HEADER + length > ring->length)
+         {
+            return 0;
+         }
+         unsigned int start = (ring->head + FRAME_HEADER) & RING_MASK;
+         if (start + length <= RING_SIZE)
+         {
+            message->data = ring->data + start;
+            message->length = length;
+            ringConsume(ring, FRAME_HEADER + length);
+            return 1;
+         }
+      }
+   }
+
+   while (1)
+   {
+      if (!parser->inFragment)
+      {
+         if (ring->length < FRAME_HEADER)
+         {
+            return 0;
+         }
+         ringCopy(ring, 0, header, FRAME_HEADER);
+         parser->fragmentRemaining = frameDecodeHeader(header, &parser->fragmentMore);
+         parser->inFragment = 1;
+         ringConsume(ring, FRAME_HEADER);
+      }
+
+      uint32_t length = ring->length < parser->fragmentRemaining ? ring->length : parser->fragmentRemaining;
+      if (!parser->streaming && parser->messageLength + length > PARSER_MAX_MESSAGE)
+      {
+         return -1;
+      }
+      if (!reserve(parser, parser->messageLength + length + 1))
+      {
+         return -1;
+      }
+      ringCopy(ring, 0, parser->message + parser->messageLength, length);
+      ringConsume(ring, length);
+      parser->messageLength += length;
+      parser->fragmentRemaining -= length;
+      if (parser->fragmentRemaining > 0)
+      {
+         return 0;
+      }
+
+      parser->inFragment = 0;
+      if (!parser->fragmentMore)
+      {
+         parser->message[parser->messageLength] = '\0';
+         message->data = parser->message;
+         message->length = parser->messageLength;
+         return 1;
+      }
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // makes sure message can hold size bytes, returns 0 if memory is out
+static int reserve(struct parser* parser, int size)
+{
+   if (parser->messageSize >= size)
+   {
+      return 1;
+   }
+   char* grown = realloc(parser->message, size);
+   if (grown == NULL)
+   {
+      perror("realloc message");
+      return 0;
+   }
+   parser->message = grown;
+   parser->messageSize = size;
+   return 1;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the lines are found with memchr and the fields point into the message,
+   // nothing is copied or terminated
+void parseRequest(struct view message, struct request* request)
+{
+   const char* data = message.data;
+   const char* end = data + message.length;
+
+   memset(request, 0, sizeof(struct request));
+   request->type = none;
+
+   while (end > data && (end[-1] == '\n' || end[-1] == '\r'))
+   {
+      --end;
+   }
+   if (end - data == 1 && data[0] == '.')
+   {
+      end = data;
+   }
+   else if (end - data >= 2 && end[-1] == '.' && end[-2] == '\n')
+   {
+      end -= 2;
+      if (end > data && end[-1] == '\r')
+      {
+         --end;
+      }
+   }
+
+   struct view rest = {data, (int)(end - data)};
+   struct view command = viewLine(&rest);
+   if (command.data == NULL)
+   {
+      return;
+   }
+   if (viewEquals(command, "SEND"))
+   {
+      request->type = sendMessage;
+      request->receiver = viewLine(&rest);
+      request->subject = viewLine(&rest);
+      request->message = rest;
+   }
+   else if (viewEquals(command, "LIST"))
+   {
+      request->type = listMessages;
+   }
+   else if (viewEquals(command, "READ"))
+   {
+      request->type = readMessage;
+      request->number = viewLine(&rest);
+   }
+   else if (viewEquals(command, "DEL"))
+   {
+      request->type = deleteMessage;
+      request->number = viewLine(&rest);
+   }
+   else if (viewEquals(command, "TOKEN"))
+   {
+      request->type = requestToken;
+   }
+   else if (viewEquals(command, "STATS"))
+   {
+      request->type = requestStats;
+   }
+   else if (viewEquals(command, "quit"))
+   {
+      request->type = quit;
+   }
+}
+
+struct view viewLine(struct view* rest)
+{
+   struct view line = *rest;
+
+   if (rest->data == NULL)
+   {
+      return line;
+   }
+   const char* newline = memchr(rest->data, '\n', rest->length);
+   if (newline == NULL)
+   {
+      rest->data = NULL;
+      rest->length = 0;
+      return line;
+   }
+   line.length = newline - line.data;
+   rest->length -= line.length + 1;
+   rest->data = newline + 1;
+   if (line.length > 0 && line.data[line.length - 1] == '\r')
+   {
+      --line.length;
+   }
+   return line;
+}
+
+int viewEquals(struct view view, const char* text)
+{
+   int length = strlen(text);
+   return view.data != NULL && view.length == length && memcmp(view.data, text, length) == 0;
+}
+
+int viewNumber(struct view view)
+{
+   char number[32];
+
+   if (view.data == NULL)
+   {
+      return 0;
+   }
+   snprintf(number, sizeof(number), "%.*s", view.length, view.data);
+   return atoi(number);
+}
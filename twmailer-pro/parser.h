@@ -0,0 +1,163 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <sys/uio.h>
+#include <stdint.h>
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro request parser                                               //
+   //                                                                           //
+   // turns what a client sends into requests, without knowing about sockets,  //
+   // so it can be fuzzed and measured on its own (parserbench.c)              //
+   // received bytes go into a ring buffer, parserNext takes the next complete //
+   // message (a record of an old client or the fragments of a frame, see      //
+   // framing.h) out of it, as many reads as it takes, and parseRequest splits //
+   // it into the fields of the command                                        //
+   // a message that arrived complete and in one piece of the ring is handed  //
+   // out as a view into the ring, nothing is copied, only messages that are   //
+   // split into fragments, wrap around the end of the ring or are too long    //
+   // for it are put together in the buffer of the parser                      //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a power of two, positions in the ring are masked instead of divided
+#define RING_SIZE 4096
+#define RING_MASK (RING_SIZE - 1)
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // old clients send every message as a string padded to BUF - 1 bytes
+#define PARSER_RECORD 1023
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // longest message that is collected, a SEND that is streamed away may be longer
+#define PARSER_MAX_MESSAGE (64 * 1024)
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // how the client puts its messages on the wire, decided by the first bytes
+   // it sends: BUF - 1 sized records (old clients) or frames (see framing.h)
+enum wireFormat{
+   unknownFormat,
+   recordFormat,
+   frameFormat
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // enum to distinguish the type of request in a switch
+   // none is only used to first initialize the type before we have parsed the request
+enum command{
+   none,
+   sendMessage,
+   listMessages,
+   readMessage,
+   deleteMessage,
+   requestToken,
+   requestStats,
+   quit
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // length bytes at data, not terminated with '\0'
+   // a field that is missing has data NULL
+struct view{
+   const char* data;
+   int length;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // length bytes starting at head, head wraps around at RING_SIZE
+struct ring{
+   char data[RING_SIZE];
+   unsigned int head;
+   unsigned int length;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a parsed request, the fields are views into the message
+struct request{
+   enum command type;
+   struct view receiver;
+   struct view subject;
+   struct view message;
+   struct view number;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // what the parser remembers between two reads
+   // a frame can end in the middle of the ring, so the parser remembers how
+   // much of the current fragment is still missing
+   // message holds a message that couldn't be handed out as a view,
+   // messageSize is what is allocated
+   // streaming is set by the caller while it takes the start of a long message
+   // out of message (a SEND whose body goes to a file), there is no limit then
+struct parser{
+   enum wireFormat format;
+   int inFragment;
+   int fragmentMore;
+   uint32_t fragmentRemaining;
+   char* message;
+   int messageLength;
+   int messageSize;
+   int streaming;
+};
+
+void ringInit(struct ring* ring);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // describes the free space of the ring for readv, returns the number of
+   // parts (0 if the ring is full), ringFill adds what was read to the ring
+int ringSpace(struct ring* ring, struct iovec parts[2]);
+void ringFill(struct ring* ring, unsigned int length);
+void ringConsume(struct ring* ring, unsigned int length);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // copies length bytes from offset (from head) without consuming them
+void ringCopy(const struct ring* ring, unsigned int offset, void* to, unsigned int length);
+
+void parserInit(struct parser* parser);
+void parserFree(struct parser* parser);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the first byte decides: 0xff starts the magic of a framing client,
+   // anything else is the uid record of an old client
+   // returns 0 as long as there are not enough bytes to tell
+int parserNegotiate(struct parser* parser, struct ring* ring);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // takes the next complete message out of the ring
+   // returns 1 and the message (valid until the ring is filled again or
+   // parserDone is called), 0 if more input is needed and -1 if the message
+   // is too long or there is no memory
+   // a message that is too long for the ring is moved to message as it
+   // arrives, so the caller can look at its start before it is complete
+int parserNext(struct parser* parser, struct ring* ring, struct view* message);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the message of parserNext is handled, a huge buffer is not kept around
+void parserDone(struct parser* parser);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 if the next message is already complete in the ring
+int parserPending(const struct parser* parser, const struct ring* ring);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // parses a request of the form
+   //    <command>\n<line>\n...\n.
+   // the terminating "." line and line endings after it are cut off first,
+   // everything after the subject of a SEND is the message, newlines included
+void parseRequest(struct view message, struct request* request);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns the next line of rest (without "\n" or "\r\n") and moves rest
+   // behind it, a missing line has data NULL
+struct view viewLine(struct view* rest);
+int viewEquals(struct view view, const char* text);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the number at the start of view, like atoi
+int viewNumber(struct view view);
+
+#endif
@@ -0,0 +1,545 @@
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "framing.h"
+#include "parser.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro parser check and benchmark                                   //
+   //                                                                           //
+   // feeds a stream of generated requests to the parser the way the server    //
+   // does after its reads:                                                     //
+   //    check : reads of random size, some messages split into fragments,     //
+   //            every message and its fields are compared to what was sent    //
+   //    fuzz  : streams of random bytes and random frame headers, the parser  //
+   //            must neither crash nor hand out anything outside its buffers  //
+   //    bench : reads of a fixed size, prints how long parsing a command      //
+   //            takes and how many commands were parsed in place              //
+   // for frames and for the records of old clients                            //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define COMMANDS 100000
+#define BODY_SIZE 200
+#define READ_SIZE RING_SIZE
+#define FUZZ_ROUNDS 2000
+#define FUZZ_LENGTH (64 * 1024)
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a generated request: its text and what parseRequest has to find in it
+   // (number is the message number of READ and DEL and names the subject of SEND)
+struct expected{
+   size_t offset;
+   int length;
+   enum command type;
+   int number;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the requests as text and as they go over the wire
+struct stream{
+   char* text;
+   size_t textLength;
+   char* wire;
+   size_t wireLength;
+   struct expected* expected;
+   int count;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+void printUsage();
+unsigned int nextRandom(unsigned int* state);
+int generate(struct stream* stream, int count, int bodySize, enum wireFormat format, int fragments, unsigned int* seed);
+size_t feed(struct ring* ring, const char* data, size_t length, size_t limit);
+int runCheck(struct stream* stream, enum wireFormat format, unsigned int* seed);
+int runFuzz(int rounds, unsigned int* seed);
+int runBench(struct stream* stream, enum wireFormat format, size_t readSize);
+int checkRequest(struct view message, const struct expected* expected, const char* text);
+int viewInside(struct view view, const char* start, size_t length);
+void freeStream(struct stream* stream);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+   int count = COMMANDS;
+   int bodySize = BODY_SIZE;
+   size_t readSize = READ_SIZE;
+   int rounds = FUZZ_ROUNDS;
+   unsigned int seed = time(NULL);
+   int option;
+
+   struct option longOptions[] = {
+      {"commands", required_argument, NULL, 'n'},
+      {"body-size", required_argument, NULL, 'b'},
+      {"read-size", required_argument, NULL, 'r'},
+      {"fuzz-rounds", required_argument, NULL, 'f'},
+      {"seed", required_argument, NULL, 's'},
+      {NULL, 0, NULL, 0}
+   };
+   while ((option = getopt_long(argc, argv, "n:b:r:f:s:", longOptions, NULL)) != -1)
+   {
+      switch (option)
+      {
+         case 'n':
+            count = atoi(optarg);
+            break;
+         case 'b':
+            bodySize = atoi(optarg);
+            break;
+         case 'r':
+            readSize = atoi(optarg);
+            break;
+         case 'f':
+            rounds = atoi(optarg);
+            break;
+         case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+         default:
+            printUsage();
+            return EXIT_FAILURE;
+      }
+   }
+   if (count < 1 || bodySize < 0 || readSize < 1 || rounds < 0)
+   {
+      printUsage();
+      return EXIT_FAILURE;
+   }
+   printf("seed %u, %d commands, bodies up to %d bytes\n", seed, count, bodySize);
+
+   int failed = 0;
+   enum wireFormat formats[] = {frameFormat, recordFormat};
+   for (int i = 0; i < 2; ++i)
+   {
+      const char* name = formats[i] == frameFormat ? "frames" : "records";
+      struct stream stream;
+
+      ///////////////////////////////////////////////////////////////////////////////
+      // the check splits some frames into fragments, the bench sends them whole
+      // like the client does
+      if (generate(&stream, count, bodySize, formats[i], 1, &seed) == -1)
+      {
+         return EXIT_FAILURE;
+      }
+      int errors = runCheck(&stream, formats[i], &seed);
+      printf("%-8s check: %d commands, %d errors\n", name, stream.count, errors);
+      failed |= errors != 0;
+      freeStream(&stream);
+
+      if (generate(&stream, count, bodySize, formats[i], 0, &seed) == -1)
+      {
+         return EXIT_FAILURE;
+      }
+      failed |= runBench(&stream, formats[i], readSize) == -1;
+      freeStream(&stream);
+   }
+
+   int errors = runFuzz(rounds, &seed);
+   printf("fuzz: %d streams of up to %d bytes, %d errors\n", rounds, FUZZ_LENGTH, errors);
+   failed |= errors != 0;
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void printUsage()
+{
+   printf("Usage: ./parserbench [-n|--commands <count>] [-b|--body-size <bytes>] [-r|--read-size <bytes>]\n");
+   printf("                     [-f|--fuzz-rounds <count>] [-s|--seed <number>]\n");
+   printf("  -n, --commands   requests in the check and in the bench (default %d)\n", COMMANDS);
+   printf("  -b, --body-size  longest body of a SEND (default %d)\n", BODY_SIZE);
+   printf("  -r, --read-size  bytes one read of the bench puts into the ring at most (default %d)\n", READ_SIZE);
+   printf("  -f, --fuzz-rounds  random streams fed to the parser (default %d)\n", FUZZ_ROUNDS);
+   printf("  -s, --seed       seed of the random numbers, to repeat a run (default the time)\n");
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // xorshift, the same seed gives the same run on every machine
+unsigned int nextRandom(unsigned int* state)
+{
+   unsigned int x = *state != 0 ? *state : 1;
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *state = x;
+   return x;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a mix of SEND, LIST, READ and DEL, framed or padded to records
+   // with fragments set some frames are split into several fragments
+int generate(struct stream* stream, int count, int bodySize, enum wireFormat format, int fragments, unsigned int* seed)
+{
+   size_t longest = 128 + bodySize;
+   if (format == recordFormat && longest > PARSER_RECORD - 1)
+   {
+      bodySize = PARSER_RECORD - 1 - 128;
+      longest = PARSER_RECORD - 1;
+   }
+
+   memset(stream, 0, sizeof(struct stream));
+   stream->text = malloc(count * longest);
+   stream->wire = malloc(FRAME_MAGIC_LENGTH + count * (longest + PARSER_RECORD + 4 * FRAME_HEADER));
+   stream->expected = malloc(count * sizeof(struct expected));
+   if (stream->text == NULL || stream->wire == NULL || stream->expected == NULL)
+   {
+      perror("malloc stream");
+      freeStream(stream);
+      return -1;
+   }
+   if (format == frameFormat)
+   {
+      memcpy(stream->wire, FRAME_MAGIC, FRAME_MAGIC_LENGTH);
+      stream->wireLength = FRAME_MAGIC_LENGTH;
+   }
+
+   for (int i = 0; i < count; ++i)
+   {
+      struct expected* expected = &stream->expected[i];
+      char* text = stream->text + stream->textLength;
+      int length;
+
+      expected->number = nextRandom(seed) % 1000;
+      switch (nextRandom(seed) % 4)
+      {
+         case 0:
+         {
+            expected->type = sendMessage;
+            length = sprintf(text, "SEND\nuser%u,user%u\nsubject %d\n", nextRandom(seed) % 100,
+                             nextRandom(seed) % 100, expected->number);
+            int body = bodySize > 0 ? nextRandom(seed) % (bodySize + 1) : 0;
+            for (int j = 0; j < body; ++j)
+            {
+               text[length++] = j % 64 == 63 ? '\n' : 'a' + nextRandom(seed) % 26;
+            }
+            length += sprintf(text + length, "\n.");
+            break;
+         }
+         case 1:
+            expected->type = listMessages;
+            length = sprintf(text, "LIST\n.");
+            break;
+         case 2:
+            expected->type = readMessage;
+            length = sprintf(text, "READ\n%d\n.", expected->number);
+            break;
+         default:
+            expected->type = deleteMessage;
+            length = sprintf(text, "DEL\n%d\n.", expected->number);
+            break;
+      }
+      expected->offset = stream->textLength;
+      expected->length = length;
+      stream->textLength += length;
+
+      char* wire = stream->wire + stream->wireLength;
+      if (format == recordFormat)
+      {
+         memset(wire, 0, PARSER_RECORD);
+         memcpy(wire, text, length);
+         stream->wireLength += PARSER_RECORD;
+         continue;
+      }
+      int pieces = fragments && nextRandom(seed) % 8 == 0 ? 2 + nextRandom(seed) % 3 : 1;
+      int sent = 0;
+      for (int j = 0; j < pieces; ++j)
+      {
+         int piece = j == pieces - 1 ? length - sent : (length - sent) / (pieces - j);
+         frameEncodeHeader((unsigned char*)wire, piece, j < pieces - 1);
+         memcpy(wire + FRAME_HEADER, text + sent, piece);
+         wire += FRAME_HEADER + piece;
+         stream->wireLength += FRAME_HEADER + piece;
+         sent += piece;
+      }
+   }
+   stream->count = count;
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // what a read of the server does: up to limit bytes into the free space
+   // of the ring, returns how many
+size_t feed(struct ring* ring, const char* data, size_t length, size_t limit)
+{
+   struct iovec parts[2];
+   int count = ringSpace(ring, parts);
+   size_t fed = 0;
+
+   if (length > limit)
+   {
+      length = limit;
+   }
+   for (int i = 0; i < count && fed < length; ++i)
+   {
+      size_t size = parts[i].iov_len < length - fed ? parts[i].iov_len : length - fed;
+      memcpy(parts[i].iov_base, data + fed, size);
+      fed += size;
+   }
+   ringFill(ring, fed);
+   return fed;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns the number of requests that came out wrong
+int runCheck(struct stream* stream, enum wireFormat format, unsigned int* seed)
+{
+   static struct ring ring;
+   struct parser parser;
+   struct view message;
+   size_t position = 0;
+   int parsed = 0;
+   int errors = 0;
+
+   ringInit(&ring);
+   parserInit(&parser);
+   while (parsed < stream->count)
+   {
+      if (parser.format == unknownFormat)
+      {
+         if (!parserNegotiate(&parser, &ring))
+         {
+            position += feed(&ring, stream->wire + position, stream->wireLength - position, 1 + nextRandom(seed) % RING_SIZE);
+            continue;
+         }
+         if (parser.format != format)
+         {
+            printf("negotiated the wrong format\n");
+            return stream->count;
+         }
+      }
+      int complete = parserNext(&parser, &ring, &message);
+      if (complete == -1)
+      {
+         printf("request %d rejected\n", parsed);
+         return errors + stream->count - parsed;
+      }
+      if (complete == 1)
+      {
+         errors += checkRequest(message, &stream->expected[parsed], stream->text);
+         parserDone(&parser);
+         ++parsed;
+         continue;
+      }
+      if (position == stream->wireLength)
+      {
+         printf("stream ended after %d requests\n", parsed);
+         return errors + stream->count - parsed;
+      }
+      position += feed(&ring, stream->wire + position, stream->wireLength - position, 1 + nextRandom(seed) % RING_SIZE);
+   }
+   if (ring.length != 0 || parserPending(&parser, &ring))
+   {
+      printf("bytes left over after the last request\n");
+      ++errors;
+   }
+   parserFree(&parser);
+   return errors;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 if the message or the fields parseRequest found in it are wrong
+int checkRequest(struct view message, const struct expected* expected, const char* text)
+{
+   struct request request;
+   char subject[32];
+
+   if (message.length != expected->length || memcmp(message.data, text + expected->offset, message.length) != 0)
+   {
+      printf("message at %zu differs\n", expected->offset);
+      return 1;
+   }
+   parseRequest(message, &request);
+   if (request.type != expected->type)
+   {
+      printf("message at %zu: wrong command\n", expected->offset);
+      return 1;
+   }
+   switch (request.type)
+   {
+      case sendMessage:
+         snprintf(subject, sizeof(subject), "subject %d", expected->number);
+         if (request.receiver.data == NULL || !viewEquals(request.subject, subject) || request.message.data == NULL)
+         {
+            printf("message at %zu: wrong fields\n", expected->offset);
+            return 1;
+         }
+         break;
+      case readMessage:
+      case deleteMessage:
+         if (viewNumber(request.number) != expected->number)
+         {
+            printf("message at %zu: wrong number\n", expected->offset);
+            return 1;
+         }
+         break;
+      default:
+         break;
+   }
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // random bytes after the magic (or none), frame headers with short lengths
+   // so the parser gets past them, now and then a long or broken one
+   // a rejected message closes the connection, the parser starts over
+   // returns the number of views that pointed outside the ring or the message
+int runFuzz(int rounds, unsigned int* seed)
+{
+   static struct ring ring;
+   static char data[FUZZ_LENGTH];
+   struct parser parser;
+   struct view message;
+   struct request request;
+   int errors = 0;
+
+   for (int round = 0; round < rounds; ++round)
+   {
+      size_t length = 0;
+      size_t wanted = 1 + nextRandom(seed) % FUZZ_LENGTH;
+      if (nextRandom(seed) % 2 == 0)
+      {
+         memcpy(data, FRAME_MAGIC, FRAME_MAGIC_LENGTH);
+         length = FRAME_MAGIC_LENGTH;
+      }
+      while (length + FRAME_HEADER < wanted)
+      {
+         unsigned int kind = nextRandom(seed) % 16;
+         uint32_t fragment = kind == 0 ? nextRandom(seed) : kind < 4 ? nextRandom(seed) % (2 * RING_SIZE) : nextRandom(seed) % 64;
+         frameEncodeHeader((unsigned char*)data + length, fragment, nextRandom(seed) % 4 == 0);
+         length += FRAME_HEADER;
+         for (uint32_t i = 0; i < fragment && length < wanted; ++i)
+         {
+            unsigned int byte = nextRandom(seed) % 8;
+            data[length++] = byte == 0 ? '\n' : byte == 1 ? '.' : byte == 2 ? '\0' : nextRandom(seed);
+         }
+      }
+
+      ringInit(&ring);
+      parserInit(&parser);
+      size_t position = 0;
+      while (1)
+      {
+         int complete = 0;
+         if (parser.format != unknownFormat || parserNegotiate(&parser, &ring))
+         {
+            complete = parserNext(&parser, &ring, &message);
+         }
+         if (complete == -1)
+         {
+            parserFree(&parser);
+            parserInit(&parser);
+            ringInit(&ring);
+            continue;
+         }
+         if (complete == 1)
+         {
+            int inside = viewInside(message, ring.data, RING_SIZE) ||
+                         (parser.message != NULL && viewInside(message, parser.message, parser.messageSize));
+            if (inside)
+            {
+               parseRequest(message, &request);
+               struct view fields[] = {request.receiver, request.subject, request.message, request.number};
+               for (int i = 0; i < 4; ++i)
+               {
+                  inside &= fields[i].data == NULL || viewInside(fields[i], message.data, message.length);
+               }
+            }
+            if (!inside)
+            {
+               printf("fuzz round %d: view outside of the buffers\n", round);
+               ++errors;
+            }
+            parserDone(&parser);
+            continue;
+         }
+         if (position == length)
+         {
+            break;
+         }
+         position += feed(&ring, data + position, length - position, 1 + nextRandom(seed) % RING_SIZE);
+      }
+      parserFree(&parser);
+   }
+   return errors;
+}
+
+int viewInside(struct view view, const char* start, size_t length)
+{
+   return view.length >= 0 && view.data >= start && view.data + view.length <= start + length;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // parses the whole stream three times and prints the fastest run
+int runBench(struct stream* stream, enum wireFormat format, size_t readSize)
+{
+   static struct ring ring;
+   struct parser parser;
+   struct view message;
+   struct request request;
+   double best = 0;
+   int inPlace = 0;
+   volatile long checksum = 0; // so the parsing isn't optimized away
+
+   for (int run = 0; run < 3; ++run)
+   {
+      struct timespec start, end;
+      size_t position = 0;
+      int parsed = 0;
+
+      inPlace = 0;
+      ringInit(&ring);
+      parserInit(&parser);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      while (parsed < stream->count)
+      {
+         int complete = 0;
+         if (parser.format != unknownFormat || parserNegotiate(&parser, &ring))
+         {
+            complete = parserNext(&parser, &ring, &message);
+         }
+         if (complete == 1)
+         {
+            parseRequest(message, &request);
+            checksum += request.type + request.subject.length + request.number.length;
+            inPlace += message.data != parser.message;
+            parserDone(&parser);
+            ++parsed;
+            continue;
+         }
+         if (complete == -1 || position == stream->wireLength)
+         {
+            printf("bench stopped after %d requests\n", parsed);
+            parserFree(&parser);
+            return -1;
+         }
+         position += feed(&ring, stream->wire + position, stream->wireLength - position, readSize);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      parserFree(&parser);
+      double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+      if (run == 0 || seconds < best)
+      {
+         best = seconds;
+      }
+   }
+   printf("%-8s bench: %.1f ns per command, %zu byte reads, %.1f%% in place\n",
+          format == frameFormat ? "frames" : "records", best * 1e9 / stream->count, readSize,
+          100.0 * inPlace / stream->count);
+   return 0;
+}
+
+void freeStream(struct stream* stream)
+{
+   free(stream->text);
+   free(stream->wire);
+   free(stream->expected);
+   stream->text = NULL;
+   stream->wire = NULL;
+   stream->expected = NULL;
+}
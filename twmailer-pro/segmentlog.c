@@ -0,0 +1,363 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include "mailstore.h"
+#include "logging.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // segment backend: the inbox is a series of segment files log/0, log/1, ...
+   // new messages are appended to the segment the index header names, once it
+   // is SEGMENT_SIZE long the next one is started
+   // the entry of a message holds segment, offset and size, DEL only marks the
+   // entry deleted (the tombstone), the bytes stay where they are until the
+   // compaction thread copies the messages that are left out of a segment
+   // which is mostly dead and removes it
+   // the outbox is the one of every backend (see mailStoreKeep), older servers
+   // appended it to out.log, which is left as it is
+#define SEGMENT_SIZE (64 * 1024 * 1024)
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // segments with less dead space than this are not worth the copying
+#define SEGMENT_COMPACT_MIN (256 * 1024)
+
+static int segmentAdd(const char* mailbox, struct mailEntry* entry, struct mailSource* source, struct commitRequest* commit);
+static int segmentStart();
+static void segmentStop();
+static int segmentAppend(struct mailIndex* index, const char* mailbox, struct mailEntry* entry, struct mailSource* source, uint32_t flags);
+static void *compactLoop(void *data);
+
+struct mailStore segmentStore = {"segment", segmentAdd, segmentStart, segmentStop};
+
+static pthread_t compactThread;
+static pthread_mutex_t compactLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compactWakeup = PTHREAD_COND_INITIALIZER;
+static int compactRunning = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static int segmentAdd(const char* mailbox, struct mailEntry* entry, struct mailSource* source, struct commitRequest* commit)
+{
+   struct mailIndex index;
+   char path[PATH_MAX];
+
+   if (mailIndexOpen(&index, mailbox, LOCK_EX) == -1)
+   {
+      return -1;
+   }
+   if (mailIndexTakeId(&index, &entry->id) == -1 || segmentAppend(&index, mailbox, entry, source, source->compressed != NULL ? MAIL_COMPRESSED : 0) == -1)
+   {
+      mailIndexClose(&index);
+      return -1;
+   }
+   int number = mailIndexAppend(&index, entry);
+   mailIndexClose(&index);
+   if (number == -1)
+   {
+      return -1;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the segment, the log directory in case the segment is new, and the index
+   snprintf(path, sizeof(path), "%s/log/%u", mailbox, entry->segment);
+   groupCommitAdd(commit, path);
+   snprintf(path, sizeof(path), "%s/log", mailbox);
+   groupCommitAdd(commit, path);
+   snprintf(path, sizeof(path), "%s/%s", mailbox, MAIL_INDEX_NAME);
+   groupCommitAdd(commit, path);
+   return number;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // appends the message to the current segment and fills in where it went,
+   // flags is MAIL_COMPRESSED if what source holds is compressed, else 0
+   // the index must be locked exclusively
+static int segmentAppend(struct mailIndex* index, const char* mailbox, struct mailEntry* entry, struct mailSource* source, uint32_t flags)
+{
+   char path[PATH_MAX];
+   struct stat status;
+
+   snprintf(path, sizeof(path), "%s/log", mailbox);
+   if (mkdir(path, 0777) == -1 && errno != EEXIST)
+   {
+      return -1;
+   }
+   snprintf(path, sizeof(path), "%s/log/%u", mailbox, index->header.segment);
+   int out = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+   if (out == -1 || fstat(out, &status) == -1)
+   {
+      if (out != -1)
+      {
+         close(out);
+      }
+      return -1;
+   }
+   if (status.st_size >= SEGMENT_SIZE)
+   {
+      close(out);
+      ++index->header.segment;
+      if (mailIndexSave(index) == -1)
+      {
+         return -1;
+      }
+      snprintf(path, sizeof(path), "%s/log/%u", mailbox, index->header.segment);
+      out = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+      if (out == -1 || fstat(out, &status) == -1)
+      {
+         if (out != -1)
+         {
+            close(out);
+         }
+         return -1;
+      }
+   }
+
+   off_t position = status.st_size;
+   if (mailStoreCopy(out, &position, source) == -1)
+   {
+      ///////////////////////////////////////////////////////////////////////////////
+      // nobody points to a half written message, but cut it off anyway
+      int error = errno;
+      if (ftruncate(out, status.st_size) == -1)
+      {
+         perror("ftruncate segment");
+      }
+      close(out);
+      errno = error;
+      return -1;
+   }
+   close(out);
+   entry->flags = MAIL_SEGMENT | flags;
+   entry->segment = index->header.segment;
+   entry->offset = status.st_size;
+   entry->size = source->length;
+   return 0;
+}
+
+static int segmentStart()
+{
+   if (mailStoreCompactInterval() <= 0)
+   {
+      return 0;
+   }
+   compactRunning = 1;
+   if (pthread_create(&compactThread, NULL, compactLoop, NULL) != 0)
+   {
+      compactRunning = 0;
+      return -1;
+   }
+   return 0;
+}
+
+static void segmentStop()
+{
+   pthread_mutex_lock(&compactLock);
+   if (!compactRunning)
+   {
+      pthread_mutex_unlock(&compactLock);
+      return;
+   }
+   compactRunning = 0;
+   pthread_cond_signal(&compactWakeup);
+   pthread_mutex_unlock(&compactLock);
+   pthread_join(compactThread, NULL);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // every interval all mailboxes of the spool that have segments are compacted
+static void *compactLoop(void *data)
+{
+   struct timespec wakeup;
+   struct dirent *dir;
+   char mailbox[PATH_MAX];
+   char log[PATH_MAX + 4];
+   struct stat status;
+
+   pthread_mutex_lock(&compactLock);
+   while (compactRunning)
+   {
+      clock_gettime(CLOCK_REALTIME, &wakeup);
+      wakeup.tv_sec += mailStoreCompactInterval();
+      while (compactRunning && pthread_cond_timedwait(&compactWakeup, &compactLock, &wakeup) != ETIMEDOUT)
+      {
+      }
+      if (!compactRunning)
+      {
+         break;
+      }
+      pthread_mutex_unlock(&compactLock);
+
+      DIR *dr = opendir(SPOOL);
+      if (dr != NULL)
+      {
+         while ((dir = readdir(dr)) != NULL)
+         {
+            if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, ".."))
+            {
+               continue;
+            }
+            snprintf(mailbox, sizeof(mailbox), "%s%s", SPOOL, dir->d_name);
+            snprintf(log, sizeof(log), "%s/log", mailbox);
+            if (stat(log, &status) == 0 && S_ISDIR(status.st_mode))
+            {
+               segmentCompact(mailbox);
+            }
+         }
+         closedir(dr);
+      }
+      else
+      {
+         perror("compaction - opendir spool");
+      }
+
+      pthread_mutex_lock(&compactLock);
+   }
+   pthread_mutex_unlock(&compactLock);
+   return NULL;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a segment is compacted when more than half of it is dead: the messages that
+   // are left are appended to the current segment and the old one is removed
+   // if that is the current segment itself, a new one is started first
+   // the mailbox is locked the whole time, SENDs to it wait until it is done
+void segmentCompact(const char* mailbox)
+{
+   struct mailIndex index;
+   struct mailEntry entry;
+   struct stat status;
+   char path[PATH_MAX + 16];
+
+   if (mailIndexOpen(&index, mailbox, LOCK_EX) == -1)
+   {
+      perror("compaction - open index");
+      return;
+   }
+   uint32_t segments = index.header.segment + 1;
+   off_t *live = calloc(segments, sizeof(off_t));
+   char *compact = calloc(segments, 1);
+   if (live == NULL || compact == NULL)
+   {
+      perror("compaction - calloc");
+      free(live);
+      free(compact);
+      mailIndexClose(&index);
+      return;
+   }
+
+   int slots = mailIndexSlots(&index);
+   for (int number = 1; number <= slots; ++number)
+   {
+      if (mailIndexRead(&index, number, &entry) == 1 && (entry.flags & MAIL_SEGMENT) &&
+          !(entry.flags & MAIL_DELETED) && entry.segment < segments)
+      {
+         live[entry.segment] += entry.size;
+      }
+   }
+
+   int chosen = 0;
+   for (uint32_t segment = 0; segment < segments; ++segment)
+   {
+      snprintf(path, sizeof(path), "%s/log/%u", mailbox, segment);
+      if (stat(path, &status) == -1)
+      {
+         continue;
+      }
+      off_t dead = status.st_size - live[segment];
+      if ((dead >= SEGMENT_COMPACT_MIN && dead > status.st_size / 2) || (live[segment] == 0 && segment != segments - 1))
+      {
+         compact[segment] = 1;
+         ++chosen;
+      }
+   }
+   if (chosen > 0 && compact[segments - 1])
+   {
+      ++index.header.segment;
+      mailIndexSave(&index);
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // move the survivors, a READ that opened the old segment before keeps
+   // reading it, the file only goes away when it is closed
+   // the bytes are moved as they are, a compressed message stays compressed
+   // the survivors go to first and, if it fills up, the segments after it
+   uint32_t first = index.header.segment;
+   int moved = 0;
+   for (int number = 1; number <= slots && chosen > 0; ++number)
+   {
+      if (mailIndexRead(&index, number, &entry) != 1 || !(entry.flags & MAIL_SEGMENT) ||
+          (entry.flags & MAIL_DELETED) || entry.segment >= segments || !compact[entry.segment])
+      {
+         continue;
+      }
+      uint32_t from = entry.segment;
+      snprintf(path, sizeof(path), "%s/log/%u", mailbox, from);
+      int in = open(path, O_RDONLY | O_CLOEXEC);
+      struct mailSource source = {NULL, in, entry.offset, entry.size, NULL, 0, "", NULL};
+      if (in == -1 || segmentAppend(&index, mailbox, &entry, &source, entry.flags & MAIL_COMPRESSED) == -1 ||
+          mailIndexWrite(&index, number, &entry) == -1)
+      {
+         ///////////////////////////////////////////////////////////////////////////////
+         // the segment can't be removed anymore, try again next time
+         perror("compaction - move message");
+         compact[from] = 0;
+      }
+      else
+      {
+         ++moved;
+      }
+      if (in != -1)
+      {
+         close(in);
+      }
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the moved messages must be on disk before the only other copy goes away:
+   // every segment they went to, the names of new segments and the index
+   if (moved > 0)
+   {
+      int failed = 0;
+      for (uint32_t segment = first; segment <= index.header.segment && !failed; ++segment)
+      {
+         snprintf(path, sizeof(path), "%s/log/%u", mailbox, segment);
+         failed = groupCommitSyncPath(path) == -1;
+      }
+      snprintf(path, sizeof(path), "%s/log", mailbox);
+      if (failed || groupCommitSyncPath(path) == -1 || fdatasync(index.fd) == -1)
+      {
+         perror("compaction - sync");
+         memset(compact, 0, segments);
+      }
+   }
+
+   for (uint32_t segment = 0; segment < segments; ++segment)
+   {
+      if (compact[segment])
+      {
+         snprintf(path, sizeof(path), "%s/log/%u", mailbox, segment);
+         if (unlink(path) == -1)
+         {
+            perror("compaction - unlink segment");
+         }
+      }
+   }
+   if (chosen > 0)
+   {
+      logInfo("compacted %s: %d segments, %d messages moved\n", mailbox, chosen, moved);
+   }
+
+   free(live);
+   free(compact);
+   mailIndexClose(&index);
+}
@@ -0,0 +1,145 @@
+#include <sys/types.h>
+#include <sys/random.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include "sessiontoken.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // the key is written once before the server serves anybody and only read
+   // afterwards, the counters are updated atomically
+
+#define KEY_LENGTH 32
+#define SIGNATURE_LENGTH 64
+
+static unsigned char key[KEY_LENGTH];
+static int tokenLifetime = 0;
+
+static unsigned long issued = 0;
+static unsigned long accepted = 0;
+static unsigned long rejected = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static int sign(const char* data, int length, char* signature);
+static int reject();
+
+///////////////////////////////////////////////////////////////////////////////
+
+int tokenInit(int lifetime)
+{
+   tokenLifetime = 0;
+   if (lifetime <= 0)
+   {
+      return 0;
+   }
+   if (getrandom(key, sizeof(key), 0) != sizeof(key))
+   {
+      perror("getrandom token key");
+      return -1;
+   }
+   tokenLifetime = lifetime;
+   return 0;
+}
+
+int tokenEnabled()
+{
+   return tokenLifetime > 0;
+}
+
+int tokenIssue(const char* uid, char* token)
+{
+   if (tokenLifetime <= 0)
+   {
+      return -1;
+   }
+   int length = snprintf(token, TOKEN_MAX, "%s:%lld:", uid, (long long)time(NULL) + tokenLifetime);
+   if (length + SIGNATURE_LENGTH >= TOKEN_MAX || sign(token, length - 1, token + length) == -1)
+   {
+      return -1;
+   }
+   __atomic_add_fetch(&issued, 1, __ATOMIC_RELAXED);
+   return length + SIGNATURE_LENGTH;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the signature is the last field and the expiry the one before it, the
+   // uid is everything in front of them (it may contain colons)
+int tokenVerify(const char* token, int length, char* uid, size_t size)
+{
+   char expected[SIGNATURE_LENGTH + 1];
+
+   if (tokenLifetime <= 0 || length <= SIGNATURE_LENGTH + 2 || length >= TOKEN_MAX)
+   {
+      return reject();
+   }
+   const char* signature = token + length - SIGNATURE_LENGTH;
+   if (signature[-1] != ':')
+   {
+      return reject();
+   }
+   const char* expires = signature - 1;
+   while (expires > token && expires[-1] != ':')
+   {
+      --expires;
+   }
+   if (expires - 1 <= token || sign(token, signature - 1 - token, expected) == -1 ||
+       CRYPTO_memcmp(expected, signature, SIGNATURE_LENGTH) != 0)
+   {
+      return reject();
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // the signature is right, so the fields are the ones tokenIssue wrote
+   if (strtoll(expires, NULL, 10) < (long long)time(NULL))
+   {
+      return reject();
+   }
+   int uidLength = expires - 1 - token;
+   if ((size_t)uidLength >= size)
+   {
+      return reject();
+   }
+   memcpy(uid, token, uidLength);
+   uid[uidLength] = '\0';
+   __atomic_add_fetch(&accepted, 1, __ATOMIC_RELAXED);
+   return 1;
+}
+
+void tokenStats(unsigned long* issuedCount, unsigned long* acceptedCount, unsigned long* rejectedCount)
+{
+   *issuedCount = __atomic_load_n(&issued, __ATOMIC_RELAXED);
+   *acceptedCount = __atomic_load_n(&accepted, __ATOMIC_RELAXED);
+   *rejectedCount = __atomic_load_n(&rejected, __ATOMIC_RELAXED);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // writes the HMAC of length bytes of data as SIGNATURE_LENGTH hex digits
+   // and a '\0' to signature
+static int sign(const char* data, int length, char* signature)
+{
+   unsigned char mac[EVP_MAX_MD_SIZE];
+   unsigned int macLength = 0;
+
+   if (HMAC(EVP_sha256(), key, sizeof(key), (const unsigned char *)data, length, mac, &macLength) == NULL ||
+       macLength * 2 != SIGNATURE_LENGTH)
+   {
+      return -1;
+   }
+   for (unsigned int i = 0; i < macLength; ++i)
+   {
+      snprintf(signature + 2 * i, 3, "%02x", mac[i]);
+   }
+   return 0;
+}
+
+static int reject()
+{
+   __atomic_add_fetch(&rejected, 1, __ATOMIC_RELAXED);
+   return 0;
+}
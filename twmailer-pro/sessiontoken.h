@@ -0,0 +1,59 @@
+#ifndef SESSIONTOKEN_H
+#define SESSIONTOKEN_H
+
+#include <stddef.h>
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro session tokens                                               //
+   //                                                                           //
+   // a client that logged in with its password may ask for a token (the      //
+   // TOKEN request) and log in with it on its next connections instead, the   //
+   // server only checks the signature and the expiry, no bind, no directory   //
+   // a token is                                                               //
+   //    <uid>:<expires>:<signature>                                           //
+   // expires in seconds since the epoch, the signature is the HMAC-SHA256 of  //
+   // "<uid>:<expires>" as 64 hex digits, keyed with random bytes drawn once   //
+   // at start, so the tokens of a previous run are worthless and forked       //
+   // children and prefork processes accept each other's tokens               //
+   // like the login cache a token outlives a password change until it        //
+   // expires, the lifetime is the price of not asking the directory          //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // seconds a token is valid by default, and the longest token there is
+#define TOKEN_LIFETIME 3600
+#define TOKEN_MAX 256
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a uid record starting with TOKEN_PREFIX logs in with the token after it
+#define TOKEN_PREFIX "TOKEN "
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // draws the key, lifetime 0 turns tokens off
+   // returns 0 or -1 if there is no randomness to draw it from
+int tokenInit(int lifetime);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 unless tokens are turned off
+int tokenEnabled();
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // writes a token for uid to token (TOKEN_MAX bytes), returns its length or
+   // -1 if tokens are off
+int tokenIssue(const char* uid, char* token);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 and copies the uid of the token to uid (size bytes) if the
+   // signature is right and the token has not expired, 0 otherwise
+   // the signatures are compared in constant time
+int tokenVerify(const char* token, int length, char* uid, size_t size);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // tokens handed out, logins with a valid token and with an invalid one
+void tokenStats(unsigned long* issued, unsigned long* accepted, unsigned long* rejected);
+
+#endif
@@ -0,0 +1,366 @@
+#define _XOPEN_SOURCE 700 // nftw
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "mailstore.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro store benchmark                                              //
+   //                                                                           //
+   // stores messages the way a SEND of the server does (body store, outbox of //
+   // the sender, then the inbox of the receiver) from a few threads at once,  //
+   // without network and ldap, once without syncing and once for every group  //
+   // commit window, and prints how many messages per second made it           //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define THREADS 16
+#define MESSAGES 500
+#define BODY_SIZE 2048
+#define USERS 8
+#define DIRECTORY "/tmp/storebench"
+#define MAX_WINDOWS 16
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // one round: every thread stores messages messages from its own sender
+struct round{
+   char directory[PATH_MAX];
+   int durable;
+   int messages;
+   int users;
+   const char* body;
+   int bodySize;
+   int failed;
+};
+
+struct sender{
+   pthread_t thread;
+   int number;
+   struct round* round;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+void printUsage();
+int runRound(struct round* round, int threads, double* seconds);
+void *senderLoop(void *data);
+int createMailbox(const char* directory, const char* user);
+int removeEntry(const char* path, const struct stat* status, int type, struct FTW* position);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+   int threads = THREADS;
+   int bodySize = BODY_SIZE;
+   int windows[MAX_WINDOWS];
+   int windowCount = 0;
+   const char* directory = DIRECTORY;
+   struct round round;
+   int option;
+
+   memset(&round, 0, sizeof(round));
+   round.messages = MESSAGES;
+   round.users = USERS;
+
+   struct option longOptions[] = {
+      {"threads", required_argument, NULL, 't'},
+      {"messages", required_argument, NULL, 'n'},
+      {"body-size", required_argument, NULL, 'b'},
+      {"users", required_argument, NULL, 'u'},
+      {"store", required_argument, NULL, 's'},
+      {"directory", required_argument, NULL, 'd'},
+      {"commit-window", required_argument, NULL, 'W'},
+      {NULL, 0, NULL, 0}
+   };
+   while ((option = getopt_long(argc, argv, "t:n:b:u:s:d:W:", longOptions, NULL)) != -1)
+   {
+      switch (option)
+      {
+         case 't':
+            threads = atoi(optarg);
+            break;
+         case 'n':
+            round.messages = atoi(optarg);
+            break;
+         case 'b':
+            bodySize = atoi(optarg);
+            break;
+         case 'u':
+            round.users = atoi(optarg);
+            break;
+         case 's':
+            if (mailStoreUse(optarg) == -1)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            break;
+         case 'd':
+            directory = optarg;
+            break;
+         case 'W':
+            if (windowCount == MAX_WINDOWS || atoi(optarg) < 0)
+            {
+               printUsage();
+               return EXIT_FAILURE;
+            }
+            windows[windowCount++] = atoi(optarg);
+            break;
+         default:
+            printUsage();
+            return EXIT_FAILURE;
+      }
+   }
+   if (threads < 1 || round.messages < 1 || bodySize < 1 || round.users < 1)
+   {
+      printUsage();
+      return EXIT_FAILURE;
+   }
+   if (windowCount == 0)
+   {
+      int defaults[] = {0, 100, 500, 1000, 5000};
+      windowCount = sizeof(defaults) / sizeof(defaults[0]);
+      memcpy(windows, defaults, sizeof(defaults));
+   }
+
+   char* body = malloc(bodySize);
+   if (body == NULL)
+   {
+      perror("malloc body");
+      return EXIT_FAILURE;
+   }
+   for (int i = 0; i < bodySize; ++i)
+   {
+      body[i] = 'a' + i % 26;
+   }
+   body[bodySize - 1] = '\n';
+   round.body = body;
+   round.bodySize = bodySize;
+
+   if (mkdir(directory, 0777) == -1 && errno != EEXIST)
+   {
+      perror("mkdir directory");
+      return EXIT_FAILURE;
+   }
+   printf("%d threads, %d messages each, %d bytes, %d receivers\n", threads, round.messages, bodySize, round.users);
+   printf("%-10s %10s %12s %8s %8s %8s\n", "window", "seconds", "messages/s", "groups", "syncs", "per group");
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // round -1 doesn't sync at all, it shows what durability costs
+   for (int i = -1; i < windowCount; ++i)
+   {
+      double seconds;
+      unsigned long groupsBefore, requestsBefore, syncsBefore;
+      unsigned long groups, requests, syncs;
+
+      round.durable = i >= 0;
+      snprintf(round.directory, sizeof(round.directory), "%s/round%d", directory, i + 1);
+      if (round.durable)
+      {
+         groupCommitConfigure(windows[i]);
+      }
+      groupCommitStats(&groupsBefore, &requestsBefore, &syncsBefore);
+      if (runRound(&round, threads, &seconds) == -1)
+      {
+         return EXIT_FAILURE;
+      }
+      groupCommitStop();
+      groupCommitStats(&groups, &requests, &syncs);
+      groups -= groupsBefore;
+      requests -= requestsBefore;
+      syncs -= syncsBefore;
+
+      char label[32];
+      if (round.durable)
+      {
+         snprintf(label, sizeof(label), "%dus", windows[i]);
+      }
+      else
+      {
+         snprintf(label, sizeof(label), "no sync");
+      }
+      printf("%-10s %10.3f %12.0f %8lu %8lu %8.1f%s\n", label, seconds,
+             (double)threads * round.messages / seconds, groups, syncs,
+             groups > 0 ? (double)requests / groups : 0.0,
+             round.failed ? "  (failures)" : "");
+      nftw(round.directory, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+   }
+   free(body);
+   return EXIT_SUCCESS;
+}
+
+void printUsage()
+{
+   printf("Usage: ./storebench [-t|--threads <count>] [-n|--messages <count>] [-b|--body-size <bytes>]\n");
+   printf("                    [-u|--users <count>] [-s|--store maildir|segment] [-d|--directory <path>]\n");
+   printf("                    [-W|--commit-window <microseconds>]...\n");
+   printf("  -t, --threads    threads that store at the same time, like concurrent SENDs (default %d)\n", THREADS);
+   printf("  -n, --messages   messages every thread stores (default %d)\n", MESSAGES);
+   printf("  -b, --body-size  bytes of every message (default %d)\n", BODY_SIZE);
+   printf("  -u, --users      receiving mailboxes (default %d)\n", USERS);
+   printf("  -s, --store      storage backend (default %s)\n", MAIL_STORE);
+   printf("  -d, --directory  where the mailboxes are created and removed again (default %s)\n", DIRECTORY);
+   printf("  -W, --commit-window  a window to measure, can be given more than once\n");
+   printf("                   (default 0, 100, 500, 1000 and 5000)\n");
+}
+
+int runRound(struct round* round, int threads, double* seconds)
+{
+   struct sender senders[threads];
+   struct timespec start, end;
+   char user[32];
+
+   if (mkdir(round->directory, 0777) == -1 && errno != EEXIST)
+   {
+      perror("mkdir round");
+      return -1;
+   }
+   for (int i = 0; i < round->users; ++i)
+   {
+      snprintf(user, sizeof(user), "receiver%d", i);
+      if (createMailbox(round->directory, user) == -1)
+      {
+         return -1;
+      }
+   }
+   for (int i = 0; i < threads; ++i)
+   {
+      snprintf(user, sizeof(user), "sender%d", i);
+      if (createMailbox(round->directory, user) == -1)
+      {
+         return -1;
+      }
+   }
+   round->failed = 0;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < threads; ++i)
+   {
+      senders[i].number = i;
+      senders[i].round = round;
+      if (pthread_create(&senders[i].thread, NULL, senderLoop, &senders[i]) != 0)
+      {
+         perror("pthread_create error");
+         return -1;
+      }
+   }
+   for (int i = 0; i < threads; ++i)
+   {
+      pthread_join(senders[i].thread, NULL);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   *seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // what deliveryCommit and sessionCommit of the server do for every SEND
+void *senderLoop(void *data)
+{
+   struct sender* sender = (struct sender *)data;
+   struct round* round = sender->round;
+   struct commitRequest commit;
+   struct mailSource source;
+   struct mailEntry entry;
+   char mailbox[PATH_MAX + 32];
+   char subject[64];
+   char header[64];
+   char* body = malloc(round->bodySize);
+
+   if (body == NULL)
+   {
+      perror("malloc body");
+      __atomic_store_n(&round->failed, 1, __ATOMIC_RELAXED);
+      return NULL;
+   }
+
+   memset(&commit, 0, sizeof(commit));
+   memset(&source, 0, sizeof(source));
+   memcpy(body, round->body, round->bodySize);
+   source.data = body;
+   source.fd = -1;
+   source.length = round->bodySize;
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // every message is different, the same body would only be stored once
+   for (int i = 0; i < round->messages; ++i)
+   {
+      struct commitRequest* request = round->durable ? &commit : NULL;
+      snprintf(subject, sizeof(subject), "subject %d", i % 10);
+      snprintf(mailbox, sizeof(mailbox), "%s/sender%d", round->directory, sender->number);
+      snprintf(header, sizeof(header), "from: sender%d\nmessage %d\n", sender->number, i);
+      int headerLength = strlen(header);
+      memcpy(body, header, headerLength < round->bodySize ? headerLength : round->bodySize);
+      source.hash = mailStoreHash(MAIL_HASH_SEED, body, round->bodySize);
+      int failed = mailStoreBody(round->directory, &source) == -1;
+      if (!failed)
+      {
+         failed = mailStoreKeep(mailbox, subject, &source, request) == -1;
+      }
+
+      memset(&entry, 0, sizeof(entry));
+      snprintf(entry.sender, sizeof(entry.sender), "sender%d", sender->number);
+      snprintf(entry.subject, sizeof(entry.subject), "%s", subject);
+      entry.time = time(NULL);
+      snprintf(mailbox, sizeof(mailbox), "%s/receiver%d", round->directory, (sender->number + i) % round->users);
+      if (!failed)
+      {
+         failed = mailStoreAdd(mailbox, &entry, &source, request) == -1;
+      }
+      if (!failed && request != NULL)
+      {
+         failed = groupCommitWait(request) == -1;
+      }
+      if (request != NULL)
+      {
+         groupCommitReset(request);
+      }
+      if (failed)
+      {
+         perror("store message");
+         __atomic_store_n(&round->failed, 1, __ATOMIC_RELAXED);
+      }
+   }
+   groupCommitRelease(&commit);
+   free(body);
+   return NULL;
+}
+
+int createMailbox(const char* directory, const char* user)
+{
+   char path[PATH_MAX + 64];
+   const char* parts[] = {"", "/in", "/out", "/tmp"};
+
+   for (unsigned int i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i)
+   {
+      snprintf(path, sizeof(path), "%s/%s%s", directory, user, parts[i]);
+      if (mkdir(path, 0777) == -1 && errno != EEXIST)
+      {
+         perror("mkdir mailbox");
+         return -1;
+      }
+   }
+   return 0;
+}
+
+int removeEntry(const char* path, const struct stat* status, int type, struct FTW* position)
+{
+   if (remove(path) == -1)
+   {
+      perror("remove");
+   }
+   return 0;
+}
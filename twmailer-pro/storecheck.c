@@ -0,0 +1,302 @@
+#define _XOPEN_SOURCE 700 // nftw
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <ftw.h>
+#include <getopt.h>
+#include "mailstore.h"
+#include "mailcompress.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro store check                                                  //
+   //                                                                           //
+   // compaction: stores compressed messages with the segment backend,       //
+   // deletes the large one so its segment is mostly dead, compacts the       //
+   // mailbox and reads the message that was moved back: it has to come out  //
+   // as it was sent                                                          //
+   // outbox: sends two messages with the same subject with the maildir       //
+   // backend, the second one without a body to link to, so the outbox falls //
+   // back to writing it: the message the first receiver got must not change //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define DIRECTORY "/tmp/storecheck"
+#define KEPT_SIZE 4096
+#define DEAD_SIZE (1024 * 1024)
+#define COMPRESSION_LEVEL 3
+
+///////////////////////////////////////////////////////////////////////////////
+
+void printUsage();
+int checkCompaction(const char* directory);
+int checkOutbox(const char* directory);
+int createMailbox(const char* directory, const char* user);
+int storeMessage(const char* directory, const char* mailbox, const char* body, int length, const char* subject);
+int checkMessage(const char* mailbox, int number, const char* body, int length);
+int removeEntry(const char* path, const struct stat* status, int type, struct FTW* position);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+   const char* directory = DIRECTORY;
+   int option;
+
+   struct option longOptions[] = {
+      {"directory", required_argument, NULL, 'd'},
+      {NULL, 0, NULL, 0}
+   };
+   while ((option = getopt_long(argc, argv, "d:", longOptions, NULL)) != -1)
+   {
+      switch (option)
+      {
+         case 'd':
+            directory = optarg;
+            break;
+         default:
+            printUsage();
+            return EXIT_FAILURE;
+      }
+   }
+
+   if (mkdir(directory, 0777) == -1 && errno != EEXIST)
+   {
+      perror("mkdir directory");
+      return EXIT_FAILURE;
+   }
+   if (mailCompressInit(directory, COMPRESSION_LEVEL, NULL) == -1)
+   {
+      fprintf(stderr, "compression not available\n");
+      return EXIT_FAILURE;
+   }
+
+   int compaction = checkCompaction(directory);
+   printf("compaction of a compressed message: %s\n", compaction == -1 ? "FAILED" : "ok");
+   int outbox = checkOutbox(directory);
+   printf("outbox written without a body: %s\n", outbox == -1 ? "FAILED" : "ok");
+   nftw(directory, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+   return compaction == -1 || outbox == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void printUsage()
+{
+   printf("Usage: ./storecheck [-d|--directory <path>]\n");
+   printf("  -d, --directory  where the mailbox is created and removed again (default %s)\n", DIRECTORY);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the kept message compresses well, the dead one (hex digits) only to about
+   // half, which is still far more than a segment needs to be compacted
+int checkCompaction(const char* directory)
+{
+   char mailbox[PATH_MAX];
+   struct mailEntry entry;
+
+   char* kept = malloc(KEPT_SIZE);
+   char* dead = malloc(DEAD_SIZE);
+   if (kept == NULL || dead == NULL)
+   {
+      perror("malloc body");
+      free(kept);
+      free(dead);
+      return -1;
+   }
+   for (int i = 0; i < KEPT_SIZE; ++i)
+   {
+      kept[i] = i % 64 == 63 ? '\n' : 'a' + i % 64 % 26;
+   }
+   srand(1);
+   for (int i = 0; i < DEAD_SIZE; ++i)
+   {
+      dead[i] = "0123456789abcdef"[rand() % 16];
+   }
+
+   int failed = 0;
+   snprintf(mailbox, sizeof(mailbox), "%s/receiver", directory);
+   if (mailStoreUse("segment") == -1 || createMailbox(directory, "receiver") == -1)
+   {
+      failed = 1;
+   }
+   memset(&entry, 0, sizeof(entry));
+   int keptNumber = failed ? -1 : storeMessage(directory, mailbox, kept, KEPT_SIZE, "kept");
+   int deadNumber = failed ? -1 : storeMessage(directory, mailbox, dead, DEAD_SIZE, "dead");
+   if (!failed && (keptNumber == -1 || deadNumber == -1 || mailStoreRemove(mailbox, deadNumber) != 1))
+   {
+      perror("store messages");
+      failed = 1;
+   }
+   if (!failed && (mailIndexGet(mailbox, keptNumber, &entry) != 1 || !(entry.flags & MAIL_COMPRESSED)))
+   {
+      fprintf(stderr, "the kept message was not stored compressed\n");
+      failed = 1;
+   }
+   uint32_t before = entry.segment;
+
+   if (!failed)
+   {
+      segmentCompact(mailbox);
+   }
+   if (!failed && (mailIndexGet(mailbox, keptNumber, &entry) != 1 || entry.segment == before))
+   {
+      fprintf(stderr, "the segment was not compacted\n");
+      failed = 1;
+   }
+   if (!failed && !(entry.flags & MAIL_COMPRESSED))
+   {
+      fprintf(stderr, "the moved message lost MAIL_COMPRESSED\n");
+      failed = 1;
+   }
+   if (!failed && checkMessage(mailbox, keptNumber, kept, KEPT_SIZE) == -1)
+   {
+      failed = 1;
+   }
+   free(kept);
+   free(dead);
+   return failed ? -1 : 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the first message is linked to its body by the outbox of the sender and
+   // the inbox of the receiver, the second one has no body (as if the link
+   // failed or all names of its hash were taken), so mailStoreKeep writes it
+   // and must replace out/<subject> instead of writing into the shared body
+int checkOutbox(const char* directory)
+{
+   char sender[PATH_MAX];
+   char receiver[PATH_MAX];
+   char first[] = "from: sender\nthe first message\n";
+   char second[] = "from: sender\nthe second message, with the same subject\n";
+   struct mailSource source;
+   struct mailEntry entry;
+
+   snprintf(sender, sizeof(sender), "%s/sender", directory);
+   snprintf(receiver, sizeof(receiver), "%s/firstreceiver", directory);
+   if (mailStoreUse("maildir") == -1 || createMailbox(directory, "sender") == -1 ||
+       createMailbox(directory, "firstreceiver") == -1)
+   {
+      return -1;
+   }
+
+   memset(&source, 0, sizeof(source));
+   source.data = first;
+   source.fd = -1;
+   source.length = strlen(first);
+   source.hash = mailStoreHash(MAIL_HASH_SEED, first, source.length);
+   memset(&entry, 0, sizeof(entry));
+   snprintf(entry.sender, sizeof(entry.sender), "sender");
+   snprintf(entry.subject, sizeof(entry.subject), "same");
+   entry.time = time(NULL);
+   int number = -1;
+   if (mailStoreBody(directory, &source) == 0 && source.body[0] != '\0' &&
+       mailStoreKeep(sender, "same", &source, NULL) == 0)
+   {
+      number = mailStoreAdd(receiver, &entry, &source, NULL);
+   }
+   mailStoreDone(&source);
+   if (number == -1)
+   {
+      perror("store the first message");
+      return -1;
+   }
+
+   memset(&source, 0, sizeof(source));
+   source.data = second;
+   source.fd = -1;
+   source.length = strlen(second);
+   source.hash = mailStoreHash(MAIL_HASH_SEED, second, source.length);
+   if (mailStoreKeep(sender, "same", &source, NULL) == -1)
+   {
+      perror("keep the second message");
+      return -1;
+   }
+   return checkMessage(receiver, number, first, strlen(first));
+}
+
+int createMailbox(const char* directory, const char* user)
+{
+   char path[PATH_MAX + 64];
+   const char* parts[] = {"", "/in", "/out", "/tmp"};
+
+   for (unsigned int i = 0; i < sizeof(parts) / sizeof(parts[0]); ++i)
+   {
+      snprintf(path, sizeof(path), "%s/%s%s", directory, user, parts[i]);
+      if (mkdir(path, 0777) == -1 && errno != EEXIST)
+      {
+         perror("mkdir mailbox");
+         return -1;
+      }
+   }
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // what deliveryCommit of the server does for one receiver, returns the
+   // message number or -1
+int storeMessage(const char* directory, const char* mailbox, const char* body, int length, const char* subject)
+{
+   struct mailSource source;
+   struct mailEntry entry;
+
+   memset(&source, 0, sizeof(source));
+   source.data = body;
+   source.fd = -1;
+   source.length = length;
+   source.hash = mailStoreHash(MAIL_HASH_SEED, body, length);
+
+   memset(&entry, 0, sizeof(entry));
+   snprintf(entry.sender, sizeof(entry.sender), "sender");
+   snprintf(entry.subject, sizeof(entry.subject), "%s", subject);
+   entry.time = time(NULL);
+
+   int number = -1;
+   if (mailStoreBody(directory, &source) != -1)
+   {
+      number = mailStoreAdd(mailbox, &entry, &source, NULL);
+   }
+   mailStoreDone(&source);
+   return number;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // reads the message the way READ does and compares it with body
+int checkMessage(const char* mailbox, int number, const char* body, int length)
+{
+   int fd;
+   off_t offset, size;
+
+   if (mailStoreOpen(mailbox, number, &fd, &offset, &size) != 1)
+   {
+      perror("open message");
+      return -1;
+   }
+   char* message = malloc(length);
+   ssize_t got = message != NULL && size == length ? pread(fd, message, length, offset) : -1;
+   close(fd);
+
+   int result = 0;
+   if (got != length || memcmp(message, body, length) != 0)
+   {
+      fprintf(stderr, "the message reads back as %lld bytes that are not the ones sent\n", (long long)size);
+      result = -1;
+   }
+   free(message);
+   return result;
+}
+
+int removeEntry(const char* path, const struct stat* status, int type, struct FTW* position)
+{
+   if (remove(path) == -1)
+   {
+      perror("remove");
+   }
+   return 0;
+}
@@ -0,0 +1,929 @@
+#define _GNU_SOURCE // memmem
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include "framing.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro load generator                                               //
+   //                                                                           //
+   // opens many sessions at once from one thread (non blocking sockets and    //
+   // epoll, like the server), logs every one of them in and lets it send a    //
+   // mix of SEND, LIST, READ and DEL requests, one at a time, until the time  //
+   // is up, then prints the throughput and the latency of every command as    //
+   // percentiles and a histogram                                              //
+   // the server should check the logins against an auth file (myserver -A),  //
+   // the same file tells the benchmark which users it can log in as           //
+   // against the directory more sessions per user log in at once than the    //
+   // login limit lets through, start the server with -r 0 -R 0 then          //
+   // only framing is spoken, the server has to offer FRAMES/1                 //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define PORT 6543
+#define CONNECTIONS 100
+#define DURATION 10
+#define BODY_SIZE 256
+#define MIX "20:40:30:10"
+#define MAX_USERS 65536
+#define MAX_EVENTS 256
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // message numbers a session remembers from its last LIST for READ and DEL
+#define MAX_NUMBERS 64
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // seconds the sessions get to say goodbye after the time is up
+#define GRACE 5
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // latencies are counted in microseconds in log linear buckets: values below
+   // HISTOGRAM_SUB have a bucket each, above that every power of two is split
+   // into HISTOGRAM_SUB buckets, so a percentile is off by at most 1/16
+#define HISTOGRAM_SUB 16
+#define HISTOGRAM_SHIFT 4
+#define HISTOGRAM_POWERS 40
+#define HISTOGRAM_SIZE (HISTOGRAM_SUB * HISTOGRAM_POWERS)
+
+enum benchCommand{
+   connectCommand,
+   loginCommand,
+   sendCommand,
+   listCommand,
+   readCommand,
+   deleteCommand,
+   commandCount
+};
+
+static const char* commandNames[commandCount] = {"CONNECT", "LOGIN", "SEND", "LIST", "READ", "DEL"};
+
+enum connectionState{
+   connecting,
+   awaitingWelcome,
+   awaitingLogin,
+   running,
+   quitting,
+   closed
+};
+
+struct histogram{
+   unsigned long counts[HISTOGRAM_SIZE];
+   unsigned long total;
+   unsigned long errors;
+   long max;
+};
+
+struct user{
+   char* uid;
+   char* password;
+};
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // in holds what arrived and wasn't handled yet, out the request that is
+   // being sent, pending the command whose answer is awaited since started
+struct connection{
+   int socket;
+   enum connectionState state;
+   const struct user* user;
+   char* in;
+   int inLength;
+   int inSize;
+   char* out;
+   int outLength;
+   int outSent;
+   int outSize;
+   enum benchCommand pending;
+   struct timespec started;
+   int numbers[MAX_NUMBERS];
+   int numberCount;
+};
+
+struct bench{
+   struct sockaddr_in address;
+   struct user users[MAX_USERS];
+   int userCount;
+   int weights[4];
+   int weightTotal;
+   int bodySize;
+   char* body;
+   int stopping;
+   int open;
+   struct histogram histograms[commandCount];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+void printUsage();
+int loadUsers(struct bench* bench, const char* path);
+int parseMix(struct bench* bench, const char* mix);
+int startConnection(struct bench* bench, struct connection* connection, int epollFd, int number);
+void connectionEvent(struct bench* bench, struct connection* connection);
+int connectionReceive(struct bench* bench, struct connection* connection);
+int connectionFlush(struct connection* connection);
+void connectionClose(struct bench* bench, struct connection* connection);
+int handleAnswer(struct bench* bench, struct connection* connection, const char* answer, int length);
+int queueRequest(struct bench* bench, struct connection* connection);
+int queueFrame(struct connection* connection, const char* data, int length);
+int reserve(char** buffer, int* size, int length);
+void rememberNumbers(struct connection* connection, const char* answer, int length);
+long elapsedMicros(const struct timespec* start, const struct timespec* end);
+void histogramAdd(struct histogram* histogram, long micros, int error);
+long histogramPercentile(const struct histogram* histogram, double percentile);
+long bucketValue(int bucket);
+void printReport(struct bench* bench, double seconds);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+   static struct bench bench;
+   int connectionCount = CONNECTIONS;
+   int duration = DURATION;
+   const char* authFile = NULL;
+   const char* uid = NULL;
+   const char* password = NULL;
+   const char* mix = MIX;
+   struct rlimit limit;
+   int option;
+
+   bench.bodySize = BODY_SIZE;
+   struct option longOptions[] = {
+      {"connections", required_argument, NULL, 'c'},
+      {"duration", required_argument, NULL, 'd'},
+      {"mix", required_argument, NULL, 'm'},
+      {"body-size", required_argument, NULL, 's'},
+      {"auth-file", required_argument, NULL, 'A'},
+      {"user", required_argument, NULL, 'u'},
+      {"password", required_argument, NULL, 'p'},
+      {NULL, 0, NULL, 0}
+   };
+   while ((option = getopt_long(argc, argv, "c:d:m:s:A:u:p:", longOptions, NULL)) != -1)
+   {
+      switch (option)
+      {
+         case 'c':
+            connectionCount = atoi(optarg);
+            break;
+         case 'd':
+            duration = atoi(optarg);
+            break;
+         case 'm':
+            mix = optarg;
+            break;
+         case 's':
+            bench.bodySize = atoi(optarg);
+            break;
+         case 'A':
+            authFile = optarg;
+            break;
+         case 'u':
+            uid = optarg;
+            break;
+         case 'p':
+            password = optarg;
+            break;
+         default:
+            printUsage();
+            return EXIT_FAILURE;
+      }
+   }
+   if (connectionCount < 1 || duration < 1 || bench.bodySize < 1 || parseMix(&bench, mix) == -1 ||
+       (authFile == NULL) == (uid == NULL || password == NULL))
+   {
+      printUsage();
+      return EXIT_FAILURE;
+   }
+   if (authFile != NULL && loadUsers(&bench, authFile) == -1)
+   {
+      return EXIT_FAILURE;
+   }
+   if (authFile == NULL)
+   {
+      bench.users[0].uid = (char*)uid;
+      bench.users[0].password = (char*)password;
+      bench.userCount = 1;
+   }
+
+   memset(&bench.address, 0, sizeof(bench.address));
+   bench.address.sin_family = AF_INET;
+   bench.address.sin_port = htons(PORT);
+   if (inet_aton(optind < argc ? argv[optind] : "127.0.0.1", &bench.address.sin_addr) == 0)
+   {
+      printUsage();
+      return EXIT_FAILURE;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // every session needs a descriptor
+   if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)connectionCount + 16)
+   {
+      limit.rlim_cur = limit.rlim_max < (rlim_t)connectionCount + 16 ? limit.rlim_max : (rlim_t)connectionCount + 16;
+      if (setrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur < (rlim_t)connectionCount + 16)
+      {
+         fprintf(stderr, "only %ld descriptors allowed, use fewer connections\n", (long)limit.rlim_cur);
+         return EXIT_FAILURE;
+      }
+   }
+
+   bench.body = malloc(bench.bodySize);
+   struct connection* connections = calloc(connectionCount, sizeof(struct connection));
+   if (bench.body == NULL || connections == NULL)
+   {
+      perror("malloc");
+      return EXIT_FAILURE;
+   }
+   for (int i = 0; i < bench.bodySize; ++i)
+   {
+      bench.body[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+   }
+   srand(time(NULL));
+
+   int epollFd = epoll_create1(0);
+   if (epollFd == -1)
+   {
+      perror("epoll_create1 error");
+      return EXIT_FAILURE;
+   }
+
+   printf("%d connections for %d seconds, mix SEND:LIST:READ:DEL %s, %d byte messages, %d users\n",
+          connectionCount, duration, mix, bench.bodySize, bench.userCount);
+   struct timespec start, now, end;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (int i = 0; i < connectionCount; ++i)
+   {
+      if (startConnection(&bench, &connections[i], epollFd, i) == -1)
+      {
+         connections[i].state = closed;
+      }
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // once the time is up every session quits after its current request,
+   // the measurement ends there, the goodbyes don't count
+   struct epoll_event events[MAX_EVENTS];
+   int measured = 0;
+   while (bench.open > 0)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long elapsed = elapsedMicros(&start, &now);
+      if (!bench.stopping && elapsed >= duration * 1000000L)
+      {
+         bench.stopping = 1;
+         end = now;
+         measured = 1;
+      }
+      if (elapsed >= (duration + GRACE) * 1000000L)
+      {
+         printf("%d sessions did not finish in time\n", bench.open);
+         break;
+      }
+      int ready = epoll_wait(epollFd, events, MAX_EVENTS, 100);
+      if (ready == -1)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("epoll_wait error");
+         break;
+      }
+      for (int i = 0; i < ready; ++i)
+      {
+         connectionEvent(&bench, (struct connection *)events[i].data.ptr);
+      }
+   }
+   if (!measured)
+   {
+      clock_gettime(CLOCK_MONOTONIC, &end);
+   }
+
+   printReport(&bench, elapsedMicros(&start, &end) / 1e6);
+   for (int i = 0; i < connectionCount; ++i)
+   {
+      if (connections[i].state != closed)
+      {
+         close(connections[i].socket);
+      }
+      free(connections[i].in);
+      free(connections[i].out);
+   }
+   free(connections);
+   free(bench.body);
+   close(epollFd);
+   return EXIT_SUCCESS;
+}
+
+void printUsage()
+{
+   printf("Usage: ./twmailer-bench (-A|--auth-file <path> | -u|--user <uid> -p|--password <password>)\n");
+   printf("                        [-c|--connections <count>] [-d|--duration <seconds>]\n");
+   printf("                        [-m|--mix <send>:<list>:<read>:<del>] [-s|--body-size <bytes>] [ip]\n");
+   printf("  -A, --auth-file    log in as the users of this file (\"<uid> <password>\" lines), start the\n");
+   printf("                     server with the same file (myserver -A) so the directory isn't asked\n");
+   printf("  -u, --user         log every session in as this user instead\n");
+   printf("  -p, --password     password of --user\n");
+   printf("  -c, --connections  sessions open at the same time (default %d)\n", CONNECTIONS);
+   printf("  -d, --duration     seconds the sessions send requests (default %d)\n", DURATION);
+   printf("  -m, --mix          weights of the commands (default %s)\n", MIX);
+   printf("  -s, --body-size    bytes of every SEND (default %d)\n", BODY_SIZE);
+   printf("  ip                 address of the server (default 127.0.0.1)\n");
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the same format the server reads, see authfile.h
+int loadUsers(struct bench* bench, const char* path)
+{
+   FILE* file = fopen(path, "r");
+   char line[512];
+
+   if (file == NULL)
+   {
+      perror("open auth file");
+      return -1;
+   }
+   while (bench->userCount < MAX_USERS && fgets(line, sizeof(line), file) != NULL)
+   {
+      char* uid = strtok(line, " \t\r\n");
+      char* password = strtok(NULL, "\r\n");
+      if (uid == NULL || uid[0] == '#')
+      {
+         continue;
+      }
+      while (password != NULL && (*password == ' ' || *password == '\t'))
+      {
+         ++password;
+      }
+      struct user* user = &bench->users[bench->userCount];
+      user->uid = strdup(uid);
+      user->password = strdup(password != NULL ? password : "");
+      if (user->uid == NULL || user->password == NULL)
+      {
+         perror("strdup");
+         fclose(file);
+         return -1;
+      }
+      ++bench->userCount;
+   }
+   fclose(file);
+   if (bench->userCount == 0)
+   {
+      fprintf(stderr, "no users in %s\n", path);
+      return -1;
+   }
+   return 0;
+}
+
+int parseMix(struct bench* bench, const char* mix)
+{
+   if (sscanf(mix, "%d:%d:%d:%d", &bench->weights[0], &bench->weights[1],
+              &bench->weights[2], &bench->weights[3]) != 4)
+   {
+      return -1;
+   }
+   bench->weightTotal = 0;
+   for (int i = 0; i < 4; ++i)
+   {
+      if (bench->weights[i] < 0)
+      {
+         return -1;
+      }
+      bench->weightTotal += bench->weights[i];
+   }
+   return bench->weightTotal > 0 ? 0 : -1;
+}
+
+int startConnection(struct bench* bench, struct connection* connection, int epollFd, int number)
+{
+   struct epoll_event event;
+   int noDelay = 1;
+
+   connection->user = &bench->users[number % bench->userCount];
+   connection->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+   if (connection->socket == -1)
+   {
+      perror("Socket error");
+      return -1;
+   }
+   setsockopt(connection->socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+   clock_gettime(CLOCK_MONOTONIC, &connection->started);
+   connection->pending = connectCommand;
+   connection->state = connecting;
+   if (connect(connection->socket, (struct sockaddr *)&bench->address, sizeof(bench->address)) == -1 &&
+       errno != EINPROGRESS)
+   {
+      perror("Connect error");
+      close(connection->socket);
+      return -1;
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // edge triggered, every event reads and writes until the socket would block
+   event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+   event.data.ptr = connection;
+   if (epoll_ctl(epollFd, EPOLL_CTL_ADD, connection->socket, &event) == -1)
+   {
+      perror("epoll_ctl error");
+      close(connection->socket);
+      return -1;
+   }
+   ++bench->open;
+   return 0;
+}
+
+void connectionEvent(struct bench* bench, struct connection* connection)
+{
+   if (connection->state == closed)
+   {
+      return;
+   }
+   if (connection->state == connecting)
+   {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      getsockopt(connection->socket, SOL_SOCKET, SO_ERROR, &error, &length);
+      if (error == EINPROGRESS)
+      {
+         return;
+      }
+      if (error != 0)
+      {
+         errno = error;
+         perror("Connect error");
+         histogramAdd(&bench->histograms[connectCommand], 0, 1);
+         connectionClose(bench, connection);
+         return;
+      }
+      connection->state = awaitingWelcome;
+   }
+   if (connectionFlush(connection) == -1 || connectionReceive(bench, connection) == -1 ||
+       connectionFlush(connection) == -1)
+   {
+      connectionClose(bench, connection);
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // reads until the socket would block and handles every complete answer,
+   // returns -1 if the session is over
+int connectionReceive(struct bench* bench, struct connection* connection)
+{
+   while (1)
+   {
+      if (reserve(&connection->in, &connection->inSize, connection->inLength + 4096) == -1)
+      {
+         return -1;
+      }
+      int size = recv(connection->socket, connection->in + connection->inLength,
+                      connection->inSize - connection->inLength, 0);
+      if (size == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+         {
+            return 0;
+         }
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("recv error");
+         return -1;
+      }
+      if (size == 0)
+      {
+         if (connection->state != quitting)
+         {
+            printf("server closed a session\n");
+            histogramAdd(&bench->histograms[connection->pending], 0, 1);
+         }
+         return -1;
+      }
+      connection->inLength += size;
+
+      int used = 0;
+      while (1)
+      {
+         char* data = connection->in + used;
+         int available = connection->inLength - used;
+         if (connection->state == awaitingWelcome)
+         {
+            ///////////////////////////////////////////////////////////////////////////////
+            // the welcome message is not framed, its last line offers framing
+            char* capability = memmem(data, available, FRAME_CAPABILITY "\r\n", strlen(FRAME_CAPABILITY "\r\n"));
+            if (capability == NULL)
+            {
+               break;
+            }
+            used += capability + strlen(FRAME_CAPABILITY "\r\n") - data;
+            if (handleAnswer(bench, connection, data, capability - data) == -1)
+            {
+               return -1;
+            }
+            continue;
+         }
+         if (available < FRAME_HEADER)
+         {
+            break;
+         }
+         int more;
+         uint32_t length = frameDecodeHeader((unsigned char*)data, &more);
+         if ((uint32_t)available - FRAME_HEADER < length)
+         {
+            break;
+         }
+         used += FRAME_HEADER + length;
+         ///////////////////////////////////////////////////////////////////////////////
+         // the server answers with single fragments, the first ones of a longer
+         // answer would only be skipped
+         if (!more && handleAnswer(bench, connection, data + FRAME_HEADER, length) == -1)
+         {
+            return -1;
+         }
+      }
+      connection->inLength -= used;
+      memmove(connection->in, connection->in + used, connection->inLength);
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // sends what is left of out, returns -1 on error
+int connectionFlush(struct connection* connection)
+{
+   while (connection->outSent < connection->outLength)
+   {
+      int sent = send(connection->socket, connection->out + connection->outSent,
+                      connection->outLength - connection->outSent, MSG_NOSIGNAL);
+      if (sent == -1)
+      {
+         if (errno == EAGAIN || errno == EWOULDBLOCK)
+         {
+            return 0;
+         }
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("send error");
+         return -1;
+      }
+      connection->outSent += sent;
+   }
+   connection->outSent = 0;
+   connection->outLength = 0;
+   return 0;
+}
+
+void connectionClose(struct bench* bench, struct connection* connection)
+{
+   close(connection->socket);
+   connection->state = closed;
+   --bench->open;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // counts the answer to the pending command and queues the next request
+   // returns -1 if the session is over
+int handleAnswer(struct bench* bench, struct connection* connection, const char* answer, int length)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   long micros = elapsedMicros(&connection->started, &now);
+   int error = length >= 3 && memcmp(answer, "ERR", 3) == 0;
+
+   switch (connection->state)
+   {
+      case awaitingWelcome:
+         histogramAdd(&bench->histograms[connectCommand], micros, 0);
+         if (queueFrame(connection, FRAME_MAGIC, -1) == -1 ||
+             queueFrame(connection, connection->user->uid, strlen(connection->user->uid)) == -1 ||
+             queueFrame(connection, connection->user->password, strlen(connection->user->password)) == -1)
+         {
+            return -1;
+         }
+         connection->pending = loginCommand;
+         connection->state = awaitingLogin;
+         clock_gettime(CLOCK_MONOTONIC, &connection->started);
+         return 0;
+      case awaitingLogin:
+         error = !(length == 7 && memcmp(answer, "LOGINOK", 7) == 0);
+         histogramAdd(&bench->histograms[loginCommand], micros, error);
+         if (error)
+         {
+            printf("login of %s failed\n", connection->user->uid);
+            return -1;
+         }
+         connection->state = running;
+         break;
+      case running:
+         histogramAdd(&bench->histograms[connection->pending], micros, error);
+         if (connection->pending == listCommand && !error)
+         {
+            rememberNumbers(connection, answer, length);
+         }
+         break;
+      case quitting:
+         return -1;
+      default:
+         return -1;
+   }
+
+   if (bench->stopping)
+   {
+      connection->state = quitting;
+      return queueFrame(connection, "quit\n.", strlen("quit\n."));
+   }
+   return queueRequest(bench, connection);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // picks the next command by its weight, READ and DEL need a number from a
+   // LIST, without one the session lists its mailbox first
+int queueRequest(struct bench* bench, struct connection* connection)
+{
+   char request[256];
+   int pick = rand() % bench->weightTotal;
+   enum benchCommand command = sendCommand;
+
+   for (int i = 0; i < 4; ++i)
+   {
+      if (pick < bench->weights[i])
+      {
+         command = sendCommand + i;
+         break;
+      }
+      pick -= bench->weights[i];
+   }
+   if ((command == readCommand || command == deleteCommand) && connection->numberCount == 0)
+   {
+      command = listCommand;
+   }
+
+   int result = 0;
+   int length = 0;
+   switch (command)
+   {
+      case sendCommand:
+      {
+         ///////////////////////////////////////////////////////////////////////////////
+         // to a random user, so every mailbox fills up
+         const struct user* receiver = &bench->users[rand() % bench->userCount];
+         length = snprintf(request, sizeof(request), "SEND\n%s\nbench\n", receiver->uid);
+         if (reserve(&connection->out, &connection->outSize,
+                     connection->outLength + FRAME_HEADER + length + bench->bodySize + 3) == -1)
+         {
+            return -1;
+         }
+         char* frame = connection->out + connection->outLength;
+         frameEncodeHeader((unsigned char*)frame, length + bench->bodySize + 2, 0);
+         memcpy(frame + FRAME_HEADER, request, length);
+         memcpy(frame + FRAME_HEADER + length, bench->body, bench->bodySize);
+         memcpy(frame + FRAME_HEADER + length + bench->bodySize, "\n.", 2);
+         connection->outLength += FRAME_HEADER + length + bench->bodySize + 2;
+         break;
+      }
+      case listCommand:
+         result = queueFrame(connection, "LIST\n.", strlen("LIST\n."));
+         break;
+      case readCommand:
+         length = snprintf(request, sizeof(request), "READ\n%d\n.",
+                           connection->numbers[rand() % connection->numberCount]);
+         result = queueFrame(connection, request, length);
+         break;
+      case deleteCommand:
+      {
+         int which = rand() % connection->numberCount;
+         length = snprintf(request, sizeof(request), "DEL\n%d\n.", connection->numbers[which]);
+         connection->numbers[which] = connection->numbers[--connection->numberCount];
+         result = queueFrame(connection, request, length);
+         break;
+      }
+      default:
+         break;
+   }
+   connection->pending = command;
+   clock_gettime(CLOCK_MONOTONIC, &connection->started);
+   return result;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // appends data as one frame to out, length -1 appends the magic unframed
+int queueFrame(struct connection* connection, const char* data, int length)
+{
+   int header = length == -1 ? 0 : FRAME_HEADER;
+   if (length == -1)
+   {
+      length = FRAME_MAGIC_LENGTH;
+   }
+   if (reserve(&connection->out, &connection->outSize, connection->outLength + header + length) == -1)
+   {
+      return -1;
+   }
+   if (header > 0)
+   {
+      frameEncodeHeader((unsigned char*)connection->out + connection->outLength, length, 0);
+   }
+   memcpy(connection->out + connection->outLength + header, data, length);
+   connection->outLength += header + length;
+   return 0;
+}
+
+int reserve(char** buffer, int* size, int length)
+{
+   if (*size >= length)
+   {
+      return 0;
+   }
+   int grown = *size > 0 ? *size : 4096;
+   while (grown < length)
+   {
+      grown *= 2;
+   }
+   char* data = realloc(*buffer, grown);
+   if (data == NULL)
+   {
+      perror("realloc");
+      return -1;
+   }
+   *buffer = data;
+   *size = grown;
+   return 0;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // takes the numbers of the "<number>: <subject>" lines of a LIST
+void rememberNumbers(struct connection* connection, const char* answer, int length)
+{
+   const char* end = answer + length;
+   const char* line = memchr(answer, '\n', length);
+
+   connection->numberCount = 0;
+   while (line != NULL && line + 1 < end && connection->numberCount < MAX_NUMBERS)
+   {
+      ++line;
+      int number = 0;
+      const char* digit = line;
+      while (digit < end && *digit >= '0' && *digit <= '9')
+      {
+         number = number * 10 + *digit - '0';
+         ++digit;
+      }
+      if (digit > line && digit < end && *digit == ':')
+      {
+         connection->numbers[connection->numberCount++] = number;
+      }
+      line = memchr(line, '\n', end - line);
+   }
+}
+
+long elapsedMicros(const struct timespec* start, const struct timespec* end)
+{
+   return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+void histogramAdd(struct histogram* histogram, long micros, int error)
+{
+   int bucket;
+
+   if (error)
+   {
+      ++histogram->errors;
+      return;
+   }
+   if (micros < HISTOGRAM_SUB)
+   {
+      bucket = micros < 0 ? 0 : micros;
+   }
+   else
+   {
+      int power = 63 - __builtin_clzl(micros);
+      bucket = (power - HISTOGRAM_SHIFT + 1) * HISTOGRAM_SUB + ((micros >> (power - HISTOGRAM_SHIFT)) & (HISTOGRAM_SUB - 1));
+      if (bucket >= HISTOGRAM_SIZE)
+      {
+         bucket = HISTOGRAM_SIZE - 1;
+      }
+   }
+   ++histogram->counts[bucket];
+   ++histogram->total;
+   if (micros > histogram->max)
+   {
+      histogram->max = micros;
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the smallest value of a bucket
+long bucketValue(int bucket)
+{
+   if (bucket < HISTOGRAM_SUB)
+   {
+      return bucket;
+   }
+   int power = bucket / HISTOGRAM_SUB - 1 + HISTOGRAM_SHIFT;
+   return (long)(HISTOGRAM_SUB + bucket % HISTOGRAM_SUB) << (power - HISTOGRAM_SHIFT);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // the upper end of the bucket the percentile falls into
+long histogramPercentile(const struct histogram* histogram, double percentile)
+{
+   unsigned long wanted = (unsigned long)(percentile / 100.0 * histogram->total + 0.5);
+   unsigned long seen = 0;
+
+   if (wanted == 0)
+   {
+      wanted = 1;
+   }
+   for (int i = 0; i < HISTOGRAM_SIZE; ++i)
+   {
+      seen += histogram->counts[i];
+      if (seen >= wanted)
+      {
+         long upper = i + 1 < HISTOGRAM_SIZE ? bucketValue(i + 1) - 1 : histogram->max;
+         return upper < histogram->max ? upper : histogram->max;
+      }
+   }
+   return histogram->max;
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // throughput counts the requests after the login, CONNECT and LOGIN are
+   // listed for their latency
+void printReport(struct bench* bench, double seconds)
+{
+   unsigned long requests = 0;
+
+   for (int i = sendCommand; i < commandCount; ++i)
+   {
+      requests += bench->histograms[i].total + bench->histograms[i].errors;
+   }
+   printf("\n%lu requests in %.2f s, %.0f requests/s\n\n", requests, seconds, requests / seconds);
+   printf("%-8s %10s %8s %10s %10s %10s %10s %10s\n", "command", "count", "errors", "per s",
+          "p50 us", "p99 us", "p999 us", "max us");
+   for (int i = 0; i < commandCount; ++i)
+   {
+      const struct histogram* histogram = &bench->histograms[i];
+      if (histogram->total + histogram->errors == 0)
+      {
+         continue;
+      }
+      printf("%-8s %10lu %8lu %10.0f %10ld %10ld %10ld %10ld\n", commandNames[i], histogram->total,
+             histogram->errors, histogram->total / seconds, histogramPercentile(histogram, 50),
+             histogramPercentile(histogram, 99), histogramPercentile(histogram, 99.9), histogram->max);
+   }
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // one line per power of two, the bar is scaled to the fullest line
+   for (int i = 0; i < commandCount; ++i)
+   {
+      const struct histogram* histogram = &bench->histograms[i];
+      unsigned long lines[HISTOGRAM_POWERS];
+      unsigned long fullest = 0;
+      int first = -1, last = -1;
+
+      if (histogram->total == 0)
+      {
+         continue;
+      }
+      memset(lines, 0, sizeof(lines));
+      for (int bucket = 0; bucket < HISTOGRAM_SIZE; ++bucket)
+      {
+         long value = bucketValue(bucket);
+         int line = value == 0 ? 0 : 64 - __builtin_clzl(value);
+         if (line >= HISTOGRAM_POWERS)
+         {
+            line = HISTOGRAM_POWERS - 1;
+         }
+         lines[line] += histogram->counts[bucket];
+      }
+      for (int line = 0; line < HISTOGRAM_POWERS; ++line)
+      {
+         if (lines[line] > 0)
+         {
+            first = first == -1 ? line : first;
+            last = line;
+            fullest = lines[line] > fullest ? lines[line] : fullest;
+         }
+      }
+      printf("\n%s\n", commandNames[i]);
+      for (int line = first; line <= last; ++line)
+      {
+         int width = (int)(50.0 * lines[line] / fullest + 0.5);
+         printf("  < %9ld us %10lu |%.*s\n", 1L << line, lines[line], width,
+                "##################################################");
+      }
+   }
+}
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "uidcache.h"
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   // the cache is a hash table of buckets with UID_CACHE_WAYS entries each,
+   // a uid can only be in the bucket its hash points to, so the size is fixed
+   // and a lookup never looks at more than UID_CACHE_WAYS entries
+   // the buckets are guarded by a fixed number of locks so workers looking up
+   // different receivers rarely wait for each other
+#define UID_CACHE_WAYS 4
+#define UID_CACHE_LOCKS 64
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // credential is the hash of a password that logged in, 0 if there was no login
+struct uidCacheEntry{
+   char uid[128];
+   int exists;
+   unsigned long long credential;
+   time_t expires;
+};
+
+static struct uidCacheEntry *entries = NULL;
+static int bucketCount = 0;
+static int timeToLive = UID_CACHE_TTL;
+static int configured = 0;
+
+static pthread_mutex_t locks[UID_CACHE_LOCKS];
+static pthread_once_t initialized = PTHREAD_ONCE_INIT;
+
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+static void uidCacheInit();
+static unsigned int uidHash(const char* uid);
+static void uidCacheRemember(const char* uid, int exists, unsigned long long credential, int keepCredential);
+
+///////////////////////////////////////////////////////////////////////////////
+
+void uidCacheConfigure(int capacity, int ttl)
+{
+   bucketCount = (capacity + UID_CACHE_WAYS - 1) / UID_CACHE_WAYS;
+   timeToLive = ttl;
+   configured = 1;
+}
+
+int uidCacheLookup(const char* uid, int* exists)
+{
+   pthread_once(&initialized, uidCacheInit);
+   if (entries == NULL || strlen(uid) >= sizeof(entries->uid))
+   {
+      __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+      return 0;
+   }
+
+   unsigned int bucket = uidHash(uid) % bucketCount;
+   struct uidCacheEntry *entry = &entries[bucket * UID_CACHE_WAYS];
+   time_t now = time(NULL);
+   int found = 0;
+
+   pthread_mutex_lock(&locks[bucket % UID_CACHE_LOCKS]);
+   for (int i = 0; i < UID_CACHE_WAYS; ++i)
+   {
+      if (entry[i].expires > now && strcmp(entry[i].uid, uid) == 0)
+      {
+         *exists = entry[i].exists;
+         found = 1;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&locks[bucket % UID_CACHE_LOCKS]);
+
+   __atomic_add_fetch(found ? &hits : &misses, 1, __ATOMIC_RELAXED);
+   return found;
+}
+
+void uidCacheStore(const char* uid, int exists)
+{
+   uidCacheRemember(uid, exists, 0, 1);
+}
+
+void uidCacheStoreLogin(const char* uid, unsigned long long credential)
+{
+   uidCacheRemember(uid, 1, credential, 0);
+}
+
+int uidCacheCheckLogin(const char* uid, unsigned long long credential)
+{
+   pthread_once(&initialized, uidCacheInit);
+   if (entries == NULL || strlen(uid) >= sizeof(entries->uid))
+   {
+      __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+      return 0;
+   }
+
+   unsigned int bucket = uidHash(uid) % bucketCount;
+   struct uidCacheEntry *entry = &entries[bucket * UID_CACHE_WAYS];
+   time_t now = time(NULL);
+   int found = 0;
+
+   pthread_mutex_lock(&locks[bucket % UID_CACHE_LOCKS]);
+   for (int i = 0; i < UID_CACHE_WAYS; ++i)
+   {
+      if (entry[i].expires > now && strcmp(entry[i].uid, uid) == 0)
+      {
+         found = entry[i].credential == credential;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&locks[bucket % UID_CACHE_LOCKS]);
+
+   __atomic_add_fetch(found ? &hits : &misses, 1, __ATOMIC_RELAXED);
+   return found;
+}
+
+void uidCacheStats(unsigned long* hitCount, unsigned long* missCount)
+{
+   *hitCount = __atomic_load_n(&hits, __ATOMIC_RELAXED);
+   *missCount = __atomic_load_n(&misses, __ATOMIC_RELAXED);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // a login that was remembered stays valid if the same uid is found again
+static void uidCacheRemember(const char* uid, int exists, unsigned long long credential, int keepCredential)
+{
+   pthread_once(&initialized, uidCacheInit);
+   if (entries == NULL || strlen(uid) >= sizeof(entries->uid))
+   {
+      return;
+   }
+
+   unsigned int bucket = uidHash(uid) % bucketCount;
+   struct uidCacheEntry *entry = &entries[bucket * UID_CACHE_WAYS];
+   struct uidCacheEntry *victim = &entry[0];
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // take the entry of the same uid if it is there already,
+   // otherwise the one that expires first (expired and empty ones come first)
+   pthread_mutex_lock(&locks[bucket % UID_CACHE_LOCKS]);
+   for (int i = 0; i < UID_CACHE_WAYS; ++i)
+   {
+      if (strcmp(entry[i].uid, uid) == 0)
+      {
+         victim = &entry[i];
+         break;
+      }
+      if (entry[i].expires < victim->expires)
+      {
+         victim = &entry[i];
+      }
+   }
+   if (!keepCredential || !exists || strcmp(victim->uid, uid) != 0 || victim->expires <= time(NULL))
+   {
+      victim->credential = credential;
+   }
+   strcpy(victim->uid, uid);
+   victim->exists = exists;
+   victim->expires = time(NULL) + timeToLive;
+   pthread_mutex_unlock(&locks[bucket % UID_CACHE_LOCKS]);
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // allocates the table on first use, a ttl of 0 leaves it unallocated
+   // which turns every lookup into a miss
+static void uidCacheInit()
+{
+   if (!configured)
+   {
+      bucketCount = (UID_CACHE_SIZE + UID_CACHE_WAYS - 1) / UID_CACHE_WAYS;
+   }
+   for (int i = 0; i < UID_CACHE_LOCKS; ++i)
+   {
+      pthread_mutex_init(&locks[i], NULL);
+   }
+   if (timeToLive <= 0 || bucketCount <= 0)
+   {
+      return;
+   }
+   entries = calloc(bucketCount * UID_CACHE_WAYS, sizeof(struct uidCacheEntry));
+   if (entries == NULL)
+   {
+      perror("uid cache disabled - calloc");
+   }
+}
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // FNV-1a, good enough to spread uids over the buckets
+static unsigned int uidHash(const char* uid)
+{
+   unsigned int hash = 2166136261u;
+   for (; *uid != '\0'; ++uid)
+   {
+      hash ^= (unsigned char)*uid;
+      hash *= 16777619u;
+   }
+   return hash;
+}
@@ -0,0 +1,46 @@
+#ifndef UIDCACHE_H
+#define UIDCACHE_H
+
+///////////////////////////////////////////////////////////////////////////////
+   ///////////////////////////////////////////////////////////////////////////////
+   //                                                                           //
+   // TWMailer Pro uid cache                                                    //
+   //                                                                           //
+   // remembers for a while if a uid exists in the directory or not, so a      //
+   // SEND to the same receivers doesn't ask LDAP again every time, and who    //
+   // logged in with which password, so a login doesn't need a bind either    //
+   //                                                                           //
+   ///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define UID_CACHE_SIZE 4096
+#define UID_CACHE_TTL 300
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // capacity: maximum number of uids remembered
+   // ttl: seconds an answer (found or not found) stays valid, 0 turns the cache off
+   // must be called before the first lookup, otherwise the defaults are used
+void uidCacheConfigure(int capacity, int ttl);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // returns 1 and sets exists if the uid is cached and not expired yet,
+   // returns 0 if the directory has to be asked
+int uidCacheLookup(const char* uid, int* exists);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // remembers the answer of the directory, replacing the oldest entry of the
+   // bucket if it is full
+void uidCacheStore(const char* uid, int exists);
+
+   ///////////////////////////////////////////////////////////////////////////////
+   // remembers that uid logged in with the password credential is the hash of
+   // (see authprovider.c), the uid exists then as well
+   // uidCacheCheckLogin returns 1 if the same credential logged in before and
+   // the entry didn't expire yet, 0 if the password has to be checked
+   // credential must not be 0
+void uidCacheStoreLogin(const char* uid, unsigned long long credential);
+int uidCacheCheckLogin(const char* uid, unsigned long long credential);
+
+void uidCacheStats(unsigned long* hits, unsigned long* misses);
+
+#endif